@@ -0,0 +1,1303 @@
+#include "chat_index.h"
+#include <iostream>
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+namespace {
+
+constexpr size_t kMaxTermBytes = 64;
+constexpr size_t kWriteBuffer = 1 << 20;
+constexpr size_t kGenerationDigits = 8;
+
+bool write_fd(int fd, uint64_t offset, const void *data, size_t size) {
+    const char *bytes = static_cast<const char *>(data);
+    while (size > 0) {
+        ssize_t written = pwrite(fd, bytes, size, static_cast<off_t>(offset));
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        bytes += written;
+        offset += static_cast<uint64_t>(written);
+        size -= static_cast<size_t>(written);
+    }
+    return true;
+}
+
+bool read_file(int fd, std::vector<char> &contents) {
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        return false;
+    }
+    contents.resize(static_cast<size_t>(info.st_size));
+    size_t done = 0;
+    while (done < contents.size()) {
+        ssize_t got = pread(fd, contents.data() + done, contents.size() - done,
+                            static_cast<off_t>(done));
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        done += static_cast<size_t>(got);
+    }
+    return true;
+}
+
+void put_varint(std::vector<uint8_t> &out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<uint8_t>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(value));
+}
+
+bool get_varint(const uint8_t *&p, const uint8_t *end, uint32_t &value) {
+    uint64_t result = 0;
+    for (int shift = 0; shift < 35 && p < end; shift += 7) {
+        uint8_t byte = *p++;
+        result |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            if (result > UINT32_MAX) {
+                return false;
+            }
+            value = static_cast<uint32_t>(result);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool is_word_byte(unsigned char c) {
+    // Bytes of multi-byte UTF-8 characters count as letters.
+    return std::isalnum(c) || c >= 0x80;
+}
+
+// Splits text into lowercase words; term i of the result is token number i.
+std::vector<std::string> tokenize(std::string_view text) {
+    std::vector<std::string> words;
+    size_t i = 0;
+    while (i < text.size()) {
+        while (i < text.size() && !is_word_byte(static_cast<unsigned char>(text[i]))) {
+            ++i;
+        }
+        size_t start = i;
+        while (i < text.size() && is_word_byte(static_cast<unsigned char>(text[i]))) {
+            ++i;
+        }
+        if (i > start) {
+            std::string word(text.substr(start, std::min(i - start, kMaxTermBytes)));
+            for (char &c : word) {
+                c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+            }
+            words.push_back(std::move(word));
+        }
+    }
+    return words;
+}
+
+struct PostingsView {
+    const uint8_t *data = nullptr;
+    size_t bytes = 0;
+    const IndexSkipEntry *skips = nullptr;
+    uint32_t skip_count = 0;
+    uint32_t docs = 0;
+};
+
+// A posting list under construction, in the same encoding as on disk.
+struct PostingList {
+    std::vector<uint8_t> bytes;
+    std::vector<IndexSkipEntry> skips;
+    uint32_t docs = 0;
+    uint32_t last_doc = 0;
+
+    void append(uint32_t doc, uint32_t frequency, const uint8_t *positions, size_t size) {
+        if (docs > 0 && docs % kIndexSkipInterval == 0) {
+            skips.push_back({last_doc, static_cast<uint32_t>(bytes.size())});
+        }
+        put_varint(bytes, doc - last_doc);
+        put_varint(bytes, frequency);
+        put_varint(bytes, size);
+        bytes.insert(bytes.end(), positions, positions + size);
+        last_doc = doc;
+        ++docs;
+    }
+
+    PostingsView view() const {
+        return {bytes.data(), bytes.size(), skips.data(), static_cast<uint32_t>(skips.size()),
+                docs};
+    }
+};
+
+class PostingCursor {
+public:
+    explicit PostingCursor(const PostingsView &view)
+        : list(view), p(view.data), end(view.data + view.bytes) {}
+
+    uint32_t doc = 0;
+    uint32_t frequency = 0;
+    const uint8_t *positions = nullptr;
+    uint32_t positions_bytes = 0;
+
+    uint32_t size() const { return list.docs; }
+
+    bool next() {
+        uint32_t gap;
+        if (upcoming >= list.docs || !get_varint(p, end, gap) ||
+            !get_varint(p, end, frequency) || !get_varint(p, end, positions_bytes) ||
+            positions_bytes > static_cast<size_t>(end - p)) {
+            upcoming = list.docs;
+            return false;
+        }
+        doc += gap;
+        positions = p;
+        p += positions_bytes;
+        ++upcoming;
+        started = true;
+        return true;
+    }
+
+    // Moves to the first document at or after target, never backwards.
+    bool seek(uint32_t target) {
+        if (started && doc >= target) {
+            return true;
+        }
+        // Skip entry k leads to document (k + 1) * interval; use the last
+        // one still before target, if it is ahead of where we are.
+        uint32_t first = upcoming / kIndexSkipInterval;
+        if (first < list.skip_count && list.skips[first].last_doc < target) {
+            const IndexSkipEntry *found = std::partition_point(
+                list.skips + first, list.skips + list.skip_count,
+                [target](const IndexSkipEntry &skip) { return skip.last_doc < target; });
+            const IndexSkipEntry &skip = found[-1];
+            uint32_t k = static_cast<uint32_t>(&skip - list.skips);
+            if (skip.offset <= list.bytes) {
+                p = list.data + skip.offset;
+                doc = skip.last_doc;
+                upcoming = (k + 1) * kIndexSkipInterval;
+            }
+        }
+        while (next()) {
+            if (doc >= target) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void decode_positions(std::vector<uint32_t> &out) const {
+        out.clear();
+        const uint8_t *q = positions;
+        const uint8_t *stop = positions + positions_bytes;
+        uint32_t position = 0;
+        uint32_t gap;
+        while (q < stop && get_varint(q, stop, gap)) {
+            position += gap;
+            out.push_back(position);
+        }
+    }
+
+private:
+    PostingsView list;
+    const uint8_t *p;
+    const uint8_t *end;
+    uint32_t upcoming = 0;
+    bool started = false;
+};
+
+// Writes a segment file: postings as they come, then the term table and
+// term bytes, then the header over the placeholder at the start.
+class SegmentWriter {
+public:
+    ~SegmentWriter() {
+        if (fd >= 0) {
+            ::close(fd);
+            unlink(temp_path.c_str());
+        }
+    }
+
+    bool begin(const std::string &target) {
+        path = target;
+        temp_path = target + ".tmp";
+        fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        pending.assign(sizeof(IndexSegmentHeader), 0);
+        offset = sizeof(IndexSegmentHeader);
+        return fd >= 0;
+    }
+
+    bool add(std::string_view term, const PostingList &list) {
+        while (offset % alignof(IndexSkipEntry) != 0) {
+            pending.push_back(0);
+            ++offset;
+        }
+        if (list.bytes.size() > UINT32_MAX) {
+            return false;
+        }
+        IndexTermEntry entry{};
+        entry.term_offset = strings.size();
+        entry.postings_offset = offset;
+        entry.term_bytes = static_cast<uint32_t>(term.size());
+        entry.doc_frequency = list.docs;
+        entry.skip_count = static_cast<uint32_t>(list.skips.size());
+        entry.postings_bytes = static_cast<uint32_t>(list.bytes.size());
+        entries.push_back(entry);
+        strings.append(term);
+        const char *skips = reinterpret_cast<const char *>(list.skips.data());
+        return put(skips, list.skips.size() * sizeof(IndexSkipEntry)) &&
+               put(list.bytes.data(), list.bytes.size());
+    }
+
+    bool finish(uint32_t first_doc, uint32_t end_doc) {
+        while (offset % alignof(IndexTermEntry) != 0) {
+            pending.push_back(0);
+            ++offset;
+        }
+        IndexSegmentHeader header{};
+        std::memcpy(header.magic, kIndexSegmentMagic, sizeof(header.magic));
+        header.version = kIndexVersion;
+        header.first_doc = first_doc;
+        header.end_doc = end_doc;
+        header.term_count = entries.size();
+        header.terms_offset = offset;
+        header.strings_offset = offset + entries.size() * sizeof(IndexTermEntry);
+        header.strings_bytes = strings.size();
+        const char *table = reinterpret_cast<const char *>(entries.data());
+        size_t table_bytes = entries.size() * sizeof(IndexTermEntry);
+        if (!put(table, table_bytes) || !put(strings.data(), strings.size()) || !drain()) {
+            return false;
+        }
+        size_t skip = offsetof(IndexSegmentHeader, crc) + sizeof(header.crc);
+        uLong crc = crc32(0, reinterpret_cast<const Bytef *>(&header) + skip,
+                          static_cast<uInt>(sizeof(header) - skip));
+        crc = crc32_combine(crc, body_crc, static_cast<z_off_t>(written - sizeof(header)));
+        header.crc = static_cast<uint32_t>(crc);
+        if (!write_fd(fd, 0, &header, sizeof(header)) || fdatasync(fd) != 0 ||
+            rename(temp_path.c_str(), path.c_str()) != 0) {
+            return false;
+        }
+        ::close(fd);
+        fd = -1;
+        return true;
+    }
+
+private:
+    bool put(const void *data, size_t size) {
+        const char *bytes = static_cast<const char *>(data);
+        pending.insert(pending.end(), bytes, bytes + size);
+        offset += size;
+        return pending.size() < kWriteBuffer || drain();
+    }
+
+    bool drain() {
+        if (!write_fd(fd, written, pending.data(), pending.size())) {
+            return false;
+        }
+        // Everything after the header placeholder, which the first drain
+        // always holds whole.
+        size_t from = written < sizeof(IndexSegmentHeader) ? sizeof(IndexSegmentHeader) : 0;
+        body_crc = crc32_z(body_crc, reinterpret_cast<const Bytef *>(pending.data()) + from,
+                           pending.size() - from);
+        written += pending.size();
+        pending.clear();
+        return true;
+    }
+
+    std::string path;
+    std::string temp_path;
+    int fd = -1;
+    uint64_t offset = 0;
+    uint64_t written = 0;
+    uLong body_crc = crc32(0, nullptr, 0);
+    std::vector<char> pending;
+    std::vector<IndexTermEntry> entries;
+    std::string strings;
+};
+
+struct QueryClause {
+    std::vector<std::string> terms;
+    bool excluded = false;
+};
+
+// Alternatives separated by OR, each a list of clauses that must all hold.
+std::vector<std::vector<QueryClause>> parse_query(std::string_view query) {
+    std::vector<std::vector<QueryClause>> groups(1);
+    size_t i = 0;
+    while (i < query.size()) {
+        if (std::isspace(static_cast<unsigned char>(query[i]))) {
+            ++i;
+            continue;
+        }
+        QueryClause clause;
+        if (query[i] == '-') {
+            clause.excluded = true;
+            ++i;
+        }
+        std::string_view text;
+        if (i < query.size() && query[i] == '"') {
+            size_t close = query.find('"', i + 1);
+            size_t stop = close == std::string_view::npos ? query.size() : close;
+            text = query.substr(i + 1, stop - i - 1);
+            i = close == std::string_view::npos ? query.size() : close + 1;
+        } else {
+            size_t stop = i;
+            while (stop < query.size() && !std::isspace(static_cast<unsigned char>(query[stop]))) {
+                ++stop;
+            }
+            text = query.substr(i, stop - i);
+            i = stop;
+            if (!clause.excluded && text == "OR") {
+                groups.emplace_back();
+                continue;
+            }
+        }
+        // A word that splits into several, like "don't", is a phrase.
+        clause.terms = tokenize(text);
+        if (!clause.terms.empty()) {
+            groups.back().push_back(std::move(clause));
+        }
+    }
+    groups.erase(std::remove_if(groups.begin(), groups.end(),
+                                [](const std::vector<QueryClause> &group) {
+                                    return std::none_of(group.begin(), group.end(),
+                                                        [](const QueryClause &clause) {
+                                                            return !clause.excluded;
+                                                        });
+                                }),
+                 groups.end());
+    return groups;
+}
+
+// True if the cursors, all on one document, hold their terms consecutively.
+// positions is scratch space kept between calls.
+bool phrase_at(const std::vector<PostingCursor *> &cursors,
+               std::vector<std::vector<uint32_t>> &positions) {
+    if (cursors.size() < 2) {
+        return true;
+    }
+    if (positions.size() < cursors.size()) {
+        positions.resize(cursors.size());
+    }
+    for (size_t i = 0; i < cursors.size(); ++i) {
+        cursors[i]->decode_positions(positions[i]);
+    }
+    for (uint32_t start : positions[0]) {
+        bool matched = true;
+        for (size_t i = 1; i < cursors.size() && matched; ++i) {
+            matched = std::binary_search(positions[i].begin(), positions[i].end(),
+                                         start + static_cast<uint32_t>(i));
+        }
+        if (matched) {
+            return true;
+        }
+    }
+    return false;
+}
+
+} // namespace
+
+struct ChatIndex::Buffer {
+    uint32_t first_doc = 0;
+    uint32_t end_doc = 0;
+    std::unordered_map<std::string, PostingList> terms;
+
+    bool find(std::string_view term, PostingsView &view) const {
+        auto found = terms.find(std::string(term));
+        if (found == terms.end()) {
+            return false;
+        }
+        view = found->second.view();
+        return true;
+    }
+};
+
+struct ChatIndex::Segment {
+    std::string path;
+    uint32_t generation = 0;
+    const char *data = nullptr;
+    size_t bytes = 0;
+    IndexSegmentHeader header{};
+    const IndexTermEntry *terms = nullptr;
+    const char *strings = nullptr;
+
+    ~Segment() {
+        if (data) {
+            munmap(const_cast<char *>(data), bytes);
+        }
+    }
+
+    std::string_view term(uint64_t i) const {
+        const IndexTermEntry &entry = terms[i];
+        if (entry.term_offset > header.strings_bytes ||
+            entry.term_bytes > header.strings_bytes - entry.term_offset) {
+            return {};
+        }
+        return std::string_view(strings + entry.term_offset, entry.term_bytes);
+    }
+
+    bool view(uint64_t i, PostingsView &view) const {
+        const IndexTermEntry &entry = terms[i];
+        uint64_t skips = static_cast<uint64_t>(entry.skip_count) * sizeof(IndexSkipEntry);
+        if (entry.postings_offset % alignof(IndexSkipEntry) != 0 ||
+            entry.postings_offset > bytes || skips + entry.postings_bytes >
+            bytes - entry.postings_offset) {
+            return false;
+        }
+        const char *start = data + entry.postings_offset;
+        view.skips = reinterpret_cast<const IndexSkipEntry *>(start);
+        view.skip_count = entry.skip_count;
+        view.data = reinterpret_cast<const uint8_t *>(start + skips);
+        view.bytes = entry.postings_bytes;
+        view.docs = entry.doc_frequency;
+        return true;
+    }
+
+    bool find(std::string_view wanted, PostingsView &out) const {
+        uint64_t low = 0;
+        uint64_t high = header.term_count;
+        while (low < high) {
+            uint64_t middle = low + (high - low) / 2;
+            if (term(middle) < wanted) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        return low < header.term_count && term(low) == wanted && view(low, out);
+    }
+};
+
+ChatIndex::~ChatIndex() {
+    close();
+}
+
+std::string ChatIndex::file_path(const std::string &name) const {
+    return root + "/" + name;
+}
+
+std::string ChatIndex::segment_path(uint32_t generation) const {
+    char name[32];
+    std::snprintf(name, sizeof(name), "%0*u.idx", static_cast<int>(kGenerationDigits),
+                  generation);
+    return file_path(name);
+}
+
+std::shared_ptr<const ChatIndex::Segment> ChatIndex::open_segment(const std::string &path,
+                                                                  uint32_t generation) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0 ||
+        static_cast<size_t>(info.st_size) < sizeof(IndexSegmentHeader)) {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        std::cerr << "Unable to open index segment " << path << std::endl;
+        return nullptr;
+    }
+    auto segment = std::make_shared<Segment>();
+    segment->path = path;
+    segment->generation = generation;
+    segment->bytes = static_cast<size_t>(info.st_size);
+    void *mapped = mmap(nullptr, segment->bytes, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED) {
+        std::cerr << "Unable to map index segment " << path << std::endl;
+        return nullptr;
+    }
+    segment->data = static_cast<const char *>(mapped);
+    IndexSegmentHeader &header = segment->header;
+    std::memcpy(&header, segment->data, sizeof(header));
+    uint64_t table_bytes = header.term_count * sizeof(IndexTermEntry);
+    bool valid = std::memcmp(header.magic, kIndexSegmentMagic, sizeof(header.magic)) == 0 &&
+                 header.version == kIndexVersion && header.first_doc <= header.end_doc &&
+                 header.term_count < segment->bytes && header.terms_offset <= segment->bytes &&
+                 header.terms_offset % alignof(IndexTermEntry) == 0 &&
+                 table_bytes <= segment->bytes - header.terms_offset &&
+                 header.strings_offset == header.terms_offset + table_bytes &&
+                 header.strings_bytes == segment->bytes - header.strings_offset;
+    if (valid) {
+        size_t skip = offsetof(IndexSegmentHeader, crc) + sizeof(header.crc);
+        uLong crc = crc32(0, reinterpret_cast<const Bytef *>(&header) + skip,
+                          static_cast<uInt>(sizeof(header) - skip));
+        crc = crc32_z(crc, reinterpret_cast<const Bytef *>(segment->data) + sizeof(header),
+                      segment->bytes - sizeof(header));
+        valid = static_cast<uint32_t>(crc) == header.crc;
+    }
+    if (!valid) {
+        std::cerr << "Index segment " << path << " is damaged" << std::endl;
+        return nullptr;
+    }
+    segment->terms = reinterpret_cast<const IndexTermEntry *>(segment->data + header.terms_offset);
+    segment->strings = segment->data + header.strings_offset;
+    return segment;
+}
+
+bool ChatIndex::open(const std::string &directory, ChatIndexOptions options) {
+    close();
+    root = directory;
+    settings = options;
+    settings.flush_docs = std::max<size_t>(1, settings.flush_docs);
+    settings.merge_factor = std::max<size_t>(2, settings.merge_factor);
+    if (mkdir(root.c_str(), 0700) != 0 && errno != EEXIST) {
+        std::cerr << "Unable to create chat index " << root << ": " << std::strerror(errno)
+                  << std::endl;
+        return false;
+    }
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    if (!load_files()) {
+        lock.unlock();
+        close();
+        return false;
+    }
+    buffer = std::make_shared<Buffer>();
+    buffer->first_doc = buffer->end_doc = static_cast<uint32_t>(docs.size());
+    lock.unlock();
+
+    stopping = false;
+    work_pending = true;
+    worker = std::thread([this] { worker_loop(); });
+    return true;
+}
+
+bool ChatIndex::load_files() {
+    chats_fd = ::open(file_path("chats.dat").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    docs_fd = ::open(file_path("docs.dat").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    deletes_fd = ::open(file_path("deletes.dat").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    std::vector<char> contents;
+    if (chats_fd < 0 || docs_fd < 0 || deletes_fd < 0 || !read_file(chats_fd, contents)) {
+        std::cerr << "Unable to open chat index files in " << root << std::endl;
+        return false;
+    }
+    // Drop torn tails: a name cut short, or half an entry.
+    size_t position = 0;
+    while (position + sizeof(uint16_t) <= contents.size()) {
+        uint16_t length;
+        std::memcpy(&length, contents.data() + position, sizeof(length));
+        if (length == 0 || length > contents.size() - position - sizeof(length)) {
+            break;
+        }
+        std::string name(contents.data() + position + sizeof(length), length);
+        chat_ids.emplace(name, static_cast<uint32_t>(chats.size()));
+        chats.push_back({std::move(name), 0, 0, {}});
+        position += sizeof(length) + length;
+    }
+    if (position < contents.size() && ftruncate(chats_fd, static_cast<off_t>(position)) != 0) {
+        return false;
+    }
+
+    // Segments left behind by a merge interrupted before it removed its
+    // inputs are covered by the merged one.
+    std::vector<std::shared_ptr<const Segment>> found;
+    if (DIR *listing = opendir(root.c_str())) {
+        while (dirent *item = readdir(listing)) {
+            std::string name = item->d_name;
+            if (name.size() == kGenerationDigits + 8 && name.ends_with(".idx.tmp")) {
+                unlink(file_path(name).c_str());
+                continue;
+            }
+            if (name.size() != kGenerationDigits + 4 ||
+                name.compare(kGenerationDigits, 4, ".idx") != 0 ||
+                !std::all_of(name.begin(), name.begin() + kGenerationDigits, ::isdigit)) {
+                continue;
+            }
+            uint32_t generation =
+                static_cast<uint32_t>(std::stoul(name.substr(0, kGenerationDigits)));
+            next_generation = std::max(next_generation, generation + 1);
+            if (auto segment = open_segment(file_path(name), generation)) {
+                found.push_back(segment);
+            }
+        }
+        closedir(listing);
+    }
+    std::sort(found.begin(), found.end(), [](const auto &a, const auto &b) {
+        return a->header.first_doc != b->header.first_doc
+                   ? a->header.first_doc < b->header.first_doc
+                   : a->header.end_doc > b->header.end_doc;
+    });
+    uint32_t covered = 0;
+    for (const auto &segment : found) {
+        if (segment->header.first_doc < covered) {
+            unlink(segment->path.c_str());
+            continue;
+        }
+        if (segment->header.first_doc > covered) {
+            std::cerr << "Chat index " << root << " is missing documents " << covered << " to "
+                      << segment->header.first_doc << std::endl;
+        }
+        segments.push_back(segment);
+        covered = segment->header.end_doc;
+    }
+
+    if (!read_file(docs_fd, contents)) {
+        return false;
+    }
+    uint64_t stored = contents.size() / sizeof(IndexDocEntry);
+    // Entries past the last segment were buffered when the process stopped.
+    while (!segments.empty() && segments.back()->header.end_doc > stored) {
+        std::cerr << "Dropping index segment " << segments.back()->path
+                  << " without document entries" << std::endl;
+        unlink(segments.back()->path.c_str());
+        segments.pop_back();
+    }
+    uint64_t kept = segments.empty() ? 0 : segments.back()->header.end_doc;
+    if (contents.size() != kept * sizeof(IndexDocEntry) &&
+        ftruncate(docs_fd, static_cast<off_t>(kept * sizeof(IndexDocEntry))) != 0) {
+        return false;
+    }
+    docs.resize(kept);
+    if (kept > 0) {
+        std::memcpy(docs.data(), contents.data(), kept * sizeof(IndexDocEntry));
+    }
+    docs_written = kept;
+    for (uint32_t doc = 0; doc < kept; ++doc) {
+        if (docs[doc].chat >= chats.size()) {
+            continue;
+        }
+        ChatState &state = chats[docs[doc].chat];
+        state.docs.push_back(doc);
+        state.next = std::max(state.next, docs[doc].sequence + 1);
+        ++live_docs;
+        live_tokens += docs[doc].tokens;
+    }
+
+    if (!read_file(deletes_fd, contents)) {
+        return false;
+    }
+    size_t deletes = contents.size() / sizeof(IndexDeleteEntry);
+    for (size_t i = 0; i < deletes; ++i) {
+        IndexDeleteEntry entry;
+        std::memcpy(&entry, contents.data() + i * sizeof(entry), sizeof(entry));
+        if (entry.chat < chats.size()) {
+            kill(chats[entry.chat], entry.below);
+        }
+    }
+    if (contents.size() % sizeof(IndexDeleteEntry) != 0 &&
+        ftruncate(deletes_fd, static_cast<off_t>(deletes * sizeof(IndexDeleteEntry))) != 0) {
+        return false;
+    }
+    return true;
+}
+
+void ChatIndex::close() {
+    if (worker.joinable()) {
+        bool froze;
+        {
+            std::unique_lock<std::shared_mutex> lock(mutex);
+            froze = freeze();
+        }
+        {
+            std::lock_guard<std::mutex> lock(worker_mutex);
+            flushes_wanted += froze ? 1 : 0;
+            stopping = true;
+            work_pending = true;
+        }
+        work_wanted.notify_all();
+        worker.join();
+    }
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    if (deletes_fd >= 0) {
+        fdatasync(deletes_fd);
+    }
+    for (int *fd : {&chats_fd, &docs_fd, &deletes_fd}) {
+        if (*fd >= 0) {
+            ::close(*fd);
+            *fd = -1;
+        }
+    }
+    chats.clear();
+    chat_ids.clear();
+    docs.clear();
+    live_docs = 0;
+    live_tokens = 0;
+    segments.clear();
+    buffer.reset();
+    frozen.clear();
+    next_generation = 1;
+    docs_written = 0;
+    flushes_wanted = 0;
+    flushes_done = 0;
+    flush_failed = false;
+}
+
+bool ChatIndex::is_open() const {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    return buffer != nullptr;
+}
+
+uint32_t ChatIndex::chat_id(std::string_view chat) {
+    auto found = chat_ids.find(std::string(chat));
+    if (found != chat_ids.end()) {
+        return found->second;
+    }
+    struct stat info;
+    uint16_t length = static_cast<uint16_t>(chat.size());
+    std::string record(reinterpret_cast<const char *>(&length), sizeof(length));
+    record.append(chat);
+    if (chat.empty() || chat.size() > UINT16_MAX || fstat(chats_fd, &info) != 0 ||
+        !write_fd(chats_fd, static_cast<uint64_t>(info.st_size), record.data(), record.size())) {
+        std::cerr << "Unable to record chat " << chat << " in index " << root << std::endl;
+        return UINT32_MAX;
+    }
+    uint32_t id = static_cast<uint32_t>(chats.size());
+    chats.push_back({std::string(chat), 0, 0, {}});
+    chat_ids.emplace(std::string(chat), id);
+    return id;
+}
+
+void ChatIndex::kill(ChatState &state, uint64_t below) {
+    if (below <= state.below) {
+        return;
+    }
+    state.below = below;
+    state.next = std::max(state.next, below);
+    while (!state.docs.empty() && docs[state.docs.front()].sequence < below) {
+        --live_docs;
+        live_tokens -= docs[state.docs.front()].tokens;
+        state.docs.pop_front();
+    }
+}
+
+bool ChatIndex::freeze() {
+    if (!buffer || buffer->end_doc == buffer->first_doc) {
+        return false;
+    }
+    frozen.push_back(buffer);
+    buffer = std::make_shared<Buffer>();
+    buffer->first_doc = buffer->end_doc = static_cast<uint32_t>(docs.size());
+    return true;
+}
+
+void ChatIndex::wake_worker(bool froze) {
+    {
+        std::lock_guard<std::mutex> lock(worker_mutex);
+        flushes_wanted += froze ? 1 : 0;
+        work_pending = true;
+    }
+    work_wanted.notify_one();
+}
+
+bool ChatIndex::add(std::string_view chat, uint64_t sequence, std::string_view text) {
+    std::vector<std::string> words = tokenize(text);
+    // Group the token numbers of each distinct word, in word order.
+    std::vector<std::pair<std::string_view, uint32_t>> tokens;
+    tokens.reserve(words.size());
+    for (size_t i = 0; i < words.size(); ++i) {
+        tokens.push_back({words[i], static_cast<uint32_t>(i)});
+    }
+    std::sort(tokens.begin(), tokens.end());
+
+    bool froze = false;
+    {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        if (!buffer) {
+            return false;
+        }
+        uint32_t id = chat_id(chat);
+        if (id == UINT32_MAX || docs.size() >= UINT32_MAX) {
+            return false;
+        }
+        ChatState &state = chats[id];
+        if (sequence < state.next || sequence < state.below) {
+            return true;
+        }
+        uint32_t doc = static_cast<uint32_t>(docs.size());
+        docs.push_back({sequence, id, static_cast<uint32_t>(words.size())});
+        state.docs.push_back(doc);
+        state.next = sequence + 1;
+        ++live_docs;
+        live_tokens += words.size();
+
+        std::vector<uint8_t> positions;
+        for (size_t i = 0; i < tokens.size();) {
+            size_t j = i;
+            uint32_t previous = 0;
+            positions.clear();
+            for (; j < tokens.size() && tokens[j].first == tokens[i].first; ++j) {
+                put_varint(positions, tokens[j].second - previous);
+                previous = tokens[j].second;
+            }
+            buffer->terms[std::string(tokens[i].first)].append(
+                doc, static_cast<uint32_t>(j - i), positions.data(), positions.size());
+            i = j;
+        }
+        buffer->end_doc = doc + 1;
+        if (buffer->end_doc - buffer->first_doc >= settings.flush_docs) {
+            froze = freeze();
+        }
+    }
+    if (froze) {
+        wake_worker(true);
+    }
+    return true;
+}
+
+bool ChatIndex::remove(std::string_view chat, uint64_t below) {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    if (!buffer) {
+        return false;
+    }
+    uint32_t id = chat_id(chat);
+    if (id == UINT32_MAX) {
+        return false;
+    }
+    if (below <= chats[id].below) {
+        return true;
+    }
+    IndexDeleteEntry entry{id, 0, below};
+    struct stat info;
+    if (fstat(deletes_fd, &info) != 0 ||
+        !write_fd(deletes_fd, static_cast<uint64_t>(info.st_size), &entry, sizeof(entry))) {
+        std::cerr << "Unable to record deletion in index " << root << std::endl;
+        return false;
+    }
+    kill(chats[id], below);
+    lock.unlock();
+    // Segments full of deleted documents are worth merging away.
+    wake_worker(false);
+    return true;
+}
+
+uint64_t ChatIndex::next_sequence(std::string_view chat) const {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    auto found = chat_ids.find(std::string(chat));
+    return found == chat_ids.end() ? 0 : chats[found->second].next;
+}
+
+size_t ChatIndex::document_count() const {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    return static_cast<size_t>(live_docs);
+}
+
+size_t ChatIndex::segment_count() const {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    return segments.size();
+}
+
+std::vector<ChatSearchHit> ChatIndex::search(std::string_view query, size_t limit) const {
+    std::vector<std::vector<QueryClause>> groups = parse_query(query);
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    if (groups.empty() || limit == 0 || live_docs == 0) {
+        return {};
+    }
+    using Lookup = std::function<bool(std::string_view, PostingsView &)>;
+    std::vector<Lookup> sources;
+    for (const auto &segment : segments) {
+        sources.push_back([&segment](std::string_view term, PostingsView &view) {
+            return segment->find(term, view);
+        });
+    }
+    for (const auto &held : frozen) {
+        sources.push_back([&held](std::string_view term, PostingsView &view) {
+            return held->find(term, view);
+        });
+    }
+    sources.push_back([this](std::string_view term, PostingsView &view) {
+        return buffer->find(term, view);
+    });
+
+    // Document frequencies count deleted documents not yet merged away,
+    // which only shifts the weights slightly.
+    double documents = static_cast<double>(live_docs);
+    double average_length = std::max(1.0, static_cast<double>(live_tokens) / documents);
+    std::unordered_map<std::string, double> idf;
+    for (const auto &group : groups) {
+        for (const QueryClause &clause : group) {
+            for (const std::string &term : clause.terms) {
+                if (clause.excluded || idf.count(term)) {
+                    continue;
+                }
+                double frequency = 0;
+                PostingsView view;
+                for (const Lookup &lookup : sources) {
+                    frequency += lookup(term, view) ? view.docs : 0;
+                }
+                idf[term] = std::log(1.0 + (documents - frequency + 0.5) / (frequency + 0.5));
+            }
+        }
+    }
+
+    std::vector<std::pair<uint32_t, double>> matches;
+    for (const auto &group : groups) {
+        for (const Lookup &lookup : sources) {
+            // One cursor per term of each clause; a required clause with a
+            // term missing from this source rules the source out.
+            std::vector<std::vector<PostingCursor>> required;
+            std::vector<std::vector<PostingCursor>> excluded;
+            bool possible = true;
+            for (const QueryClause &clause : group) {
+                std::vector<PostingCursor> cursors;
+                PostingsView view;
+                bool present = true;
+                for (const std::string &term : clause.terms) {
+                    present = present && lookup(term, view);
+                    if (present) {
+                        cursors.emplace_back(view);
+                    }
+                }
+                if (clause.excluded) {
+                    if (present) {
+                        excluded.push_back(std::move(cursors));
+                    }
+                } else if (!present) {
+                    possible = false;
+                    break;
+                } else {
+                    required.push_back(std::move(cursors));
+                }
+            }
+            if (!possible) {
+                continue;
+            }
+            // The rarest term leads, so the others mostly skip ahead.
+            std::vector<PostingCursor *> all;
+            for (auto &cursors : required) {
+                for (PostingCursor &cursor : cursors) {
+                    all.push_back(&cursor);
+                }
+            }
+            std::sort(all.begin(), all.end(), [](const PostingCursor *a, const PostingCursor *b) {
+                return a->size() < b->size();
+            });
+            // Each distinct term scores once, through its first cursor.
+            std::vector<std::pair<PostingCursor *, double>> scored;
+            std::vector<std::string_view> seen;
+            size_t clause_index = 0;
+            for (const QueryClause &clause : group) {
+                if (clause.excluded) {
+                    continue;
+                }
+                for (size_t t = 0; t < clause.terms.size(); ++t) {
+                    const std::string &term = clause.terms[t];
+                    if (std::find(seen.begin(), seen.end(), term) == seen.end()) {
+                        seen.push_back(term);
+                        scored.push_back({&required[clause_index][t], idf[term]});
+                    }
+                }
+                ++clause_index;
+            }
+
+            uint32_t target = 0;
+            std::vector<PostingCursor *> phrase;
+            std::vector<std::vector<uint32_t>> positions;
+            while (true) {
+                bool aligned = true;
+                bool exhausted = false;
+                for (PostingCursor *cursor : all) {
+                    if (!cursor->seek(target)) {
+                        exhausted = true;
+                        break;
+                    }
+                    if (cursor->doc != target) {
+                        target = cursor->doc;
+                        aligned = false;
+                        break;
+                    }
+                }
+                if (exhausted) {
+                    break;
+                }
+                if (!aligned) {
+                    continue;
+                }
+                bool accepted = true;
+                for (auto &cursors : required) {
+                    phrase.clear();
+                    for (PostingCursor &cursor : cursors) {
+                        phrase.push_back(&cursor);
+                    }
+                    if (!phrase_at(phrase, positions)) {
+                        accepted = false;
+                        break;
+                    }
+                }
+                for (auto &cursors : excluded) {
+                    if (!accepted) {
+                        break;
+                    }
+                    phrase.clear();
+                    bool here = true;
+                    for (PostingCursor &cursor : cursors) {
+                        here = here && cursor.seek(target) && cursor.doc == target;
+                        phrase.push_back(&cursor);
+                    }
+                    accepted = !(here && phrase_at(phrase, positions));
+                }
+                const IndexDocEntry &entry = docs[target];
+                if (accepted && entry.chat < chats.size() &&
+                    entry.sequence >= chats[entry.chat].below) {
+                    double norm = settings.k1 * (1.0 - settings.b + settings.b * entry.tokens /
+                                                                        average_length);
+                    double score = 0.0;
+                    for (const auto &[cursor, weight] : scored) {
+                        double tf = cursor->frequency;
+                        score += weight * tf * (settings.k1 + 1.0) / (tf + norm);
+                    }
+                    matches.push_back({target, score});
+                }
+                if (target == UINT32_MAX) {
+                    break;
+                }
+                ++target;
+            }
+        }
+    }
+
+    if (groups.size() > 1) {
+        // A document matching several alternatives gets their scores summed.
+        std::sort(matches.begin(), matches.end());
+        size_t kept = 0;
+        for (size_t i = 0; i < matches.size(); ++i) {
+            if (kept > 0 && matches[kept - 1].first == matches[i].first) {
+                matches[kept - 1].second += matches[i].second;
+            } else {
+                matches[kept++] = matches[i];
+            }
+        }
+        matches.resize(kept);
+    }
+    auto better = [](const std::pair<uint32_t, double> &a, const std::pair<uint32_t, double> &b) {
+        return a.second != b.second ? a.second > b.second : a.first > b.first;
+    };
+    size_t count = std::min(limit, matches.size());
+    std::partial_sort(matches.begin(), matches.begin() + count, matches.end(), better);
+    std::vector<ChatSearchHit> hits;
+    hits.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        const IndexDocEntry &entry = docs[matches[i].first];
+        hits.push_back({chats[entry.chat].name, entry.sequence, matches[i].second});
+    }
+    return hits;
+}
+
+bool ChatIndex::write_segment(const Buffer &source, const std::string &path) {
+    std::vector<const std::pair<const std::string, PostingList> *> sorted;
+    sorted.reserve(source.terms.size());
+    for (const auto &item : source.terms) {
+        sorted.push_back(&item);
+    }
+    std::sort(sorted.begin(), sorted.end(),
+              [](const auto *a, const auto *b) { return a->first < b->first; });
+    SegmentWriter writer;
+    if (!writer.begin(path)) {
+        return false;
+    }
+    for (const auto *item : sorted) {
+        if (!writer.add(item->first, item->second)) {
+            return false;
+        }
+    }
+    return writer.finish(source.first_doc, source.end_doc);
+}
+
+bool ChatIndex::flush_frozen() {
+    std::shared_ptr<const Buffer> next;
+    std::vector<IndexDocEntry> entries;
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        if (frozen.empty()) {
+            return true;
+        }
+        next = frozen.front();
+        entries.assign(docs.begin() + next->first_doc, docs.begin() + next->end_doc);
+    }
+    // Document entries and deletions go first, so a segment on disk never
+    // refers to documents the next open cannot find.
+    std::string path = segment_path(next_generation++);
+    if (!write_fd(docs_fd, docs_written * sizeof(IndexDocEntry), entries.data(),
+                  entries.size() * sizeof(IndexDocEntry)) ||
+        fdatasync(docs_fd) != 0 || fdatasync(deletes_fd) != 0 || !write_segment(*next, path)) {
+        std::cerr << "Unable to write index segment " << path << std::endl;
+        return false;
+    }
+    std::shared_ptr<const Segment> segment = open_segment(path, next_generation - 1);
+    if (!segment) {
+        return false;
+    }
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    docs_written = next->end_doc;
+    segments.push_back(segment);
+    frozen.pop_front();
+    return true;
+}
+
+bool ChatIndex::write_merged(const std::vector<std::shared_ptr<const Segment>> &inputs,
+                             const std::string &path) {
+    uint32_t first_doc = inputs.front()->header.first_doc;
+    uint32_t end_doc = inputs.back()->header.end_doc;
+    // Deletions only ever grow, so documents dead now stay dead.
+    std::vector<bool> alive(end_doc - first_doc);
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        for (uint32_t doc = first_doc; doc < end_doc; ++doc) {
+            const IndexDocEntry &entry = docs[doc];
+            alive[doc - first_doc] = entry.chat < chats.size() &&
+                                     entry.sequence >= chats[entry.chat].below;
+        }
+    }
+
+    SegmentWriter writer;
+    if (!writer.begin(path)) {
+        return false;
+    }
+    std::vector<uint64_t> next(inputs.size(), 0);
+    PostingList merged;
+    while (true) {
+        std::string_view term;
+        bool any = false;
+        for (size_t i = 0; i < inputs.size(); ++i) {
+            if (next[i] < inputs[i]->header.term_count) {
+                std::string_view candidate = inputs[i]->term(next[i]);
+                if (!any || candidate < term) {
+                    term = candidate;
+                    any = true;
+                }
+            }
+        }
+        if (!any) {
+            break;
+        }
+        merged = PostingList();
+        // Inputs are in document order, so their lists simply follow on.
+        for (size_t i = 0; i < inputs.size(); ++i) {
+            if (next[i] >= inputs[i]->header.term_count || inputs[i]->term(next[i]) != term) {
+                continue;
+            }
+            PostingsView view;
+            if (inputs[i]->view(next[i], view)) {
+                PostingCursor cursor(view);
+                while (cursor.next()) {
+                    if (cursor.doc >= first_doc && cursor.doc < end_doc &&
+                        alive[cursor.doc - first_doc]) {
+                        merged.append(cursor.doc, cursor.frequency, cursor.positions,
+                                      cursor.positions_bytes);
+                    }
+                }
+            }
+            ++next[i];
+        }
+        std::string name(term);
+        if (merged.docs > 0 && !writer.add(name, merged)) {
+            return false;
+        }
+    }
+    return writer.finish(first_doc, end_doc);
+}
+
+bool ChatIndex::merge_once() {
+    std::vector<std::shared_ptr<const Segment>> current;
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        current = segments;
+    }
+    size_t width = settings.merge_factor;
+    if (current.size() <= width) {
+        return false;
+    }
+    // Merge the adjacent run with the fewest bytes, so segments of a size
+    // are merged with each other rather than into a big one every time.
+    size_t best = 0;
+    uint64_t best_bytes = UINT64_MAX;
+    for (size_t start = 0; start + width <= current.size(); ++start) {
+        uint64_t bytes = 0;
+        for (size_t i = start; i < start + width; ++i) {
+            bytes += current[i]->bytes;
+        }
+        if (bytes < best_bytes) {
+            best = start;
+            best_bytes = bytes;
+        }
+    }
+    std::vector<std::shared_ptr<const Segment>> inputs(current.begin() + best,
+                                                       current.begin() + best + width);
+    std::string path = segment_path(next_generation++);
+    if (!write_merged(inputs, path)) {
+        std::cerr << "Unable to merge index segments into " << path << std::endl;
+        unlink(path.c_str());
+        return false;
+    }
+    std::shared_ptr<const Segment> merged = open_segment(path, next_generation - 1);
+    if (!merged) {
+        return false;
+    }
+    {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        auto first = std::find(segments.begin(), segments.end(), inputs.front());
+        first = segments.erase(first, first + static_cast<std::ptrdiff_t>(width));
+        segments.insert(first, merged);
+    }
+    // Searches still holding the inputs keep their mappings.
+    for (const auto &input : inputs) {
+        unlink(input->path.c_str());
+    }
+    return true;
+}
+
+void ChatIndex::merge() {
+    std::lock_guard<std::mutex> lock(maintenance_mutex);
+    while (merge_once()) {
+    }
+}
+
+bool ChatIndex::flush() {
+    bool froze;
+    {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        if (!buffer) {
+            return false;
+        }
+        froze = freeze();
+    }
+    wake_worker(froze);
+    std::unique_lock<std::mutex> lock(worker_mutex);
+    uint64_t target = flushes_wanted;
+    work_done.wait(lock, [&] { return flushes_done >= target || flush_failed; });
+    return !flush_failed && fdatasync(deletes_fd) == 0;
+}
+
+void ChatIndex::worker_loop() {
+    while (true) {
+        bool stop;
+        {
+            std::unique_lock<std::mutex> lock(worker_mutex);
+            work_wanted.wait(lock, [this] { return work_pending; });
+            work_pending = false;
+            stop = stopping;
+        }
+        std::lock_guard<std::mutex> maintenance(maintenance_mutex);
+        while (true) {
+            {
+                std::shared_lock<std::shared_mutex> lock(mutex);
+                if (frozen.empty()) {
+                    break;
+                }
+            }
+            bool written = flush_frozen();
+            {
+                std::lock_guard<std::mutex> lock(worker_mutex);
+                flush_failed = !written;
+                flushes_done += written ? 1 : 0;
+            }
+            work_done.notify_all();
+            if (!written) {
+                break;
+            }
+        }
+        if (stop) {
+            return;
+        }
+        while (merge_once()) {
+        }
+    }
+}
@@ -0,0 +1,198 @@
+#ifndef CHAT_INDEX_H
+#define CHAT_INDEX_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Every indexed message is a document with a number assigned in order.
+// The index directory holds:
+//
+//     chats.dat      chat names, each a uint16 length and the bytes, in id order
+//     docs.dat       one IndexDocEntry per document, in document order
+//     deletes.dat    IndexDeleteEntry records, one per remove()
+//     NNNNNNNN.idx   segments, each covering a contiguous range of documents
+//
+// A segment file is an IndexSegmentHeader, the posting lists, the term table
+// sorted by term and the term bytes, all little-endian; the CRC covers the
+// header after its own field and every byte after the header, posting lists
+// included, so opening a segment reads it once in full. A posting
+// list is one IndexSkipEntry per kIndexSkipInterval documents, then per
+// document the varint-encoded gap from the previous document number, the
+// term frequency, the byte length of the positions and the gaps between
+// the positions (token numbers) of the term in the message.
+constexpr char kIndexSegmentMagic[8] = {'S', 'V', 'K', 'L', 'I', 'D', 'X', '1'};
+constexpr uint32_t kIndexVersion = 2;
+constexpr uint32_t kIndexSkipInterval = 128;
+
+struct IndexSegmentHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t crc;
+    uint32_t first_doc;
+    uint32_t end_doc;
+    uint64_t term_count;
+    uint64_t terms_offset;
+    uint64_t strings_offset;
+    uint64_t strings_bytes;
+    uint64_t reserved;
+};
+
+struct IndexTermEntry {
+    uint64_t term_offset;
+    uint64_t postings_offset;
+    uint32_t term_bytes;
+    uint32_t doc_frequency;
+    uint32_t skip_count;
+    uint32_t postings_bytes;
+};
+
+// Entry k lets a reader jump to document (k + 1) * kIndexSkipInterval of
+// the list: last_doc is the number of the document before it and offset
+// the position of its encoding after the skip table.
+struct IndexSkipEntry {
+    uint32_t last_doc;
+    uint32_t offset;
+};
+
+struct IndexDocEntry {
+    uint64_t sequence;
+    uint32_t chat;
+    uint32_t tokens;
+};
+
+// Documents of chat with a sequence number below below are deleted.
+struct IndexDeleteEntry {
+    uint32_t chat;
+    uint32_t reserved;
+    uint64_t below;
+};
+
+static_assert(sizeof(IndexSegmentHeader) == 64);
+static_assert(sizeof(IndexTermEntry) == 32);
+static_assert(sizeof(IndexDocEntry) == 16);
+
+struct ChatSearchHit {
+    std::string chat;
+    uint64_t sequence = 0;
+    double score = 0.0;
+};
+
+struct ChatIndexOptions {
+    // Buffered documents written out as a new segment at a time.
+    size_t flush_docs = 32768;
+    // Adjacent segments merged together once there are more than this.
+    size_t merge_factor = 8;
+    // BM25 parameters.
+    double k1 = 1.2;
+    double b = 0.75;
+};
+
+// Incremental full-text index over chat messages. New messages go to an
+// in-memory buffer that is searchable at once; a background thread writes
+// full buffers out as immutable segments, read through mmap, and merges
+// runs of small segments into larger ones, dropping deleted documents.
+//
+// Queries are words, which must all occur, "quoted phrases", -excluded
+// words or phrases, and OR between alternatives of those. Words are runs
+// of letters and digits, compared case-insensitively for ASCII. Hits are
+// ranked by BM25. All methods may be called from any thread.
+class ChatIndex {
+public:
+    ChatIndex() = default;
+    ~ChatIndex();
+    ChatIndex(const ChatIndex &) = delete;
+    ChatIndex &operator=(const ChatIndex &) = delete;
+
+    // Opens or creates the index in directory. Documents that were still
+    // buffered when the process stopped are gone; next_sequence() tells the
+    // caller where to resume indexing each chat.
+    bool open(const std::string &directory, ChatIndexOptions options = ChatIndexOptions());
+    void close();
+    bool is_open() const;
+
+    // Indexes a message. Sequence numbers of a chat must increase; one
+    // below next_sequence(chat) is ignored.
+    bool add(std::string_view chat, uint64_t sequence, std::string_view text);
+    // Deletes the chat's messages numbered below below.
+    bool remove(std::string_view chat, uint64_t below);
+    uint64_t next_sequence(std::string_view chat) const;
+
+    // Up to limit best hits, best first.
+    std::vector<ChatSearchHit> search(std::string_view query, size_t limit) const;
+
+    // Writes buffered documents out and waits for them to be durable.
+    bool flush();
+    // Runs merges now until no more are due.
+    void merge();
+    size_t document_count() const;
+    size_t segment_count() const;
+
+private:
+    struct Buffer;
+    struct Segment;
+    struct ChatState {
+        std::string name;
+        uint64_t below = 0;
+        uint64_t next = 0;
+        // Live documents, in sequence order.
+        std::deque<uint32_t> docs;
+    };
+
+    uint32_t chat_id(std::string_view chat);
+    void kill(ChatState &state, uint64_t below);
+    bool load_files();
+    std::shared_ptr<const Segment> open_segment(const std::string &path, uint32_t generation);
+    bool write_segment(const Buffer &buffer, const std::string &path);
+    bool write_merged(const std::vector<std::shared_ptr<const Segment>> &inputs,
+                      const std::string &path);
+    bool freeze();
+    void wake_worker(bool froze);
+    bool flush_frozen();
+    bool merge_once();
+    void worker_loop();
+    std::string file_path(const std::string &name) const;
+    std::string segment_path(uint32_t generation) const;
+
+    std::string root;
+    ChatIndexOptions settings;
+
+    mutable std::shared_mutex mutex;
+    std::vector<ChatState> chats;
+    std::unordered_map<std::string, uint32_t> chat_ids;
+    std::vector<IndexDocEntry> docs;
+    uint64_t live_docs = 0;
+    uint64_t live_tokens = 0;
+    std::vector<std::shared_ptr<const Segment>> segments;
+    std::shared_ptr<Buffer> buffer;
+    std::deque<std::shared_ptr<const Buffer>> frozen;
+    uint32_t next_generation = 1;
+    int chats_fd = -1;
+    int docs_fd = -1;
+    int deletes_fd = -1;
+    uint64_t docs_written = 0;
+
+    // Held while writing segments, so merge() and the worker take turns.
+    std::mutex maintenance_mutex;
+    std::mutex worker_mutex;
+    std::condition_variable work_wanted;
+    std::condition_variable work_done;
+    bool work_pending = false;
+    bool stopping = false;
+    // Buffers frozen and buffers written out so far, for flush() to wait on.
+    uint64_t flushes_wanted = 0;
+    uint64_t flushes_done = 0;
+    bool flush_failed = false;
+    std::thread worker;
+};
+
+#endif // CHAT_INDEX_H
@@ -0,0 +1,891 @@
+#include "chat_log.h"
+#include <iostream>
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+namespace {
+
+constexpr size_t kScanBuffer = 1 << 20;
+constexpr size_t kMaxChatName = 0xffff;
+constexpr size_t kSegmentDigits = 8;
+
+struct HintFileHeader {
+    uint32_t magic;
+    uint32_t crc;
+    uint64_t bytes;
+};
+
+uint32_t crc_of(uint32_t crc, const void *data, size_t size) {
+    const Bytef *bytes = static_cast<const Bytef *>(data);
+    while (size > 0) {
+        uInt step = static_cast<uInt>(std::min<size_t>(size, 1u << 30));
+        crc = static_cast<uint32_t>(crc32(crc, bytes, step));
+        bytes += step;
+        size -= step;
+    }
+    return crc;
+}
+
+// The CRC of a record covers everything after its crc field.
+uint32_t record_crc(const char *record, size_t size) {
+    size_t skip = offsetof(ChatRecordHeader, crc) + sizeof(uint32_t);
+    return crc_of(0, record + skip, size - skip);
+}
+
+using ContentDigest = std::array<unsigned char, 32>;
+
+ContentDigest digest_of(std::string_view data) {
+    ContentDigest digest{};
+    unsigned int size = 0;
+    EVP_Digest(data.data(), data.size(), digest.data(), &size, EVP_sha256(), nullptr);
+    return digest;
+}
+
+// A running SHA-256 that has taken in data.
+EVP_MD_CTX *start_digest(std::string_view data) {
+    EVP_MD_CTX *context = EVP_MD_CTX_new();
+    if (context) {
+        EVP_DigestInit_ex(context, EVP_sha256(), nullptr);
+        EVP_DigestUpdate(context, data.data(), data.size());
+    }
+    return context;
+}
+
+// The digest of what context has taken in so far, leaving it running.
+ContentDigest digest_so_far(const EVP_MD_CTX *context) {
+    ContentDigest digest{};
+    unsigned int size = 0;
+    EVP_MD_CTX *copy = EVP_MD_CTX_new();
+    if (copy && EVP_MD_CTX_copy_ex(copy, context) == 1) {
+        EVP_DigestFinal_ex(copy, digest.data(), &size);
+    }
+    EVP_MD_CTX_free(copy);
+    return digest;
+}
+
+bool write_fd(int fd, uint64_t offset, const void *data, size_t size) {
+    const char *bytes = static_cast<const char *>(data);
+    while (size > 0) {
+        ssize_t written = pwrite(fd, bytes, size, static_cast<off_t>(offset));
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        bytes += written;
+        offset += static_cast<uint64_t>(written);
+        size -= static_cast<size_t>(written);
+    }
+    return true;
+}
+
+bool read_fd(int fd, uint64_t offset, void *data, size_t size) {
+    char *bytes = static_cast<char *>(data);
+    while (size > 0) {
+        ssize_t got = pread(fd, bytes, size, static_cast<off_t>(offset));
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        bytes += got;
+        offset += static_cast<uint64_t>(got);
+        size -= static_cast<size_t>(got);
+    }
+    return true;
+}
+
+// Calls visit for each intact record of a segment in order, reading it in
+// large blocks. Returns the offset just past the last intact record.
+uint64_t scan_records(int fd, uint64_t file_bytes,
+                      const std::function<void(uint64_t offset, const ChatRecordHeader &header,
+                                               const char *record)> &visit) {
+    std::vector<char> buffer(kScanBuffer);
+    uint64_t buffer_start = 0;
+    size_t buffered = 0;
+    uint64_t offset = 0;
+    auto fill = [&](uint64_t from, size_t need) {
+        if (from >= buffer_start && from + need <= buffer_start + buffered) {
+            return true;
+        }
+        if (buffer.size() < need) {
+            buffer.resize(need);
+        }
+        size_t length = static_cast<size_t>(std::min<uint64_t>(buffer.size(), file_bytes - from));
+        if (length < need || !read_fd(fd, from, buffer.data(), length)) {
+            return false;
+        }
+        buffer_start = from;
+        buffered = length;
+        return true;
+    };
+    while (offset + sizeof(ChatRecordHeader) <= file_bytes) {
+        if (!fill(offset, sizeof(ChatRecordHeader))) {
+            break;
+        }
+        ChatRecordHeader header;
+        std::memcpy(&header, buffer.data() + (offset - buffer_start), sizeof(header));
+        uint64_t size = sizeof(header) + static_cast<uint64_t>(header.chat_bytes) +
+                        header.text_bytes;
+        if (header.magic != kChatRecordMagic || header.chat_bytes == 0 ||
+            header.kind > static_cast<uint8_t>(ChatRecordKind::Reset) ||
+            size > file_bytes - offset || !fill(offset, size)) {
+            break;
+        }
+        const char *record = buffer.data() + (offset - buffer_start);
+        if (record_crc(record, size) != header.crc) {
+            break;
+        }
+        visit(offset, header, record);
+        offset += size;
+    }
+    return offset;
+}
+
+int64_t now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+
+} // namespace
+
+struct ChatLog::Segment {
+    uint32_t id = 0;
+    int fd = -1;
+    uint64_t bytes = 0;
+    uint64_t live = 0;
+    bool sealed = false;
+    // Compaction stopped at a record that fails its CRC; the segment stays,
+    // since records after it may still be live, and is not tried again.
+    bool damaged = false;
+    // Hint entries of the records written so far, kept until the segment
+    // is sealed and they go to its hint file.
+    std::vector<char> hints;
+
+    ~Segment() {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+};
+
+ChatLog::~ChatLog() {
+    close();
+}
+
+std::string ChatLog::segment_path(uint32_t id, const char *suffix) const {
+    char name[32];
+    std::snprintf(name, sizeof(name), "%0*u%s", static_cast<int>(kSegmentDigits), id, suffix);
+    return root + "/" + name;
+}
+
+std::shared_ptr<ChatLog::Segment> ChatLog::open_segment(uint32_t id, bool create) {
+    std::string path = segment_path(id, ".log");
+    int flags = O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0);
+    int fd = ::open(path.c_str(), flags, 0600);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        std::cerr << "Unable to open chat segment " << path << ": " << std::strerror(errno)
+                  << std::endl;
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        return nullptr;
+    }
+    auto segment = std::make_shared<Segment>();
+    segment->id = id;
+    segment->fd = fd;
+    segment->bytes = static_cast<uint64_t>(info.st_size);
+    return segment;
+}
+
+bool ChatLog::open(const std::string &directory, ChatLogOptions options) {
+    close();
+    root = directory;
+    settings = options;
+    if (mkdir(root.c_str(), 0700) != 0 && errno != EEXIST) {
+        std::cerr << "Unable to create chat log " << root << ": " << std::strerror(errno)
+                  << std::endl;
+        return false;
+    }
+    DIR *listing = opendir(root.c_str());
+    if (!listing) {
+        std::cerr << "Unable to read chat log " << root << std::endl;
+        return false;
+    }
+    std::vector<uint32_t> ids;
+    while (dirent *item = readdir(listing)) {
+        std::string name = item->d_name;
+        if (name.size() == kSegmentDigits + 4 && name.compare(kSegmentDigits, 4, ".log") == 0 &&
+            std::all_of(name.begin(), name.begin() + kSegmentDigits, ::isdigit)) {
+            ids.push_back(static_cast<uint32_t>(std::stoul(name.substr(0, kSegmentDigits))));
+        }
+    }
+    closedir(listing);
+    std::sort(ids.begin(), ids.end());
+
+    std::lock_guard<std::mutex> lock(mutex);
+    for (size_t i = 0; i < ids.size(); ++i) {
+        std::shared_ptr<Segment> segment = open_segment(ids[i], false);
+        if (!segment) {
+            segments.clear();
+            chats.clear();
+            return false;
+        }
+        bool last = i + 1 == ids.size();
+        if (last) {
+            replay(*segment, true);
+            active = segment;
+        } else {
+            if (!replay_hints(*segment)) {
+                replay(*segment, false);
+                write_hints(*segment);
+            }
+            segment->sealed = true;
+            segment->hints.clear();
+            segment->hints.shrink_to_fit();
+        }
+        segments[segment->id] = segment;
+    }
+    if (!active) {
+        active = open_segment(1, true);
+        if (!active) {
+            return false;
+        }
+        segments[active->id] = active;
+    }
+    for (auto &[name, entry] : chats) {
+        for (const Location &location : entry.messages) {
+            if (location.size > 0) {
+                segments[location.segment]->live += location.size;
+            }
+        }
+        if (entry.has_reset) {
+            segments[entry.reset_record.segment]->live += entry.reset_record.size;
+        }
+    }
+
+    stopping = false;
+    compaction_pending = true;
+    compactor = std::thread([this] { compaction_loop(); });
+    return true;
+}
+
+void ChatLog::close() {
+    if (compactor.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(compaction_mutex);
+            stopping = true;
+        }
+        compaction_wanted.notify_all();
+        compactor.join();
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    if (active) {
+        fdatasync(active->fd);
+    }
+    active.reset();
+    segments.clear();
+    chats.clear();
+}
+
+bool ChatLog::is_open() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return active != nullptr;
+}
+
+bool ChatLog::replay(Segment &segment, bool truncate_torn) {
+    segment.hints.clear();
+    uint64_t end = scan_records(segment.fd, segment.bytes, [&](uint64_t offset,
+                                                                const ChatRecordHeader &header,
+                                                                const char *record) {
+        std::string_view chat(record + sizeof(header), header.chat_bytes);
+        uint32_t size = static_cast<uint32_t>(sizeof(header) + header.chat_bytes +
+                                              header.text_bytes);
+        apply(segment.id, offset, size, static_cast<ChatRecordKind>(header.kind), chat,
+              header.sequence);
+        HintEntry hint{offset, header.sequence, size, header.kind, 0, header.chat_bytes};
+        const char *bytes = reinterpret_cast<const char *>(&hint);
+        segment.hints.insert(segment.hints.end(), bytes, bytes + sizeof(hint));
+        segment.hints.insert(segment.hints.end(), chat.begin(), chat.end());
+    });
+    if (end < segment.bytes) {
+        std::string path = segment_path(segment.id, ".log");
+        if (truncate_torn) {
+            std::cerr << "Discarding " << segment.bytes - end << " torn bytes at the end of "
+                      << path << std::endl;
+            if (ftruncate(segment.fd, static_cast<off_t>(end)) != 0) {
+                return false;
+            }
+        } else {
+            std::cerr << "Chat segment " << path << " is damaged after byte " << end
+                      << std::endl;
+        }
+        segment.bytes = end;
+    }
+    return true;
+}
+
+bool ChatLog::replay_hints(Segment &segment) {
+    int fd = ::open(segment_path(segment.id, ".hint").c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    HintFileHeader header;
+    std::vector<char> entries;
+    bool intact = read_fd(fd, 0, &header, sizeof(header)) && header.magic == kChatHintMagic &&
+                  header.bytes < (1ull << 40);
+    if (intact) {
+        entries.resize(header.bytes);
+        intact = read_fd(fd, sizeof(header), entries.data(), entries.size()) &&
+                 crc_of(0, entries.data(), entries.size()) == header.crc;
+    }
+    ::close(fd);
+    if (!intact) {
+        return false;
+    }
+    size_t position = 0;
+    while (position + sizeof(HintEntry) <= entries.size()) {
+        HintEntry hint;
+        std::memcpy(&hint, entries.data() + position, sizeof(hint));
+        position += sizeof(hint);
+        if (hint.chat_bytes > entries.size() - position) {
+            return false;
+        }
+        apply(segment.id, hint.offset, hint.size, static_cast<ChatRecordKind>(hint.kind),
+              std::string_view(entries.data() + position, hint.chat_bytes), hint.sequence);
+        position += hint.chat_bytes;
+    }
+    return true;
+}
+
+void ChatLog::apply(uint32_t segment, uint64_t offset, uint32_t size, ChatRecordKind kind,
+                    std::string_view chat, uint64_t sequence) {
+    ChatEntry &entry = chats[std::string(chat)];
+    entry.next_sequence = std::max(entry.next_sequence, sequence + 1);
+    Location location{segment, size, offset};
+    if (kind == ChatRecordKind::Reset) {
+        if (entry.has_reset && sequence + 1 < entry.base) {
+            return;
+        }
+        // A newer reset clears what came before it; the same one seen again
+        // is a compaction copy, whose later location wins.
+        uint64_t base = sequence + 1;
+        size_t cleared = static_cast<size_t>(std::min<uint64_t>(entry.messages.size(),
+                                                                base - entry.base));
+        entry.messages.erase(entry.messages.begin(), entry.messages.begin() + cleared);
+        entry.base = base;
+        entry.has_reset = true;
+        entry.reset_record = location;
+        return;
+    }
+    if (sequence < entry.base) {
+        return;
+    }
+    size_t position = static_cast<size_t>(sequence - entry.base);
+    if (position >= entry.messages.size()) {
+        entry.messages.resize(position + 1);
+    }
+    entry.messages[position] = location;
+}
+
+bool ChatLog::write_record(std::string_view chat, ChatRecordKind kind, std::string_view text,
+                           uint64_t sequence, Location &where) {
+    ChatRecordHeader header{};
+    header.magic = kChatRecordMagic;
+    header.sequence = sequence;
+    header.timestamp = now_ms();
+    header.chat_bytes = static_cast<uint16_t>(chat.size());
+    header.kind = static_cast<uint8_t>(kind);
+    header.text_bytes = static_cast<uint32_t>(text.size());
+    scratch.resize(sizeof(header) + chat.size() + text.size());
+    std::memcpy(scratch.data(), &header, sizeof(header));
+    std::memcpy(scratch.data() + sizeof(header), chat.data(), chat.size());
+    if (!text.empty()) {
+        std::memcpy(scratch.data() + sizeof(header) + chat.size(), text.data(), text.size());
+    }
+    header.crc = record_crc(scratch.data(), scratch.size());
+    std::memcpy(scratch.data() + offsetof(ChatRecordHeader, crc), &header.crc,
+                sizeof(header.crc));
+    return write_raw(chat, kind, sequence, scratch, where);
+}
+
+bool ChatLog::write_raw(std::string_view chat, ChatRecordKind kind, uint64_t sequence,
+                        const std::vector<char> &record, Location &where) {
+    if (!active) {
+        return false;
+    }
+    if (active->bytes > 0 && active->bytes + record.size() > settings.segment_bytes &&
+        !seal_active()) {
+        return false;
+    }
+    if (!write_fd(active->fd, active->bytes, record.data(), record.size())) {
+        std::cerr << "Unable to append to " << segment_path(active->id, ".log") << std::endl;
+        // Leave nothing half written for the next record to follow.
+        if (ftruncate(active->fd, static_cast<off_t>(active->bytes)) != 0) {
+            std::cerr << "Unable to trim " << segment_path(active->id, ".log") << std::endl;
+        }
+        return false;
+    }
+    where = {active->id, static_cast<uint32_t>(record.size()), active->bytes};
+    HintEntry hint{active->bytes, sequence, where.size, static_cast<uint8_t>(kind), 0,
+                   static_cast<uint16_t>(chat.size())};
+    const char *bytes = reinterpret_cast<const char *>(&hint);
+    active->hints.insert(active->hints.end(), bytes, bytes + sizeof(hint));
+    active->hints.insert(active->hints.end(), chat.begin(), chat.end());
+    active->bytes += record.size();
+    active->live += record.size();
+    return true;
+}
+
+bool ChatLog::seal_active() {
+    std::shared_ptr<Segment> next = open_segment(active->id + 1, true);
+    if (!next) {
+        return false;
+    }
+    fdatasync(active->fd);
+    write_hints(*active);
+    active->sealed = true;
+    active->hints.clear();
+    active->hints.shrink_to_fit();
+    active = next;
+    segments[active->id] = active;
+    request_compaction();
+    return true;
+}
+
+bool ChatLog::write_hints(const Segment &segment) {
+    std::string path = segment_path(segment.id, ".hint");
+    std::string temp_path = path + ".tmp";
+    int fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return false;
+    }
+    HintFileHeader header{kChatHintMagic, crc_of(0, segment.hints.data(), segment.hints.size()),
+                          segment.hints.size()};
+    // Hints only save a scan on the next open, so they are not synced: a
+    // damaged one fails its CRC and the segment is scanned instead.
+    bool written = write_fd(fd, 0, &header, sizeof(header)) &&
+                   write_fd(fd, sizeof(header), segment.hints.data(), segment.hints.size());
+    ::close(fd);
+    if (!written || rename(temp_path.c_str(), path.c_str()) != 0) {
+        unlink(temp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+void ChatLog::release(const Location &location) {
+    auto found = segments.find(location.segment);
+    if (found != segments.end() && location.size > 0) {
+        found->second->live -= std::min<uint64_t>(found->second->live, location.size);
+    }
+}
+
+bool ChatLog::append(std::string_view chat, std::string_view text, uint64_t *sequence) {
+    if (chat.empty() || chat.size() > kMaxChatName || text.size() > UINT32_MAX / 2) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    return append_locked(chat, text, sequence);
+}
+
+bool ChatLog::append_locked(std::string_view chat, std::string_view text, uint64_t *sequence) {
+    ChatEntry &entry = chats[std::string(chat)];
+    uint64_t number = entry.next_sequence;
+    Location where;
+    if (!write_record(chat, ChatRecordKind::Message, text, number, where)) {
+        return false;
+    }
+    ++entry.next_sequence;
+    entry.messages.resize(static_cast<size_t>(number - entry.base));
+    entry.messages.push_back(where);
+    if (entry.content_digest) {
+        EVP_DigestUpdate(entry.content_digest.get(), text.data(), text.size());
+        entry.content_bytes += text.size();
+    }
+    if (sequence) {
+        *sequence = number;
+    }
+    if (listener) {
+        listener(chat, ChatRecordKind::Message, number, text);
+    }
+    return true;
+}
+
+bool ChatLog::reset(std::string_view chat) {
+    if (chat.empty() || chat.size() > kMaxChatName) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    return reset_locked(chat);
+}
+
+bool ChatLog::reset_locked(std::string_view chat) {
+    ChatEntry &entry = chats[std::string(chat)];
+    uint64_t number = entry.next_sequence;
+    Location where;
+    if (!write_record(chat, ChatRecordKind::Reset, {}, number, where)) {
+        return false;
+    }
+    ++entry.next_sequence;
+    for (const Location &location : entry.messages) {
+        release(location);
+    }
+    if (entry.has_reset) {
+        release(entry.reset_record);
+    }
+    entry.messages.clear();
+    entry.messages.shrink_to_fit();
+    entry.base = number + 1;
+    entry.has_reset = true;
+    entry.reset_record = where;
+    entry.content_digest.reset(start_digest({}));
+    entry.content_bytes = 0;
+    if (listener) {
+        listener(chat, ChatRecordKind::Reset, number, {});
+    }
+    request_compaction();
+    return true;
+}
+
+bool ChatLog::parse_record(const Segment &segment, const Location &location,
+                           const char *record, ChatMessage &message) const {
+    ChatRecordHeader header;
+    std::memcpy(&header, record, sizeof(header));
+    if (header.magic != kChatRecordMagic || location.size != sizeof(header) +
+        header.chat_bytes + header.text_bytes || record_crc(record, location.size) !=
+        header.crc) {
+        std::cerr << "Damaged chat record in " << segment_path(segment.id, ".log") << " at "
+                  << location.offset << std::endl;
+        return false;
+    }
+    message.sequence = header.sequence;
+    message.timestamp = header.timestamp;
+    message.text.assign(record + sizeof(header) + header.chat_bytes, header.text_bytes);
+    return true;
+}
+
+// Newest first. The segments are held, so compaction may delete their
+// files while the records are read.
+ChatLog::RecordList ChatLog::last_records(std::string_view chat, size_t count) const {
+    RecordList wanted;
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = chats.find(std::string(chat));
+    if (found == chats.end()) {
+        return wanted;
+    }
+    const std::vector<Location> &messages = found->second.messages;
+    for (size_t i = messages.size(); i-- > 0 && wanted.size() < count;) {
+        auto segment = segments.find(messages[i].segment);
+        if (messages[i].size > 0 && segment != segments.end()) {
+            wanted.push_back({segment->second, messages[i]});
+        }
+    }
+    return wanted;
+}
+
+// One positioned read per record, each into its own buffer.
+std::vector<IoRequest> ChatLog::record_reads(const RecordList &records,
+                                             std::vector<std::vector<char>> &buffers) {
+    buffers.resize(records.size());
+    std::vector<IoRequest> reads(records.size());
+    for (size_t i = 0; i < records.size(); ++i) {
+        buffers[i].resize(records[i].second.size);
+        reads[i].op = IoOp::Read;
+        reads[i].fd = records[i].first->fd;
+        reads[i].offset = records[i].second.offset;
+        reads[i].data = buffers[i].data();
+        reads[i].size = buffers[i].size();
+    }
+    return reads;
+}
+
+// The messages record_reads() fetched, oldest first, skipping any record
+// that could not be read whole or is damaged.
+std::vector<ChatMessage> ChatLog::parse_reads(const RecordList &records,
+                                              const std::vector<std::vector<char>> &buffers,
+                                              const std::vector<IoRequest> &reads) const {
+    std::vector<ChatMessage> result;
+    result.reserve(records.size());
+    for (size_t i = records.size(); i-- > 0;) {
+        const Segment &segment = *records[i].first;
+        const Location &location = records[i].second;
+        if (reads[i].result != static_cast<ssize_t>(location.size)) {
+            std::cerr << "Unable to read chat record in " << segment_path(segment.id, ".log")
+                      << " at " << location.offset << std::endl;
+            continue;
+        }
+        ChatMessage message;
+        if (parse_record(segment, location, buffers[i].data(), message)) {
+            result.push_back(std::move(message));
+        }
+    }
+    return result;
+}
+
+std::vector<ChatMessage> ChatLog::read_last(std::string_view chat, size_t count) const {
+    RecordList wanted = last_records(chat, count);
+    std::vector<std::vector<char>> buffers;
+    std::vector<IoRequest> reads = record_reads(wanted, buffers);
+    storage_io().run(reads);
+    return parse_reads(wanted, buffers, reads);
+}
+
+void ChatLog::read_last_async(std::string_view chat, size_t count,
+                              std::function<void(std::vector<ChatMessage>)> done) const {
+    // Held by the callback: the buffers the reads land in, and the segments
+    // whose descriptors they use.
+    struct Pending {
+        RecordList wanted;
+        std::vector<std::vector<char>> buffers;
+    };
+    auto pending = std::make_shared<Pending>();
+    pending->wanted = last_records(chat, count);
+    std::vector<IoRequest> reads = record_reads(pending->wanted, pending->buffers);
+    storage_io().submit(std::move(reads), [this, pending, done = std::move(done)](
+                                              std::vector<IoRequest> &completed) {
+        done(parse_reads(pending->wanted, pending->buffers, completed));
+    });
+}
+
+std::string ChatLog::read_all(std::string_view chat) {
+    uint64_t next_sequence;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = chats.find(std::string(chat));
+        if (found == chats.end()) {
+            return "";
+        }
+        next_sequence = found->second.next_sequence;
+    }
+    std::vector<ChatMessage> messages = read_last(chat, SIZE_MAX);
+    std::string content;
+    for (const ChatMessage &message : messages) {
+        content += message.text;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = chats.find(std::string(chat));
+    // Only remember the digest if nothing was written while reading.
+    if (found != chats.end() && found->second.next_sequence == next_sequence) {
+        found->second.content_digest.reset(start_digest(content));
+        found->second.content_bytes = content.size();
+    }
+    return content;
+}
+
+bool ChatLog::store(std::string_view chat, std::string_view content) {
+    if (chat.empty() || chat.size() > kMaxChatName || content.size() > UINT32_MAX / 2) {
+        return false;
+    }
+    std::string name(chat);
+    // Length and digest of the stored content; false while it is unknown.
+    // A chat never written holds the empty content.
+    auto stored = [&](uint64_t &bytes, ContentDigest &digest) {
+        auto found = chats.find(name);
+        if (found == chats.end()) {
+            bytes = 0;
+            digest = digest_of({});
+            return true;
+        }
+        if (!found->second.content_digest) {
+            return false;
+        }
+        bytes = found->second.content_bytes;
+        digest = digest_so_far(found->second.content_digest.get());
+        return true;
+    };
+    // The prefix of content is hashed without the lock; the state it was
+    // compared with is checked again under the lock that covers the write,
+    // and all of it retried if another writer got in between.
+    for (int attempt = 0; attempt < 3; ++attempt) {
+        uint64_t bytes = 0;
+        ContentDigest digest;
+        bool known;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            known = stored(bytes, digest);
+        }
+        if (!known) {
+            read_all(chat);
+            continue;
+        }
+        bool extends = content.size() >= bytes && digest_of(content.substr(0, bytes)) == digest;
+        std::lock_guard<std::mutex> lock(mutex);
+        uint64_t bytes_now = 0;
+        ContentDigest digest_now;
+        if (!stored(bytes_now, digest_now) || bytes_now != bytes || digest_now != digest) {
+            continue;
+        }
+        if (extends) {
+            return content.size() == bytes || append_locked(chat, content.substr(bytes), nullptr);
+        }
+        return reset_locked(chat) && (content.empty() || append_locked(chat, content, nullptr));
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    return reset_locked(chat) && (content.empty() || append_locked(chat, content, nullptr));
+}
+
+void ChatLog::set_listener(Listener callback) {
+    std::lock_guard<std::mutex> lock(mutex);
+    listener = std::move(callback);
+}
+
+std::vector<std::string> ChatLog::chat_names() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<std::string> names;
+    names.reserve(chats.size());
+    for (const auto &item : chats) {
+        names.push_back(item.first);
+    }
+    return names;
+}
+
+bool ChatLog::sequence_range(std::string_view chat, uint64_t &base, uint64_t &next) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = chats.find(std::string(chat));
+    if (found == chats.end()) {
+        return false;
+    }
+    base = found->second.base;
+    next = found->second.next_sequence;
+    return true;
+}
+
+bool ChatLog::flush() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return active && fdatasync(active->fd) == 0;
+}
+
+size_t ChatLog::chat_count() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return chats.size();
+}
+
+size_t ChatLog::segment_count() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return segments.size();
+}
+
+void ChatLog::request_compaction() {
+    {
+        std::lock_guard<std::mutex> lock(compaction_mutex);
+        compaction_pending = true;
+    }
+    compaction_wanted.notify_one();
+}
+
+void ChatLog::compaction_loop() {
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(compaction_mutex);
+            compaction_wanted.wait(lock, [this] { return stopping || compaction_pending; });
+            if (stopping) {
+                return;
+            }
+            compaction_pending = false;
+        }
+        compact();
+    }
+}
+
+void ChatLog::compact() {
+    std::vector<uint32_t> victims;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto &[id, segment] : segments) {
+            if (segment->sealed && !segment->damaged &&
+                static_cast<double>(segment->live) <
+                    settings.compact_below * static_cast<double>(segment->bytes)) {
+                victims.push_back(id);
+            }
+        }
+    }
+    for (uint32_t id : victims) {
+        compact_segment(id);
+    }
+}
+
+bool ChatLog::compact_segment(uint32_t id) {
+    std::shared_ptr<Segment> victim;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = segments.find(id);
+        if (found == segments.end()) {
+            return false;
+        }
+        victim = found->second;
+    }
+    // Copy forward every record the index still points at, checking under
+    // the lock each time since appends and resets carry on meanwhile.
+    std::vector<char> copy;
+    bool copied = true;
+    uint64_t end = scan_records(victim->fd, victim->bytes,
+                                [&](uint64_t offset, const ChatRecordHeader &header,
+                                    const char *record) {
+        std::string_view chat(record + sizeof(header), header.chat_bytes);
+        size_t size = sizeof(header) + header.chat_bytes + header.text_bytes;
+        ChatRecordKind kind = static_cast<ChatRecordKind>(header.kind);
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = chats.find(std::string(chat));
+        if (found == chats.end()) {
+            return;
+        }
+        ChatEntry &entry = found->second;
+        Location *location = nullptr;
+        if (kind == ChatRecordKind::Reset) {
+            if (entry.has_reset && header.sequence + 1 == entry.base) {
+                location = &entry.reset_record;
+            }
+        } else if (header.sequence >= entry.base &&
+                   header.sequence - entry.base < entry.messages.size()) {
+            location = &entry.messages[header.sequence - entry.base];
+        }
+        if (!location || location->segment != id || location->offset != offset) {
+            return;
+        }
+        copy.assign(record, record + size);
+        Location moved;
+        if (!write_raw(chat, kind, header.sequence, copy, moved)) {
+            copied = false;
+            return;
+        }
+        release(*location);
+        *location = moved;
+    });
+    if (!copied) {
+        return false;
+    }
+    if (end != victim->bytes) {
+        std::cerr << "Chat log segment " << segment_path(id, ".log") << " is damaged at byte "
+                  << end << "; keeping it" << std::endl;
+        std::lock_guard<std::mutex> lock(mutex);
+        victim->damaged = true;
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        // The copies must be durable before the originals go.
+        if (fdatasync(active->fd) != 0) {
+            return false;
+        }
+        segments.erase(id);
+    }
+    unlink(segment_path(id, ".hint").c_str());
+    unlink(segment_path(id, ".log").c_str());
+    return true;
+}
@@ -0,0 +1,206 @@
+#ifndef CHAT_LOG_H
+#define CHAT_LOG_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <openssl/evp.h>
+#include "../include/async_io.h"
+
+// Every chat's messages live in one log split into numbered segment files,
+// NNNNNNNN.log, all fields little-endian. A record is a ChatRecordHeader,
+// the chat name and the message text; the CRC-32 covers everything after
+// its own field. Each chat numbers its records: a message takes the next
+// sequence number and a reset record (clearing the chat) takes one too,
+// so after a restart the index is rebuilt in the right order even where
+// compaction has moved older messages behind newer ones.
+//
+// A segment that fills up is sealed and gets a NNNNNNNN.hint file listing
+// its records without their text, so opening the log reads the hints plus
+// the one unsealed segment rather than every message ever written.
+constexpr uint32_t kChatRecordMagic = 0x474f4c43; // "CLOG"
+constexpr uint32_t kChatHintMagic = 0x544e4948; // "HINT"
+
+enum class ChatRecordKind : uint8_t {
+    Message = 0,
+    Reset = 1,
+};
+
+struct ChatRecordHeader {
+    uint32_t magic;
+    uint32_t crc;
+    uint64_t sequence;
+    // Milliseconds since the Unix epoch.
+    int64_t timestamp;
+    uint16_t chat_bytes;
+    uint8_t kind;
+    uint8_t reserved;
+    uint32_t text_bytes;
+};
+
+static_assert(sizeof(ChatRecordHeader) == 32);
+
+struct ChatMessage {
+    uint64_t sequence = 0;
+    int64_t timestamp = 0;
+    std::string text;
+};
+
+struct ChatLogOptions {
+    // Appends go to a new segment once the current one reaches this.
+    uint64_t segment_bytes = 64ull << 20;
+    // A sealed segment is compacted once less than this fraction of it is
+    // still live.
+    double compact_below = 0.5;
+};
+
+// Segmented append-only chat store. An in-memory hash index maps each chat
+// to the location of each of its messages, so appending is one write at
+// the end of the active segment and reading the last N messages of a chat
+// is N positioned reads, submitted to storage_io() as one batch, however
+// long the log has grown. Messages cleared
+// by a reset stay in their segments as garbage until a background thread
+// copies the live records of mostly-dead sealed segments forward and
+// deletes them.
+//
+// Appends are written straight to the file but only synced by flush() and
+// when a segment is sealed. All methods may be called from any thread.
+class ChatLog {
+public:
+    ChatLog() = default;
+    ~ChatLog();
+    ChatLog(const ChatLog &) = delete;
+    ChatLog &operator=(const ChatLog &) = delete;
+
+    // Opens or creates the log in directory, discarding a torn record at
+    // the end of the last segment. Returns false (after logging) if the
+    // directory cannot be used.
+    bool open(const std::string &directory, ChatLogOptions options = ChatLogOptions());
+    void close();
+    bool is_open() const;
+
+    // Adds text as the chat's newest message; sequence receives its number.
+    bool append(std::string_view chat, std::string_view text, uint64_t *sequence = nullptr);
+    // Drops every message of chat written so far.
+    bool reset(std::string_view chat);
+    // Up to count of the chat's most recent messages, oldest first.
+    std::vector<ChatMessage> read_last(std::string_view chat, size_t count) const;
+    // read_last() without waiting: calls done with the messages on a
+    // storage_io() thread, or at once if the chat has none. The log must
+    // stay open until then.
+    void read_last_async(std::string_view chat, size_t count,
+                         std::function<void(std::vector<ChatMessage>)> done) const;
+    // All of the chat's texts concatenated.
+    std::string read_all(std::string_view chat);
+    // Replaces the chat's content, appending only the new tail when
+    // content extends what is already stored. The stored content is
+    // identified by its SHA-256, and the comparison and the write happen
+    // under one lock, so a concurrent writer cannot slip in between.
+    bool store(std::string_view chat, std::string_view content);
+
+    // Called after each record is written, in log order, with the log's
+    // lock held: it must not call back into the log.
+    using Listener = std::function<void(std::string_view chat, ChatRecordKind kind,
+                                        uint64_t sequence, std::string_view text)>;
+    void set_listener(Listener callback);
+
+    std::vector<std::string> chat_names() const;
+    // Sequence numbers of the chat's live messages are at least base and
+    // below next. False for an unknown chat.
+    bool sequence_range(std::string_view chat, uint64_t &base, uint64_t &next) const;
+
+    bool flush();
+    size_t chat_count() const;
+    size_t segment_count() const;
+    // Runs one compaction pass now; the background thread does the same.
+    void compact();
+
+private:
+    struct Segment;
+    struct Location {
+        uint32_t segment = 0;
+        uint32_t size = 0;
+        uint64_t offset = 0;
+    };
+    struct DigestFree {
+        void operator()(EVP_MD_CTX *context) const { EVP_MD_CTX_free(context); }
+    };
+    struct ChatEntry {
+        uint64_t next_sequence = 0;
+        // Messages hold sequence numbers base, base + 1, ... in order.
+        uint64_t base = 0;
+        bool has_reset = false;
+        Location reset_record;
+        std::vector<Location> messages;
+        // Running SHA-256 and length of the concatenated texts, so store()
+        // can tell an extension of the content without reading it back.
+        // Null until the content is known.
+        std::unique_ptr<EVP_MD_CTX, DigestFree> content_digest;
+        uint64_t content_bytes = 0;
+    };
+    struct HintEntry {
+        uint64_t offset;
+        uint64_t sequence;
+        uint32_t size;
+        uint8_t kind;
+        uint8_t reserved;
+        uint16_t chat_bytes;
+    };
+
+    std::string segment_path(uint32_t id, const char *suffix) const;
+    std::shared_ptr<Segment> open_segment(uint32_t id, bool create);
+    bool replay(Segment &segment, bool truncate_torn);
+    bool replay_hints(Segment &segment);
+    void apply(uint32_t segment, uint64_t offset, uint32_t size, ChatRecordKind kind,
+               std::string_view chat, uint64_t sequence);
+    // append() and reset() with the lock already held.
+    bool append_locked(std::string_view chat, std::string_view text, uint64_t *sequence);
+    bool reset_locked(std::string_view chat);
+    bool write_record(std::string_view chat, ChatRecordKind kind, std::string_view text,
+                      uint64_t sequence, Location &where);
+    bool write_raw(std::string_view chat, ChatRecordKind kind, uint64_t sequence,
+                   const std::vector<char> &record, Location &where);
+    bool seal_active();
+    bool write_hints(const Segment &segment);
+    void release(const Location &location);
+    using RecordList = std::vector<std::pair<std::shared_ptr<Segment>, Location>>;
+    RecordList last_records(std::string_view chat, size_t count) const;
+    static std::vector<IoRequest> record_reads(const RecordList &records,
+                                               std::vector<std::vector<char>> &buffers);
+    std::vector<ChatMessage> parse_reads(const RecordList &records,
+                                         const std::vector<std::vector<char>> &buffers,
+                                         const std::vector<IoRequest> &reads) const;
+    bool parse_record(const Segment &segment, const Location &location, const char *record,
+                      ChatMessage &message) const;
+    bool compact_segment(uint32_t id);
+    void request_compaction();
+    void compaction_loop();
+
+    std::string root;
+    ChatLogOptions settings;
+
+    mutable std::mutex mutex;
+    std::unordered_map<std::string, ChatEntry> chats;
+    std::map<uint32_t, std::shared_ptr<Segment>> segments;
+    std::shared_ptr<Segment> active;
+    std::vector<char> scratch;
+    Listener listener;
+
+    std::mutex compaction_mutex;
+    std::condition_variable compaction_wanted;
+    bool compaction_pending = false;
+    bool stopping = false;
+    std::thread compactor;
+};
+
+#endif // CHAT_LOG_H
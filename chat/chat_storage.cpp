@@ -1,35 +1,266 @@
 #include "chat_storage.h"
 #include <iostream>
-#include <fstream>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
 #include <string>
+#include "chat_log.h"
+#include "../include/async_io.h"
+#include "../include/wal.h"
+
+namespace {
+
+// Log record type of a chat message or reset: a ChatRecordKind byte, the
+// uint64 sequence number, the uint16 chat name length, the name and text.
+constexpr uint16_t kChatWalRecord = 1;
+// The log is checkpointed once it holds this much.
+constexpr uint64_t kChatWalCheckpointBytes = 64ull << 20;
+
+ChatLog log;
+ChatIndex searchIndex;
+Wal wal;
+std::once_flag opened;
+// Set once the first chatLog() call has finished opening everything.
+std::atomic<bool> openDone{false};
+std::mutex checkpointMutex;
+// LSN of the last record this thread logged, for commitLogged() to wait on.
+thread_local uint64_t lastLsn = 0;
+
+// Puts back a record the chat log lost with the machine; records it
+// still has, by sequence number, are skipped.
+void replayRecord(uint16_t type, uint64_t, std::string_view payload) {
+    uint8_t kind;
+    uint64_t sequence;
+    uint16_t chatBytes;
+    constexpr size_t fixed = sizeof(kind) + sizeof(sequence) + sizeof(chatBytes);
+    if (type != kChatWalRecord || payload.size() < fixed) {
+        return;
+    }
+    std::memcpy(&kind, payload.data(), sizeof(kind));
+    std::memcpy(&sequence, payload.data() + sizeof(kind), sizeof(sequence));
+    std::memcpy(&chatBytes, payload.data() + sizeof(kind) + sizeof(sequence), sizeof(chatBytes));
+    if (payload.size() < fixed + chatBytes) {
+        return;
+    }
+    std::string_view chat = payload.substr(fixed, chatBytes);
+    uint64_t base = 0;
+    uint64_t next = 0;
+    if (log.sequence_range(chat, base, next) && sequence < next) {
+        return;
+    }
+    if (static_cast<ChatRecordKind>(kind) == ChatRecordKind::Reset) {
+        log.reset(chat);
+    } else {
+        log.append(chat, payload.substr(fixed + chatBytes));
+    }
+}
+
+void logRecord(std::string_view chat, ChatRecordKind kind, uint64_t sequence,
+               std::string_view text) {
+    if (!wal.is_open()) {
+        return;
+    }
+    uint8_t kindByte = static_cast<uint8_t>(kind);
+    uint16_t chatBytes = static_cast<uint16_t>(chat.size());
+    lastLsn = wal.append(
+        kChatWalRecord,
+        {std::string_view(reinterpret_cast<const char*>(&kindByte), sizeof(kindByte)),
+         std::string_view(reinterpret_cast<const char*>(&sequence), sizeof(sequence)),
+         std::string_view(reinterpret_cast<const char*>(&chatBytes), sizeof(chatBytes)), chat,
+         text});
+}
+
+// Waits for the records of the calling thread's last change to be durable,
+// then checkpoints the log if it has grown large. Every record up to the
+// captured LSN is already in the chat log, since records are logged after
+// the chat log writes them, so syncing the chat log covers them.
+bool commitLogged() {
+    if (!wal.is_open()) {
+        return true;
+    }
+    bool committed = lastLsn == 0 || wal.commit(lastLsn);
+    lastLsn = 0;
+    if (wal.size_bytes() >= kChatWalCheckpointBytes) {
+        std::unique_lock<std::mutex> lock(checkpointMutex, std::try_to_lock);
+        if (lock.owns_lock()) {
+            uint64_t lsn = wal.last_lsn();
+            if (log.flush()) {
+                wal.checkpoint(lsn);
+            }
+        }
+    }
+    return committed;
+}
+
+// Indexes whatever the log holds that the index lost, such as documents
+// still buffered when the process last stopped.
+void catchUpIndex() {
+    for (const std::string& name : log.chat_names()) {
+        uint64_t base = 0;
+        uint64_t next = 0;
+        if (!log.sequence_range(name, base, next)) {
+            continue;
+        }
+        uint64_t indexed = searchIndex.next_sequence(name);
+        if (indexed < base) {
+            searchIndex.remove(name, base);
+            indexed = base;
+        }
+        if (indexed >= next) {
+            continue;
+        }
+        for (const ChatMessage& message : log.read_last(name, next - indexed)) {
+            if (message.sequence >= indexed) {
+                searchIndex.add(name, message.sequence, message.text);
+            }
+        }
+    }
+}
+
+ChatLog& chatLog() {
+    std::call_once(opened, [] {
+        const char* directory = std::getenv("SVAKLA_CHAT_DIR");
+        std::string root = directory && *directory ? directory : "chats";
+        if (!log.open(root)) {
+            return;
+        }
+        // Without its log the chat log still works, syncing only as it
+        // seals segments.
+        if (wal.open(root + "/wal", wal_options_from_env(), replayRecord) && log.flush()) {
+            wal.checkpoint(wal.last_lsn());
+        }
+        if (!searchIndex.open(root + "/index")) {
+            return;
+        }
+        catchUpIndex();
+        log.set_listener([](std::string_view chat, ChatRecordKind kind, uint64_t sequence,
+                            std::string_view text) {
+            if (kind == ChatRecordKind::Reset) {
+                searchIndex.remove(chat, sequence + 1);
+            } else {
+                searchIndex.add(chat, sequence, text);
+            }
+            logRecord(chat, kind, sequence, text);
+        });
+    });
+    openDone = true;
+    return log;
+}
+
+// The chat log if it is open; otherwise logs why the operation cannot run
+// and returns null.
+ChatLog* openChatLog() {
+    ChatLog& opened = chatLog();
+    if (!opened.is_open()) {
+        std::cerr << "Chat storage is not available" << std::endl;
+        return nullptr;
+    }
+    return &opened;
+}
+
+// Runs task with openChatLog(), on a storage thread if the log has yet to
+// be opened, since opening reads the hints and replays the write-ahead log.
+void withChatLog(std::function<void(ChatLog*)> task) {
+    if (openDone) {
+        task(openChatLog());
+        return;
+    }
+    storage_io().defer([task = std::move(task)] { task(openChatLog()); });
+}
+
+bool appendMessage(const std::string& chatName, const std::string& message) {
+    ChatLog* chats = openChatLog();
+    if (!chats || !chats->append(chatName, message) || !commitLogged()) {
+        std::cerr << "Unable to append to chat: " << chatName << std::endl;
+        return false;
+    }
+    return true;
+}
+
+} // namespace
 
 void initializeChatStorage() {
-    std::cout << "Chat storage initialized." << std::endl;
+    if (chatLog().is_open()) {
+        std::cout << "Chat storage initialized." << std::endl;
+    }
 }
 
 void saveChat(const std::string& chatName, const std::string& chatContent) {
-    std::ofstream outFile(chatName + ".txt");
-    if (outFile.is_open()) {
-        outFile << chatContent;
-        outFile.close();
+    ChatLog* chats = openChatLog();
+    if (chats && chats->store(chatName, chatContent) && commitLogged()) {
         std::cout << "Chat saved: " << chatName << std::endl;
     } else {
-        std::cerr << "Unable to open file: " << chatName << std::endl;
+        std::cerr << "Unable to save chat: " << chatName << std::endl;
     }
 }
 
 std::string loadChat(const std::string& chatName) {
-    std::ifstream inFile(chatName + ".txt");
-    std::string content;
-    if (inFile.is_open()) {
-        std::string line;
-        while (std::getline(inFile, line)) {
-            content += line + "\n";
-        }
-        inFile.close();
-        std::cout << "Chat loaded: " << chatName << std::endl;
-    } else {
-        std::cerr << "Unable to open file: " << chatName << std::endl;
+    ChatLog* chats = openChatLog();
+    if (!chats) {
+        return "";
     }
+    std::string content = chats->read_all(chatName);
+    std::cout << "Chat loaded: " << chatName << std::endl;
     return content;
 }
+
+void appendChatMessage(const std::string& chatName, const std::string& message) {
+    appendMessage(chatName, message);
+}
+
+std::vector<std::string> loadRecentMessages(const std::string& chatName, size_t count) {
+    std::vector<std::string> messages;
+    ChatLog* chats = openChatLog();
+    if (!chats) {
+        return messages;
+    }
+    for (ChatMessage& message : chats->read_last(chatName, count)) {
+        messages.push_back(std::move(message.text));
+    }
+    return messages;
+}
+
+std::vector<ChatSearchHit> searchChats(const std::string& query, size_t limit) {
+    if (!openChatLog() || !searchIndex.is_open()) {
+        return {};
+    }
+    return searchIndex.search(query, limit);
+}
+
+void searchChatsAsync(const std::string& query, size_t limit,
+                      std::function<void(std::vector<ChatSearchHit>)> done) {
+    storage_io().defer([query, limit, done = std::move(done)] {
+        done(searchChats(query, limit));
+    });
+}
+
+void loadRecentMessagesAsync(const std::string& chatName, size_t count,
+                             std::function<void(std::vector<std::string>)> done) {
+    withChatLog([chatName, count, done = std::move(done)](ChatLog* chats) {
+        if (!chats) {
+            done({});
+            return;
+        }
+        chats->read_last_async(chatName, count, [done](std::vector<ChatMessage> read) {
+            std::vector<std::string> messages;
+            messages.reserve(read.size());
+            for (ChatMessage& message : read) {
+                messages.push_back(std::move(message.text));
+            }
+            done(std::move(messages));
+        });
+    });
+}
+
+void appendChatMessagesAsync(const std::string& chatName, std::vector<std::string> messages,
+                             std::function<void(bool)> done) {
+    storage_io().defer([chatName, messages = std::move(messages), done = std::move(done)] {
+        bool appended = true;
+        for (const std::string& message : messages) {
+            appended = appended && appendMessage(chatName, message);
+        }
+        done(appended);
+    });
+}
@@ -1,10 +1,35 @@
 #ifndef CHAT_STORAGE_H
 #define CHAT_STORAGE_H
 
+#include <cstddef>
+#include <functional>
 #include <string>
+#include <vector>
+#include "chat_index.h"
 
+// Chats are kept in one segmented log (see chat_log.h) under the directory
+// named by SVAKLA_CHAT_DIR, "chats" by default, with a full-text index of
+// every message in its "index" subdirectory. Changes are committed to a
+// write-ahead log in its "wal" subdirectory before saveChat() and
+// appendChatMessage() return, with durability from wal_options_from_env().
 void initializeChatStorage();
 void saveChat(const std::string& chatName, const std::string& chatContent);
 std::string loadChat(const std::string& chatName);
+void appendChatMessage(const std::string& chatName, const std::string& message);
+std::vector<std::string> loadRecentMessages(const std::string& chatName, size_t count);
+std::vector<ChatSearchHit> searchChats(const std::string& query, size_t limit);
+
+// For request handlers, which must never wait for the disk on a network
+// thread: these return at once and call done on a storage_io() thread (see
+// async_io.h). loadRecentMessagesAsync() submits the chat's record reads as
+// one batch, and may call done at once for a chat with no messages.
+// appendChatMessagesAsync() appends the messages in order and reports
+// whether all of them were committed.
+void searchChatsAsync(const std::string& query, size_t limit,
+                      std::function<void(std::vector<ChatSearchHit>)> done);
+void loadRecentMessagesAsync(const std::string& chatName, size_t count,
+                             std::function<void(std::vector<std::string>)> done);
+void appendChatMessagesAsync(const std::string& chatName, std::vector<std::string> messages,
+                             std::function<void(bool)> done);
 
 #endif // CHAT_STORAGE_H
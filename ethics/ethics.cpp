@@ -2,6 +2,7 @@
 #include <iostream>
 #include <openssl/evp.h>
 #include <openssl/err.h>
+#include "../include/auth.h"
 
 void initializeAuth() {
     OpenSSL_add_all_algorithms();
@@ -9,8 +10,13 @@ void initializeAuth() {
     std::cout << "Authentication system initialized." << std::endl;
 }
 
+// The password is a session token from the auth service; username must be
+// the subject (key fingerprint) it was issued to.
 bool authenticateUser(const std::string& username, const std::string& password) {
-    // Placeholder for actual authentication logic
-    std::cout << "Authenticating user: " << username << std::endl;
+    std::string subject;
+    if (!auth_service().verify_token(password, &subject) || subject != username) {
+        std::cout << "Authentication failed for user: " << username << std::endl;
+        return false;
+    }
     return true;
 }
@@ -0,0 +1,109 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// Milliseconds on the monotonic clock; the time base for every limit below.
+uint64_t monotonic_ms();
+
+// Refills at rate tokens per second up to burst. A zero rate never limits.
+class TokenBucket {
+public:
+    TokenBucket() = default;
+    TokenBucket(double rate, double burst);
+
+    bool take(uint64_t now);
+    // True once the bucket has refilled completely, i.e. it carries no
+    // state worth remembering.
+    bool full(uint64_t now) const;
+
+private:
+    double rate = 0;
+    double burst = 0;
+    double tokens = 0;
+    uint64_t updated = 0;
+};
+
+// Per-service limits. Connection counts and the buffer budget are shared by
+// every shard serving the port; the rest apply to each connection.
+struct ConnectionLimits {
+    size_t max_connections = 1024;
+    size_t max_connections_per_ip = 64;
+    double connection_rate_per_ip = 20;
+    double connection_burst_per_ip = 40;
+    // Requests per second on one connection; 0 disables the limit.
+    double request_rate = 100;
+    double request_burst = 200;
+    size_t max_header_bytes = 64 * 1024;
+    size_t max_body_bytes = 8 * 1024 * 1024;
+    // Reading pauses once this much unconsumed input is buffered, which
+    // pushes back on the peer through TCP flow control.
+    size_t max_input_bytes = 9 * 1024 * 1024;
+    // Handlers stop producing once this much output is queued.
+    size_t max_output_bytes = 4 * 1024 * 1024;
+    // New connections are refused while the port's connections together
+    // buffer more than this.
+    size_t max_buffered_bytes = 64 * 1024 * 1024;
+    // Closes connections with no traffic in either direction.
+    uint32_t idle_timeout_ms = 60 * 1000;
+    // Time a request (or TLS handshake) may take to arrive once started;
+    // bounds slow-loris clients that drip bytes to dodge the idle timeout.
+    uint32_t request_timeout_ms = 30 * 1000;
+    // Sent on plaintext listeners before a refused connection is closed;
+    // empty to close silently.
+    std::string reject_response = "HTTP/1.1 503 Service Unavailable\r\n"
+                                  "Connection: close\r\n"
+                                  "Retry-After: 1\r\n"
+                                  "Content-Length: 0\r\n\r\n";
+};
+
+// Reads SVAKLA_MAX_CONNECTIONS, SVAKLA_MAX_CONNECTIONS_PER_IP,
+// SVAKLA_CONNECTION_RATE (new connections per second from one address),
+// SVAKLA_REQUEST_RATE, SVAKLA_IDLE_TIMEOUT_MS and SVAKLA_REQUEST_TIMEOUT_MS
+// on top of the defaults. Either rate also sets its burst to twice the
+// rate; 0 lifts the limit.
+ConnectionLimits connection_limits_from_env();
+
+// Admission state of one service, shared by the event loops of all shards.
+// Only accepts and closes take the lock; the per-request limits live on the
+// connection itself.
+class AdmissionControl {
+public:
+    explicit AdmissionControl(ConnectionLimits limits) : config(std::move(limits)) {}
+
+    const ConnectionLimits &limits() const { return config; }
+
+    // Counts the connection against the port and the peer, or returns
+    // false if either is over its limit.
+    bool admit(uint32_t address, uint64_t now);
+    void release(uint32_t address);
+
+    // Each loop periodically reports what its connections of this port
+    // hold; previous is the amount it reported last time.
+    void update_buffered(size_t previous, size_t current);
+
+    size_t active() const;
+    uint64_t rejected() const { return rejected_count.load(std::memory_order_relaxed); }
+
+private:
+    struct Peer {
+        size_t connections = 0;
+        TokenBucket accepts;
+    };
+
+    void prune(uint64_t now);
+
+    ConnectionLimits config;
+    mutable std::mutex mutex;
+    size_t active_count = 0;
+    std::unordered_map<uint32_t, Peer> peers;
+    std::atomic<size_t> buffered{0};
+    std::atomic<uint64_t> rejected_count{0};
+};
+
+#endif // ADMISSION_H
@@ -0,0 +1,171 @@
+#ifndef AI_CORE_H
+#define AI_CORE_H
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "compile_cache.h"
+#include "compute_pool.h"
+#include "generation_scheduler.h"
+#include "inference.h"
+#include "kv_cache.h"
+#include "model_weights.h"
+#include "tokenizer.h"
+#include "vector_index.h"
+#include "vectorizer.h"
+
+// Holds the keys and values of every conversation in one paged cache.
+// SVAKLA_KV_BUDGET_MB (default 512) caps the memory it takes; colder blocks
+// go to a spill file in SVAKLA_KV_SPILL_DIR (default TMPDIR, then /var/tmp),
+// or nowhere if that is "none".
+//
+// Past contexts are recalled by similarity: each is tokenized and turned by
+// a Vectorizer into the mean of fixed pseudo-random token vectors, so the
+// match is by shared tokens rather than meaning, and kept in an HNSW index.
+// SVAKLA_MEMORY_INDEX names a saved index to map at startup. Its texts stay
+// on disk beside it, in the same name plus ".text": an append-only file of
+// length-prefixed records, each keyed in the index by its offset. A save
+// appends and syncs one record; the index itself is rewritten only every
+// 1024 saves and on destruction, and texts saved after that are indexed
+// again when the file is next opened.
+class ContextMemoryManager {
+public:
+    ContextMemoryManager() = default;
+    ~ContextMemoryManager();
+    ContextMemoryManager(const ContextMemoryManager &) = delete;
+    ContextMemoryManager &operator=(const ContextMemoryManager &) = delete;
+
+    // Builds the token vectors; tokenizer must stay alive and unchanged
+    // while contexts are saved or loaded.
+    void configure_recall(const Tokenizer &tokenizer);
+    // Maps a saved index, or starts empty and saves to path if there is
+    // none yet, and opens its texts; false (after logging) if either is
+    // unreadable or the index was built for other vectors.
+    bool open_memories(const std::string &path);
+    // Indexes context unless an identical one is saved already. False for
+    // a context with no tokens, with no memories open, or if its text
+    // cannot be written; the index is then left as it was.
+    bool save_context(const std::string &context);
+    // The saved context most similar to query, or empty if there is none.
+    std::string load_context(const std::string &query) const;
+    // Rewrites the index if anything was saved since it last was.
+    bool flush_memories();
+
+    // Sizes the cache for a model; drops whatever it held.
+    bool configure(const ModelConfig &config);
+    KvBlockPool &kv_cache() { return blocks; }
+    HnswIndex &memory_index() { return memories; }
+    const HnswIndex &memory_index() const { return memories; }
+
+private:
+    bool embed(const std::string &text, AlignedFloats &row) const;
+    bool read_text(uint64_t offset, std::string &text) const;
+    bool append_text(const std::string &text);
+    bool checkpoint_locked();
+
+    KvBlockPool blocks;
+    const Tokenizer *recall_tokenizer = nullptr;
+    Vectorizer vectorizer;
+    HnswIndex memories;
+    std::string memories_path;
+    // Guards the texts file and the fields below; the index locks itself.
+    mutable std::mutex texts_mutex;
+    int texts_fd = -1;
+    uint64_t texts_end = 0;
+    // Saves since the index was last written.
+    size_t unsaved = 0;
+};
+
+// A function built by DynamicLogicGenerator; args holds the values the
+// expression reads as x[0], x[1], ...
+using GeneratedLogic = double (*)(const double *args);
+
+// Generated C is built into loadable modules through a CompileCache kept in
+// SVAKLA_COMPILE_CACHE (default svakla-compile-<uid> under TMPDIR, then
+// /var/tmp) and capped at SVAKLA_COMPILE_CACHE_MB (default 256). SVAKLA_CC
+// picks the compiler. This is a library facility: none of the servers
+// generate code.
+class DynamicLogicGenerator {
+public:
+    // Exactly one of function and error is set; module keeps function
+    // loaded and must be held for as long as it is called.
+    using Callback = std::function<void(GeneratedLogic function,
+                                        std::shared_ptr<CompiledModule> module,
+                                        const std::string &error)>;
+
+    // Emits a C function returning expression, an arithmetic expression
+    // over x[i] that may call <math.h>, and builds it through
+    // compile_cache().load(), so the same expression compiles only once.
+    // Expressions with characters that could end the function early
+    // (braces, semicolons, quotes, '#') are refused without compiling.
+    // done runs on this thread for a cached or refused expression,
+    // otherwise on a compile worker.
+    void generate_logic(const std::string &expression, Callback done);
+    // Created on first use, so nothing is put on disk until code is built.
+    CompileCache &compile_cache();
+
+private:
+    std::once_flag cache_created;
+    std::unique_ptr<CompileCache> cache;
+};
+
+// Receives each piece of generated text as soon as it is produced. Returning
+// false stops generation, e.g. when the client has gone away.
+using TokenCallback = std::function<bool(std::string_view token)>;
+
+// Generation settings come from the environment: SVAKLA_TOKENIZER (vocabulary
+// file), SVAKLA_THREADS (0 = every core), SVAKLA_CONTEXT (tokens per
+// conversation, default 2048), SVAKLA_MAX_TOKENS (per reply, default 256),
+// SVAKLA_TEMPERATURE (default 0.8), SVAKLA_BATCH (replies decoded together,
+// default 8), SVAKLA_PREFILL_CHUNK (prompt tokens per batch step, default
+// 256) and SVAKLA_PREFIX_CACHE_MB (computed prompt prefixes kept for reuse,
+// default 128). Concurrent callers share one GenerationScheduler.
+class AIEngine {
+public:
+    // Maps the weights named by SVAKLA_MODEL, if set.
+    AIEngine();
+
+    // Maps a weight file; set SVAKLA_VERIFY_WEIGHTS=1 to also check every
+    // tensor's checksum, at the cost of reading the whole file. Fails if
+    // the tokenizer has more tokens than the model's vocabulary.
+    bool load_model(const std::string &path);
+    const ModelWeights &weights() const { return model; }
+    bool ready() const { return scheduler != nullptr; }
+    PrefixCache::Stats prefix_cache_stats() const {
+        return scheduler ? scheduler->prefix_stats() : PrefixCache::Stats();
+    }
+
+    // Demo of the training pipeline: runs the CartPole DQN of
+    // reinforcement_learning.h (SVAKLA_TRAIN_ITERATIONS,
+    // SVAKLA_TRAIN_ENVIRONMENTS, SVAKLA_TRAIN_CHECKPOINT). It does not
+    // train or change the language model served by this engine.
+    void train_model();
+
+    std::string generate_response(const std::string &input);
+    void generate_response_stream(const std::string &input, const TokenCallback &on_token,
+                                  GenerationPriority priority = GenerationPriority::Normal);
+    // Starts a reply without waiting for it: on_text runs on the scheduler
+    // thread whenever Generation::poll has more to give. Null if no model
+    // is loaded.
+    std::shared_ptr<Generation> start_generation(
+        const std::string &input, std::function<void()> on_text,
+        GenerationPriority priority = GenerationPriority::Normal);
+
+private:
+    ModelWeights model;
+    TransformerModel transformer;
+    ContextMemoryManager memory;
+    Tokenizer tokenizer;
+    std::unique_ptr<ComputePool> pool;
+    SamplingParams sampling;
+    size_t context_tokens = 2048;
+    size_t max_reply_tokens = 256;
+    GenerationScheduler::Options batching;
+    // Declared last: its thread uses everything above.
+    std::unique_ptr<GenerationScheduler> scheduler;
+};
+
+#endif // AI_CORE_H
@@ -0,0 +1,94 @@
+#ifndef ASYNC_IO_H
+#define ASYNC_IO_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <sys/types.h>
+
+enum class IoOp : uint8_t {
+    Read,
+    Write,
+    Sync,
+    DataSync,
+};
+
+// One positioned transfer or sync. A read or write is continued until size
+// bytes have moved or, for a read, the file ends; result is then the number
+// of bytes moved, or -errno if the transfer failed.
+struct IoRequest {
+    IoOp op = IoOp::Read;
+    int fd = -1;
+    uint64_t offset = 0;
+    // Destination of a read, source of a write.
+    void *data = nullptr;
+    size_t size = 0;
+    ssize_t result = 0;
+};
+
+using IoBatchDone = std::function<void(std::vector<IoRequest> &requests)>;
+
+enum class IoBackendKind {
+    // io_uring when the kernel allows it, the thread pool otherwise.
+    Auto,
+    Uring,
+    Threads,
+};
+
+struct IoBackendOptions {
+    IoBackendKind kind = IoBackendKind::Auto;
+    // Submission queue entries of the ring.
+    unsigned queue_depth = 256;
+    // Buffers registered with the ring once, so transfers up to buffer_bytes
+    // skip pinning their pages on every request.
+    size_t registered_buffers = 64;
+    size_t buffer_bytes = 64 * 1024;
+    // Threads of the fallback, and of either backend for defer().
+    size_t threads = 4;
+};
+
+// Options from SVAKLA_IO_BACKEND ("auto", the default, "uring" or
+// "threads") and SVAKLA_IO_THREADS.
+IoBackendOptions io_backend_options_from_env();
+
+// Asynchronous file I/O for the storage layer, so that request handlers
+// hand disk work off instead of waiting for it on a network thread. The
+// io_uring backend queues a whole batch with one system call and a single
+// completion thread reaps the results; the fallback runs pread/pwrite on a
+// thread pool. Completion callbacks run on a backend thread: handlers
+// return to their connection with EventLoop::post_to().
+//
+// Chat history reads are submit()ted as one batch of record reads (see
+// ChatLog::read_last_async()). Work that also takes locks or waits for a
+// log commit, such as a context save, is defer()red and does its I/O with
+// run() from the backend thread.
+class IoBackend {
+public:
+    IoBackend() = default;
+    virtual ~IoBackend() = default;
+    IoBackend(const IoBackend &) = delete;
+    IoBackend &operator=(const IoBackend &) = delete;
+
+    // Starts every request at once and calls done when all have finished.
+    // Buffers must stay valid until then; done must not block.
+    virtual void submit(std::vector<IoRequest> requests, IoBatchDone done) = 0;
+    // Runs task on a backend thread, for storage work that is more than
+    // plain transfers (taking locks, encrypting, waiting for a commit).
+    virtual void defer(std::function<void()> task) = 0;
+    virtual const char *name() const = 0;
+
+    // Submits requests and waits for them. True if every transfer moved
+    // all its bytes and every sync succeeded. Safe to call from a defer()
+    // task, but not from a submit() callback.
+    virtual bool run(std::vector<IoRequest> &requests);
+};
+
+std::unique_ptr<IoBackend> make_io_backend(const IoBackendOptions &options = IoBackendOptions());
+
+// The backend shared by the storage layer, made on first use from
+// io_backend_options_from_env().
+IoBackend &storage_io();
+
+#endif // ASYNC_IO_H
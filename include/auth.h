@@ -0,0 +1,111 @@
+#ifndef AUTH_H
+#define AUTH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <openssl/evp.h>
+
+struct AuthConfig {
+    // Disabled only on request (SVAKLA_AUTH=off); with no usable key every
+    // protected request is refused.
+    bool enabled = true;
+    // Public keys allowed to log in, as written by generate_key_pair().
+    std::vector<std::string> public_key_paths = {"public.pem"};
+    uint32_t token_ttl_seconds = 15 * 60;
+    uint32_t challenge_ttl_seconds = 30;
+    size_t max_pending_challenges = 4096;
+};
+
+// Reads SVAKLA_AUTH, SVAKLA_AUTH_PUBLIC_KEY and SVAKLA_AUTH_TOKEN_TTL on top
+// of the defaults.
+AuthConfig auth_config_from_env();
+
+// HMAC-SHA256 with the key's inner and outer pads hashed once up front, so
+// signing a short message costs two SHA-256 compressions and two context
+// copies.
+class HmacKey {
+public:
+    HmacKey() = default;
+    ~HmacKey();
+
+    HmacKey(const HmacKey &) = delete;
+    HmacKey &operator=(const HmacKey &) = delete;
+
+    bool init(const unsigned char *key, size_t size);
+    // Thread-safe; out receives 32 bytes.
+    bool sign(std::string_view message, unsigned char out[32]) const;
+
+private:
+    EVP_MD_CTX *inner = nullptr;
+    EVP_MD_CTX *outer = nullptr;
+};
+
+// Public-key login for every service. A client asks for a challenge, signs
+// it with its private key and trades the signature for a session token:
+//
+//     <subject>.<expiry>.<hmac>
+//
+// subject identifies the key, expiry is in Unix seconds and hmac signs the
+// two with a secret drawn at startup. Tokens are stateless, so checking one
+// is a single HMAC and a constant-time compare; RSA only runs at login.
+class AuthService {
+public:
+    explicit AuthService(AuthConfig config = AuthConfig());
+    ~AuthService();
+
+    AuthService(const AuthService &) = delete;
+    AuthService &operator=(const AuthService &) = delete;
+
+    bool enabled() const { return config.enabled; }
+    bool has_keys() const { return !keys.empty(); }
+    uint32_t token_ttl() const { return config.token_ttl_seconds; }
+    uint32_t challenge_ttl() const { return config.challenge_ttl_seconds; }
+
+    // Returns false (after logging) when the key cannot be read.
+    bool add_public_key(const std::string &path);
+
+    // A one-time base64url nonce, or an empty string while too many are
+    // outstanding.
+    std::string issue_challenge();
+    // Consumes the challenge and, if signature (base64url) verifies under
+    // one of the keys, sets token.
+    bool redeem_challenge(std::string_view challenge, std::string_view signature,
+                          std::string &token);
+    bool verify_token(std::string_view token, std::string *subject = nullptr) const;
+
+private:
+    struct AuthorizedKey {
+        std::string subject;
+        EVP_PKEY *key;
+    };
+
+    std::string make_token(const std::string &subject, uint64_t expiry) const;
+    void prune_challenges(uint64_t now);
+
+    AuthConfig config;
+    std::vector<AuthorizedKey> keys;
+    HmacKey hmac;
+    std::mutex mutex;
+    std::unordered_map<std::string, uint64_t> challenges;
+};
+
+// Process-wide service configured from the environment on first use.
+AuthService &auth_service();
+
+// Client side: signs challenge with the PEM private key at path and returns
+// the base64url signature that redeem_challenge() expects.
+bool auth_sign_challenge(const std::string &private_key_path, std::string_view challenge,
+                         std::string &signature);
+
+void generate_key_pair();
+// Logs in against public_key_path with private_key_path, proving the pair
+// can authenticate.
+bool authenticate_user(const std::string &public_key_path, const std::string &private_key_path);
+
+#endif // AUTH_H
@@ -0,0 +1,26 @@
+#ifndef AUTH_MIDDLEWARE_H
+#define AUTH_MIDDLEWARE_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include "auth.h"
+#include "http.h"
+
+constexpr std::string_view kSessionCookie = "svakla_session";
+
+// The session token of a request: an "Authorization: Bearer" header, the
+// session cookie or, when allow_query is set (browsers cannot add headers
+// to a WebSocket handshake), a token= query parameter.
+std::string_view auth_request_token(const HttpRequest &request, bool allow_query = false);
+
+// Puts router behind auth:
+//   POST /auth/challenge  -> {"challenge": "...", "expires_in": 30}
+//   (the client signs "svakla-auth-v1:" + challenge with RSA-SHA256)
+//   POST /auth/session    challenge=...&signature=... -> token and cookie
+// Every other path needs a valid token unless it starts with one of
+// public_prefixes; refused requests get a 401.
+void install_auth(HttpRouter &router, AuthService &auth,
+                  std::vector<std::string> public_prefixes = {});
+
+#endif // AUTH_MIDDLEWARE_H
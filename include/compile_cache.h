@@ -0,0 +1,106 @@
+#ifndef COMPILE_CACHE_H
+#define COMPILE_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "thread_pool.h"
+
+struct CompileCacheOptions {
+    // Holds one <digest>.so per compiled source. Created 0700 if missing;
+    // refused if another user could write to it, since anything placed
+    // there gets loaded into this process.
+    std::string directory;
+    std::string compiler = "cc";
+    // Passed to the compiler as -x, so the source needs no extension.
+    std::string language = "c";
+    // Least recently used objects are deleted once the directory holds
+    // more than this. Modules loaded in this process are kept.
+    uint64_t max_bytes = 256ull << 20;
+    size_t workers = 1;
+};
+
+// A shared object built from generated source and loaded with dlopen. It
+// stays loaded while any reference to it does, so function pointers taken
+// from symbol() are valid for as long as the module is held.
+class CompiledModule {
+public:
+    CompiledModule(std::string digest, void *handle);
+    ~CompiledModule();
+    CompiledModule(const CompiledModule &) = delete;
+    CompiledModule &operator=(const CompiledModule &) = delete;
+
+    const std::string &digest() const { return key; }
+    // nullptr if the module does not export name.
+    void *symbol(const char *name) const;
+
+private:
+    std::string key;
+    void *handle;
+};
+
+// Content-addressed cache of compiled generated code. A module is keyed by
+// the SHA-256 of the compiler, language, flags and source, so the same
+// snippet built the same way is compiled once: later requests cost a hash
+// and a map lookup, or a dlopen of the stored object after a restart.
+// Misses compile on background workers, and concurrent requests for the
+// same digest share one compiler run.
+class CompileCache {
+public:
+    // Exactly one of module and error is set.
+    using Callback =
+        std::function<void(std::shared_ptr<CompiledModule> module, const std::string &error)>;
+
+    struct Stats {
+        uint64_t memory_hits = 0;
+        uint64_t disk_hits = 0;
+        uint64_t compiles = 0;
+        uint64_t failures = 0;
+        uint64_t evictions = 0;
+    };
+
+    explicit CompileCache(CompileCacheOptions options);
+    ~CompileCache();
+    CompileCache(const CompileCache &) = delete;
+    CompileCache &operator=(const CompileCache &) = delete;
+
+    bool ready() const { return usable; }
+    const CompileCacheOptions &options() const { return settings; }
+
+    // Calls done on this thread for a cached module, otherwise on a worker
+    // once the compiler has finished.
+    void load(const std::string &source, const std::vector<std::string> &flags, Callback done);
+    // Blocks until the module is available; error receives the compiler's
+    // diagnostics on failure.
+    std::shared_ptr<CompiledModule> load_now(const std::string &source,
+                                             const std::vector<std::string> &flags,
+                                             std::string &error);
+    Stats stats() const;
+
+private:
+    std::string digest_of(const std::string &source, const std::vector<std::string> &flags) const;
+    std::string object_path(const std::string &digest) const;
+    std::shared_ptr<CompiledModule> open_object(const std::string &digest, std::string &error);
+    void compile(const std::string &digest, const std::string &source,
+                 const std::vector<std::string> &flags);
+    bool run_compiler(const std::string &source, const std::vector<std::string> &flags,
+                      const std::string &output, std::string &error);
+    void enforce_limit();
+
+    CompileCacheOptions settings;
+    bool usable = false;
+
+    mutable std::mutex mutex;
+    std::unordered_map<std::string, std::shared_ptr<CompiledModule>> loaded;
+    std::unordered_map<std::string, std::vector<Callback>> pending;
+    Stats counters;
+    // Declared last: draining it runs compiles that use everything above.
+    std::unique_ptr<ThreadPool> workers;
+};
+
+#endif // COMPILE_CACHE_H
@@ -0,0 +1,47 @@
+#ifndef COMPUTE_POOL_H
+#define COMPUTE_POOL_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fork-join threads for splitting one computation (a matmul, the heads of
+// an attention step) across cores. Unlike ThreadPool there is no queue: the
+// calling thread takes part and run() returns once every thread is done.
+// Workers spin briefly between jobs, since a forward pass issues them back
+// to back, and then sleep. Jobs from different callers run one at a time.
+class ComputePool {
+public:
+    // Total thread count, the caller included; 0 means one per hardware
+    // thread.
+    explicit ComputePool(size_t threads = 0);
+    ~ComputePool();
+
+    ComputePool(const ComputePool &) = delete;
+    ComputePool &operator=(const ComputePool &) = delete;
+
+    size_t size() const { return workers.size() + 1; }
+
+    // Calls job(index, size()) once on every thread.
+    void run(const std::function<void(size_t index, size_t count)> &job);
+    // Hands out [0, count) in chunks of grain items to whichever thread is
+    // free; body(begin, end) must be safe to call concurrently.
+    void parallel_for(size_t count, size_t grain,
+                      const std::function<void(size_t begin, size_t end)> &body);
+
+private:
+    void worker_loop(size_t index);
+
+    std::mutex run_mutex;
+    const std::function<void(size_t, size_t)> *job = nullptr;
+    std::atomic<uint32_t> generation{0};
+    std::atomic<uint32_t> pending{0};
+    std::atomic<bool> stopping{false};
+    std::vector<std::thread> workers;
+};
+
+#endif // COMPUTE_POOL_H
@@ -0,0 +1,192 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <openssl/ssl.h>
+#include "admission.h"
+
+// Protocol handlers attach their per-connection parser state here; it is
+// destroyed together with the connection.
+struct ConnectionState {
+    virtual ~ConnectionState() = default;
+};
+
+class EventLoop;
+
+// Identifies a connection across threads. The fd alone is not enough since
+// the kernel reuses descriptors; id is unique for the lifetime of a loop.
+struct ConnectionRef {
+    int fd = -1;
+    uint64_t id = 0;
+};
+
+// Output queued ahead of Connection::out. Shared segments reference
+// immutable bytes (e.g. cached static assets) that are handed to writev
+// without copying them into the connection.
+struct OutputSegment {
+    std::string owned;
+    std::shared_ptr<const std::string> shared;
+    std::string_view data;
+};
+
+// Per-connection buffers owned by the event loop. Handlers read from
+// input(), call consume() for the bytes they have processed and queue
+// replies with send(); the loop flushes the output when the socket is
+// writable and closes the socket once close_after_write is set and
+// everything has been sent.
+struct Connection {
+    int fd = -1;
+    uint64_t id = 0;
+    EventLoop *loop = nullptr;
+    std::string in;
+    size_t in_offset = 0;
+    std::string out;
+    size_t out_offset = 0;
+    std::deque<OutputSegment> segments;
+    size_t segment_bytes = 0;
+    bool close_after_write = false;
+    bool closed = false;
+    // When set, the handler is invoked again once the output buffer has
+    // been fully written, which lets producers apply backpressure.
+    bool notify_on_drain = false;
+    std::unique_ptr<ConnectionState> state;
+    // Set for listeners with a TLS context; input and output then carry
+    // plaintext and the loop drives SSL_do_handshake/SSL_read/SSL_write.
+    SSL *ssl = nullptr;
+    bool handshake_done = false;
+    // Limits of the service that accepted the connection, if it has any.
+    const ConnectionLimits *limits = nullptr;
+    uint64_t last_active_ms = 0;
+    uint64_t deadline_ms = 0;
+    // Set while input is at its limit and the socket has not been drained.
+    bool read_paused = false;
+
+    Connection() = default;
+    Connection(const Connection &) = delete;
+    Connection &operator=(const Connection &) = delete;
+    ~Connection();
+
+    std::string_view input() const {
+        return std::string_view(in).substr(in_offset);
+    }
+
+    void consume(size_t n);
+    void send(std::string_view data);
+    // Output buffer for handlers that serialize replies in place.
+    std::string &output_buffer();
+    // Queues size bytes of data starting at offset without copying them.
+    void send_shared(std::shared_ptr<const std::string> data, size_t offset, size_t size);
+    void consume_output(size_t n);
+    size_t pending_output() const { return segment_bytes + out.size() - out_offset; }
+    bool input_full() const {
+        return limits && in.size() - in_offset >= limits->max_input_bytes;
+    }
+    // The loop closes the connection once timeout_ms have passed unless the
+    // deadline is cleared first. Arming an armed deadline keeps the earlier one.
+    void arm_deadline(uint32_t timeout_ms);
+    void clear_deadline() { deadline_ms = 0; }
+    ConnectionRef ref() const { return ConnectionRef{fd, id}; }
+};
+
+using ConnectionHandler = std::function<void(Connection &)>;
+
+// Counters updated by the loop thread and readable from any thread.
+struct EventLoopStats {
+    std::atomic<uint64_t> accepted{0};
+    std::atomic<uint64_t> active{0};
+    std::atomic<uint64_t> bytes_read{0};
+    std::atomic<uint64_t> bytes_written{0};
+    std::atomic<uint64_t> rejected{0};
+    std::atomic<uint64_t> timed_out{0};
+};
+
+// Single-threaded, edge-triggered epoll reactor. Every socket is
+// non-blocking; accept, read and write each loop until EAGAIN so that a
+// single readiness notification drains the kernel queue.
+class EventLoop {
+public:
+    EventLoop();
+    ~EventLoop();
+
+    EventLoop(const EventLoop &) = delete;
+    EventLoop &operator=(const EventLoop &) = delete;
+
+    bool valid() const { return epoll_fd >= 0; }
+
+    // Binds a non-blocking listener on port and dispatches readable data of
+    // every accepted connection to on_data. With a TLS context, handshakes
+    // are driven by readiness events like any other I/O, never on accept.
+    // With reuse_port several loops may bind the same port and the kernel
+    // spreads incoming connections across them. With admission, connections
+    // over its limits are refused on accept and the rest are held to its
+    // timeouts and buffer caps.
+    bool listen(int port, ConnectionHandler on_data, SSL_CTX *tls = nullptr,
+                bool reuse_port = false,
+                std::shared_ptr<AdmissionControl> admission = nullptr);
+
+    void run();
+    void stop();
+
+    const EventLoopStats &stats() const { return counters; }
+
+    // Thread-safe: queues task to run on the loop thread.
+    void post(std::function<void()> task);
+    // Thread-safe: runs task against the connection on the loop thread and
+    // flushes its output afterwards. Dropped if the connection has closed.
+    void post_to(ConnectionRef ref, std::function<void(Connection &)> task);
+
+private:
+    struct Listener {
+        int fd;
+        ConnectionHandler on_data;
+        SSL_CTX *tls;
+        std::shared_ptr<AdmissionControl> admission;
+        size_t reported_buffered = 0;
+        size_t buffered = 0;
+    };
+
+    struct Client {
+        std::unique_ptr<Connection> conn;
+        int listener_fd;
+        uint32_t peer;
+    };
+
+    void accept_all(Listener &listener);
+    void drive_handshake(Connection &conn, const ConnectionHandler &on_data);
+    void handle_readable(Connection &conn, const ConnectionHandler &on_data);
+    ssize_t read_some(Connection &conn, bool &peer_closed);
+    ssize_t write_some(Connection &conn);
+    void flush(Connection &conn);
+    void drain_output(Connection &conn, const ConnectionHandler &on_data);
+    void after_io(Connection &conn, const ConnectionHandler &on_data);
+    void sweep(uint64_t now);
+    void run_posted();
+    void close_connection(int fd);
+
+    int epoll_fd = -1;
+    int wake_fd = -1;
+    std::atomic<bool> stopping{false};
+    std::unordered_map<int, Listener> listeners;
+    std::unordered_map<int, Client> clients;
+    uint64_t next_connection_id = 1;
+    uint64_t last_sweep = 0;
+    EventLoopStats counters;
+    std::mutex posted_mutex;
+    std::vector<std::function<void()>> posted;
+    std::array<char, 64 * 1024> read_buffer;
+};
+
+int create_listen_socket(int port, bool reuse_port = false);
+
+#endif // EVENT_LOOP_H
@@ -0,0 +1,141 @@
+#ifndef GENERATION_SCHEDULER_H
+#define GENERATION_SCHEDULER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "compute_pool.h"
+#include "inference.h"
+#include "kv_cache.h"
+#include "prefix_cache.h"
+#include "tokenizer.h"
+
+// Lower classes are admitted to the batch, and get their prompts through,
+// first.
+enum class GenerationPriority { Interactive = 0, Normal = 1, Background = 2 };
+
+struct GenerationParams {
+    size_t max_tokens = 256;
+    SamplingParams sampling;
+    GenerationPriority priority = GenerationPriority::Normal;
+    // For readers that poll() instead of waiting in next(): called on the
+    // scheduler thread when text becomes available or the generation ends.
+    // Must not block.
+    std::function<void()> on_text;
+};
+
+// One submitted generation, shared between the scheduler and the thread
+// that reads its output.
+class Generation {
+public:
+    // Waits for text produced since the last call and appends it to out;
+    // false once the generation has ended and all of its text was taken.
+    // Text never ends inside a UTF-8 character.
+    bool next(std::string &out);
+    // Like next(), but takes whatever text is there without waiting; true
+    // until the generation has ended and all of its text was taken.
+    bool poll(std::string &out);
+    // Stops the generation before its next step; callable from any thread.
+    void cancel() { cancelled = true; }
+
+    GenerationPriority priority() const { return params.priority; }
+    uint64_t sequence() const { return order; }
+
+private:
+    friend class GenerationScheduler;
+
+    std::vector<uint32_t> prompt;
+    GenerationParams params;
+    uint64_t order = 0;
+    std::atomic<bool> cancelled{false};
+
+    // Only touched by the scheduler thread.
+    std::unique_ptr<InferenceState> state;
+    size_t prefilled = 0;
+    size_t produced = 0;
+    uint32_t next_token = 0;
+    std::mt19937 rng;
+    std::string partial;
+
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::string text;
+    bool finished = false;
+};
+
+// Runs every generation on one thread that advances them together. Each
+// step feeds one token of every decoding generation, plus a share of the
+// prompts still being read, through a single forward_batch, so the weights
+// stream through the cache once per step instead of once per generation.
+// Generations join and leave the batch between steps: waiting ones are
+// admitted by priority, then age, up to max_batch at a time, and one whose
+// reader has fallen behind sits out until it catches up. A prompt that
+// starts like an earlier one skips the prefill of the shared prefix.
+class GenerationScheduler {
+public:
+    struct Options {
+        size_t max_batch = 8;
+        // Prompt tokens per step, so a long prompt is read in slices
+        // between the decode steps of the others.
+        size_t prefill_chunk = 256;
+        size_t context_tokens = 2048;
+        // Memory for the keys and values of recent prompt prefixes; see
+        // PrefixCache. 0 turns the cache off.
+        size_t prefix_cache_bytes = size_t(128) << 20;
+    };
+
+    GenerationScheduler(const TransformerModel &model, const Tokenizer &tokenizer,
+                        KvBlockPool &cache, ComputePool &pool, const Options &options);
+    // Ends every generation, finished or not.
+    ~GenerationScheduler();
+
+    GenerationScheduler(const GenerationScheduler &) = delete;
+    GenerationScheduler &operator=(const GenerationScheduler &) = delete;
+
+    // prompt must fit in context_tokens along with some reply.
+    std::shared_ptr<Generation> submit(std::vector<uint32_t> prompt,
+                                       const GenerationParams &params);
+
+    PrefixCache::Stats prefix_stats() const { return prefix.stats(); }
+
+private:
+    void run();
+    void admit();
+    bool step();
+    void advance(Generation &generation, size_t fed, float *row);
+    void emit(Generation &generation, uint32_t token);
+    void finish(Generation &generation);
+
+    const TransformerModel &model;
+    const Tokenizer &tokenizer;
+    KvBlockPool &cache;
+    ComputePool &pool;
+    Options options;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+    uint64_t submitted = 0;
+    std::vector<std::shared_ptr<Generation>> waiting;
+
+    // Only touched by the scheduler thread.
+    std::vector<std::shared_ptr<Generation>> active;
+    std::vector<Generation *> members;
+    std::vector<BatchEntry> batch;
+    std::vector<uint32_t> tokens;
+    std::vector<float> logits;
+    ForwardScratch scratch;
+    PrefixCache prefix;
+
+    std::thread worker;
+};
+
+#endif // GENERATION_SCHEDULER_H
@@ -0,0 +1,151 @@
+#ifndef HTTP_H
+#define HTTP_H
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "event_loop.h"
+
+// Lets string-keyed maps be probed with a string_view without allocating.
+struct StringViewHash {
+    using is_transparent = void;
+    size_t operator()(std::string_view value) const {
+        return std::hash<std::string_view>{}(value);
+    }
+};
+
+struct HttpHeader {
+    std::string_view name;
+    std::string_view value;
+};
+
+// All views point into the connection's receive buffer and stay valid
+// until the request is consumed. A chunked body is decoded in place, so
+// body always refers to the de-chunked payload.
+struct HttpRequest {
+    std::string_view method;
+    std::string_view target;
+    std::string_view path;
+    std::string_view query;
+    int version_minor = 1;
+    std::vector<HttpHeader> headers;
+    std::string_view body;
+    bool keep_alive = true;
+    bool chunked = false;
+
+    std::string_view header(std::string_view name) const;
+};
+
+struct HttpResponse {
+    int status = 200;
+    std::string content_type = "text/plain";
+    std::vector<std::pair<std::string, std::string>> headers;
+    std::string body;
+    // Set instead of body to send a slice of an immutable shared buffer
+    // straight from the cache that owns it.
+    std::shared_ptr<const std::string> shared_body;
+    size_t shared_offset = 0;
+    size_t shared_size = 0;
+    bool close = false;
+
+    void set_header(std::string name, std::string value) {
+        headers.emplace_back(std::move(name), std::move(value));
+    }
+};
+
+enum class HttpParseResult {
+    Complete,
+    Incomplete,
+    Error,
+    HeaderTooLarge,
+    BodyTooLarge,
+};
+
+constexpr size_t kMaxHttpHeaderBytes = 64 * 1024;
+constexpr size_t kMaxHttpBodyBytes = 8 * 1024 * 1024;
+
+// Incremental request parser. parse() is called every time more bytes
+// arrive; it remembers how far it has already scanned for the end of the
+// header block so a request split over many reads is scanned once.
+class HttpParser {
+public:
+    HttpParseResult parse(std::string &buffer, size_t offset, HttpRequest &request,
+                          size_t &consumed);
+    void reset() { scanned = 0; }
+    void set_limits(size_t header_bytes, size_t body_bytes) {
+        max_header_bytes = header_bytes;
+        max_body_bytes = body_bytes;
+    }
+
+private:
+    size_t scanned = 0;
+    size_t max_header_bytes = kMaxHttpHeaderBytes;
+    size_t max_body_bytes = kMaxHttpBodyBytes;
+};
+
+using HttpHandler = std::function<void(const HttpRequest &, HttpResponse &)>;
+// Sends the response to a request whose route answers later. Call it exactly
+// once, from any thread; the response goes out on the connection's loop.
+using HttpReply = std::function<void(HttpResponse response)>;
+// A route that hands its work off, e.g. to storage_io(), and answers through
+// reply. It runs on the loop thread and the request's views are only valid
+// during the call. Later requests on the connection wait for the reply, so
+// responses stay in order.
+using HttpAsyncHandler = std::function<void(const HttpRequest &, HttpReply reply)>;
+// Runs ahead of every route. Returning false means the guard has filled in
+// the response itself (e.g. a 401) and the route is skipped.
+using HttpGuard = std::function<bool(const HttpRequest &, HttpResponse &)>;
+
+class HttpRouter {
+public:
+    void add(std::string_view method, std::string_view path, HttpHandler handler);
+    // Matches any path starting with prefix when no exact route exists.
+    void add_prefix(std::string_view method, std::string_view prefix, HttpHandler handler);
+    void add_async(std::string_view method, std::string_view path, HttpAsyncHandler handler);
+    void set_fallback(HttpHandler handler) { fallback = std::move(handler); }
+    void set_guard(HttpGuard check) { guard = std::move(check); }
+
+    // Fills in response, or returns the handler of an asynchronous route
+    // for the caller to run.
+    const HttpAsyncHandler *dispatch(const HttpRequest &request, HttpResponse &response) const;
+
+private:
+    std::unordered_map<std::string, HttpHandler, StringViewHash, std::equal_to<>> routes;
+    std::vector<std::pair<std::string, HttpHandler>> prefix_routes;
+    std::unordered_map<std::string, HttpAsyncHandler, StringViewHash, std::equal_to<>>
+        async_routes;
+    HttpHandler fallback;
+    HttpGuard guard;
+};
+
+const char *http_status_text(int status);
+// True when the comma-separated header value lists token (case-insensitive).
+bool http_header_has_token(std::string_view value, std::string_view token);
+// Finds name among the &-separated name=value pairs of a query string and
+// stores its value with %XX escapes and '+' decoded; the first occurrence
+// wins. False if the name is absent or its value is badly escaped.
+bool http_query_param(std::string_view query, std::string_view name, std::string &value);
+
+void http_write_response(std::string &out, const HttpResponse &response, bool keep_alive);
+// Like http_write_response, but queues a shared body without copying it and
+// omits the body for HEAD requests.
+void http_send_response(Connection &conn, const HttpResponse &response, bool keep_alive,
+                        bool head_only = false);
+// Streaming replies: write the head once, then any number of chunks, then
+// the terminating zero-length chunk.
+void http_write_chunked_head(std::string &out, const HttpResponse &response, bool keep_alive);
+void http_write_chunk(std::string &out, std::string_view data);
+void http_write_last_chunk(std::string &out);
+
+// Parses and answers every complete request buffered on conn, in order, so
+// pipelined requests are served from a single read. With connection limits,
+// serving pauses while too much output is queued, a request that takes too
+// long to arrive closes the connection and requests over the rate get a 503.
+void serve_http(Connection &conn, const HttpRouter &router);
+
+#endif // HTTP_H
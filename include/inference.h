@@ -0,0 +1,144 @@
+#ifndef INFERENCE_H
+#define INFERENCE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <span>
+#include <vector>
+#include "compute_pool.h"
+#include "kv_cache.h"
+#include "model_weights.h"
+
+// Llama-style decoder-only transformer: RMSNorm, rotary position
+// embeddings on adjacent pairs, grouped-query attention and a SwiGLU
+// feed-forward block. Tensors are looked up by name in the weight file:
+//
+//     tok_embeddings                       vocab x dim
+//     layers.N.attention_norm              1 x dim, F32
+//     layers.N.wq / wk / wv / wo           dim x dim, kv_dim x dim, ..., dim x dim
+//     layers.N.ffn_norm                    1 x dim, F32
+//     layers.N.w1 / w3, layers.N.w2        hidden x dim, dim x hidden
+//     norm                                 1 x dim, F32
+//     output                               vocab x dim; tok_embeddings if absent
+//
+// An optional F32 tensor "hparams" holds {heads, kv_heads, rope_theta,
+// norm_eps, eos_token}; without it heads are 64 wide, rope_theta is 10000,
+// norm_eps 1e-5 and there is no end-of-sequence token.
+struct ModelConfig {
+    size_t dim = 0;
+    size_t hidden = 0;
+    size_t layers = 0;
+    size_t heads = 0;
+    size_t kv_heads = 0;
+    size_t head_dim = 0;
+    size_t vocab = 0;
+    float rope_theta = 10000.0f;
+    float norm_eps = 1e-5f;
+    int64_t eos_token = -1;
+
+    size_t kv_dim() const { return kv_heads * head_dim; }
+};
+
+// Activations of the rows of one forward pass.
+struct ForwardScratch {
+    void reserve(const ModelConfig &config, size_t count);
+
+    size_t rows = 0;
+    std::vector<float> x, xb, q, k, v, attention, gate, up, out;
+    // Per row, the index into the batch of the sequence it extends and how
+    // many positions of that sequence it attends to.
+    std::vector<uint32_t> owner;
+    std::vector<size_t> visible;
+};
+
+// Scratch activations of one sequence, and its keys and values as blocks
+// of a KvBlockPool set up for the model's layers and kv_dim().
+class InferenceState {
+public:
+    InferenceState(const ModelConfig &config, KvBlockPool &cache, size_t max_positions);
+
+    size_t position() const { return length; }
+    size_t capacity() const { return max_positions; }
+    void reset() {
+        length = 0;
+        cache.truncate(0);
+    }
+    // A state at the same position that shares this one's cache blocks
+    // until either of them writes to one.
+    InferenceState fork() const;
+
+    KvSequence &blocks() { return cache; }
+    const KvSequence &blocks() const { return cache; }
+    // Takes the first count positions as computed, their keys and values
+    // having been placed in blocks() by other means.
+    void adopt_prefix(size_t count) { length = count; }
+
+private:
+    friend class TransformerModel;
+
+    ModelConfig config;
+    size_t max_positions;
+    size_t length = 0;
+    KvSequence cache;
+    // The pinned blocks of the layer being computed.
+    std::vector<float *> block_data;
+    ForwardScratch scratch;
+};
+
+// One sequence of a batched forward pass and how many tokens it takes.
+struct BatchEntry {
+    InferenceState *state;
+    size_t tokens;
+};
+
+class TransformerModel {
+public:
+    // Binds the tensors of an open weight file and derives the config;
+    // returns false (after logging) if a tensor is missing or misshapen.
+    bool load(const ModelWeights &weights);
+    bool loaded() const { return embeddings != nullptr; }
+    const ModelConfig &config() const { return model_config; }
+
+    // Appends tokens to the sequence of state and writes the logits that
+    // follow the last of them to logits (vocab floats). A prompt goes in as
+    // one call, so its matmuls run as matrix products.
+    bool forward(InferenceState &state, std::span<const uint32_t> tokens, float *logits,
+                 ComputePool &pool) const;
+
+    // Extends several sequences in one pass: tokens holds each entry's
+    // tokens in turn, and every matmul multiplies all of them at once, so
+    // decoding many sequences together costs little more than one. The
+    // logits after each entry's last token go to logits + i * vocab. On
+    // failure no sequence has advanced.
+    bool forward_batch(std::span<const BatchEntry> batch, std::span<const uint32_t> tokens,
+                       float *logits, ForwardScratch &scratch, ComputePool &pool) const;
+
+private:
+    struct Layer {
+        const WeightTensor *attention_norm;
+        const WeightTensor *wq, *wk, *wv, *wo;
+        const WeightTensor *ffn_norm;
+        const WeightTensor *w1, *w2, *w3;
+    };
+
+    ModelConfig model_config;
+    const WeightTensor *embeddings = nullptr;
+    const WeightTensor *final_norm = nullptr;
+    const WeightTensor *output = nullptr;
+    std::vector<Layer> layers;
+    std::vector<float> inv_freq;
+};
+
+struct SamplingParams {
+    // 0 picks the most likely token every time.
+    float temperature = 0.8f;
+    float top_p = 0.95f;
+    size_t top_k = 40;
+};
+
+// Picks the next token from logits, which it overwrites.
+uint32_t sample_token(float *logits, size_t vocab, const SamplingParams &params,
+                      std::mt19937 &rng);
+
+#endif // INFERENCE_H
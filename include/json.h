@@ -0,0 +1,12 @@
+#ifndef JSON_H
+#define JSON_H
+
+#include <string>
+#include <string_view>
+
+// Appends value to out as a quoted JSON string. Quotes, backslashes and
+// control characters are escaped; other bytes, UTF-8 included, are copied
+// as they are.
+void append_json_string(std::string &out, std::string_view value);
+
+#endif // JSON_H
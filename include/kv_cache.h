@@ -0,0 +1,157 @@
+#ifndef KV_CACHE_H
+#define KV_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <span>
+#include <string>
+#include <vector>
+
+// Paged key/value cache. The keys and values a sequence has produced live in
+// fixed-size blocks of block_tokens positions of one layer: block_tokens
+// rows of kv_dim key floats followed by as many value rows. Blocks come from
+// a shared pool, so a sequence takes memory in block-sized steps instead of
+// reserving its whole context up front, and sequences can share blocks.
+//
+// The pool keeps at most memory_budget bytes of blocks in memory. Past that
+// the least recently used block that is not pinned is written to a spill
+// file and read back the next time it is pinned; a block that has not been
+// written since it was last spilled is not written again.
+struct KvCacheOptions {
+    size_t layers = 0;
+    size_t kv_dim = 0;
+    size_t block_tokens = 32;
+    size_t memory_budget = size_t(512) << 20;
+    // Directory for the spill file, which is unlinked as soon as it is
+    // created. Empty means never spill: allocation fails once the budget is
+    // spent.
+    std::string spill_dir;
+};
+
+class KvBlockPool {
+public:
+    static constexpr uint32_t kNoBlock = UINT32_MAX;
+
+    struct Stats {
+        size_t blocks = 0;
+        size_t resident = 0;
+        size_t spilled = 0;
+        size_t shared = 0;
+        uint64_t spills = 0;
+        uint64_t reloads = 0;
+    };
+
+    KvBlockPool() = default;
+    ~KvBlockPool();
+
+    KvBlockPool(const KvBlockPool &) = delete;
+    KvBlockPool &operator=(const KvBlockPool &) = delete;
+
+    // Drops every block and sets the pool up for a new shape; no sequence
+    // of the old shape may outlive this.
+    bool init(const KvCacheOptions &options);
+    bool ready() const { return arena != nullptr; }
+    const KvCacheOptions &options() const { return config; }
+    size_t block_floats() const { return 2 * config.block_tokens * config.kv_dim; }
+
+    // A new block with one reference, or kNoBlock (after logging).
+    uint32_t allocate();
+    void retain(uint32_t id);
+    void release(uint32_t id);
+    // A block holding what id holds that only the caller references: id
+    // itself when it is not shared, otherwise a copy, and the caller's
+    // reference to id is dropped. kNoBlock if no copy could be made.
+    uint32_t make_private(uint32_t id);
+
+    // Brings the blocks into memory and keeps them there until unpin(),
+    // storing a pointer to each in data. Blocks from ids[written_from] on
+    // will be modified. Fails without pinning anything if they do not all
+    // fit in the budget at once.
+    bool pin(std::span<const uint32_t> ids, float **data, size_t written_from);
+    void unpin(std::span<const uint32_t> ids);
+
+    Stats stats() const;
+
+private:
+    struct Block {
+        uint32_t refs = 0;
+        uint32_t pins = 0;
+        uint32_t slot = kNoBlock;
+        uint32_t spill = kNoBlock;
+        // The memory copy differs from the spilled one.
+        bool dirty = true;
+        // Links of the recency list of resident, unpinned blocks.
+        uint32_t prev = kNoBlock;
+        uint32_t next = kNoBlock;
+    };
+
+    void reset();
+    float *slot_data(uint32_t slot) const;
+    float *spill_data(uint32_t spill) const;
+    void lru_unlink(uint32_t id);
+    void lru_append(uint32_t id);
+    void pin_locked(uint32_t id);
+    void unpin_locked(uint32_t id);
+    void release_locked(uint32_t id);
+    uint32_t take_slot();
+    uint32_t take_spill();
+    bool make_resident(uint32_t id);
+
+    KvCacheOptions config;
+    size_t block_bytes = 0;
+    mutable std::mutex lock;
+    std::vector<Block> blocks;
+    std::vector<uint32_t> free_ids;
+
+    // Resident blocks live in slots of one reserved mapping that is only
+    // backed by memory as slots are first used.
+    float *arena = nullptr;
+    size_t slot_count = 0;
+    size_t slots_used = 0;
+    std::vector<uint32_t> free_slots;
+    uint32_t lru_head = kNoBlock;
+    uint32_t lru_tail = kNoBlock;
+
+    int spill_fd = -1;
+    float *spill_map = nullptr;
+    size_t spill_capacity = 0;
+    size_t spills_used = 0;
+    std::vector<uint32_t> free_spills;
+    uint64_t spill_count = 0;
+    uint64_t reload_count = 0;
+};
+
+// The block table of one sequence: per layer, the blocks holding its
+// positions in order.
+class KvSequence {
+public:
+    explicit KvSequence(KvBlockPool &pool);
+    ~KvSequence();
+
+    KvSequence(KvSequence &&other) noexcept;
+    KvSequence &operator=(KvSequence &&other) noexcept;
+    KvSequence(const KvSequence &) = delete;
+    KvSequence &operator=(const KvSequence &) = delete;
+
+    // A sequence sharing every block of this one. Whichever of the two
+    // writes to a shared block first gets its own copy.
+    KvSequence fork() const;
+
+    KvBlockPool &pool() const { return *owner; }
+    std::span<const uint32_t> blocks(size_t layer) const { return tables[layer]; }
+
+    // Appends a block that someone else also holds to layer's table.
+    void attach(size_t layer, uint32_t id);
+    // Gives positions [first, first + count) blocks of their own in every
+    // layer, allocating or copying as needed.
+    bool prepare(size_t first, size_t count);
+    // Forgets every position from positions on.
+    void truncate(size_t positions);
+
+private:
+    KvBlockPool *owner;
+    std::vector<std::vector<uint32_t>> tables;
+};
+
+#endif // KV_CACHE_H
@@ -0,0 +1,145 @@
+#ifndef LOCAL_MEMORY_STORAGE_H
+#define LOCAL_MEMORY_STORAGE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+#include <openssl/evp.h>
+#include "wal.h"
+
+// Layout of a context file, all fields little-endian:
+//
+//     ContextFileHeader                  64 bytes
+//     record, record, ...                each 64 + chunk_bytes bytes
+//
+// The context is cut into chunks of chunk_bytes. A save appends one record
+// per chunk that changed, each AES-256-GCM encrypted under a fresh random
+// nonce, and flags the last record of the save as its commit; the newest
+// committed record of each chunk index is the live one. Records after the
+// last commit are the remains of an interrupted save and are ignored, then
+// overwritten by the next one. The GCM tag covers the record header, the
+// file ID and the record's slot number, so records cannot be moved between
+// files or positions without failing to decrypt.
+constexpr char kContextMagic[8] = {'S', 'V', 'K', 'L', 'C', 'T', 'X', '1'};
+constexpr uint32_t kContextVersion = 1;
+constexpr size_t kContextKeyBytes = 32;
+
+struct ContextFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t chunk_bytes;
+    unsigned char file_id[16];
+    // Tag of an empty message, so a wrong key is reported as such rather
+    // than as corruption.
+    unsigned char check_nonce[12];
+    unsigned char check_tag[16];
+    uint32_t reserved;
+};
+
+struct ContextRecordHeader {
+    uint32_t magic;
+    uint32_t flags;
+    uint64_t index;
+    // Length of the whole context as of this record's save.
+    uint64_t total_bytes;
+    uint32_t length;
+    uint32_t reserved0;
+    unsigned char nonce[12];
+    unsigned char tag[16];
+    uint32_t reserved1;
+};
+
+static_assert(sizeof(ContextFileHeader) == 64);
+static_assert(sizeof(ContextRecordHeader) == 64);
+
+// One encrypted context file, kept open between saves. Only the chunks a
+// save changes are written, so extending a long context costs the new text
+// plus at most one rewritten chunk. Loading reads the file with one read
+// into a reused buffer and decrypts each live chunk straight into place.
+// Every read, write and sync goes through storage_io() and waits for it.
+// Once superseded records make up most of the file it is rewritten with
+// just the live ones.
+class ContextStore {
+public:
+    ContextStore() = default;
+    ~ContextStore();
+    ContextStore(const ContextStore &) = delete;
+    ContextStore &operator=(const ContextStore &) = delete;
+
+    // Opens or creates path. chunk_bytes only applies to a new file; an
+    // existing one keeps its own. Returns false (after logging) for a wrong
+    // key or a damaged file.
+    //
+    // With a log, a save commits its encrypted records there first and then
+    // writes them to the file unsynced, instead of syncing the file twice;
+    // replay_context_record() reapplies them after a crash.
+    bool open(const std::string &path, const unsigned char (&key)[kContextKeyBytes],
+              size_t chunk_bytes = 4096, Wal *log = nullptr);
+    void close();
+    bool is_open() const { return fd >= 0; }
+
+    bool load(std::string &context);
+    bool save(const std::string &context);
+    // Syncs what saves wrote, so their log records can be checkpointed.
+    bool sync();
+
+    uint64_t file_bytes() const { return end; }
+    uint64_t records_written() const { return written; }
+
+private:
+    size_t slot_bytes() const { return sizeof(ContextRecordHeader) + chunk; }
+    bool create(const unsigned char *file_id);
+    bool write_at(uint64_t offset, const void *data, size_t size);
+    bool encrypt(ContextRecordHeader &header, uint64_t slot, const char *plain,
+                 unsigned char *cipher);
+    bool decrypt(const ContextRecordHeader &header, uint64_t slot, const unsigned char *cipher,
+                 char *plain);
+    void authenticate(const ContextRecordHeader &header, uint64_t slot);
+    bool compact();
+
+    std::string path;
+    int fd = -1;
+    Wal *wal = nullptr;
+    unsigned char key[kContextKeyBytes] = {};
+    unsigned char file_id[16] = {};
+    size_t chunk = 0;
+    EVP_CIPHER_CTX *cipher = nullptr;
+    // The context as of the last load or save, which a save is compared
+    // against to find the chunks that changed.
+    std::string current;
+    uint64_t end = 0;
+    uint64_t live_records = 0;
+    uint64_t written = 0;
+    std::vector<unsigned char> buffer;
+};
+
+// Log record type of a context store write.
+constexpr uint16_t kContextWalWrite = 1;
+
+// Applies a kContextWalWrite record to its file and syncs it, if the file
+// is still the one the record was written for. False only if applying it
+// failed; a record for a file since compacted or deleted is skipped.
+bool replay_context_record(std::string_view payload);
+
+// Context file helpers used by the shell. The AES key lives in
+// SVAKLA_CONTEXT_KEY_FILE, or filename + ".key" by default, and is created
+// with mode 0600 the first time. Stores stay open for the process, so
+// repeated saves of a growing context only append. All stores share the
+// write-ahead log in SVAKLA_CONTEXT_WAL ("context.wal" by default), with
+// durability from wal_options_from_env().
+void save_context(const std::string &filename, const std::string &context);
+std::string load_context(const std::string &filename);
+
+// For request handlers, which must never wait for the disk on a network
+// thread: these return at once and call done on a storage_io() thread (see
+// async_io.h), where the store's reads, writes and syncs go through the
+// same backend. Loading a file that does not exist fails instead of
+// creating it.
+void save_context_async(const std::string &filename, std::string context,
+                        std::function<void(bool saved)> done);
+void load_context_async(const std::string &filename,
+                        std::function<void(bool loaded, std::string context)> done);
+
+#endif // LOCAL_MEMORY_STORAGE_H
@@ -0,0 +1,180 @@
+#ifndef MODEL_WEIGHTS_H
+#define MODEL_WEIGHTS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// On-disk tensor container, all fields little-endian:
+//
+//     WeightFileHeader                      64 bytes
+//     WeightTensorEntry[tensor_count]      128 bytes each
+//     tensor data                          every block 64-byte aligned
+//
+// Quantized tensors are stored row by row. Rows are padded to a multiple
+// of kWeightBlock values; each block of a row has one float scale, with
+// value = quant * scale. Q8 stores one int8 per value. Q4 packs two values
+// in [-8, 7] per byte, biased by 8: value j of a block sits in the low
+// nibble of byte j and value j + 32 in the high nibble. The quants of all
+// rows come first, followed by the scales of all rows.
+//
+// The header, the table and every tensor carry a CRC-32. The header and
+// table are checked on open; tensor data is only checked by verify(), since
+// reading it would page in the whole model.
+constexpr char kWeightMagic[8] = {'S', 'V', 'K', 'L', 'W', 'G', 'T', '1'};
+constexpr uint32_t kWeightVersion = 1;
+constexpr size_t kWeightBlock = 64;
+constexpr size_t kWeightAlignment = 64;
+constexpr size_t kWeightNameBytes = 64;
+
+enum class WeightType : uint32_t {
+    F32 = 0,
+    Q8 = 1,
+    Q4 = 2,
+};
+
+struct WeightFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t tensor_count;
+    uint64_t table_offset;
+    uint64_t data_offset;
+    uint64_t file_bytes;
+    uint32_t table_crc;
+    uint32_t reserved[4];
+    // Covers every byte before it.
+    uint32_t header_crc;
+};
+
+struct WeightTensorEntry {
+    char name[kWeightNameBytes];
+    uint32_t type;
+    uint32_t reserved0;
+    uint64_t rows;
+    uint64_t cols;
+    uint64_t offset;
+    uint64_t bytes;
+    // Relative to offset; zero for F32.
+    uint64_t scales_offset;
+    uint32_t crc;
+    uint32_t reserved[3];
+};
+
+static_assert(sizeof(WeightFileHeader) == 64);
+static_assert(sizeof(WeightTensorEntry) == 128);
+
+// Bytes one stored row of cols values takes, block padding included.
+size_t weight_row_bytes(WeightType type, size_t cols);
+size_t weight_blocks_per_row(size_t cols);
+
+void quantize_row_q8(const float *src, size_t cols, int8_t *quants, float *scales);
+void quantize_row_q4(const float *src, size_t cols, uint8_t *quants, float *scales);
+
+// A tensor inside a mapped file. Vectors are a single row.
+struct WeightTensor {
+    std::string_view name;
+    WeightType type = WeightType::F32;
+    size_t rows = 0;
+    size_t cols = 0;
+    size_t row_bytes = 0;
+    const uint8_t *data = nullptr;
+    const float *scales = nullptr;
+    size_t bytes = 0;
+    uint32_t crc = 0;
+
+    const float *f32_row(size_t row) const {
+        return reinterpret_cast<const float *>(data + row * row_bytes);
+    }
+    const int8_t *q8_row(size_t row) const {
+        return reinterpret_cast<const int8_t *>(data + row * row_bytes);
+    }
+    const uint8_t *q4_row(size_t row) const { return data + row * row_bytes; }
+    const float *row_scales(size_t row) const {
+        return scales + row * weight_blocks_per_row(cols);
+    }
+
+    // Expands one row to cols floats.
+    void dequantize_row(size_t row, float *out) const;
+};
+
+// Read-only mapping of a weight file. Opening only reads the header and the
+// tensor table, so it is fast however large the model is; the kernel pages
+// tensor data in on first use and may drop it again under memory pressure.
+class ModelWeights {
+public:
+    ModelWeights() = default;
+    ~ModelWeights();
+    ModelWeights(const ModelWeights &) = delete;
+    ModelWeights &operator=(const ModelWeights &) = delete;
+
+    // Returns false (after logging) if the file is missing, truncated, or
+    // its header or table fail their checks.
+    bool open(const std::string &path);
+    void close();
+    bool is_open() const { return base != nullptr; }
+
+    size_t mapped_bytes() const { return length; }
+    const std::vector<WeightTensor> &tensors() const { return table; }
+    const WeightTensor *find(std::string_view name) const;
+
+    // Checks tensor data against its CRC; this reads every page of it.
+    bool verify(const WeightTensor &tensor) const;
+    bool verify_all() const;
+
+    // Hints for the pager: read a tensor ahead of use, or drop its pages
+    // once a layer is done with it. Neither affects correctness.
+    void prefetch(const WeightTensor &tensor) const;
+    void evict(const WeightTensor &tensor) const;
+
+private:
+    uint8_t *base = nullptr;
+    size_t length = 0;
+    std::vector<WeightTensor> table;
+    std::unordered_map<std::string_view, size_t> by_name;
+};
+
+struct WeightTensorSpec {
+    std::string name;
+    WeightType type = WeightType::Q8;
+    size_t rows = 0;
+    size_t cols = 0;
+};
+
+// Writes a weight file one row at a time, so converting a model needs
+// memory for a single row rather than a whole tensor. Tensors are written
+// in the order they were declared. The file appears under its final name
+// only once finish() succeeds.
+class WeightWriter {
+public:
+    WeightWriter() = default;
+    ~WeightWriter();
+    WeightWriter(const WeightWriter &) = delete;
+    WeightWriter &operator=(const WeightWriter &) = delete;
+
+    bool open(const std::string &path, const std::vector<WeightTensorSpec> &specs);
+    // Appends cols floats to the current tensor.
+    bool write_row(const float *values);
+    // Fills in checksums and the header; false if a tensor is incomplete.
+    bool finish();
+
+private:
+    bool write_at(uint64_t offset, const void *data, size_t size);
+    void close_tensor();
+
+    int fd = -1;
+    std::string path;
+    std::string temp_path;
+    WeightFileHeader header{};
+    std::vector<WeightTensorEntry> entries;
+    size_t current = 0;
+    size_t rows_written = 0;
+    uint32_t quants_crc = 0;
+    uint32_t scales_crc = 0;
+    std::vector<uint8_t> row;
+    std::vector<float> scales;
+};
+
+#endif // MODEL_WEIGHTS_H
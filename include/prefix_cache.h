@@ -0,0 +1,76 @@
+#ifndef PREFIX_CACHE_H
+#define PREFIX_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <unordered_map>
+#include <vector>
+#include "inference.h"
+#include "kv_cache.h"
+
+// Keys and values of prompt prefixes that were already computed, so a
+// prompt starting with a cached prefix only prefills the rest.
+//
+// The cache is a radix tree over token IDs whose edges are one KV block of
+// tokens: a node holds the blocks (one per layer) for its block_tokens
+// tokens, given everything on the path above it. Children are found by a
+// hash of their tokens and confirmed by comparing them. A hit hands the
+// blocks to the new sequence as shared blocks, so nothing is copied unless
+// the sequence writes into one. Only whole blocks are cached.
+//
+// Past byte_budget the least recently used leaves are dropped.
+class PrefixCache {
+public:
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t reused_tokens = 0;
+        uint64_t evictions = 0;
+        size_t nodes = 0;
+        size_t bytes = 0;
+    };
+
+    PrefixCache(KvBlockPool &pool, size_t byte_budget);
+    ~PrefixCache();
+
+    PrefixCache(const PrefixCache &) = delete;
+    PrefixCache &operator=(const PrefixCache &) = delete;
+
+    // Gives the fresh state the longest cached prefix of tokens and returns
+    // how many positions it now holds. That stops short of the last token,
+    // whose logits the caller still has to compute.
+    size_t lookup(std::span<const uint32_t> tokens, InferenceState &state);
+    // Caches the whole blocks of tokens, whose keys and values state holds.
+    void insert(std::span<const uint32_t> tokens, const InferenceState &state);
+
+    Stats stats() const;
+
+private:
+    struct Node {
+        Node *parent = nullptr;
+        uint64_t hash = 0;
+        std::vector<uint32_t> tokens;
+        std::vector<uint32_t> blocks;
+        std::unordered_map<uint64_t, std::unique_ptr<Node>> children;
+        std::list<Node *>::iterator recency;
+    };
+
+    Node *child(Node *node, std::span<const uint32_t> tokens, uint64_t hash) const;
+    void touch(Node *node);
+    void evict();
+
+    KvBlockPool &pool;
+    size_t budget;
+    size_t node_bytes;
+    mutable std::mutex lock;
+    Node root;
+    // Least recently used first.
+    std::list<Node *> recency;
+    Stats counters;
+};
+
+#endif // PREFIX_CACHE_H
@@ -0,0 +1,91 @@
+#ifndef SERVER_RUNTIME_H
+#define SERVER_RUNTIME_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <openssl/ssl.h>
+#include "event_loop.h"
+#include "thread_pool.h"
+#include "tls.h"
+
+struct ShardOptions {
+    // Number of event loops; 0 means one per CPU the process may run on.
+    // With more than one, every port is bound once per loop with
+    // SO_REUSEPORT and the kernel spreads connections across them.
+    unsigned shards = 1;
+    // Pin shard i to the i-th allowed CPU so its connections stay cache-warm.
+    bool pin_cpus = false;
+};
+
+// Reads SVAKLA_SHARDS and SVAKLA_PIN_CPUS; unset means a single shard.
+ShardOptions shard_options_from_env();
+
+struct ShardStats {
+    unsigned shard;
+    int cpu;
+    uint64_t accepted;
+    uint64_t active;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t rejected;
+    uint64_t timed_out;
+};
+
+// Hosts every network service of the process: one set of event loops (one
+// per shard) serves all registered ports, and a shared worker pool takes
+// the blocking work handlers must not do on a loop thread. Handlers are
+// shared by all shards and must be safe to call concurrently.
+class ServerRuntime {
+public:
+    explicit ServerRuntime(ShardOptions options = ShardOptions(), size_t worker_threads = 0);
+    ~ServerRuntime();
+
+    ServerRuntime(const ServerRuntime &) = delete;
+    ServerRuntime &operator=(const ServerRuntime &) = delete;
+
+    // Binds port on every shard. May be called before or after start().
+    // Without explicit limits the service gets default_limits().
+    bool add_service(int port, ConnectionHandler handler);
+    bool add_service(int port, ConnectionHandler handler, const ConnectionLimits &limits);
+    // Same, with TLS terminated by the event loops; the runtime owns the
+    // context built from config.
+    bool add_tls_service(int port, ConnectionHandler handler, const TlsConfig &config);
+    bool add_tls_service(int port, ConnectionHandler handler, const TlsConfig &config,
+                         const ConnectionLimits &limits);
+
+    // connection_limits_from_env() as read when the runtime was created.
+    const ConnectionLimits &default_limits() const { return limits; }
+
+    bool start();
+    void wait();
+    void stop();
+
+    ThreadPool &workers() { return pool; }
+    size_t shard_count() const { return shards.size(); }
+    std::vector<ShardStats> stats() const;
+
+private:
+    struct Shard {
+        std::unique_ptr<EventLoop> loop;
+        std::thread thread;
+        int cpu = -1;
+    };
+
+    bool bind_service(int port, const ConnectionHandler &handler, SSL_CTX *tls,
+                      const ConnectionLimits &service_limits);
+
+    ShardOptions options;
+    ConnectionLimits limits;
+    std::vector<Shard> shards;
+    std::vector<SSL_CTX *> tls_contexts;
+    std::mutex mutex;
+    bool started = false;
+    std::atomic<bool> stopped{false};
+    ThreadPool pool;
+};
+
+#endif // SERVER_RUNTIME_H
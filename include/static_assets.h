@@ -0,0 +1,44 @@
+#ifndef STATIC_ASSETS_H
+#define STATIC_ASSETS_H
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include "http.h"
+
+struct StaticAsset {
+    std::string content_type;
+    std::string etag;
+    std::shared_ptr<const std::string> body;
+    // Null when gzip does not make the asset meaningfully smaller.
+    std::shared_ptr<const std::string> gzip_body;
+    // The gzip body is a different representation, so it has its own
+    // strong validator; ranges are only ever served from body.
+    std::string gzip_etag;
+};
+
+// Loads the panel's files once at startup, precompresses them and answers
+// GET/HEAD requests from memory: conditional requests get a 304, Range
+// requests a 206 slice, and bodies are queued by reference so every reply
+// is one writev of headers plus cached bytes.
+class StaticAssetCache {
+public:
+    // Adds every regular file below root, keyed by its URL path
+    // ("/css/panel.css"). Returns the number of files loaded.
+    size_t load_directory(const std::string &root);
+    void add(std::string path, std::string content);
+
+    // "/" and directory paths resolve to their index.html.
+    const StaticAsset *find(std::string_view path) const;
+    void serve(const HttpRequest &request, HttpResponse &response) const;
+    size_t size() const { return assets.size(); }
+
+private:
+    std::unordered_map<std::string, StaticAsset, StringViewHash, std::equal_to<>> assets;
+};
+
+std::string static_content_type(std::string_view path);
+
+#endif // STATIC_ASSETS_H
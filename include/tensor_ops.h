@@ -0,0 +1,50 @@
+#ifndef TENSOR_OPS_H
+#define TENSOR_OPS_H
+
+#include <cstddef>
+#include <cstdint>
+#include "compute_pool.h"
+#include "model_weights.h"
+
+// Kernels of the transformer forward pass. Vectors are plain float arrays;
+// weights are tensors of a mapped ModelWeights file.
+//
+// Quantized matmuls quantize the activations to int8 with one scale per
+// kWeightBlock values, the same blocking as the weights, so each block is an
+// integer dot product scaled once. The dot products use AVX-512 VNNI,
+// AVX-VNNI or AVX2 when the CPU has them, chosen once at startup.
+
+// y[b * y_stride + r] = dot(row r of w, x[b * x_stride ...]) for every row
+// of w and every b < batch. The rows of w are split across the pool, and a
+// band of rows is reused against a tile of inputs while it is in cache.
+void matmul(const WeightTensor &w, const float *x, size_t batch, size_t x_stride, float *y,
+            size_t y_stride, ComputePool &pool);
+
+void rmsnorm(const float *x, const float *weight, size_t n, float eps, float *out);
+void softmax(float *x, size_t n);
+// gate[i] = silu(gate[i]) * up[i]
+void silu_mul(float *gate, const float *up, size_t n);
+// Rotates each head of x in place by position pos; inv_freq has head_dim / 2
+// entries.
+void rope(float *x, size_t heads, size_t head_dim, size_t pos, const float *inv_freq);
+
+// Keys and values of one layer in blocks of rows positions (see kv_cache.h):
+// the key of position p is row p % rows of blocks[p / rows], rows are
+// stride floats apart, and a block's value rows follow its key rows.
+struct KvBlocks {
+    const float *const *blocks;
+    size_t rows;
+    size_t stride;
+};
+
+// Attention of one query head over the first positions keys and values of
+// kv, reading head_dim floats at offset in each row, with a single-pass
+// online softmax so the scores are never stored. Writes head_dim floats to
+// out.
+void attend(const float *q, const KvBlocks &kv, size_t offset, size_t positions,
+            size_t head_dim, float *out);
+
+// Name of the dot-product kernels in use, for logs and benchmarks.
+const char *tensor_ops_isa();
+
+#endif // TENSOR_OPS_H
@@ -0,0 +1,29 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <cstddef>
+#include <string>
+#include <openssl/ssl.h>
+
+struct TlsConfig {
+    // PEM files, relative to the working directory unless absolute.
+    std::string certificate_path = "fullchain.pem";
+    std::string private_key_path = "privkey.pem";
+    // Server-side session cache for TLS 1.2 session IDs.
+    size_t session_cache_size = 20 * 1024;
+    long session_timeout_seconds = 2 * 60 * 60;
+    // TLS 1.3 tickets issued after each full handshake; each one lets the
+    // client resume once without a certificate exchange.
+    size_t session_tickets = 2;
+};
+
+// Reads SVAKLA_TLS_CERT (certificate chain) and SVAKLA_TLS_KEY on top of the
+// defaults.
+TlsConfig tls_config_from_env();
+
+// Builds a server context configured for non-blocking use with session
+// resumption enabled. Returns nullptr (after logging) when the certificate
+// or key cannot be loaded.
+SSL_CTX *create_tls_server_context(const TlsConfig &config);
+
+#endif // TLS_H
@@ -0,0 +1,88 @@
+#ifndef TOKENIZER_H
+#define TOKENIZER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Byte-level BPE. Input is first split into pieces (words with their
+// leading space, digit runs, punctuation runs, whitespace) following the
+// GPT-2 rules, with every non-ASCII byte counted as a letter. Each piece is
+// then merged pairwise, lowest rank first, starting from single bytes.
+//
+// The vocabulary file uses the tiktoken layout, one token per line:
+//
+//     <base64 token bytes> <rank>
+//
+// where the rank is also the token ID. Without a file every byte is its own
+// token. Encoding is const and thread-safe.
+class Tokenizer {
+public:
+    Tokenizer();
+
+    // Replaces the vocabulary; returns false (after logging) if the file
+    // cannot be read or lacks one of the 256 single-byte tokens.
+    bool load(const std::string &path);
+
+    size_t vocab_size() const { return offsets.size() - 1; }
+
+    std::vector<uint32_t> tokenize(std::string_view text) const;
+    // Appends the IDs of text to out.
+    void encode(std::string_view text, std::vector<uint32_t> &out) const;
+
+    std::string_view token_bytes(uint32_t id) const;
+    std::string decode(const std::vector<uint32_t> &ids) const;
+
+private:
+    friend class TokenStream;
+
+    struct Merge {
+        uint64_t pair;
+        uint32_t merged;
+        uint32_t rank;
+    };
+
+    static constexpr uint64_t kEmptyPair = ~0ULL;
+
+    const Merge *find_merge(uint32_t left, uint32_t right) const;
+    void encode_piece(std::string_view piece, std::vector<uint32_t> &out) const;
+
+    uint32_t byte_ids[256];
+    // Token i spans bytes[offsets[i], offsets[i + 1]).
+    std::string bytes;
+    std::vector<uint32_t> offsets;
+    // Open addressing keyed by (left ID, right ID); size is a power of two.
+    std::vector<Merge> merges;
+    unsigned merge_shift = 64;
+};
+
+// Tokenizes input that arrives in chunks. Only the piece that may continue
+// in the next chunk is held back, so memory stays constant however long the
+// document is; pieces longer than a fixed cap are cut. Recently seen pieces
+// are cached, which is where most of the speed on natural text comes from.
+// A stream belongs to one thread.
+class TokenStream {
+public:
+    explicit TokenStream(const Tokenizer &tokenizer);
+    ~TokenStream();
+
+    // Appends the IDs of every piece that is complete to out.
+    void feed(std::string_view chunk, std::vector<uint32_t> &out);
+    // Flushes the held-back piece; the stream can then be reused.
+    void finish(std::vector<uint32_t> &out);
+
+private:
+    struct CacheEntry;
+
+    size_t encode_pieces(std::string_view data, bool final, std::vector<uint32_t> &out);
+    void encode_cached(std::string_view piece, std::vector<uint32_t> &out);
+
+    const Tokenizer &tokenizer;
+    std::string carry;
+    std::unique_ptr<CacheEntry[]> cache;
+};
+
+#endif // TOKENIZER_H
@@ -0,0 +1,180 @@
+#ifndef VECTOR_INDEX_H
+#define VECTOR_INDEX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "vectorizer.h"
+
+// On-disk layout of a saved index, all fields little-endian. Every section
+// starts on a 64-byte boundary and has exactly the in-memory layout, so an
+// opened file is searched in place:
+//
+//     HnswFileHeader                            128 bytes
+//     vectors      count x stride floats, unit length, zero padded
+//     links        count x (1 + 2M) uint32: neighbour count, then neighbours
+//     keys         count x uint64
+//     levels       count x uint8
+//     deleted      count x uint8
+//     upper_index  count x uint64: where a node's upper layers start in upper
+//     upper        per node above layer 0, level x (1 + M) uint32
+constexpr char kHnswMagic[8] = {'S', 'V', 'K', 'L', 'H', 'N', 'S', 'W'};
+constexpr uint32_t kHnswVersion = 1;
+
+struct HnswFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t dim;
+    uint32_t stride;
+    uint32_t max_neighbors;
+    uint64_t count;
+    uint64_t deleted_count;
+    uint32_t entry;
+    uint32_t top_level;
+    uint64_t vectors_offset;
+    uint64_t links_offset;
+    uint64_t keys_offset;
+    uint64_t levels_offset;
+    uint64_t deleted_offset;
+    uint64_t upper_index_offset;
+    uint64_t upper_offset;
+    uint64_t upper_count;
+    uint64_t file_bytes;
+    uint32_t reserved;
+    // Covers every byte before it.
+    uint32_t header_crc;
+};
+
+static_assert(sizeof(HnswFileHeader) == 128);
+
+struct HnswOptions {
+    // Neighbours per node on the upper layers; layer 0 keeps twice as many.
+    size_t max_neighbors = 16;
+    // Candidate list size while inserting and, by default, while searching.
+    // Larger finds better neighbours at a proportional cost in time.
+    size_t ef_construction = 200;
+    size_t ef_search = 64;
+    uint64_t seed = 42;
+};
+
+struct HnswMatch {
+    uint64_t key;
+    // Cosine similarity to the query, in [-1, 1].
+    float similarity;
+};
+
+// Approximate nearest-neighbour search over embeddings by cosine similarity,
+// using a hierarchical navigable small world graph (Malkov and Yashunin,
+// 2016): each query walks greedily down a few sparse layers to a good entry
+// point on the dense bottom layer, then explores a bounded candidate list
+// there, touching O(log n) nodes rather than all of them.
+//
+// Vectors are stored normalized and padded like EmbeddingTable rows, so
+// similarity is one AVX-512 or AVX2 dot product with no tail. Removing a key
+// only marks its node deleted: the node keeps routing searches but is never
+// returned. compact() rebuilds without the deleted nodes once they pile up.
+//
+// Searches may run concurrently with each other; inserts and removals take
+// the index exclusively.
+class HnswIndex {
+public:
+    HnswIndex() = default;
+    ~HnswIndex();
+    HnswIndex(const HnswIndex &) = delete;
+    HnswIndex &operator=(const HnswIndex &) = delete;
+
+    // Empties the index and sets the dimension of the vectors it takes.
+    void init(size_t dim, HnswOptions options = HnswOptions());
+    size_t dim() const { return width; }
+    // Live entries, not counting deleted ones.
+    size_t size() const;
+    size_t deleted() const;
+
+    // Adds vector (dim() floats) under key, replacing what key held before.
+    // Returns false for a vector of the wrong size or all zeros.
+    bool insert(uint64_t key, const float *vector, size_t size);
+    bool remove(uint64_t key);
+    // Up to k live entries most similar to query, best first. ef overrides
+    // HnswOptions::ef_search; it is raised to k if smaller.
+    std::vector<HnswMatch> search(const float *query, size_t size, size_t k,
+                                  size_t ef = 0) const;
+    void compact();
+
+    // save() writes to a temporary file and renames it over path. open()
+    // maps a saved index read-only and checks its header and that the graph
+    // links stay within the file, one pass over the links rather than the
+    // vectors; vector pages come in as searches reach them. The first
+    // insert, remove or compact() after open() copies the index into memory.
+    bool save(const std::string &path) const;
+    bool open(const std::string &path, HnswOptions options = HnswOptions());
+    bool mapped() const { return mapping != nullptr; }
+
+private:
+    // Bounds of the live arrays, pointing either into the owned vectors
+    // below or into the mapped file.
+    struct View {
+        const float *vectors = nullptr;
+        const uint32_t *links = nullptr;
+        const uint64_t *keys = nullptr;
+        const uint8_t *levels = nullptr;
+        const uint8_t *deleted = nullptr;
+        const uint64_t *upper_index = nullptr;
+        const uint32_t *upper = nullptr;
+    };
+    struct Candidate {
+        float distance;
+        uint32_t node;
+        bool operator<(const Candidate &other) const { return distance < other.distance; }
+        bool operator>(const Candidate &other) const { return distance > other.distance; }
+    };
+
+    size_t max_links(size_t level) const;
+    const uint32_t *links_of(uint32_t node, size_t level) const;
+    uint32_t *mutable_links(uint32_t node, size_t level);
+    float distance(const float *query, uint32_t node) const;
+    uint32_t greedy_descend(const float *query, uint32_t node, size_t from, size_t to) const;
+    std::vector<Candidate> search_layer(const float *query, uint32_t entry_node, size_t ef,
+                                        size_t level, bool live_only) const;
+    std::vector<uint32_t> select_neighbors(std::vector<Candidate> candidates,
+                                           size_t limit) const;
+    void link(uint32_t node, uint32_t neighbor, size_t level);
+    bool insert_locked(uint64_t key, const float *normalized);
+    void reserve_nodes(size_t nodes);
+    void refresh_view();
+    void materialize();
+    void unmap();
+
+    size_t width = 0;
+    size_t row_stride = 0;
+    HnswOptions settings;
+    double level_scale = 0.0;
+    uint64_t level_state = 0;
+
+    size_t count = 0;
+    size_t deleted_count = 0;
+    uint32_t entry = 0;
+    size_t top_level = 0;
+    View view;
+
+    size_t capacity = 0;
+    AlignedFloats vector_data;
+    std::vector<uint32_t> link_data;
+    std::vector<uint64_t> key_data;
+    std::vector<uint8_t> level_data;
+    std::vector<uint8_t> deleted_data;
+    std::vector<uint64_t> upper_index_data;
+    std::vector<uint32_t> upper_data;
+    // Built on the first mutation, so a mapped index opens without it.
+    std::unordered_map<uint64_t, uint32_t> nodes_by_key;
+
+    void *mapping = nullptr;
+    size_t mapping_bytes = 0;
+    size_t upper_count = 0;
+
+    mutable std::shared_mutex mutex;
+};
+
+#endif // VECTOR_INDEX_H
@@ -0,0 +1,68 @@
+#ifndef VECTORIZER_H
+#define VECTORIZER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <span>
+
+// Every row handed out by the vectorizer starts on a cache line.
+constexpr size_t kVectorAlignment = 64;
+
+struct AlignedFree {
+    void operator()(void *pointer) const { std::free(pointer); }
+};
+
+using AlignedFloats = std::unique_ptr<float[], AlignedFree>;
+
+// Zeroed storage for count floats, rounded up to whole cache lines.
+AlignedFloats allocate_aligned_floats(size_t count);
+
+// Row-major token embeddings. Rows are padded to a multiple of 16 floats so
+// that each one is cache-line aligned and the kernels never need a tail
+// loop; the padding stays zero.
+class EmbeddingTable {
+public:
+    EmbeddingTable() = default;
+    EmbeddingTable(size_t rows, size_t dim);
+
+    size_t rows() const { return row_count; }
+    size_t dim() const { return width; }
+    // Distance in floats between the starts of consecutive rows.
+    size_t stride() const { return row_stride; }
+
+    float *row(uint32_t id) { return data.get() + static_cast<size_t>(id) * row_stride; }
+    const float *row(uint32_t id) const {
+        return data.get() + static_cast<size_t>(id) * row_stride;
+    }
+
+private:
+    size_t row_count = 0;
+    size_t width = 0;
+    size_t row_stride = 0;
+    AlignedFloats data;
+};
+
+// Turns token IDs into vectors a batch at a time. Output buffers belong to
+// the caller, must be kVectorAlignment-aligned and hold stride() floats per
+// row. IDs outside the table produce zero rows. The kernels use AVX-512 or
+// AVX2 when the CPU has them, chosen once at startup.
+class Vectorizer {
+public:
+    Vectorizer() = default;
+    explicit Vectorizer(EmbeddingTable table);
+
+    const EmbeddingTable &table() const { return embeddings; }
+    size_t stride() const { return embeddings.stride(); }
+
+    // Writes the embedding of ids[i] to row i of out.
+    void lookup(std::span<const uint32_t> ids, float *out) const;
+    // Writes the mean embedding of batch[i] to row i of out.
+    void vectorize(std::span<const std::span<const uint32_t>> batch, float *out) const;
+
+private:
+    EmbeddingTable embeddings;
+};
+
+#endif // VECTORIZER_H
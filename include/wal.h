@@ -0,0 +1,142 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <sys/types.h>
+
+// A log directory holds segment files named by the LSN of their first
+// record in 16 hex digits, NNNNNNNNNNNNNNNN.wal, and a "checkpoint" file
+// with the LSN up to which records need no replay. A record is a
+// WalRecordHeader and its payload, all little-endian; the CRC-32 covers
+// everything after its own field. LSNs start at 1 and increase by one per
+// record with no gaps, so replay stops at the first record out of place.
+constexpr uint32_t kWalRecordMagic = 0x314c4157; // "WAL1"
+
+struct WalRecordHeader {
+    uint32_t magic;
+    uint32_t crc;
+    uint64_t lsn;
+    uint32_t length;
+    uint16_t type;
+    uint16_t reserved;
+};
+
+static_assert(sizeof(WalRecordHeader) == 24);
+
+enum class WalDurability {
+    // Records reach the kernel in order but are synced only by sync() and
+    // checkpoints; a crash of the machine loses whatever it had cached.
+    None,
+    // The writer thread syncs every sync_interval and commit() does not
+    // wait, so at most about one interval of records is lost.
+    Interval,
+    // commit() returns once the record is on disk.
+    Commit,
+};
+
+struct WalOptions {
+    WalDurability durability = WalDurability::Commit;
+    std::chrono::milliseconds sync_interval{100};
+    // Records go to a new segment once the current one reaches this.
+    uint64_t segment_bytes = 64ull << 20;
+};
+
+// Options from SVAKLA_WAL_DURABILITY ("none", "interval" or "commit", the
+// default) and SVAKLA_WAL_SYNC_MS.
+WalOptions wal_options_from_env();
+
+// Write-ahead log with group commit. append() only queues a record; one
+// writer thread takes everything queued since its last pass, writes it with
+// one write() and syncs it with one fdatasync(), so any number of threads
+// committing at once share a single flush instead of paying one each.
+//
+// Owners log what they are about to change, commit, then apply the change
+// to their own files without syncing them. Replay hands back every record
+// after the last checkpoint, so applying a record must be idempotent; once
+// the owner has synced its files it calls checkpoint() to let the log drop
+// the records behind them.
+class Wal {
+public:
+    using Replay = std::function<void(uint16_t type, uint64_t lsn, std::string_view payload)>;
+
+    Wal() = default;
+    ~Wal();
+    Wal(const Wal &) = delete;
+    Wal &operator=(const Wal &) = delete;
+
+    // Opens or creates the log in directory and passes every record after
+    // the checkpoint to replay, in order, before returning. A torn record at
+    // the end is discarded. Returns false (after logging) on failure.
+    bool open(const std::string &directory, WalOptions options = WalOptions(),
+              const Replay &replay = nullptr);
+    void close();
+    bool is_open() const;
+
+    // Queues a record made of parts and returns its LSN, or 0 on failure.
+    uint64_t append(uint16_t type, std::initializer_list<std::string_view> parts);
+    // Under Commit durability, waits until the record lsn is on disk;
+    // otherwise only until it has been written. False if the log failed.
+    bool commit(uint64_t lsn);
+    // Waits until everything appended so far is on disk, whatever the
+    // durability.
+    bool sync();
+
+    uint64_t last_lsn() const;
+    // Bytes in the segments still kept.
+    uint64_t size_bytes() const;
+    // Records up to lsn no longer need replay; whole segments of them are
+    // deleted.
+    bool checkpoint(uint64_t lsn);
+
+private:
+    struct SegmentFile {
+        uint64_t first_lsn;
+        uint64_t bytes;
+    };
+
+    std::string segment_path(uint64_t first_lsn) const;
+    bool scan(const Replay &replay);
+    bool start_segment(uint64_t first_lsn);
+    bool write_batch(const std::vector<char> &batch, uint64_t first_lsn);
+    bool write_checkpoint(uint64_t lsn);
+    void writer_loop();
+
+    std::string root;
+    WalOptions settings;
+    // The active segment, written only by the writer thread.
+    int fd = -1;
+    uint64_t active_bytes = 0;
+    std::vector<SegmentFile> files;
+    uint64_t sealed_bytes = 0;
+
+    mutable std::mutex mutex;
+    std::condition_variable work_wanted;
+    std::condition_variable progress;
+    std::vector<char> pending;
+    uint64_t pending_first = 0;
+    uint64_t next_lsn = 1;
+    uint64_t written_lsn = 0;
+    uint64_t durable_lsn = 0;
+    uint64_t sync_wanted = 0;
+    uint64_t checkpoint_lsn = 0;
+    bool failed = false;
+    bool stopping = false;
+    std::thread writer;
+};
+
+// Replaces path with data in one step: a temporary file is written and
+// synced, then renamed over path and the directory synced, so readers see
+// the old contents or the new, never a mix, even after a crash.
+bool write_file_durably(const std::string &path, std::string_view data, mode_t mode);
+
+#endif // WAL_H
@@ -0,0 +1,67 @@
+#ifndef WEBSOCKET_H
+#define WEBSOCKET_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include "event_loop.h"
+#include "http.h"
+
+enum class WebSocketOpcode : uint8_t {
+    Continuation = 0x0,
+    Text = 0x1,
+    Binary = 0x2,
+    Close = 0x8,
+    Ping = 0x9,
+    Pong = 0xA,
+};
+
+constexpr size_t kMaxWebSocketMessageBytes = 16 * 1024 * 1024;
+
+// Sec-WebSocket-Accept value for a client's Sec-WebSocket-Key (RFC 6455 4.2.2).
+std::string websocket_accept_key(std::string_view client_key);
+
+bool websocket_is_upgrade(const HttpRequest &request);
+// Writes the 101 response completing the opening handshake.
+void websocket_write_handshake(std::string &out, const HttpRequest &request);
+
+// XORs size bytes with the 4-byte masking key in place, 32 or 16 bytes at a
+// time when AVX2/SSE2 is available.
+void websocket_unmask(char *data, size_t size, const uint8_t mask[4]);
+
+// True if data is well-formed UTF-8: no overlong forms, surrogates or code
+// points past U+10FFFF (RFC 3629).
+bool websocket_valid_utf8(std::string_view data);
+
+// Server frames are never masked.
+void websocket_write_frame(std::string &out, WebSocketOpcode opcode, std::string_view payload,
+                           bool fin = true);
+void websocket_write_close(std::string &out, uint16_t code);
+
+// Reassembles data messages from the connection's input. Control frames are
+// answered inline: pings get a pong, a close gets the closing handshake. A
+// text message that is not valid UTF-8 fails the connection with 1007.
+class WebSocketReader {
+public:
+    enum class Status {
+        Message,
+        Incomplete,
+        Closed,
+    };
+
+    // On Message, message views either the receive buffer (single-frame
+    // messages, unmasked in place) or the reassembly buffer; it stays valid
+    // until the next call.
+    Status next(Connection &conn, WebSocketOpcode &opcode, std::string_view &message);
+
+private:
+    void fail(Connection &conn, uint16_t code);
+
+    size_t pending_consume = 0;
+    std::string fragments;
+    WebSocketOpcode fragment_opcode = WebSocketOpcode::Text;
+    bool in_fragment = false;
+};
+
+#endif // WEBSOCKET_H
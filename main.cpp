@@ -1,33 +1,40 @@
 #include "include/openssl_init.h"
+#include "include/server_runtime.h"
 #include <iostream>
 #include <openssl/err.h>
 #include <openssl/ssl.h>
 #include <string>
 #include <thread>
 
+// Every network service shares one set of event loops and workers.
+ServerRuntime &server_runtime() {
+  static ServerRuntime runtime(shard_options_from_env());
+  return runtime;
+}
+
 void start_http_server() {
-  extern void start_server(int port);
-  start_server(992);
+  extern void register_http_server(ServerRuntime &runtime, int port);
+  register_http_server(server_runtime(), 992);
 }
 
 void start_websocket_server() {
-  extern void start_server(int port);
-  start_server(776);
+  extern void register_websocket_server(ServerRuntime &runtime, int port);
+  register_websocket_server(server_runtime(), 776);
 }
 
 void start_api_server() {
-  extern void start_server(int port);
-  start_server(933);
+  extern void register_api_server(ServerRuntime &runtime, int port);
+  register_api_server(server_runtime(), 933);
 }
 
 void start_web_interface_server() {
-  extern void start_server(int port);
-  start_server(8443); // Custom port for web interface server
+  extern void register_web_interface_server(ServerRuntime &runtime, int port);
+  register_web_interface_server(server_runtime(), 8443); // Custom port for web interface server
 }
 
 void start_external_service_interface() {
-  extern void start_server(int port);
-  start_server(9999); // Custom port for external service interface
+  extern void register_external_service_interface(ServerRuntime &runtime, int port);
+  register_external_service_interface(server_runtime(), 9999); // Custom port for external service interface
 }
 
 void authenticate_user() {
@@ -123,7 +130,7 @@ void run_documentation_system() {
             << std::endl;
 }
 
-void display_final_summary() {
+void show_final_summary() {
   extern void display_final_summary();
   display_final_summary();
 }
@@ -131,13 +138,15 @@ void display_final_summary() {
 int main() {
   init_openssl();
 
-  std::thread http_thread(start_http_server);
-  std::thread websocket_thread(start_websocket_server);
-  std::thread api_thread(start_api_server);
-  std::thread web_interface_thread(start_web_interface_server);
+  start_http_server();
+  start_websocket_server();
+  start_api_server();
+  start_web_interface_server();
+  start_external_service_interface();
+  server_runtime().start();
+
   std::thread auth_thread(authenticate_user);
   std::thread ai_thread(run_ai_engine);
-  std::thread external_service_thread(start_external_service_interface);
   std::thread plugin_thread(load_plugins);
   std::thread memory_thread(manage_local_memory);
   std::thread shell_thread(run_interactive_shell);
@@ -147,15 +156,10 @@ int main() {
   std::thread expansion_thread(run_expansion_modules);
   std::thread install_thread(run_installation_system);
   std::thread doc_thread(run_documentation_system);
-  std::thread summary_thread(display_final_summary);
+  std::thread summary_thread(show_final_summary);
 
-  http_thread.join();
-  websocket_thread.join();
-  api_thread.join();
-  web_interface_thread.join();
   auth_thread.join();
   ai_thread.join();
-  external_service_thread.join();
   plugin_thread.join();
   memory_thread.join();
   shell_thread.join();
@@ -166,6 +170,7 @@ int main() {
   install_thread.join();
   doc_thread.join();
   summary_thread.join();
+  server_runtime().wait();
 
   cleanup_openssl();
   return 0;
@@ -0,0 +1,138 @@
+// Offline converter from raw float32 tensors to the mapped weight format.
+//
+//     convert_weights <manifest> <output>
+//     convert_weights --verify <weights>
+//
+// Each manifest line describes one tensor, in the order it is written:
+//
+//     <name> <f32|q8|q4> <rows> <cols> <file of rows * cols little-endian floats>
+//
+// Blank lines and lines starting with '#' are ignored; relative paths are
+// resolved against the manifest's directory. Input is streamed a row at a
+// time, so models much larger than RAM convert fine.
+#include <iostream>
+#include <string>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include "../include/model_weights.h"
+
+namespace {
+
+struct ManifestEntry {
+    WeightTensorSpec spec;
+    std::string source;
+};
+
+bool parse_type(const std::string &text, WeightType &type) {
+    if (text == "f32") {
+        type = WeightType::F32;
+    } else if (text == "q8") {
+        type = WeightType::Q8;
+    } else if (text == "q4") {
+        type = WeightType::Q4;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool read_manifest(const std::string &path, std::vector<ManifestEntry> &entries) {
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        std::cerr << "Unable to open manifest: " << path << std::endl;
+        return false;
+    }
+    std::filesystem::path directory = std::filesystem::path(path).parent_path();
+    std::string line;
+    for (size_t number = 1; std::getline(file, line); ++number) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        std::istringstream fields(line);
+        ManifestEntry entry;
+        std::string type;
+        if (!(fields >> entry.spec.name >> type >> entry.spec.rows >> entry.spec.cols >>
+              entry.source) || !parse_type(type, entry.spec.type)) {
+            std::cerr << path << ":" << number << ": malformed tensor line" << std::endl;
+            return false;
+        }
+        std::filesystem::path source(entry.source);
+        if (source.is_relative()) {
+            entry.source = (directory / source).string();
+        }
+        entries.push_back(std::move(entry));
+    }
+    return true;
+}
+
+int convert(const std::string &manifest, const std::string &output) {
+    std::vector<ManifestEntry> entries;
+    if (!read_manifest(manifest, entries)) {
+        return 1;
+    }
+    std::vector<WeightTensorSpec> specs;
+    for (const ManifestEntry &entry : entries) {
+        std::error_code error;
+        uintmax_t size = std::filesystem::file_size(entry.source, error);
+        if (error || size != entry.spec.rows * entry.spec.cols * sizeof(float)) {
+            std::cerr << entry.source << ": expected " << entry.spec.rows << "x"
+                      << entry.spec.cols << " floats" << std::endl;
+            return 1;
+        }
+        specs.push_back(entry.spec);
+    }
+
+    WeightWriter writer;
+    if (!writer.open(output, specs)) {
+        return 1;
+    }
+    for (const ManifestEntry &entry : entries) {
+        std::ifstream source(entry.source, std::ios::binary);
+        std::vector<float> row(entry.spec.cols);
+        for (size_t r = 0; r < entry.spec.rows; ++r) {
+            if (!source.read(reinterpret_cast<char *>(row.data()),
+                             static_cast<std::streamsize>(row.size() * sizeof(float)))) {
+                std::cerr << "Unable to read " << entry.source << std::endl;
+                return 1;
+            }
+            if (!writer.write_row(row.data())) {
+                return 1;
+            }
+        }
+        std::cout << entry.spec.name << " " << entry.spec.rows << "x" << entry.spec.cols
+                  << std::endl;
+    }
+    if (!writer.finish()) {
+        return 1;
+    }
+    std::cout << "Wrote " << output << " (" << std::filesystem::file_size(output) << " bytes)"
+              << std::endl;
+    return 0;
+}
+
+int verify(const std::string &path) {
+    ModelWeights weights;
+    if (!weights.open(path)) {
+        return 1;
+    }
+    bool ok = weights.verify_all();
+    std::cout << path << ": " << weights.tensors().size() << " tensors, "
+              << (ok ? "checksums OK" : "checksum FAILED") << std::endl;
+    return ok ? 0 : 1;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    if (argc == 3 && std::string(argv[1]) == "--verify") {
+        return verify(argv[2]);
+    }
+    if (argc == 3) {
+        return convert(argv[1], argv[2]);
+    }
+    std::cerr << "Usage: " << argv[0] << " <manifest> <output>\n"
+              << "       " << argv[0] << " --verify <weights>" << std::endl;
+    return 2;
+}
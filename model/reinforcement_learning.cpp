@@ -1,5 +1,178 @@
 #include "reinforcement_learning.h"
 #include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <deque>
+#include <numeric>
+#include <sys/stat.h>
+#include "replay_buffer.h"
+#include "work_stealing_pool.h"
+#include "../include/model_weights.h"
+
+namespace {
+
+constexpr float kGravity = 9.8f;
+constexpr float kCartMass = 1.0f;
+constexpr float kPoleMass = 0.1f;
+constexpr float kPoleHalfLength = 0.5f;
+constexpr float kForce = 10.0f;
+constexpr float kTimeStep = 0.02f;
+constexpr float kAngleLimit = 12.0f * 3.14159265f / 180.0f;
+constexpr float kTrackLimit = 2.4f;
+
+// Adam, and the global gradient norm an update is clipped to.
+constexpr float kBeta1 = 0.9f;
+constexpr float kBeta2 = 0.999f;
+constexpr float kAdamEpsilon = 1e-8f;
+constexpr float kMaxGradientNorm = 10.0f;
+
+// Episodes the reported mean return covers.
+constexpr size_t kReturnWindow = 100;
+
+struct Actor {
+    CartPole env;
+    std::mt19937_64 rng;
+    float observation[CartPole::kObservationSize];
+    float episode_return = 0.0f;
+    std::vector<float> activations;
+    std::vector<float> finished;
+};
+
+struct Shard {
+    std::mt19937_64 rng;
+    std::vector<float> grad;
+    std::vector<float> online, target, scratch;
+    Transition transition;
+};
+
+// Tensors under which a checkpoint keeps the online and target networks and
+// the Adam state; the step is split in two floats so it stays exact.
+constexpr char kOnlinePrefix[] = "q";
+constexpr char kTargetPrefix[] = "target";
+constexpr char kMomentName[] = "adam.moment";
+constexpr char kVelocityName[] = "adam.velocity";
+constexpr char kStepName[] = "adam.step";
+constexpr uint64_t kStepSplit = 1 << 16;
+
+// The optimizer state a resumed run continues from.
+struct TrainingState {
+    std::vector<float> params, target, moment, velocity;
+    uint64_t step = 0;
+};
+
+std::string layer_name(const char *prefix, size_t layer, const char *part) {
+    return std::string(prefix) + ".layers." + std::to_string(layer) + "." + part;
+}
+
+void add_network_specs(const Mlp &net, const char *prefix, std::vector<WeightTensorSpec> &specs) {
+    for (size_t l = 0; l < net.layer_count(); ++l) {
+        specs.push_back({layer_name(prefix, l, "weight"), WeightType::F32, net.layer_outputs(l),
+                         net.layer_inputs(l)});
+        specs.push_back({layer_name(prefix, l, "bias"), WeightType::F32, 1,
+                         net.layer_outputs(l)});
+    }
+}
+
+bool write_network(WeightWriter &writer, const Mlp &net, const std::vector<float> &params) {
+    for (size_t l = 0; l < net.layer_count(); ++l) {
+        const float *weights = params.data() + net.weights_offset(l);
+        for (size_t r = 0; r < net.layer_outputs(l); ++r) {
+            if (!writer.write_row(weights + r * net.layer_inputs(l))) {
+                return false;
+            }
+        }
+        if (!writer.write_row(params.data() + net.biases_offset(l))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool read_network(const ModelWeights &weights, const Mlp &net, const char *prefix,
+                  std::vector<float> &params) {
+    for (size_t l = 0; l < net.layer_count(); ++l) {
+        const WeightTensor *w = weights.find(layer_name(prefix, l, "weight"));
+        const WeightTensor *b = weights.find(layer_name(prefix, l, "bias"));
+        if (!w || !b || w->type != WeightType::F32 || b->type != WeightType::F32 ||
+            w->rows != net.layer_outputs(l) || w->cols != net.layer_inputs(l) ||
+            b->cols != net.layer_outputs(l)) {
+            return false;
+        }
+        for (size_t r = 0; r < w->rows; ++r) {
+            std::copy_n(w->f32_row(r), w->cols,
+                        params.begin() + net.weights_offset(l) + r * w->cols);
+        }
+        std::copy_n(b->f32_row(0), b->cols, params.begin() + net.biases_offset(l));
+    }
+    return true;
+}
+
+const WeightTensor *find_vector(const ModelWeights &weights, const char *name, size_t cols) {
+    const WeightTensor *tensor = weights.find(name);
+    if (!tensor || tensor->type != WeightType::F32 || tensor->rows != 1 || tensor->cols != cols) {
+        return nullptr;
+    }
+    return tensor;
+}
+
+bool save_checkpoint(const Mlp &net, const TrainingState &state, const std::string &path) {
+    std::vector<WeightTensorSpec> specs;
+    add_network_specs(net, kOnlinePrefix, specs);
+    add_network_specs(net, kTargetPrefix, specs);
+    specs.push_back({kMomentName, WeightType::F32, 1, state.moment.size()});
+    specs.push_back({kVelocityName, WeightType::F32, 1, state.velocity.size()});
+    specs.push_back({kStepName, WeightType::F32, 1, 2});
+    WeightWriter writer;
+    if (!writer.open(path, specs)) {
+        return false;
+    }
+    const float step[2] = {static_cast<float>(state.step % kStepSplit),
+                           static_cast<float>(state.step / kStepSplit)};
+    return write_network(writer, net, state.params) && write_network(writer, net, state.target) &&
+           writer.write_row(state.moment.data()) && writer.write_row(state.velocity.data()) &&
+           writer.write_row(step) && writer.finish();
+}
+
+// Checkpoints holding only the online network, as older runs wrote them,
+// resume with a fresh optimizer and a target equal to the network.
+bool load_checkpoint(const Mlp &net, TrainingState &state, const std::string &path) {
+    ModelWeights weights;
+    if (!weights.open(path)) {
+        return false;
+    }
+    if (!read_network(weights, net, kOnlinePrefix, state.params)) {
+        std::cerr << "Checkpoint " << path << " does not match the network" << std::endl;
+        return false;
+    }
+    size_t count = state.params.size();
+    const WeightTensor *moment = find_vector(weights, kMomentName, count);
+    const WeightTensor *velocity = find_vector(weights, kVelocityName, count);
+    const WeightTensor *step = find_vector(weights, kStepName, 2);
+    if (!weights.find(kStepName)) {
+        state.target = state.params;
+        return true;
+    }
+    if (!moment || !velocity || !step ||
+        !read_network(weights, net, kTargetPrefix, state.target)) {
+        std::cerr << "Checkpoint " << path << " has a damaged optimizer state" << std::endl;
+        return false;
+    }
+    std::copy_n(moment->f32_row(0), count, state.moment.begin());
+    std::copy_n(velocity->f32_row(0), count, state.velocity.begin());
+    const float *parts = step->f32_row(0);
+    state.step = static_cast<uint64_t>(parts[0]) + static_cast<uint64_t>(parts[1]) * kStepSplit;
+    return true;
+}
+
+// Derivative of the Huber loss at error, which is quadratic within 1 and
+// linear beyond, so rare large TD errors do not dominate an update.
+float huber_grad(float error) {
+    return std::clamp(error, -1.0f, 1.0f);
+}
+
+} // namespace
 
 void initializeModel() {
     std::cout << "AI model initialized." << std::endl;
@@ -7,4 +180,308 @@ void initializeModel() {
 
 void trainModel() {
     std::cout << "Training AI model." << std::endl;
+    TrainingReport report;
+    if (train_agent(TrainingOptions(), report)) {
+        std::cout << "Trained for " << report.episodes << " episodes, mean return "
+                  << report.mean_return << std::endl;
+    }
+}
+
+void CartPole::reset(std::mt19937_64 &rng, float *observation) {
+    std::uniform_real_distribution<float> start(-0.05f, 0.05f);
+    x = start(rng);
+    x_dot = start(rng);
+    theta = start(rng);
+    theta_dot = start(rng);
+    steps = 0;
+    observe(observation);
+}
+
+float CartPole::step(uint32_t action, float *observation, bool &terminal) {
+    float force = action == 1 ? kForce : -kForce;
+    float cos_theta = std::cos(theta);
+    float sin_theta = std::sin(theta);
+    float total_mass = kCartMass + kPoleMass;
+    float pole_moment = kPoleMass * kPoleHalfLength;
+    float temp = (force + pole_moment * theta_dot * theta_dot * sin_theta) / total_mass;
+    float theta_acc = (kGravity * sin_theta - cos_theta * temp) /
+                      (kPoleHalfLength *
+                       (4.0f / 3.0f - kPoleMass * cos_theta * cos_theta / total_mass));
+    float x_acc = temp - pole_moment * theta_acc * cos_theta / total_mass;
+
+    x += kTimeStep * x_dot;
+    x_dot += kTimeStep * x_acc;
+    theta += kTimeStep * theta_dot;
+    theta_dot += kTimeStep * theta_acc;
+    ++steps;
+    terminal = std::fabs(x) > kTrackLimit || std::fabs(theta) > kAngleLimit;
+    observe(observation);
+    return 1.0f;
+}
+
+void CartPole::observe(float *observation) const {
+    observation[0] = x;
+    observation[1] = x_dot;
+    observation[2] = theta;
+    observation[3] = theta_dot;
+}
+
+Mlp::Mlp(std::vector<size_t> layer_sizes) : sizes(std::move(layer_sizes)) {
+    size_t activation = 0;
+    for (size_t l = 0; l + 1 < sizes.size(); ++l) {
+        offsets.push_back(parameters);
+        parameters += sizes[l] * sizes[l + 1] + sizes[l + 1];
+        activation_offsets.push_back(activation);
+        activation += sizes[l + 1];
+    }
+    activation_offsets.push_back(activation);
+}
+
+void Mlp::init(std::vector<float> &params, std::mt19937_64 &rng) const {
+    params.assign(parameters, 0.0f);
+    for (size_t l = 0; l < layer_count(); ++l) {
+        // He initialisation suits the ReLUs that follow.
+        std::normal_distribution<float> normal(0.0f, std::sqrt(2.0f / sizes[l]));
+        float *weights = params.data() + weights_offset(l);
+        for (size_t i = 0; i < sizes[l] * sizes[l + 1]; ++i) {
+            weights[i] = normal(rng);
+        }
+    }
+}
+
+void Mlp::forward(const float *params, const float *input, std::vector<float> &activations) const {
+    activations.resize(activation_offsets.back());
+    const float *in = input;
+    for (size_t l = 0; l < layer_count(); ++l) {
+        const float *weights = params + weights_offset(l);
+        const float *biases = params + biases_offset(l);
+        float *out = activations.data() + activation_offsets[l];
+        bool hidden = l + 1 < layer_count();
+        for (size_t o = 0; o < sizes[l + 1]; ++o) {
+            const float *row = weights + o * sizes[l];
+            float sum = biases[o];
+            for (size_t i = 0; i < sizes[l]; ++i) {
+                sum += row[i] * in[i];
+            }
+            out[o] = hidden ? std::max(sum, 0.0f) : sum;
+        }
+        in = out;
+    }
+}
+
+const float *Mlp::output(const std::vector<float> &activations) const {
+    return activations.data() + activation_offsets[layer_count() - 1];
+}
+
+void Mlp::backward(const float *params, const float *input, const std::vector<float> &activations,
+                   const float *output_grad, float *grad, std::vector<float> &scratch) const {
+    // scratch holds the gradient with respect to the current layer's
+    // output, then, in its second half, that of the layer below.
+    size_t widest = *std::max_element(sizes.begin(), sizes.end());
+    scratch.resize(2 * widest);
+    float *delta = scratch.data();
+    float *below = scratch.data() + widest;
+    std::copy_n(output_grad, sizes.back(), delta);
+
+    for (size_t l = layer_count(); l-- > 0;) {
+        const float *in = l == 0 ? input : activations.data() + activation_offsets[l - 1];
+        const float *weights = params + weights_offset(l);
+        float *weight_grad = grad + weights_offset(l);
+        float *bias_grad = grad + biases_offset(l);
+        size_t inputs = sizes[l];
+        if (l > 0) {
+            std::fill(below, below + inputs, 0.0f);
+        }
+        for (size_t o = 0; o < sizes[l + 1]; ++o) {
+            float d = delta[o];
+            if (d == 0.0f) {
+                continue;
+            }
+            bias_grad[o] += d;
+            for (size_t i = 0; i < inputs; ++i) {
+                weight_grad[o * inputs + i] += d * in[i];
+            }
+            if (l > 0) {
+                for (size_t i = 0; i < inputs; ++i) {
+                    below[i] += d * weights[o * inputs + i];
+                }
+            }
+        }
+        if (l > 0) {
+            // Through the ReLU: nothing flows where it was off.
+            for (size_t i = 0; i < inputs; ++i) {
+                delta[i] = in[i] > 0.0f ? below[i] : 0.0f;
+            }
+        }
+    }
+}
+
+bool train_agent(const TrainingOptions &options, TrainingReport &report) {
+    auto start = std::chrono::steady_clock::now();
+    report = TrainingReport();
+    WorkStealingPool workers(options.threads);
+    report.threads = workers.size();
+
+    Mlp net({CartPole::kObservationSize, options.hidden, options.hidden, CartPole::kActions});
+    size_t count = net.parameter_count();
+    std::mt19937_64 rng(options.seed);
+    TrainingState state;
+    net.init(state.params, rng);
+    state.moment.assign(count, 0.0f);
+    state.velocity.assign(count, 0.0f);
+    state.target = state.params;
+    struct stat info;
+    if (options.resume && !options.checkpoint_path.empty() &&
+        stat(options.checkpoint_path.c_str(), &info) == 0 &&
+        !load_checkpoint(net, state, options.checkpoint_path)) {
+        return false;
+    }
+    std::vector<float> &params = state.params;
+    std::vector<float> &target = state.target;
+    std::vector<float> &moment = state.moment;
+    std::vector<float> &velocity = state.velocity;
+    std::vector<float> accumulated(count);
+
+    ReplayBuffer replay(options.replay_capacity, CartPole::kObservationSize);
+    std::vector<Actor> actors(std::max<size_t>(1, options.environments));
+    for (size_t a = 0; a < actors.size(); ++a) {
+        actors[a].rng.seed(options.seed * 7919 + a + 1);
+        actors[a].env.reset(actors[a].rng, actors[a].observation);
+    }
+    // One shard of each micro-batch per thread; a shard's gradient is
+    // private until they are summed.
+    std::vector<Shard> shards(workers.size());
+    for (size_t s = 0; s < shards.size(); ++s) {
+        shards[s].rng.seed(options.seed * 104729 + s + 1);
+        shards[s].grad.resize(count);
+    }
+    size_t batch = std::max<size_t>(1, options.batch_size);
+    size_t micro_batches = std::max<size_t>(1, options.accumulation_steps);
+    std::deque<float> recent;
+
+    for (size_t iteration = 0; iteration < options.iterations; ++iteration) {
+        float progress = options.epsilon_iterations == 0
+            ? 1.0f
+            : std::min(1.0f, static_cast<float>(iteration) / options.epsilon_iterations);
+        float epsilon = options.epsilon_start +
+                        (options.epsilon_end - options.epsilon_start) * progress;
+
+        // Rollouts read the parameters, which stay put until the updates.
+        workers.parallel_for(actors.size(), 1, [&](size_t a) {
+            Actor &actor = actors[a];
+            std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+            float next[CartPole::kObservationSize];
+            for (size_t step = 0; step < options.rollout_steps; ++step) {
+                uint32_t action;
+                if (unit(actor.rng) < epsilon) {
+                    action = static_cast<uint32_t>(actor.rng() % CartPole::kActions);
+                } else {
+                    net.forward(params.data(), actor.observation, actor.activations);
+                    const float *q = net.output(actor.activations);
+                    action = static_cast<uint32_t>(std::max_element(q, q + CartPole::kActions) - q);
+                }
+                bool terminal = false;
+                float reward = actor.env.step(action, next, terminal);
+                replay.push(actor.observation, action, reward, next, terminal);
+                actor.episode_return += reward;
+                if (terminal || actor.env.truncated()) {
+                    actor.finished.push_back(actor.episode_return);
+                    actor.episode_return = 0.0f;
+                    actor.env.reset(actor.rng, actor.observation);
+                } else {
+                    std::copy_n(next, CartPole::kObservationSize, actor.observation);
+                }
+            }
+        });
+        report.env_steps += actors.size() * options.rollout_steps;
+        for (Actor &actor : actors) {
+            for (float episode : actor.finished) {
+                recent.push_back(episode);
+                if (recent.size() > kReturnWindow) {
+                    recent.pop_front();
+                }
+                ++report.episodes;
+            }
+            actor.finished.clear();
+        }
+
+        for (size_t update = 0; replay.size() >= batch && update < options.updates_per_iteration;
+             ++update) {
+            std::fill(accumulated.begin(), accumulated.end(), 0.0f);
+            for (size_t micro = 0; micro < micro_batches; ++micro) {
+                workers.parallel_for(shards.size(), 1, [&](size_t s) {
+                    Shard &shard = shards[s];
+                    std::fill(shard.grad.begin(), shard.grad.end(), 0.0f);
+                    size_t first = batch * s / shards.size();
+                    size_t last = batch * (s + 1) / shards.size();
+                    for (size_t k = first; k < last; ++k) {
+                        Transition &t = shard.transition;
+                        if (!replay.sample(shard.rng, t)) {
+                            return;
+                        }
+                        net.forward(target.data(), t.next_state.data(), shard.target);
+                        const float *next_q = net.output(shard.target);
+                        float best = *std::max_element(next_q, next_q + CartPole::kActions);
+                        float goal = t.reward + (t.done ? 0.0f : options.gamma * best);
+
+                        net.forward(params.data(), t.state.data(), shard.online);
+                        float output_grad[CartPole::kActions] = {};
+                        float error = net.output(shard.online)[t.action] - goal;
+                        output_grad[t.action] = huber_grad(error);
+                        net.backward(params.data(), t.state.data(), shard.online, output_grad,
+                                     shard.grad.data(), shard.scratch);
+                    }
+                });
+                // Sum the shards, each thread taking a slice of parameters.
+                workers.parallel_for(count, 256, [&](size_t p) {
+                    float sum = 0.0f;
+                    for (const Shard &shard : shards) {
+                        sum += shard.grad[p];
+                    }
+                    accumulated[p] += sum;
+                });
+            }
+
+            float scale = 1.0f / static_cast<float>(batch * micro_batches);
+            double norm = 0.0;
+            for (float &g : accumulated) {
+                g *= scale;
+                norm += static_cast<double>(g) * g;
+            }
+            float clip = std::min(
+                1.0f, kMaxGradientNorm / static_cast<float>(std::sqrt(norm) + 1e-12));
+            ++report.updates;
+            ++state.step;
+            float t = static_cast<float>(state.step);
+            float correction1 = 1.0f - std::pow(kBeta1, t);
+            float correction2 = 1.0f - std::pow(kBeta2, t);
+            for (size_t p = 0; p < count; ++p) {
+                float g = accumulated[p] * clip;
+                moment[p] = kBeta1 * moment[p] + (1.0f - kBeta1) * g;
+                velocity[p] = kBeta2 * velocity[p] + (1.0f - kBeta2) * g * g;
+                params[p] -= options.learning_rate * (moment[p] / correction1) /
+                             (std::sqrt(velocity[p] / correction2) + kAdamEpsilon);
+            }
+            if (options.target_sync > 0 && state.step % options.target_sync == 0) {
+                target = params;
+            }
+        }
+
+        bool last = iteration + 1 == options.iterations;
+        if (!options.checkpoint_path.empty() &&
+            (last || (options.checkpoint_every > 0 &&
+                      (iteration + 1) % options.checkpoint_every == 0))) {
+            if (!save_checkpoint(net, state, options.checkpoint_path)) {
+                return false;
+            }
+            ++report.checkpoints;
+        }
+    }
+
+    if (!recent.empty()) {
+        report.mean_return = std::accumulate(recent.begin(), recent.end(), 0.0) / recent.size();
+    }
+    report.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+                         .count();
+    return true;
 }
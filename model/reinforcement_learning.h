@@ -1,7 +1,125 @@
 #ifndef REINFORCEMENT_LEARNING_H
 #define REINFORCEMENT_LEARNING_H
 
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
 void initializeModel();
+// Trains with the default TrainingOptions and prints the report.
 void trainModel();
 
+// Pole balancing on a moving cart (Barto, Sutton and Anderson, 1983), the
+// environment the rollouts run. Observations are cart position and
+// velocity, pole angle and angular velocity; the two actions push the
+// cart left or right, and every step the pole stays up is worth 1.
+class CartPole {
+public:
+    static constexpr size_t kObservationSize = 4;
+    static constexpr size_t kActions = 2;
+    static constexpr size_t kMaxSteps = 500;
+
+    void reset(std::mt19937_64 &rng, float *observation);
+    // Returns the reward and writes the next observation. terminal is set
+    // once the pole has fallen or the cart left the track; an episode that
+    // reaches kMaxSteps is truncated() instead.
+    float step(uint32_t action, float *observation, bool &terminal);
+    bool truncated() const { return steps >= kMaxSteps; }
+
+private:
+    void observe(float *observation) const;
+
+    float x = 0.0f;
+    float x_dot = 0.0f;
+    float theta = 0.0f;
+    float theta_dot = 0.0f;
+    size_t steps = 0;
+};
+
+// Fully connected network with ReLU between layers. All weights and biases
+// live in one flat parameter array (per layer, an out x in weight matrix
+// then out biases), so per-thread gradients are summed elementwise and the
+// optimizer and checkpoints see a single vector.
+class Mlp {
+public:
+    explicit Mlp(std::vector<size_t> layer_sizes);
+
+    size_t parameter_count() const { return parameters; }
+    size_t layer_count() const { return sizes.size() - 1; }
+    size_t layer_inputs(size_t layer) const { return sizes[layer]; }
+    size_t layer_outputs(size_t layer) const { return sizes[layer + 1]; }
+    size_t weights_offset(size_t layer) const { return offsets[layer]; }
+    size_t biases_offset(size_t layer) const {
+        return offsets[layer] + sizes[layer] * sizes[layer + 1];
+    }
+
+    void init(std::vector<float> &params, std::mt19937_64 &rng) const;
+    // Runs input through the network; activations receives every layer's
+    // output, the last of which output() returns.
+    void forward(const float *params, const float *input, std::vector<float> &activations) const;
+    const float *output(const std::vector<float> &activations) const;
+    // Adds to grad the gradient of a loss whose derivative with respect to
+    // the output is output_grad, for the pass that filled activations.
+    void backward(const float *params, const float *input, const std::vector<float> &activations,
+                  const float *output_grad, float *grad, std::vector<float> &scratch) const;
+
+private:
+    std::vector<size_t> sizes;
+    std::vector<size_t> offsets;
+    std::vector<size_t> activation_offsets;
+    size_t parameters = 0;
+};
+
+struct TrainingOptions {
+    // 0 means one per hardware thread.
+    size_t threads = 0;
+    size_t environments = 16;
+    size_t iterations = 200;
+    // Steps each environment takes per iteration.
+    size_t rollout_steps = 64;
+    size_t updates_per_iteration = 32;
+    // Transitions per micro-batch; each update sums the gradients of
+    // accumulation_steps micro-batches before the optimizer step.
+    size_t batch_size = 64;
+    size_t accumulation_steps = 2;
+    size_t replay_capacity = 100000;
+    size_t hidden = 64;
+    float gamma = 0.99f;
+    float learning_rate = 1e-3f;
+    // Updates between copies of the online network into the target one.
+    size_t target_sync = 250;
+    float epsilon_start = 1.0f;
+    float epsilon_end = 0.05f;
+    // Iterations over which exploration falls from start to end.
+    size_t epsilon_iterations = 100;
+    // Weight file the online and target networks and the Adam state are
+    // saved to every checkpoint_every iterations and at the end; empty
+    // saves nothing. With resume, training continues from it when it exists.
+    std::string checkpoint_path;
+    size_t checkpoint_every = 50;
+    bool resume = false;
+    uint64_t seed = 1;
+};
+
+struct TrainingReport {
+    uint64_t episodes = 0;
+    // Average return of the last 100 episodes.
+    double mean_return = 0.0;
+    uint64_t env_steps = 0;
+    uint64_t updates = 0;
+    uint64_t checkpoints = 0;
+    double seconds = 0.0;
+    size_t threads = 0;
+};
+
+// Deep Q-learning on CartPole. Each iteration first steps every environment
+// in parallel on a work-stealing pool, feeding a shared lock-free replay
+// buffer, then runs updates whose micro-batches are split into one shard
+// per thread; the shards' gradients are summed, accumulated and applied
+// with Adam. Returns false (after logging) if a checkpoint cannot be read
+// or written.
+bool train_agent(const TrainingOptions &options, TrainingReport &report);
+
 #endif // REINFORCEMENT_LEARNING_H
@@ -0,0 +1,88 @@
+#include <iostream>
+#include <string>
+#include <algorithm>
+#include <thread>
+#include "replay_buffer.h"
+
+// Slot contents are read and written through relaxed atomic_refs, so a
+// sampler overlapping a writer is a detected retry rather than a data race.
+
+ReplayBuffer::ReplayBuffer(size_t capacity, size_t observation_size)
+    : slot_count(std::max<size_t>(1, capacity)), width(observation_size),
+      versions(new std::atomic<uint64_t>[slot_count]),
+      data(new float[slot_count * (2 * observation_size + 3)]()) {
+    for (size_t i = 0; i < slot_count; ++i) {
+        versions[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+void ReplayBuffer::push(const float *state, uint32_t action, float reward,
+                        const float *next_state, bool done) {
+    uint64_t ticket = written.fetch_add(1, std::memory_order_relaxed);
+    size_t slot = ticket % slot_count;
+    std::atomic<uint64_t> &version = versions[slot];
+
+    // Another writer a whole lap ahead may still hold the slot.
+    uint64_t seen = version.load(std::memory_order_relaxed);
+    while ((seen & 1) || !version.compare_exchange_weak(seen, seen + 1,
+                                                        std::memory_order_acquire,
+                                                        std::memory_order_relaxed)) {
+        if (seen & 1) {
+            std::this_thread::yield();
+            seen = version.load(std::memory_order_relaxed);
+        }
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+
+    float *out = data.get() + slot * stride();
+    auto put = [](float &target, float value) {
+        std::atomic_ref<float>(target).store(value, std::memory_order_relaxed);
+    };
+    for (size_t i = 0; i < width; ++i) {
+        put(out[i], state[i]);
+        put(out[width + i], next_state[i]);
+    }
+    put(out[2 * width], reward);
+    put(out[2 * width + 1], static_cast<float>(action));
+    put(out[2 * width + 2], done ? 1.0f : 0.0f);
+    version.store(seen + 2, std::memory_order_release);
+}
+
+bool ReplayBuffer::sample(std::mt19937_64 &rng, Transition &out) const {
+    size_t filled = size();
+    if (filled == 0) {
+        return false;
+    }
+    out.state.resize(width);
+    out.next_state.resize(width);
+    std::uniform_int_distribution<size_t> pick(0, filled - 1);
+    auto get = [](float &source) {
+        return std::atomic_ref<float>(source).load(std::memory_order_relaxed);
+    };
+    while (true) {
+        size_t slot = pick(rng);
+        const std::atomic<uint64_t> &version = versions[slot];
+        uint64_t before = version.load(std::memory_order_acquire);
+        if (before == 0 || (before & 1)) {
+            // Claimed but never finished, or being rewritten right now.
+            continue;
+        }
+        float *in = data.get() + slot * stride();
+        for (size_t i = 0; i < width; ++i) {
+            out.state[i] = get(in[i]);
+            out.next_state[i] = get(in[width + i]);
+        }
+        out.reward = get(in[2 * width]);
+        out.action = static_cast<uint32_t>(get(in[2 * width + 1]));
+        out.done = get(in[2 * width + 2]) != 0.0f;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (version.load(std::memory_order_relaxed) == before) {
+            return true;
+        }
+    }
+}
+
+size_t ReplayBuffer::size() const {
+    return static_cast<size_t>(
+        std::min<uint64_t>(written.load(std::memory_order_acquire), slot_count));
+}
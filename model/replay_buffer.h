@@ -0,0 +1,56 @@
+#ifndef REPLAY_BUFFER_H
+#define REPLAY_BUFFER_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <vector>
+
+// One step of experience: in observation state the agent took action,
+// received reward and saw next_state; done marks the end of an episode.
+struct Transition {
+    std::vector<float> state;
+    uint32_t action = 0;
+    float reward = 0.0f;
+    std::vector<float> next_state;
+    bool done = false;
+};
+
+// Fixed-capacity ring of transitions that any number of rollout threads
+// write and any number of learner threads sample without locks. A writer
+// claims the next slot with one fetch_add and, once the ring is full,
+// overwrites the oldest transition. Each slot carries a sequence number
+// that is odd while the slot is being written (a seqlock), so a sampler
+// that raced a writer notices and picks again instead of returning a torn
+// transition.
+class ReplayBuffer {
+public:
+    ReplayBuffer(size_t capacity, size_t observation_size);
+
+    ReplayBuffer(const ReplayBuffer &) = delete;
+    ReplayBuffer &operator=(const ReplayBuffer &) = delete;
+
+    void push(const float *state, uint32_t action, float reward, const float *next_state,
+              bool done);
+    // Copies a uniformly chosen stored transition into out; false while
+    // the buffer is empty.
+    bool sample(std::mt19937_64 &rng, Transition &out) const;
+
+    size_t size() const;
+    size_t capacity() const { return slot_count; }
+    size_t observation_size() const { return width; }
+
+private:
+    // Per slot: state, next_state, then reward, action and done as floats.
+    size_t stride() const { return 2 * width + 3; }
+
+    size_t slot_count;
+    size_t width;
+    std::atomic<uint64_t> written{0};
+    std::unique_ptr<std::atomic<uint64_t>[]> versions;
+    std::unique_ptr<float[]> data;
+};
+
+#endif // REPLAY_BUFFER_H
@@ -0,0 +1,183 @@
+#include <iostream>
+#include <string>
+#include <algorithm>
+#include "work_stealing_pool.h"
+
+namespace {
+
+// The pool and deque index of the worker running on this thread, if any.
+thread_local const void *current_pool = nullptr;
+thread_local size_t current_index = 0;
+
+} // namespace
+
+bool WorkStealingPool::Deque::push(Task *task) {
+    int64_t b = bottom.load(std::memory_order_relaxed);
+    int64_t t = top.load(std::memory_order_acquire);
+    if (b - t >= kCapacity) {
+        return false;
+    }
+    slots[b % kCapacity].store(task, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom.store(b + 1, std::memory_order_relaxed);
+    return true;
+}
+
+WorkStealingPool::Task *WorkStealingPool::Deque::pop() {
+    int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+    bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = top.load(std::memory_order_relaxed);
+    if (t > b) {
+        bottom.store(b + 1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    Task *task = slots[b % kCapacity].load(std::memory_order_relaxed);
+    if (t == b) {
+        // The last task: race any thief for it.
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                         std::memory_order_relaxed)) {
+            task = nullptr;
+        }
+        bottom.store(b + 1, std::memory_order_relaxed);
+    }
+    return task;
+}
+
+WorkStealingPool::Task *WorkStealingPool::Deque::steal() {
+    int64_t t = top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = bottom.load(std::memory_order_acquire);
+    if (t >= b) {
+        return nullptr;
+    }
+    Task *task = slots[t % kCapacity].load(std::memory_order_relaxed);
+    if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                     std::memory_order_relaxed)) {
+        return nullptr;
+    }
+    return task;
+}
+
+WorkStealingPool::WorkStealingPool(size_t threads) {
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (size_t i = 0; i < threads; ++i) {
+        deques.push_back(std::make_unique<Deque>());
+    }
+    for (size_t i = 0; i < threads; ++i) {
+        workers.emplace_back([this, i] { worker_loop(i); });
+    }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+    for (Task *task : shared) {
+        delete task;
+    }
+}
+
+void WorkStealingPool::enqueue(Task *task) {
+    // Counted first, so a thief never sees a task it was not told about.
+    queued.fetch_add(1, std::memory_order_release);
+    bool local = current_pool == this && deques[current_index]->push(task);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!local) {
+            shared.push_back(task);
+        }
+    }
+    wake.notify_one();
+}
+
+void WorkStealingPool::submit(std::function<void()> task) {
+    enqueue(new Task{std::move(task)});
+}
+
+WorkStealingPool::Task *WorkStealingPool::find_task(size_t index) {
+    Task *task = nullptr;
+    if (index < deques.size()) {
+        task = deques[index]->pop();
+    }
+    if (!task && queued.load(std::memory_order_acquire) > 0) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!shared.empty()) {
+                task = shared.front();
+                shared.pop_front();
+            }
+        }
+        // Start the search at a neighbour so thieves spread out.
+        for (size_t k = 1; !task && k <= deques.size(); ++k) {
+            task = deques[(index + k) % deques.size()]->steal();
+        }
+    }
+    if (task) {
+        queued.fetch_sub(1, std::memory_order_relaxed);
+    }
+    return task;
+}
+
+void WorkStealingPool::worker_loop(size_t index) {
+    current_pool = this;
+    current_index = index;
+    while (true) {
+        if (Task *task = find_task(index)) {
+            task->run();
+            delete task;
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        wake.wait(lock, [this] {
+            return stopping || queued.load(std::memory_order_acquire) > 0;
+        });
+        if (stopping) {
+            return;
+        }
+    }
+}
+
+void WorkStealingPool::parallel_for(size_t count, size_t grain,
+                                    const std::function<void(size_t)> &body) {
+    if (count == 0) {
+        return;
+    }
+    // A few chunks per worker leave room for stealing to even things out.
+    size_t chunk = std::max<size_t>({1, grain, count / (workers.size() * 4)});
+    size_t chunks = (count + chunk - 1) / chunk;
+    // Shared, since the last task still notifies after the caller may have
+    // seen the count reach zero and returned.
+    auto remaining = std::make_shared<std::atomic<size_t>>(chunks);
+    for (size_t c = 0; c < chunks; ++c) {
+        size_t begin = c * chunk;
+        size_t end = std::min(count, begin + chunk);
+        enqueue(new Task{[&body, remaining, begin, end] {
+            for (size_t i = begin; i < end; ++i) {
+                body(i);
+            }
+            if (remaining->fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                remaining->notify_all();
+            }
+        }});
+    }
+
+    size_t index = current_pool == this ? current_index : deques.size();
+    size_t left;
+    while ((left = remaining->load(std::memory_order_acquire)) > 0) {
+        if (Task *task = find_task(index)) {
+            task->run();
+            delete task;
+        } else {
+            // Everything left is running on other threads.
+            remaining->wait(left, std::memory_order_acquire);
+        }
+    }
+}
@@ -0,0 +1,71 @@
+#ifndef WORK_STEALING_POOL_H
+#define WORK_STEALING_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Worker threads that each own a deque of tasks. A worker pushes and pops
+// tasks at one end of its own deque without locking, and a worker that runs
+// dry steals from the other end of someone else's, so tasks of uneven
+// length (rollouts that end early, shards of different cost) keep every
+// core busy. Tasks submitted from outside the pool go through a shared
+// queue. Unlike ComputePool, tasks may submit more tasks and wait on them.
+class WorkStealingPool {
+public:
+    // 0 means one worker per hardware thread.
+    explicit WorkStealingPool(size_t threads = 0);
+    ~WorkStealingPool();
+
+    WorkStealingPool(const WorkStealingPool &) = delete;
+    WorkStealingPool &operator=(const WorkStealingPool &) = delete;
+
+    size_t size() const { return workers.size(); }
+
+    void submit(std::function<void()> task);
+    // Calls body(i) for every i < count across the pool, in chunks of at
+    // least grain, and returns when all calls are done. The calling thread
+    // runs tasks while it waits, so this may be nested inside a task.
+    void parallel_for(size_t count, size_t grain, const std::function<void(size_t)> &body);
+
+private:
+    struct Task {
+        std::function<void()> run;
+    };
+
+    // Chase-Lev deque of fixed capacity; the owner uses push() and pop(),
+    // anyone may steal().
+    class Deque {
+    public:
+        bool push(Task *task);
+        Task *pop();
+        Task *steal();
+
+    private:
+        static constexpr int64_t kCapacity = 1024;
+        std::atomic<int64_t> top{0};
+        std::atomic<int64_t> bottom{0};
+        std::atomic<Task *> slots[kCapacity] = {};
+    };
+
+    void worker_loop(size_t index);
+    Task *find_task(size_t index);
+    void enqueue(Task *task);
+
+    std::vector<std::unique_ptr<Deque>> deques;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<Task *> shared;
+    std::atomic<size_t> queued{0};
+    bool stopping = false;
+    std::vector<std::thread> workers;
+};
+
+#endif // WORK_STEALING_POOL_H
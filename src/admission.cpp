@@ -0,0 +1,129 @@
+#include <iostream>
+#include <string>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include "../include/admission.h"
+
+namespace {
+
+// Peers without connections are only forgotten in bulk, once the table has
+// grown past what the connection limit can explain.
+constexpr size_t kPeerTableSlack = 1024;
+
+void read_env(const char *name, size_t &value) {
+    if (const char *text = std::getenv(name)) {
+        value = std::strtoull(text, nullptr, 10);
+    }
+}
+
+void read_env(const char *name, uint32_t &value) {
+    if (const char *text = std::getenv(name)) {
+        value = static_cast<uint32_t>(std::strtoul(text, nullptr, 10));
+    }
+}
+
+} // namespace
+
+uint64_t monotonic_ms() {
+    using namespace std::chrono;
+    return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+TokenBucket::TokenBucket(double rate, double burst)
+    : rate(rate), burst(std::max(burst, 1.0)), tokens(this->burst), updated(monotonic_ms()) {}
+
+bool TokenBucket::take(uint64_t now) {
+    if (rate <= 0) {
+        return true;
+    }
+    if (now > updated) {
+        tokens = std::min(burst, tokens + (now - updated) * rate / 1000.0);
+        updated = now;
+    }
+    if (tokens < 1.0) {
+        return false;
+    }
+    tokens -= 1.0;
+    return true;
+}
+
+bool TokenBucket::full(uint64_t now) const {
+    return rate <= 0 || tokens + (now > updated ? now - updated : 0) * rate / 1000.0 >= burst;
+}
+
+ConnectionLimits connection_limits_from_env() {
+    ConnectionLimits limits;
+    read_env("SVAKLA_MAX_CONNECTIONS", limits.max_connections);
+    read_env("SVAKLA_MAX_CONNECTIONS_PER_IP", limits.max_connections_per_ip);
+    if (const char *rate = std::getenv("SVAKLA_CONNECTION_RATE")) {
+        limits.connection_rate_per_ip = std::strtod(rate, nullptr);
+        limits.connection_burst_per_ip = 2 * limits.connection_rate_per_ip;
+    }
+    if (const char *rate = std::getenv("SVAKLA_REQUEST_RATE")) {
+        limits.request_rate = std::strtod(rate, nullptr);
+        limits.request_burst = 2 * limits.request_rate;
+    }
+    read_env("SVAKLA_IDLE_TIMEOUT_MS", limits.idle_timeout_ms);
+    read_env("SVAKLA_REQUEST_TIMEOUT_MS", limits.request_timeout_ms);
+    return limits;
+}
+
+bool AdmissionControl::admit(uint32_t address, uint64_t now) {
+    std::lock_guard<std::mutex> lock(mutex);
+    bool admitted = false;
+    if (active_count < config.max_connections &&
+        buffered.load(std::memory_order_relaxed) <= config.max_buffered_bytes) {
+        if (peers.size() >= config.max_connections + kPeerTableSlack) {
+            prune(now);
+        }
+        auto peer = peers.find(address);
+        if (peer == peers.end()) {
+            peer = peers.emplace(address, Peer{0, TokenBucket(config.connection_rate_per_ip,
+                                                              config.connection_burst_per_ip)})
+                       .first;
+        }
+        if (peer->second.connections < config.max_connections_per_ip &&
+            peer->second.accepts.take(now)) {
+            ++peer->second.connections;
+            ++active_count;
+            admitted = true;
+        }
+    }
+    if (!admitted) {
+        rejected_count.fetch_add(1, std::memory_order_relaxed);
+    }
+    return admitted;
+}
+
+void AdmissionControl::release(uint32_t address) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto peer = peers.find(address);
+    if (peer != peers.end() && peer->second.connections > 0) {
+        --peer->second.connections;
+        --active_count;
+    }
+}
+
+void AdmissionControl::update_buffered(size_t previous, size_t current) {
+    if (current >= previous) {
+        buffered.fetch_add(current - previous, std::memory_order_relaxed);
+    } else {
+        buffered.fetch_sub(previous - current, std::memory_order_relaxed);
+    }
+}
+
+size_t AdmissionControl::active() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return active_count;
+}
+
+void AdmissionControl::prune(uint64_t now) {
+    for (auto peer = peers.begin(); peer != peers.end();) {
+        if (peer->second.connections == 0 && peer->second.accepts.full(now)) {
+            peer = peers.erase(peer);
+        } else {
+            ++peer;
+        }
+    }
+}
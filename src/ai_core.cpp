@@ -1,54 +1,486 @@
 #include <iostream>
 #include <string>
+#include <cerrno>
+#include <cstdlib>
+#include <span>
 #include <vector>
-#include <unordered_map>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include "../include/ai_core.h"
 #include "../include/openssl_init.h"
+#include "../include/tensor_ops.h"
+#include "../include/wal.h"
+#include "../model/reinforcement_learning.h"
 
-class Tokenizer {
-public:
-    std::vector<std::string> tokenize(const std::string &text) {
-        // Tokenization logic here
-        return {};
+namespace {
+
+void read_env(const char *name, size_t &value) {
+    if (const char *text = std::getenv(name)) {
+        value = std::strtoull(text, nullptr, 10);
     }
-};
+}
+
+// Width of the vectors contexts are recalled by, and the number of token
+// vectors; token IDs share them modulo kRecallRows, which keeps the table
+// at 2 MB whatever the vocabulary.
+constexpr size_t kRecallDim = 128;
+constexpr size_t kRecallRows = 4096;
+
+uint64_t splitmix64(uint64_t &state) {
+    uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+// Length field of the record the memory texts get each time the index is
+// saved; every text before it is in the saved index.
+constexpr uint64_t kIndexSaved = ~0ull;
+// Saves between rewrites of the memory index.
+constexpr size_t kIndexCheckpointSaves = 1024;
 
-class Vectorizer {
-public:
-    std::vector<float> vectorize(const std::vector<std::string> &tokens) {
-        // Vectorization logic here
-        return {};
+bool write_fd(int fd, uint64_t offset, const void *data, size_t size) {
+    const char *bytes = static_cast<const char *>(data);
+    while (size > 0) {
+        ssize_t written = pwrite(fd, bytes, size, static_cast<off_t>(offset));
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        bytes += written;
+        offset += static_cast<uint64_t>(written);
+        size -= static_cast<size_t>(written);
     }
-};
+    return true;
+}
 
-class ContextMemoryManager {
-public:
-    void save_context(const std::string &context) {
-        // Save context logic here
+// Name of the function generate_logic() emits.
+constexpr char kLogicSymbol[] = "svakla_logic";
+
+} // namespace
+
+void ContextMemoryManager::configure_recall(const Tokenizer &tokenizer) {
+    EmbeddingTable table(kRecallRows, kRecallDim);
+    for (uint32_t id = 0; id < table.rows(); ++id) {
+        uint64_t state = id;
+        float *row = table.row(id);
+        for (size_t i = 0; i < kRecallDim; ++i) {
+            // Uniform in [-1, 1) from the top 24 bits.
+            row[i] = static_cast<float>(splitmix64(state) >> 40) / (1 << 23) - 1.0f;
+        }
     }
+    std::lock_guard<std::mutex> lock(texts_mutex);
+    recall_tokenizer = &tokenizer;
+    vectorizer = Vectorizer(std::move(table));
+    if (memories.dim() != kRecallDim) {
+        memories.init(kRecallDim);
+    }
+}
 
-    std::string load_context() {
-        // Load context logic here
-        return "";
+ContextMemoryManager::~ContextMemoryManager() {
+    flush_memories();
+    if (texts_fd >= 0) {
+        ::close(texts_fd);
+    }
+}
+
+bool ContextMemoryManager::open_memories(const std::string &path) {
+    std::lock_guard<std::mutex> lock(texts_mutex);
+    std::string texts_path = path + ".text";
+    int fd = ::open(texts_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        std::cerr << "Unable to open memory texts: " << texts_path << std::endl;
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        return false;
+    }
+    uint64_t file_size = static_cast<uint64_t>(info.st_size);
+    bool indexed = stat(path.c_str(), &info) == 0;
+    if (indexed && !memories.open(path)) {
+        ::close(fd);
+        return false;
+    }
+    if (indexed && memories.dim() != kRecallDim) {
+        std::cerr << "Memory index " << path << " holds " << memories.dim()
+                  << "-dimensional vectors, not " << kRecallDim << std::endl;
+        memories.init(kRecallDim);
+        ::close(fd);
+        return false;
+    }
+
+    // Only the lengths are read: the texts stay on disk. Those after the
+    // last checkpoint, or all of them without an index, are indexed again.
+    std::vector<uint64_t> unindexed;
+    uint64_t offset = 0;
+    uint64_t length = 0;
+    while (pread(fd, &length, sizeof(length), static_cast<off_t>(offset)) ==
+           static_cast<ssize_t>(sizeof(length))) {
+        if (length == kIndexSaved) {
+            unindexed.clear();
+            offset += sizeof(length);
+            continue;
+        }
+        if (length > file_size - offset - sizeof(length)) {
+            break;
+        }
+        unindexed.push_back(offset);
+        offset += sizeof(length) + length;
+    }
+    // Drop a record cut short by a crash, so the next one follows the last
+    // whole record.
+    if (ftruncate(fd, static_cast<off_t>(offset)) != 0) {
+        std::cerr << "Unable to trim memory texts: " << texts_path << std::endl;
+    }
+    if (texts_fd >= 0) {
+        ::close(texts_fd);
     }
-};
+    texts_fd = fd;
+    texts_end = offset;
+    memories_path = path;
+    unsaved = 0;
+    if (!indexed) {
+        memories.init(kRecallDim);
+    }
+    std::string text;
+    for (uint64_t record : unindexed) {
+        AlignedFloats row;
+        if (read_text(record, text) && embed(text, row) &&
+            memories.insert(record, row.get(), kRecallDim)) {
+            ++unsaved;
+        }
+    }
+    return true;
+}
+
+bool ContextMemoryManager::embed(const std::string &text, AlignedFloats &row) const {
+    if (!recall_tokenizer) {
+        return false;
+    }
+    std::vector<uint32_t> ids = recall_tokenizer->tokenize(text);
+    if (ids.empty()) {
+        return false;
+    }
+    for (uint32_t &id : ids) {
+        id %= kRecallRows;
+    }
+    row = allocate_aligned_floats(vectorizer.stride());
+    std::span<const uint32_t> batch[1] = {ids};
+    vectorizer.vectorize(batch, row.get());
+    return true;
+}
+
+bool ContextMemoryManager::read_text(uint64_t offset, std::string &text) const {
+    uint64_t length = 0;
+    if (texts_fd < 0 || offset + sizeof(length) > texts_end ||
+        pread(texts_fd, &length, sizeof(length), static_cast<off_t>(offset)) !=
+            static_cast<ssize_t>(sizeof(length)) ||
+        length > texts_end - offset - sizeof(length)) {
+        return false;
+    }
+    text.resize(length);
+    return pread(texts_fd, text.data(), length, static_cast<off_t>(offset + sizeof(length))) ==
+           static_cast<ssize_t>(length);
+}
 
-class DynamicLogicGenerator {
-public:
-    void generate_logic() {
-        // Dynamic logic generation logic here
+bool ContextMemoryManager::append_text(const std::string &text) {
+    uint64_t length = text.size();
+    std::string record(reinterpret_cast<const char *>(&length), sizeof(length));
+    record += text;
+    if (!write_fd(texts_fd, texts_end, record.data(), record.size()) ||
+        fdatasync(texts_fd) != 0) {
+        std::cerr << "Unable to save memory text: " << memories_path << ".text" << std::endl;
+        // Leave nothing a later open would take for a record.
+        if (ftruncate(texts_fd, static_cast<off_t>(texts_end)) != 0) {
+            std::cerr << "Unable to trim memory texts" << std::endl;
+        }
+        return false;
     }
-};
+    return true;
+}
 
-class AIEngine {
-public:
-    void train_model() {
-        // Model training logic here
+bool ContextMemoryManager::checkpoint_locked() {
+    if (unsaved == 0 || memories_path.empty()) {
+        return true;
+    }
+    // The marker goes after the index is in place, so a crash in between
+    // only indexes the same texts again on open.
+    uint64_t marker = kIndexSaved;
+    if (!memories.save(memories_path) ||
+        !write_fd(texts_fd, texts_end, &marker, sizeof(marker)) || fdatasync(texts_fd) != 0) {
+        std::cerr << "Unable to save memory index: " << memories_path << std::endl;
+        return false;
+    }
+    texts_end += sizeof(marker);
+    unsaved = 0;
+    return true;
+}
+
+bool ContextMemoryManager::flush_memories() {
+    std::lock_guard<std::mutex> lock(texts_mutex);
+    return checkpoint_locked();
+}
+
+bool ContextMemoryManager::save_context(const std::string &context) {
+    std::lock_guard<std::mutex> lock(texts_mutex);
+    AlignedFloats row;
+    if (!embed(context, row)) {
+        return false;
+    }
+    // The same text embeds to the same vector, so it is the nearest match.
+    std::string text;
+    for (const HnswMatch &match : memories.search(row.get(), kRecallDim, 1)) {
+        if (match.similarity > 0.9999f && read_text(match.key, text) && text == context) {
+            return true;
+        }
+    }
+    if (memories_path.empty()) {
+        std::cerr << "No memory file is open" << std::endl;
+        return false;
+    }
+    // A text is keyed by where its record starts.
+    uint64_t key = texts_end;
+    if (!append_text(context)) {
+        return false;
+    }
+    if (!memories.insert(key, row.get(), kRecallDim)) {
+        if (ftruncate(texts_fd, static_cast<off_t>(texts_end)) != 0) {
+            std::cerr << "Unable to trim memory texts" << std::endl;
+        }
+        return false;
     }
+    texts_end += sizeof(uint64_t) + context.size();
+    if (++unsaved >= kIndexCheckpointSaves) {
+        checkpoint_locked();
+    }
+    return true;
+}
 
-    std::string generate_response(const std::string &input) {
-        // Response generation logic here
+std::string ContextMemoryManager::load_context(const std::string &query) const {
+    std::lock_guard<std::mutex> lock(texts_mutex);
+    AlignedFloats row;
+    if (!embed(query, row)) {
         return "";
     }
-};
+    std::string text;
+    for (const HnswMatch &match : memories.search(row.get(), kRecallDim, 1)) {
+        if (read_text(match.key, text)) {
+            return text;
+        }
+    }
+    return "";
+}
+
+bool ContextMemoryManager::configure(const ModelConfig &config) {
+    KvCacheOptions options;
+    options.layers = config.layers;
+    options.kv_dim = config.kv_dim();
+    size_t budget_mb = options.memory_budget >> 20;
+    read_env("SVAKLA_KV_BUDGET_MB", budget_mb);
+    options.memory_budget = budget_mb << 20;
+    const char *spill_dir = std::getenv("SVAKLA_KV_SPILL_DIR");
+    if (!spill_dir) {
+        spill_dir = std::getenv("TMPDIR");
+    }
+    options.spill_dir = spill_dir ? spill_dir : "/var/tmp";
+    if (options.spill_dir == "none") {
+        options.spill_dir.clear();
+    }
+    return blocks.init(options);
+}
+
+void DynamicLogicGenerator::generate_logic(const std::string &expression, Callback done) {
+    if (expression.empty() ||
+        expression.find_first_of("{};\"'#\\\n") != std::string::npos) {
+        done(nullptr, nullptr, "Expression is not a single C expression");
+        return;
+    }
+    std::string source = "#include <math.h>\n"
+                         "double " + std::string(kLogicSymbol) +
+                         "(const double *x) {\n    return (" + expression + ");\n}\n";
+    compile_cache().load(source, {"-O2"},
+                         [done = std::move(done)](std::shared_ptr<CompiledModule> module,
+                                                  const std::string &error) {
+        if (!module) {
+            done(nullptr, nullptr, error);
+            return;
+        }
+        auto function = reinterpret_cast<GeneratedLogic>(module->symbol(kLogicSymbol));
+        if (!function) {
+            done(nullptr, nullptr, "Generated module lacks " + std::string(kLogicSymbol));
+            return;
+        }
+        done(function, std::move(module), "");
+    });
+}
+
+CompileCache &DynamicLogicGenerator::compile_cache() {
+    std::call_once(cache_created, [this] {
+        CompileCacheOptions options;
+        if (const char *directory = std::getenv("SVAKLA_COMPILE_CACHE")) {
+            options.directory = directory;
+        } else {
+            const char *temp = std::getenv("TMPDIR");
+            options.directory = std::string(temp ? temp : "/var/tmp") + "/svakla-compile-" +
+                                std::to_string(geteuid());
+        }
+        if (const char *compiler = std::getenv("SVAKLA_CC")) {
+            options.compiler = compiler;
+        }
+        size_t limit_mb = options.max_bytes >> 20;
+        read_env("SVAKLA_COMPILE_CACHE_MB", limit_mb);
+        options.max_bytes = static_cast<uint64_t>(limit_mb) << 20;
+        cache = std::make_unique<CompileCache>(options);
+    });
+    return *cache;
+}
+
+AIEngine::AIEngine() {
+    read_env("SVAKLA_CONTEXT", context_tokens);
+    read_env("SVAKLA_MAX_TOKENS", max_reply_tokens);
+    read_env("SVAKLA_BATCH", batching.max_batch);
+    read_env("SVAKLA_PREFILL_CHUNK", batching.prefill_chunk);
+    size_t prefix_mb = batching.prefix_cache_bytes >> 20;
+    read_env("SVAKLA_PREFIX_CACHE_MB", prefix_mb);
+    batching.prefix_cache_bytes = prefix_mb << 20;
+    if (const char *temperature = std::getenv("SVAKLA_TEMPERATURE")) {
+        sampling.temperature = std::strtof(temperature, nullptr);
+    }
+    if (const char *path = std::getenv("SVAKLA_TOKENIZER")) {
+        tokenizer.load(path);
+    }
+    memory.configure_recall(tokenizer);
+    if (const char *path = std::getenv("SVAKLA_MEMORY_INDEX")) {
+        memory.open_memories(path);
+    }
+    if (const char *path = std::getenv("SVAKLA_MODEL")) {
+        load_model(path);
+    }
+}
+
+bool AIEngine::load_model(const std::string &path) {
+    // The scheduler runs the transformer, which points into the mapping
+    // that is about to be replaced.
+    scheduler.reset();
+    transformer = TransformerModel();
+    if (!model.open(path)) {
+        return false;
+    }
+    const char *verify = std::getenv("SVAKLA_VERIFY_WEIGHTS");
+    if (verify && std::string(verify) == "1" && !model.verify_all()) {
+        model.close();
+        return false;
+    }
+    if (!transformer.load(model) || !memory.configure(transformer.config())) {
+        transformer = TransformerModel();
+        model.close();
+        return false;
+    }
+    // Prompts would tokenize to IDs the model has no embedding for, and the
+    // forward pass rejects every batch that holds one.
+    if (tokenizer.vocab_size() > transformer.config().vocab) {
+        std::cerr << "Tokenizer has " << tokenizer.vocab_size() << " tokens but the model only "
+                  << transformer.config().vocab << std::endl;
+        transformer = TransformerModel();
+        model.close();
+        return false;
+    }
+    if (!pool) {
+        size_t threads = 0;
+        read_env("SVAKLA_THREADS", threads);
+        pool = std::make_unique<ComputePool>(threads);
+    }
+    const ModelConfig &config = transformer.config();
+    batching.context_tokens = context_tokens;
+    scheduler = std::make_unique<GenerationScheduler>(transformer, tokenizer, memory.kv_cache(),
+                                                      *pool, batching);
+    std::cout << "Loaded model " << path << ": " << config.layers << " layers, width "
+              << config.dim << ", vocabulary " << config.vocab << ", " << pool->size()
+              << " threads, " << tensor_ops_isa() << " kernels" << std::endl;
+    return true;
+}
+
+void AIEngine::train_model() {
+    TrainingOptions options;
+    read_env("SVAKLA_THREADS", options.threads);
+    read_env("SVAKLA_TRAIN_ITERATIONS", options.iterations);
+    read_env("SVAKLA_TRAIN_ENVIRONMENTS", options.environments);
+    if (const char *path = std::getenv("SVAKLA_TRAIN_CHECKPOINT")) {
+        options.checkpoint_path = path;
+        options.resume = true;
+    }
+    std::cout << "Training the CartPole demo agent; the language model is not changed"
+              << std::endl;
+    TrainingReport report;
+    if (!train_agent(options, report)) {
+        std::cerr << "Training failed" << std::endl;
+        return;
+    }
+    std::cout << "Demo agent trained " << report.updates << " updates over " << report.env_steps
+              << " environment steps on " << report.threads << " threads in "
+              << report.seconds << " s; mean return " << report.mean_return << " over the last "
+              << "100 of " << report.episodes << " episodes" << std::endl;
+}
+
+std::string AIEngine::generate_response(const std::string &input) {
+    std::string response;
+    generate_response_stream(input, [&response](std::string_view token) {
+        response.append(token);
+        return true;
+    });
+    return response;
+}
+
+void AIEngine::generate_response_stream(const std::string &input, const TokenCallback &on_token,
+                                        GenerationPriority priority) {
+    std::shared_ptr<Generation> generation = start_generation(input, nullptr, priority);
+    if (!generation) {
+        return;
+    }
+    std::string text;
+    while (generation->next(text)) {
+        if (!on_token(text)) {
+            generation->cancel();
+            return;
+        }
+        text.clear();
+    }
+}
+
+std::shared_ptr<Generation> AIEngine::start_generation(const std::string &input,
+                                                       std::function<void()> on_text,
+                                                       GenerationPriority priority) {
+    if (!ready()) {
+        std::cerr << "No model loaded; set SVAKLA_MODEL" << std::endl;
+        return nullptr;
+    }
+    std::vector<uint32_t> prompt = tokenizer.tokenize(input);
+    // Keep the end of an oversized prompt and leave room for the reply.
+    size_t reply_room = std::min(max_reply_tokens, context_tokens / 2);
+    if (prompt.size() + reply_room > context_tokens) {
+        prompt.erase(prompt.begin(), prompt.end() - (context_tokens - reply_room));
+    }
+
+    GenerationParams params;
+    params.max_tokens = max_reply_tokens;
+    params.sampling = sampling;
+    params.priority = priority;
+    params.on_text = std::move(on_text);
+    return scheduler->submit(std::move(prompt), params);
+}
+
+// Replies are generated by the engine behind the WebSocket server, which
+// maps the model on its first prompt; this only reports what it will load.
+void run_ai_core() {
+    if (const char *path = std::getenv("SVAKLA_MODEL")) {
+        std::cout << "AI engine model: " << path << std::endl;
+    } else {
+        std::cout << "No model configured; set SVAKLA_MODEL" << std::endl;
+    }
+}
@@ -1,56 +1,196 @@
 #include <iostream>
 #include <string>
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <cstdlib>
+#include <sys/stat.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <unistd.h>
-#include <cstring>
+#include "../include/auth_middleware.h"
+#include "../include/event_loop.h"
+#include "../include/http.h"
+#include "../include/json.h"
+#include "../include/local_memory_storage.h"
 #include "../include/openssl_init.h"
+#include "../include/server_runtime.h"
+#include "chat_storage.h"
 
-void handle_client(int client_socket) {
-    const char *response = "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n\r\n{\"message\": \"API Server\"}";
-    send(client_socket, response, strlen(response), 0);
-    close(client_socket);
+namespace {
+
+constexpr size_t kDefaultSearchHits = 20;
+constexpr size_t kMaxSearchHits = 1000;
+constexpr size_t kDefaultHistoryMessages = 50;
+constexpr size_t kMaxHistoryMessages = 1000;
+constexpr size_t kMaxContextName = 64;
+
+// Directory of the contexts /context reads and writes.
+std::string context_dir() {
+    const char *directory = std::getenv("SVAKLA_CONTEXT_DIR");
+    return directory && *directory ? directory : "contexts";
 }
 
-void start_server(int port) {
-    int server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket < 0) {
-        std::cerr << "Error creating socket" << std::endl;
+// Reads the limit=N query parameter, capped at most; answers 400 through
+// reply and returns false if it is not a whole number.
+bool read_limit(const HttpRequest &request, size_t most, size_t &limit, HttpReply &reply) {
+    std::string text;
+    if (http_query_param(request.query, "limit", text)) {
+        const char *end = text.data() + text.size();
+        auto [stop, error] = std::from_chars(text.data(), end, limit);
+        if (text.empty() || error != std::errc() || stop != end) {
+            HttpResponse response;
+            response.status = 400;
+            response.body = "limit must be a whole number";
+            reply(std::move(response));
+            return false;
+        }
+    }
+    limit = std::min(limit, most);
+    return true;
+}
+
+// POST /search: the body is the query, a limit=N query parameter caps the
+// hits. The search runs on a storage thread and the reply comes back to
+// the loop.
+void handle_search(const HttpRequest &request, HttpReply reply) {
+    size_t limit = kDefaultSearchHits;
+    if (!read_limit(request, kMaxSearchHits, limit, reply)) {
         return;
     }
+    searchChatsAsync(std::string(request.body), limit,
+                     [reply = std::move(reply)](std::vector<ChatSearchHit> hits) {
+        std::string body = "{\"hits\":[";
+        bool first = true;
+        for (const ChatSearchHit &hit : hits) {
+            body += first ? "{\"chat\":" : ",{\"chat\":";
+            append_json_string(body, hit.chat);
+            body += ",\"sequence\":" + std::to_string(hit.sequence);
+            body += ",\"score\":" + std::to_string(hit.score) + "}";
+            first = false;
+        }
+        body += "]}";
+        HttpResponse response;
+        response.content_type = "application/json";
+        response.body = std::move(body);
+        reply(std::move(response));
+    });
+}
 
-    struct sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(port);
+// POST /history: the body names a chat, whose last messages (limit=N of
+// them) come back oldest first. Their records are read as one batch.
+void handle_history(const HttpRequest &request, HttpReply reply) {
+    size_t limit = kDefaultHistoryMessages;
+    if (!read_limit(request, kMaxHistoryMessages, limit, reply)) {
+        return;
+    }
+    if (request.body.empty()) {
+        HttpResponse response;
+        response.status = 400;
+        response.body = "The body must name a chat";
+        reply(std::move(response));
+        return;
+    }
+    loadRecentMessagesAsync(std::string(request.body), limit,
+                            [reply = std::move(reply)](std::vector<std::string> messages) {
+        std::string body = "{\"messages\":[";
+        for (size_t i = 0; i < messages.size(); ++i) {
+            if (i > 0) {
+                body.push_back(',');
+            }
+            append_json_string(body, messages[i]);
+        }
+        body += "]}";
+        HttpResponse response;
+        response.content_type = "application/json";
+        response.body = std::move(body);
+        reply(std::move(response));
+    });
+}
 
-    if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        std::cerr << "Error binding socket" << std::endl;
-        close(server_socket);
+// The file of the context named by the name=... query parameter, or empty
+// (after answering 400) unless the name is 1 to 64 letters, digits, '-' or
+// '_', so that it cannot leave the context directory.
+std::string context_file(const HttpRequest &request, HttpReply &reply) {
+    std::string name;
+    bool valid = http_query_param(request.query, "name", name) && !name.empty() &&
+                 name.size() <= kMaxContextName &&
+                 std::all_of(name.begin(), name.end(), [](char c) {
+                     return std::isalnum(static_cast<unsigned char>(c)) || c == '-' || c == '_';
+                 });
+    if (!valid) {
+        HttpResponse response;
+        response.status = 400;
+        response.body = "name must be 1 to 64 letters, digits, '-' or '_'";
+        reply(std::move(response));
+        return "";
+    }
+    return context_dir() + "/" + name + ".ctx";
+}
+
+// GET /context?name=...: the saved context, or 404 if there is none.
+void handle_load_context(const HttpRequest &request, HttpReply reply) {
+    std::string file = context_file(request, reply);
+    if (file.empty()) {
         return;
     }
+    load_context_async(file, [reply = std::move(reply)](bool loaded, std::string context) {
+        HttpResponse response;
+        if (loaded) {
+            response.body = std::move(context);
+        } else {
+            response.status = 404;
+            response.body = "No such context";
+        }
+        reply(std::move(response));
+    });
+}
 
-    if (listen(server_socket, 3) < 0) {
-        std::cerr << "Error listening on socket" << std::endl;
-        close(server_socket);
+// PUT /context?name=...: replaces the context with the body, encrypted.
+void handle_save_context(const HttpRequest &request, HttpReply reply) {
+    std::string file = context_file(request, reply);
+    if (file.empty()) {
         return;
     }
+    save_context_async(file, std::string(request.body), [reply = std::move(reply)](bool saved) {
+        HttpResponse response;
+        if (saved) {
+            response.status = 204;
+        } else {
+            response.status = 500;
+            response.body = "Unable to save the context";
+        }
+        reply(std::move(response));
+    });
+}
 
-    std::cout << "API server listening on port " << port << std::endl;
+void handle_client(Connection &conn) {
+    static const HttpRouter router = [] {
+        HttpRouter routes;
+        routes.set_fallback([](const HttpRequest &, HttpResponse &response) {
+            response.content_type = "application/json";
+            response.body = "{\"message\": \"API Server\"}";
+        });
+        routes.add_async("POST", "/search", handle_search);
+        routes.add_async("POST", "/history", handle_history);
+        routes.add_async("GET", "/context", handle_load_context);
+        routes.add_async("PUT", "/context", handle_save_context);
+        install_auth(routes, auth_service());
+        return routes;
+    }();
+    serve_http(conn, router);
+}
 
-    while (true) {
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
-        int client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &client_len);
-        if (client_socket < 0) {
-            std::cerr << "Error accepting connection" << std::endl;
-            continue;
-        }
+} // namespace
 
-        handle_client(client_socket);
+void register_api_server(ServerRuntime &runtime, int port) {
+    if (!runtime.add_service(port, handle_client)) {
+        return;
+    }
+    std::string contexts = context_dir();
+    if (mkdir(contexts.c_str(), 0700) != 0 && errno != EEXIST) {
+        std::cerr << "Unable to create context directory " << contexts << std::endl;
     }
 
-    close(server_socket);
+    std::cout << "API server listening on port " << port << std::endl;
 }
@@ -0,0 +1,591 @@
+#include <iostream>
+#include <string>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "../include/async_io.h"
+#include "../include/thread_pool.h"
+
+namespace {
+
+// Longest transfer handed to the kernel at once; the rest follows as a
+// continuation like any short transfer.
+constexpr size_t kMaxTransfer = 1u << 30;
+
+// Runs one request to the end with plain system calls.
+void run_blocking(IoRequest &request) {
+    if (request.op == IoOp::Sync || request.op == IoOp::DataSync) {
+        int synced = request.op == IoOp::Sync ? fsync(request.fd) : fdatasync(request.fd);
+        request.result = synced == 0 ? 0 : -errno;
+        return;
+    }
+    char *bytes = static_cast<char *>(request.data);
+    size_t moved = 0;
+    while (moved < request.size) {
+        off_t at = static_cast<off_t>(request.offset + moved);
+        ssize_t step = request.op == IoOp::Read
+                           ? pread(request.fd, bytes + moved, request.size - moved, at)
+                           : pwrite(request.fd, bytes + moved, request.size - moved, at);
+        if (step < 0 && errno == EINTR) {
+            continue;
+        }
+        if (step < 0) {
+            request.result = -errno;
+            return;
+        }
+        if (step == 0) {
+            break;
+        }
+        moved += static_cast<size_t>(step);
+    }
+    request.result = static_cast<ssize_t>(moved);
+}
+
+bool is_transfer(const IoRequest &request) {
+    return request.op == IoOp::Read || request.op == IoOp::Write;
+}
+
+bool batch_succeeded(const std::vector<IoRequest> &requests) {
+    for (const IoRequest &request : requests) {
+        if (request.result < 0 ||
+            (is_transfer(request) && static_cast<size_t>(request.result) != request.size)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The fallback: a batch is split across the pool, so its requests still
+// run in parallel, up to one per thread.
+class ThreadBackend : public IoBackend {
+public:
+    explicit ThreadBackend(size_t threads) : pool(threads) {}
+
+    void submit(std::vector<IoRequest> requests, IoBatchDone done) override {
+        struct Batch {
+            std::vector<IoRequest> requests;
+            IoBatchDone done;
+            std::atomic<size_t> remaining{0};
+        };
+        auto batch = std::make_shared<Batch>();
+        batch->requests = std::move(requests);
+        batch->done = std::move(done);
+        size_t count = batch->requests.size();
+        size_t parts = std::max<size_t>(1, std::min(count, pool.size()));
+        batch->remaining = parts;
+        for (size_t part = 0; part < parts; ++part) {
+            pool.submit([batch, begin = count * part / parts, end = count * (part + 1) / parts] {
+                for (size_t i = begin; i < end; ++i) {
+                    run_blocking(batch->requests[i]);
+                }
+                if (--batch->remaining == 0) {
+                    batch->done(batch->requests);
+                }
+            });
+        }
+    }
+
+    // The caller works through the batch alongside the pool instead of
+    // sleeping, so a deferred task that waits for I/O cannot tie up every
+    // thread the I/O is queued behind.
+    bool run(std::vector<IoRequest> &requests) override {
+        struct Shared {
+            std::vector<IoRequest> *requests = nullptr;
+            size_t count = 0;
+            std::atomic<size_t> next{0};
+            std::mutex mutex;
+            std::condition_variable finished;
+            size_t done = 0;
+
+            // Runs unclaimed requests until none are left.
+            void work() {
+                size_t ran = 0;
+                for (size_t i = next++; i < count; i = next++) {
+                    run_blocking((*requests)[i]);
+                    ++ran;
+                }
+                if (ran > 0) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    done += ran;
+                    finished.notify_all();
+                }
+            }
+        };
+        auto shared = std::make_shared<Shared>();
+        shared->requests = &requests;
+        shared->count = requests.size();
+        size_t helpers = requests.empty() ? 0 : std::min(requests.size() - 1, pool.size());
+        for (size_t i = 0; i < helpers; ++i) {
+            pool.submit([shared] { shared->work(); });
+        }
+        shared->work();
+        std::unique_lock<std::mutex> lock(shared->mutex);
+        shared->finished.wait(lock, [&shared] { return shared->done == shared->count; });
+        return batch_succeeded(requests);
+    }
+
+    void defer(std::function<void()> task) override { pool.submit(std::move(task)); }
+    const char *name() const override { return "threads"; }
+
+private:
+    ThreadPool pool;
+};
+
+int ring_setup(unsigned entries, io_uring_params *params) {
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+int ring_enter(int fd, unsigned submit, unsigned wait, unsigned flags) {
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, submit, wait, flags, nullptr, 0));
+}
+
+int ring_register(int fd, unsigned opcode, const void *arg, unsigned count) {
+    return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, count));
+}
+
+// io_uring through the raw system calls. Submitters fill submission queue
+// entries under the mutex and push a whole batch with one io_uring_enter();
+// one reaper thread waits for completions, continues short transfers and
+// calls each batch's callback once its last request is done. Requests in
+// flight never exceed the completion queue, so none can be dropped.
+class UringBackend : public IoBackend {
+public:
+    explicit UringBackend(const IoBackendOptions &options);
+    ~UringBackend() override;
+
+    bool ready() const { return ring_fd >= 0; }
+
+    void submit(std::vector<IoRequest> requests, IoBatchDone done) override;
+    void defer(std::function<void()> task) override { workers->submit(std::move(task)); }
+    const char *name() const override { return "io_uring"; }
+
+private:
+    struct Batch;
+    struct Slot {
+        Batch *batch = nullptr;
+        size_t index = 0;
+        size_t moved = 0;
+        // Registered buffer the transfer goes through, or -1.
+        int buffer = -1;
+        iovec vector{};
+    };
+    struct Batch {
+        std::vector<IoRequest> requests;
+        std::vector<Slot> slots;
+        IoBatchDone done;
+        // Counted down by the reaper, and by a submitter failing requests
+        // that never reached the kernel.
+        std::atomic<size_t> remaining{0};
+    };
+
+    char *buffer_at(int buffer) const {
+        return buffers + static_cast<size_t>(buffer) * buffer_bytes;
+    }
+    io_uring_sqe &next_entry(uint64_t user_data);
+    void queue(Slot &slot);
+    void flush_queue();
+    void fail_withdrawn();
+    void complete(const io_uring_cqe &cqe);
+    void finish(Slot &slot, ssize_t result);
+    void reap_loop();
+
+    int ring_fd = -1;
+    void *ring_memory = nullptr;
+    size_t ring_bytes = 0;
+    io_uring_sqe *sqes = nullptr;
+    size_t sqes_bytes = 0;
+    unsigned *sq_tail = nullptr;
+    unsigned *sq_array = nullptr;
+    unsigned sq_mask = 0;
+    unsigned sq_entries = 0;
+    unsigned *cq_head = nullptr;
+    unsigned *cq_tail = nullptr;
+    io_uring_cqe *cqes = nullptr;
+    unsigned cq_mask = 0;
+    unsigned cq_entries = 0;
+
+    char *buffers = nullptr;
+    size_t buffer_bytes = 0;
+
+    std::mutex mutex;
+    std::condition_variable room;
+    // Entries written to the submission queue but not yet submitted.
+    unsigned queued = 0;
+    size_t in_flight = 0;
+    // Requests taken back from the submission queue after io_uring_enter()
+    // failed, with the negated errno they fail with; fail_withdrawn()
+    // completes them once the mutex is released.
+    std::vector<std::pair<Slot *, int>> withdrawn;
+    // The destructor's stop entry was withdrawn, so the reaper will never
+    // see it complete and stops on this instead.
+    std::atomic<bool> stop_withdrawn{false};
+    std::vector<int> free_buffers;
+    std::thread reaper;
+    std::unique_ptr<ThreadPool> workers;
+};
+
+UringBackend::UringBackend(const IoBackendOptions &options) {
+    io_uring_params params{};
+    int fd = ring_setup(std::max(options.queue_depth, 8u), &params);
+    if (fd < 0) {
+        return;
+    }
+    // Kernels before 5.4 map the two rings separately; they get the pool.
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        ::close(fd);
+        errno = ENOSYS;
+        return;
+    }
+    ring_bytes = std::max<size_t>(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                                  params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+    sqes_bytes = params.sq_entries * sizeof(io_uring_sqe);
+    void *rings = mmap(nullptr, ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       fd, IORING_OFF_SQ_RING);
+    void *entries = rings == MAP_FAILED ? MAP_FAILED
+                                        : mmap(nullptr, sqes_bytes, PROT_READ | PROT_WRITE,
+                                               MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (entries == MAP_FAILED) {
+        int error = errno;
+        if (rings != MAP_FAILED) {
+            munmap(rings, ring_bytes);
+        }
+        ::close(fd);
+        errno = error;
+        return;
+    }
+    ring_memory = rings;
+    sqes = static_cast<io_uring_sqe *>(entries);
+    char *base = static_cast<char *>(rings);
+    sq_tail = reinterpret_cast<unsigned *>(base + params.sq_off.tail);
+    sq_array = reinterpret_cast<unsigned *>(base + params.sq_off.array);
+    sq_mask = *reinterpret_cast<unsigned *>(base + params.sq_off.ring_mask);
+    sq_entries = params.sq_entries;
+    cq_head = reinterpret_cast<unsigned *>(base + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned *>(base + params.cq_off.tail);
+    cqes = reinterpret_cast<io_uring_cqe *>(base + params.cq_off.cqes);
+    cq_mask = *reinterpret_cast<unsigned *>(base + params.cq_off.ring_mask);
+    cq_entries = params.cq_entries;
+
+    // Without registered buffers (e.g. over RLIMIT_MEMLOCK) every transfer
+    // simply uses the caller's memory.
+    size_t count = std::min<size_t>(options.registered_buffers, UINT16_MAX);
+    void *memory = nullptr;
+    if (count > 0 && options.buffer_bytes > 0 &&
+        posix_memalign(&memory, 4096, count * options.buffer_bytes) == 0) {
+        std::vector<iovec> vectors(count);
+        for (size_t i = 0; i < count; ++i) {
+            vectors[i].iov_base = static_cast<char *>(memory) + i * options.buffer_bytes;
+            vectors[i].iov_len = options.buffer_bytes;
+        }
+        if (ring_register(fd, IORING_REGISTER_BUFFERS, vectors.data(),
+                          static_cast<unsigned>(count)) == 0) {
+            buffers = static_cast<char *>(memory);
+            buffer_bytes = options.buffer_bytes;
+            for (size_t i = count; i-- > 0;) {
+                free_buffers.push_back(static_cast<int>(i));
+            }
+        } else {
+            std::free(memory);
+        }
+    }
+
+    ring_fd = fd;
+    workers = std::make_unique<ThreadPool>(options.threads);
+    reaper = std::thread([this] { reap_loop(); });
+}
+
+UringBackend::~UringBackend() {
+    if (ring_fd < 0) {
+        return;
+    }
+    // Deferred tasks may still submit, so they finish first.
+    workers.reset();
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        room.wait(lock, [this] { return in_flight == 0; });
+        // A no-op with no slot tells the reaper to stop.
+        next_entry(0).opcode = IORING_OP_NOP;
+        flush_queue();
+    }
+    fail_withdrawn();
+    reaper.join();
+    munmap(sqes, sqes_bytes);
+    munmap(ring_memory, ring_bytes);
+    ::close(ring_fd);
+    std::free(buffers);
+}
+
+void UringBackend::submit(std::vector<IoRequest> requests, IoBatchDone done) {
+    if (requests.empty()) {
+        done(requests);
+        return;
+    }
+    auto owned = std::make_unique<Batch>();
+    owned->requests = std::move(requests);
+    owned->slots.resize(owned->requests.size());
+    owned->done = std::move(done);
+    owned->remaining = owned->requests.size();
+    Batch *batch = owned.release();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    for (size_t i = 0; i < batch->requests.size(); ++i) {
+        if (in_flight >= cq_entries) {
+            flush_queue();
+            lock.unlock();
+            fail_withdrawn();
+            lock.lock();
+            room.wait(lock, [this] { return in_flight < cq_entries; });
+        }
+        Slot &slot = batch->slots[i];
+        const IoRequest &request = batch->requests[i];
+        slot.batch = batch;
+        slot.index = i;
+        if (is_transfer(request) && request.size > 0 && request.size <= buffer_bytes &&
+            !free_buffers.empty()) {
+            slot.buffer = free_buffers.back();
+            free_buffers.pop_back();
+            if (request.op == IoOp::Write) {
+                std::memcpy(buffer_at(slot.buffer), request.data, request.size);
+            }
+        }
+        queue(slot);
+        ++in_flight;
+    }
+    flush_queue();
+    lock.unlock();
+    fail_withdrawn();
+}
+
+// Claims the next submission queue entry; the mutex must be held.
+io_uring_sqe &UringBackend::next_entry(uint64_t user_data) {
+    if (queued == sq_entries) {
+        flush_queue();
+    }
+    unsigned tail = *sq_tail;
+    unsigned index = tail & sq_mask;
+    io_uring_sqe &entry = sqes[index];
+    std::memset(&entry, 0, sizeof(entry));
+    entry.user_data = user_data;
+    sq_array[index] = index;
+    // The release store keeps the kernel from seeing the new tail before
+    // the entry behind it.
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++queued;
+    return entry;
+}
+
+void UringBackend::queue(Slot &slot) {
+    const IoRequest &request = slot.batch->requests[slot.index];
+    io_uring_sqe &entry = next_entry(reinterpret_cast<uint64_t>(&slot));
+    entry.fd = request.fd;
+    if (!is_transfer(request)) {
+        entry.opcode = IORING_OP_FSYNC;
+        entry.fsync_flags = request.op == IoOp::DataSync ? IORING_FSYNC_DATASYNC : 0;
+        return;
+    }
+    bool read = request.op == IoOp::Read;
+    size_t left = std::min(request.size - slot.moved, kMaxTransfer);
+    entry.off = request.offset + slot.moved;
+    if (slot.buffer >= 0) {
+        entry.opcode = read ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+        entry.addr = reinterpret_cast<uint64_t>(buffer_at(slot.buffer) + slot.moved);
+        entry.len = static_cast<uint32_t>(left);
+        entry.buf_index = static_cast<uint16_t>(slot.buffer);
+    } else {
+        slot.vector.iov_base = static_cast<char *>(request.data) + slot.moved;
+        slot.vector.iov_len = left;
+        entry.opcode = read ? IORING_OP_READV : IORING_OP_WRITEV;
+        entry.addr = reinterpret_cast<uint64_t>(&slot.vector);
+        entry.len = 1;
+    }
+}
+
+// Submits every queued entry; the mutex must be held.
+void UringBackend::flush_queue() {
+    while (queued > 0) {
+        int submitted = ring_enter(ring_fd, queued, 0, 0);
+        if (submitted < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                std::this_thread::yield();
+                continue;
+            }
+            int error = errno;
+            std::cerr << "io_uring submission failed: " << std::strerror(error) << std::endl;
+            // Without SQPOLL the kernel reads entries only inside
+            // io_uring_enter(), so the unsubmitted ones can be taken back.
+            unsigned tail = *sq_tail;
+            for (unsigned i = tail - queued; i != tail; ++i) {
+                uint64_t user_data = sqes[sq_array[i & sq_mask]].user_data;
+                if (user_data == 0) {
+                    stop_withdrawn = true;
+                } else {
+                    withdrawn.emplace_back(reinterpret_cast<Slot *>(user_data), -error);
+                }
+            }
+            __atomic_store_n(sq_tail, tail - queued, __ATOMIC_RELEASE);
+            queued = 0;
+            return;
+        }
+        queued -= static_cast<unsigned>(submitted);
+    }
+}
+
+// Completes the requests flush_queue() withdrew; the mutex must not be held.
+void UringBackend::fail_withdrawn() {
+    std::vector<std::pair<Slot *, int>> failed;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        failed.swap(withdrawn);
+    }
+    for (const auto &[slot, error] : failed) {
+        finish(*slot, error);
+    }
+}
+
+void UringBackend::complete(const io_uring_cqe &cqe) {
+    Slot &slot = *reinterpret_cast<Slot *>(cqe.user_data);
+    const IoRequest &request = slot.batch->requests[slot.index];
+    if (!is_transfer(request)) {
+        finish(slot, cqe.res);
+        return;
+    }
+    bool retry = cqe.res == -EINTR || cqe.res == -EAGAIN;
+    if (cqe.res > 0) {
+        slot.moved += static_cast<size_t>(cqe.res);
+        retry = slot.moved < request.size;
+    }
+    if (retry) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue(slot);
+            flush_queue();
+        }
+        fail_withdrawn();
+        return;
+    }
+    // A read of 0 bytes is the end of the file.
+    finish(slot, cqe.res < 0 ? cqe.res : static_cast<ssize_t>(slot.moved));
+}
+
+void UringBackend::finish(Slot &slot, ssize_t result) {
+    Batch *batch = slot.batch;
+    IoRequest &request = batch->requests[slot.index];
+    request.result = result;
+    if (slot.buffer >= 0 && request.op == IoOp::Read && result > 0) {
+        std::memcpy(request.data, buffer_at(slot.buffer), static_cast<size_t>(result));
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (slot.buffer >= 0) {
+            free_buffers.push_back(slot.buffer);
+        }
+        --in_flight;
+    }
+    room.notify_all();
+    if (--batch->remaining == 0) {
+        batch->done(batch->requests);
+        delete batch;
+    }
+}
+
+void UringBackend::reap_loop() {
+    while (true) {
+        if (ring_enter(ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+            std::cerr << "io_uring wait failed: " << std::strerror(errno) << std::endl;
+            std::this_thread::yield();
+        }
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        // Every completion is of an entry queued under the mutex. Taking it
+        // orders the submitters' writes to their slots before the reads
+        // below in terms the race detector sees; it cannot see the kernel.
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+        }
+        bool stop = false;
+        while (head != tail) {
+            io_uring_cqe cqe = cqes[head & cq_mask];
+            // The entry is copied out, so its place is returned at once.
+            __atomic_store_n(cq_head, ++head, __ATOMIC_RELEASE);
+            if (cqe.user_data == 0) {
+                stop = true;
+            } else {
+                complete(cqe);
+            }
+        }
+        if (stop || stop_withdrawn) {
+            return;
+        }
+    }
+}
+
+} // namespace
+
+IoBackendOptions io_backend_options_from_env() {
+    IoBackendOptions options;
+    if (const char *backend = std::getenv("SVAKLA_IO_BACKEND")) {
+        std::string_view name = backend;
+        if (name == "uring") {
+            options.kind = IoBackendKind::Uring;
+        } else if (name == "threads") {
+            options.kind = IoBackendKind::Threads;
+        } else if (name != "auto") {
+            std::cerr << "Unknown SVAKLA_IO_BACKEND " << name << ", using auto" << std::endl;
+        }
+    }
+    if (const char *threads = std::getenv("SVAKLA_IO_THREADS")) {
+        long count = std::strtol(threads, nullptr, 10);
+        if (count > 0) {
+            options.threads = static_cast<size_t>(count);
+        }
+    }
+    return options;
+}
+
+bool IoBackend::run(std::vector<IoRequest> &requests) {
+    std::mutex mutex;
+    std::condition_variable finished;
+    bool done = false;
+    bool ok = true;
+    submit(std::move(requests), [&](std::vector<IoRequest> &completed) {
+        ok = batch_succeeded(completed);
+        std::lock_guard<std::mutex> lock(mutex);
+        requests = std::move(completed);
+        done = true;
+        finished.notify_one();
+    });
+    std::unique_lock<std::mutex> lock(mutex);
+    finished.wait(lock, [&done] { return done; });
+    return ok;
+}
+
+std::unique_ptr<IoBackend> make_io_backend(const IoBackendOptions &options) {
+    if (options.kind != IoBackendKind::Threads) {
+        auto ring = std::make_unique<UringBackend>(options);
+        if (ring->ready()) {
+            return ring;
+        }
+        if (options.kind == IoBackendKind::Uring) {
+            std::cerr << "io_uring is unavailable (" << std::strerror(errno)
+                      << "), using a thread pool" << std::endl;
+        }
+    }
+    return std::make_unique<ThreadBackend>(options.threads);
+}
+
+IoBackend &storage_io() {
+    static std::unique_ptr<IoBackend> backend = make_io_backend(io_backend_options_from_env());
+    return *backend;
+}
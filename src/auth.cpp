@@ -1,12 +1,393 @@
 #include <iostream>
 #include <string>
+#include <charconv>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
 #include <openssl/rsa.h>
 #include <openssl/pem.h>
 #include <openssl/rand.h>
+#include <openssl/crypto.h>
+#include <openssl/decoder.h>
+#include "../include/auth.h"
 #include "../include/openssl_init.h"
+#include "../include/wal.h"
+
+namespace {
+
+constexpr size_t kChallengeBytes = 32;
+constexpr size_t kSecretBytes = 32;
+constexpr size_t kMacBytes = 32;
+// Signatures cover this prefix too, so a login key cannot be tricked into
+// signing anything else that happens to look like a challenge.
+constexpr std::string_view kChallengeContext = "svakla-auth-v1:";
+
+std::string base64url_encode(const unsigned char *data, size_t size) {
+    std::string encoded(4 * ((size + 2) / 3), '\0');
+    int length = EVP_EncodeBlock(reinterpret_cast<unsigned char *>(encoded.data()), data,
+                                 static_cast<int>(size));
+    encoded.resize(length);
+    while (!encoded.empty() && encoded.back() == '=') {
+        encoded.pop_back();
+    }
+    for (char &c : encoded) {
+        if (c == '+') {
+            c = '-';
+        } else if (c == '/') {
+            c = '_';
+        }
+    }
+    return encoded;
+}
+
+bool base64url_decode(std::string_view text, std::string &out) {
+    if (text.size() % 4 == 1) {
+        return false;
+    }
+    std::string padded(text);
+    for (char &c : padded) {
+        if (c == '-') {
+            c = '+';
+        } else if (c == '_') {
+            c = '/';
+        } else if (c == '+' || c == '/' || c == '=') {
+            return false;
+        }
+    }
+    size_t padding = (4 - padded.size() % 4) % 4;
+    padded.append(padding, '=');
+
+    out.resize(padded.size() / 4 * 3);
+    int length = EVP_DecodeBlock(reinterpret_cast<unsigned char *>(out.data()),
+                                 reinterpret_cast<const unsigned char *>(padded.data()),
+                                 static_cast<int>(padded.size()));
+    if (length < 0) {
+        return false;
+    }
+    // EVP_DecodeBlock counts the bytes the padding stands in for.
+    out.resize(length - padding);
+    return true;
+}
+
+EVP_PKEY *load_public_key(const std::string &path) {
+    BIO *bio = BIO_new_file(path.c_str(), "r");
+    if (!bio) {
+        return nullptr;
+    }
+    // Accepts both the PKCS#1 "RSA PUBLIC KEY" that generate_key_pair()
+    // writes and SubjectPublicKeyInfo PEM.
+    EVP_PKEY *key = nullptr;
+    OSSL_DECODER_CTX *decoder = OSSL_DECODER_CTX_new_for_pkey(
+        &key, "PEM", nullptr, nullptr, OSSL_KEYMGMT_SELECT_PUBLIC_KEY, nullptr, nullptr);
+    if (decoder) {
+        OSSL_DECODER_from_bio(decoder, bio);
+        OSSL_DECODER_CTX_free(decoder);
+    }
+    BIO_free(bio);
+    ERR_clear_error();
+    return key;
+}
+
+// Short, stable name for a key: the first 8 bytes of the SHA-256 of its
+// DER encoding, in hex.
+std::string key_subject(EVP_PKEY *key) {
+    unsigned char *der = nullptr;
+    int der_size = i2d_PUBKEY(key, &der);
+    if (der_size <= 0) {
+        return {};
+    }
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_size = 0;
+    EVP_Digest(der, der_size, digest, &digest_size, EVP_sha256(), nullptr);
+    OPENSSL_free(der);
+
+    static const char hex[] = "0123456789abcdef";
+    std::string subject;
+    for (int i = 0; i < 8; ++i) {
+        subject.push_back(hex[digest[i] >> 4]);
+        subject.push_back(hex[digest[i] & 0xF]);
+    }
+    return subject;
+}
+
+std::string signed_message(std::string_view challenge) {
+    std::string message(kChallengeContext);
+    message.append(challenge);
+    return message;
+}
+
+uint64_t unix_seconds() {
+    return static_cast<uint64_t>(std::time(nullptr));
+}
+
+} // namespace
+
+AuthConfig auth_config_from_env() {
+    AuthConfig config;
+    if (const char *enabled = std::getenv("SVAKLA_AUTH")) {
+        config.enabled = std::string(enabled) != "off";
+    }
+    if (const char *path = std::getenv("SVAKLA_AUTH_PUBLIC_KEY")) {
+        config.public_key_paths = {path};
+    }
+    if (const char *ttl = std::getenv("SVAKLA_AUTH_TOKEN_TTL")) {
+        config.token_ttl_seconds = static_cast<uint32_t>(std::strtoul(ttl, nullptr, 10));
+    }
+    return config;
+}
+
+HmacKey::~HmacKey() {
+    EVP_MD_CTX_free(inner);
+    EVP_MD_CTX_free(outer);
+}
+
+bool HmacKey::init(const unsigned char *key, size_t size) {
+    constexpr size_t kBlockSize = 64;
+    if (size > kBlockSize) {
+        return false;
+    }
+    unsigned char inner_pad[kBlockSize];
+    unsigned char outer_pad[kBlockSize];
+    for (size_t i = 0; i < kBlockSize; ++i) {
+        unsigned char byte = i < size ? key[i] : 0;
+        inner_pad[i] = byte ^ 0x36;
+        outer_pad[i] = byte ^ 0x5c;
+    }
+
+    inner = EVP_MD_CTX_new();
+    outer = EVP_MD_CTX_new();
+    bool ok = inner && outer && EVP_DigestInit_ex(inner, EVP_sha256(), nullptr) == 1 &&
+              EVP_DigestUpdate(inner, inner_pad, kBlockSize) == 1 &&
+              EVP_DigestInit_ex(outer, EVP_sha256(), nullptr) == 1 &&
+              EVP_DigestUpdate(outer, outer_pad, kBlockSize) == 1;
+    OPENSSL_cleanse(inner_pad, sizeof(inner_pad));
+    OPENSSL_cleanse(outer_pad, sizeof(outer_pad));
+    return ok;
+}
+
+bool HmacKey::sign(std::string_view message, unsigned char out[32]) const {
+    if (!inner || !outer) {
+        return false;
+    }
+    thread_local std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> scratch(
+        EVP_MD_CTX_new(), EVP_MD_CTX_free);
+    unsigned char inner_hash[kMacBytes];
+    return scratch && EVP_MD_CTX_copy_ex(scratch.get(), inner) == 1 &&
+           EVP_DigestUpdate(scratch.get(), message.data(), message.size()) == 1 &&
+           EVP_DigestFinal_ex(scratch.get(), inner_hash, nullptr) == 1 &&
+           EVP_MD_CTX_copy_ex(scratch.get(), outer) == 1 &&
+           EVP_DigestUpdate(scratch.get(), inner_hash, sizeof(inner_hash)) == 1 &&
+           EVP_DigestFinal_ex(scratch.get(), out, nullptr) == 1;
+}
+
+AuthService::AuthService(AuthConfig config) : config(std::move(config)) {
+    unsigned char secret[kSecretBytes];
+    if (RAND_bytes(secret, sizeof(secret)) != 1 || !hmac.init(secret, sizeof(secret))) {
+        // Every token check then fails, which keeps the services closed.
+        std::cerr << "Error initializing session token key" << std::endl;
+    }
+    OPENSSL_cleanse(secret, sizeof(secret));
+
+    if (!this->config.enabled) {
+        std::cerr << "Authentication disabled (SVAKLA_AUTH=off)" << std::endl;
+        return;
+    }
+    for (const auto &path : this->config.public_key_paths) {
+        add_public_key(path);
+    }
+    if (keys.empty()) {
+        std::cerr << "No authorized public key loaded; protected requests will be refused"
+                  << std::endl;
+    }
+}
+
+AuthService::~AuthService() {
+    for (auto &entry : keys) {
+        EVP_PKEY_free(entry.key);
+    }
+}
+
+bool AuthService::add_public_key(const std::string &path) {
+    EVP_PKEY *key = load_public_key(path);
+    if (!key) {
+        std::cerr << "Error loading public key: " << path << std::endl;
+        return false;
+    }
+    keys.push_back(AuthorizedKey{key_subject(key), key});
+    return true;
+}
+
+std::string AuthService::issue_challenge() {
+    unsigned char nonce[kChallengeBytes];
+    if (RAND_bytes(nonce, sizeof(nonce)) != 1) {
+        std::cerr << "Error generating authentication challenge" << std::endl;
+        return {};
+    }
+    std::string challenge = base64url_encode(nonce, sizeof(nonce));
+
+    uint64_t now = unix_seconds();
+    std::lock_guard<std::mutex> lock(mutex);
+    if (challenges.size() >= config.max_pending_challenges) {
+        prune_challenges(now);
+        if (challenges.size() >= config.max_pending_challenges) {
+            return {};
+        }
+    }
+    challenges.emplace(challenge, now + config.challenge_ttl_seconds);
+    return challenge;
+}
+
+bool AuthService::redeem_challenge(std::string_view challenge, std::string_view signature,
+                                   std::string &token) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto entry = challenges.find(std::string(challenge));
+        if (entry == challenges.end()) {
+            return false;
+        }
+        uint64_t expiry = entry->second;
+        challenges.erase(entry);
+        if (unix_seconds() > expiry) {
+            return false;
+        }
+    }
+
+    std::string raw_signature;
+    if (!base64url_decode(signature, raw_signature)) {
+        return false;
+    }
+    std::string message = signed_message(challenge);
+
+    for (const auto &entry : keys) {
+        EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+        bool verified =
+            ctx && EVP_DigestVerifyInit(ctx, nullptr, EVP_sha256(), nullptr, entry.key) == 1 &&
+            EVP_DigestVerify(ctx, reinterpret_cast<const unsigned char *>(raw_signature.data()),
+                             raw_signature.size(),
+                             reinterpret_cast<const unsigned char *>(message.data()),
+                             message.size()) == 1;
+        EVP_MD_CTX_free(ctx);
+        ERR_clear_error();
+        if (verified) {
+            token = make_token(entry.subject, unix_seconds() + config.token_ttl_seconds);
+            return !token.empty();
+        }
+    }
+    return false;
+}
+
+std::string AuthService::make_token(const std::string &subject, uint64_t expiry) const {
+    std::string token = subject;
+    token.push_back('.');
+    token.append(std::to_string(expiry));
+
+    unsigned char mac[kMacBytes];
+    if (!hmac.sign(token, mac)) {
+        return {};
+    }
+    token.push_back('.');
+    token.append(base64url_encode(mac, sizeof(mac)));
+    return token;
+}
+
+bool AuthService::verify_token(std::string_view token, std::string *subject) const {
+    size_t mac_dot = token.rfind('.');
+    if (mac_dot == std::string_view::npos) {
+        return false;
+    }
+    std::string_view payload = token.substr(0, mac_dot);
+    size_t expiry_dot = payload.find('.');
+    if (expiry_dot == std::string_view::npos) {
+        return false;
+    }
+
+    std::string_view expiry_text = payload.substr(expiry_dot + 1);
+    uint64_t expiry = 0;
+    auto result = std::from_chars(expiry_text.data(), expiry_text.data() + expiry_text.size(),
+                                  expiry);
+    if (result.ec != std::errc() || result.ptr != expiry_text.data() + expiry_text.size() ||
+        expiry < unix_seconds()) {
+        return false;
+    }
+
+    // 32 bytes are always 43 base64url characters.
+    std::string_view mac_text = token.substr(mac_dot + 1);
+    std::string received;
+    if (mac_text.size() != 43 || !base64url_decode(mac_text, received) ||
+        received.size() != kMacBytes) {
+        return false;
+    }
+    unsigned char expected[kMacBytes];
+    if (!hmac.sign(payload, expected) ||
+        CRYPTO_memcmp(expected, received.data(), kMacBytes) != 0) {
+        return false;
+    }
+
+    if (subject) {
+        subject->assign(payload.substr(0, expiry_dot));
+    }
+    return true;
+}
+
+void AuthService::prune_challenges(uint64_t now) {
+    for (auto entry = challenges.begin(); entry != challenges.end();) {
+        if (entry->second < now) {
+            entry = challenges.erase(entry);
+        } else {
+            ++entry;
+        }
+    }
+}
+
+AuthService &auth_service() {
+    static AuthService service(auth_config_from_env());
+    return service;
+}
+
+bool auth_sign_challenge(const std::string &private_key_path, std::string_view challenge,
+                         std::string &signature) {
+    BIO *bio = BIO_new_file(private_key_path.c_str(), "r");
+    if (!bio) {
+        std::cerr << "Error opening private key: " << private_key_path << std::endl;
+        return false;
+    }
+    EVP_PKEY *key = PEM_read_bio_PrivateKey(bio, nullptr, nullptr, nullptr);
+    BIO_free(bio);
+    if (!key) {
+        std::cerr << "Error reading private key: " << private_key_path << std::endl;
+        ERR_clear_error();
+        return false;
+    }
+
+    std::string message = signed_message(challenge);
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    size_t size = 0;
+    std::string raw;
+    bool ok = ctx && EVP_DigestSignInit(ctx, nullptr, EVP_sha256(), nullptr, key) == 1 &&
+              EVP_DigestSign(ctx, nullptr, &size,
+                             reinterpret_cast<const unsigned char *>(message.data()),
+                             message.size()) == 1;
+    if (ok) {
+        raw.resize(size);
+        ok = EVP_DigestSign(ctx, reinterpret_cast<unsigned char *>(raw.data()), &size,
+                            reinterpret_cast<const unsigned char *>(message.data()),
+                            message.size()) == 1;
+        raw.resize(size);
+    }
+    EVP_MD_CTX_free(ctx);
+    EVP_PKEY_free(key);
+    if (!ok) {
+        std::cerr << "Error signing authentication challenge" << std::endl;
+        ERR_clear_error();
+        return false;
+    }
+    signature = base64url_encode(reinterpret_cast<const unsigned char *>(raw.data()),
+                                 raw.size());
+    return true;
+}
 
 void generate_key_pair() {
     RSA *rsa = RSA_generate_key(2048, RSA_F4, NULL, NULL);
@@ -15,11 +396,29 @@ void generate_key_pair() {
         return;
     }
 
-    BIO *bp_public = BIO_new_file("public.pem", "w+");
-    BIO *bp_private = BIO_new_file("private.pem", "w+");
-
-    PEM_write_bio_RSAPublicKey(bp_public, rsa);
-    PEM_write_bio_RSAPrivateKey(bp_private, rsa, NULL, NULL, 0, NULL, NULL);
+    // The keys are encoded in memory and each file replaced in one durable
+    // step, so a crash never leaves a truncated key behind.
+    BIO *bp_public = BIO_new(BIO_s_mem());
+    BIO *bp_private = BIO_new(BIO_s_mem());
+    bool encoded = bp_public && bp_private && PEM_write_bio_RSAPublicKey(bp_public, rsa) == 1 &&
+                   PEM_write_bio_RSAPrivateKey(bp_private, rsa, NULL, NULL, 0, NULL, NULL) == 1;
+    if (encoded) {
+        char *public_pem = nullptr;
+        char *private_pem = nullptr;
+        long public_bytes = BIO_get_mem_data(bp_public, &public_pem);
+        long private_bytes = BIO_get_mem_data(bp_private, &private_pem);
+        if (!write_file_durably("public.pem",
+                                std::string_view(public_pem, static_cast<size_t>(public_bytes)),
+                                0644) ||
+            !write_file_durably("private.pem",
+                                std::string_view(private_pem, static_cast<size_t>(private_bytes)),
+                                0600)) {
+            std::cerr << "Error writing RSA key pair" << std::endl;
+        }
+    } else {
+        std::cerr << "Error encoding RSA key pair" << std::endl;
+        ERR_clear_error();
+    }
 
     BIO_free_all(bp_public);
     BIO_free_all(bp_private);
@@ -27,6 +426,16 @@ void generate_key_pair() {
 }
 
 bool authenticate_user(const std::string &public_key_path, const std::string &private_key_path) {
-    // Authentication logic here
-    return true;
+    AuthConfig config;
+    config.public_key_paths = {public_key_path};
+    AuthService service(config);
+    if (!service.has_keys()) {
+        return false;
+    }
+
+    std::string challenge = service.issue_challenge();
+    std::string signature;
+    std::string token;
+    return !challenge.empty() && auth_sign_challenge(private_key_path, challenge, signature) &&
+           service.redeem_challenge(challenge, signature, token) && service.verify_token(token);
 }
@@ -0,0 +1,124 @@
+#include <iostream>
+#include <string>
+#include "../include/auth_middleware.h"
+
+namespace {
+
+constexpr std::string_view kAuthPrefix = "/auth/";
+
+// Value of name in a "a=1&b=2" list; no percent-decoding is needed for the
+// base64url values exchanged here.
+std::string_view form_value(std::string_view form, std::string_view name) {
+    while (!form.empty()) {
+        size_t amp = form.find('&');
+        std::string_view pair = form.substr(0, amp);
+        size_t equals = pair.find('=');
+        if (equals != std::string_view::npos && pair.substr(0, equals) == name) {
+            return pair.substr(equals + 1);
+        }
+        if (amp == std::string_view::npos) {
+            break;
+        }
+        form.remove_prefix(amp + 1);
+    }
+    return {};
+}
+
+std::string_view cookie_value(std::string_view cookies, std::string_view name) {
+    while (!cookies.empty()) {
+        size_t semicolon = cookies.find(';');
+        std::string_view pair = cookies.substr(0, semicolon);
+        while (!pair.empty() && pair.front() == ' ') {
+            pair.remove_prefix(1);
+        }
+        size_t equals = pair.find('=');
+        if (equals != std::string_view::npos && pair.substr(0, equals) == name) {
+            return pair.substr(equals + 1);
+        }
+        if (semicolon == std::string_view::npos) {
+            break;
+        }
+        cookies.remove_prefix(semicolon + 1);
+    }
+    return {};
+}
+
+void refuse(HttpResponse &response, int status) {
+    response.status = status;
+    response.content_type = "application/json";
+    response.body = status == 401 ? "{\"error\": \"authentication required\"}"
+                                  : "{\"error\": \"authentication failed\"}";
+    if (status == 401) {
+        response.set_header("WWW-Authenticate", "Bearer");
+    }
+}
+
+} // namespace
+
+std::string_view auth_request_token(const HttpRequest &request, bool allow_query) {
+    std::string_view authorization = request.header("Authorization");
+    if (authorization.size() > 7 && authorization.substr(0, 7) == "Bearer ") {
+        return authorization.substr(7);
+    }
+    std::string_view cookie = cookie_value(request.header("Cookie"), kSessionCookie);
+    if (!cookie.empty()) {
+        return cookie;
+    }
+    return allow_query ? form_value(request.query, "token") : std::string_view();
+}
+
+void install_auth(HttpRouter &router, AuthService &auth,
+                  std::vector<std::string> public_prefixes) {
+    if (!auth.enabled()) {
+        return;
+    }
+
+    router.add("POST", "/auth/challenge", [&auth](const HttpRequest &, HttpResponse &response) {
+        std::string challenge = auth.issue_challenge();
+        if (challenge.empty()) {
+            response.status = 503;
+            response.set_header("Retry-After", "1");
+            return;
+        }
+        response.content_type = "application/json";
+        response.set_header("Cache-Control", "no-store");
+        response.body = "{\"challenge\": \"" + challenge +
+                        "\", \"expires_in\": " + std::to_string(auth.challenge_ttl()) + "}";
+    });
+
+    router.add("POST", "/auth/session", [&auth](const HttpRequest &request,
+                                                 HttpResponse &response) {
+        std::string_view challenge = form_value(request.body, "challenge");
+        std::string_view signature = form_value(request.body, "signature");
+        std::string token;
+        if (challenge.empty() || signature.empty() ||
+            !auth.redeem_challenge(challenge, signature, token)) {
+            refuse(response, 403);
+            return;
+        }
+        std::string ttl = std::to_string(auth.token_ttl());
+        response.content_type = "application/json";
+        response.set_header("Cache-Control", "no-store");
+        response.set_header("Set-Cookie", std::string(kSessionCookie) + "=" + token +
+                                              "; Max-Age=" + ttl +
+                                              "; Path=/; HttpOnly; Secure; SameSite=Strict");
+        response.body = "{\"token\": \"" + token + "\", \"expires_in\": " + ttl + "}";
+    });
+
+    router.set_guard([&auth, public_prefixes = std::move(public_prefixes)](
+                         const HttpRequest &request, HttpResponse &response) {
+        if (request.path.starts_with(kAuthPrefix)) {
+            return true;
+        }
+        for (const auto &prefix : public_prefixes) {
+            if (request.path.starts_with(prefix)) {
+                return true;
+            }
+        }
+        if (!auth.verify_token(auth_request_token(request))) {
+            refuse(response, 401);
+            return false;
+        }
+        return true;
+    });
+}
@@ -0,0 +1,359 @@
+#include <iostream>
+#include <string>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <future>
+#include <unordered_set>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <openssl/evp.h>
+#include "../include/compile_cache.h"
+
+extern char **environ;
+
+namespace {
+
+constexpr const char *kObjectSuffix = ".so";
+// Compiler output kept for the error message.
+constexpr size_t kMaxDiagnostics = 8192;
+
+void hash_part(EVP_MD_CTX *context, const std::string &part) {
+    // Length-prefixed, so moving text between parts changes the digest.
+    uint64_t size = part.size();
+    EVP_DigestUpdate(context, &size, sizeof(size));
+    EVP_DigestUpdate(context, part.data(), part.size());
+}
+
+bool write_all(int fd, const std::string &text) {
+    const char *data = text.data();
+    size_t left = text.size();
+    while (left > 0) {
+        ssize_t written = write(fd, data, left);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        left -= static_cast<size_t>(written);
+    }
+    return true;
+}
+
+std::string read_head(int fd, size_t limit) {
+    std::string text(limit, '\0');
+    ssize_t got = pread(fd, text.data(), limit, 0);
+    text.resize(got > 0 ? static_cast<size_t>(got) : 0);
+    return text;
+}
+
+} // namespace
+
+CompiledModule::CompiledModule(std::string digest, void *handle)
+    : key(std::move(digest)), handle(handle) {}
+
+CompiledModule::~CompiledModule() {
+    if (handle) {
+        dlclose(handle);
+    }
+}
+
+void *CompiledModule::symbol(const char *name) const {
+    return dlsym(handle, name);
+}
+
+CompileCache::CompileCache(CompileCacheOptions options) : settings(std::move(options)) {
+    if (settings.directory.empty()) {
+        std::cerr << "Compile cache needs a directory" << std::endl;
+        return;
+    }
+    if (mkdir(settings.directory.c_str(), 0700) != 0 && errno != EEXIST) {
+        std::cerr << "Unable to create compile cache " << settings.directory << ": "
+                  << std::strerror(errno) << std::endl;
+        return;
+    }
+    struct stat info;
+    if (lstat(settings.directory.c_str(), &info) != 0 || !S_ISDIR(info.st_mode) ||
+        info.st_uid != geteuid() || (info.st_mode & (S_IWGRP | S_IWOTH))) {
+        std::cerr << "Compile cache " << settings.directory
+                  << " must be a directory only this user can write" << std::endl;
+        return;
+    }
+    workers = std::make_unique<ThreadPool>(std::max<size_t>(1, settings.workers));
+    usable = true;
+}
+
+CompileCache::~CompileCache() {
+    // Finish queued compiles while the maps they report into still exist.
+    workers.reset();
+}
+
+std::string CompileCache::digest_of(const std::string &source,
+                                    const std::vector<std::string> &flags) const {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int size = 0;
+    EVP_MD_CTX *context = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(context, EVP_sha256(), nullptr);
+    hash_part(context, settings.compiler);
+    hash_part(context, settings.language);
+    hash_part(context, std::to_string(flags.size()));
+    for (const std::string &flag : flags) {
+        hash_part(context, flag);
+    }
+    hash_part(context, source);
+    EVP_DigestFinal_ex(context, digest, &size);
+    EVP_MD_CTX_free(context);
+
+    static const char kHex[] = "0123456789abcdef";
+    std::string hex;
+    hex.reserve(2 * size);
+    for (unsigned int i = 0; i < size; ++i) {
+        hex.push_back(kHex[digest[i] >> 4]);
+        hex.push_back(kHex[digest[i] & 15]);
+    }
+    return hex;
+}
+
+std::string CompileCache::object_path(const std::string &digest) const {
+    return settings.directory + "/" + digest + kObjectSuffix;
+}
+
+std::shared_ptr<CompiledModule> CompileCache::open_object(const std::string &digest,
+                                                          std::string &error) {
+    void *handle = dlopen(object_path(digest).c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (!handle) {
+        const char *reason = dlerror();
+        error = reason ? reason : "dlopen failed";
+        return nullptr;
+    }
+    return std::make_shared<CompiledModule>(digest, handle);
+}
+
+void CompileCache::load(const std::string &source, const std::vector<std::string> &flags,
+                        Callback done) {
+    if (!usable) {
+        done(nullptr, "compile cache is unavailable");
+        return;
+    }
+    std::string digest = digest_of(source, flags);
+    std::shared_ptr<CompiledModule> module;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = loaded.find(digest);
+        if (found != loaded.end()) {
+            ++counters.memory_hits;
+            module = found->second;
+        } else if (auto waiting = pending.find(digest); waiting != pending.end()) {
+            waiting->second.push_back(std::move(done));
+            return;
+        }
+    }
+    if (module) {
+        done(module, "");
+        return;
+    }
+
+    // Built by an earlier run. Touching it marks it recently used for
+    // eviction; an object that fails to load is rebuilt.
+    std::string path = object_path(digest);
+    if (access(path.c_str(), R_OK) == 0) {
+        std::string error;
+        module = open_object(digest, error);
+        if (module) {
+            utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                ++counters.disk_hits;
+                module = loaded.emplace(digest, module).first->second;
+            }
+            done(module, "");
+            return;
+        }
+        std::cerr << "Discarding cached object " << path << ": " << error << std::endl;
+        unlink(path.c_str());
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<Callback> &waiting = pending[digest];
+        waiting.push_back(std::move(done));
+        if (waiting.size() > 1) {
+            return;
+        }
+    }
+    workers->submit([this, digest, source, flags] { compile(digest, source, flags); });
+}
+
+std::shared_ptr<CompiledModule> CompileCache::load_now(const std::string &source,
+                                                       const std::vector<std::string> &flags,
+                                                       std::string &error) {
+    std::promise<std::pair<std::shared_ptr<CompiledModule>, std::string>> result;
+    load(source, flags, [&result](std::shared_ptr<CompiledModule> module, const std::string &why) {
+        result.set_value({std::move(module), why});
+    });
+    auto [module, why] = result.get_future().get();
+    error = why;
+    return module;
+}
+
+CompileCache::Stats CompileCache::stats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return counters;
+}
+
+void CompileCache::compile(const std::string &digest, const std::string &source,
+                           const std::vector<std::string> &flags) {
+    std::string error;
+    std::shared_ptr<CompiledModule> module;
+    if (run_compiler(source, flags, object_path(digest), error)) {
+        module = open_object(digest, error);
+    }
+    std::vector<Callback> waiting;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        waiting = std::move(pending[digest]);
+        pending.erase(digest);
+        if (module) {
+            ++counters.compiles;
+            loaded.emplace(digest, module);
+        } else {
+            ++counters.failures;
+        }
+    }
+    for (Callback &done : waiting) {
+        done(module, module ? "" : error);
+    }
+    if (module) {
+        enforce_limit();
+    }
+}
+
+bool CompileCache::run_compiler(const std::string &source, const std::vector<std::string> &flags,
+                                const std::string &output, std::string &error) {
+    std::string base = output.substr(0, output.size() - std::strlen(kObjectSuffix));
+    std::string source_path = base + ".src.XXXXXX";
+    std::string log_path = base + ".log.XXXXXX";
+    std::string temp_output = base + ".tmp.XXXXXX";
+    int source_fd = mkstemp(source_path.data());
+    int log_fd = source_fd >= 0 ? mkstemp(log_path.data()) : -1;
+    int output_fd = log_fd >= 0 ? mkstemp(temp_output.data()) : -1;
+    auto cleanup = [&] {
+        for (int fd : {source_fd, log_fd, output_fd}) {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+        }
+        unlink(source_path.c_str());
+        unlink(log_path.c_str());
+        unlink(temp_output.c_str());
+    };
+    if (output_fd < 0 || !write_all(source_fd, source)) {
+        error = "unable to write source to " + settings.directory;
+        cleanup();
+        return false;
+    }
+
+    std::vector<std::string> args = {settings.compiler};
+    args.insert(args.end(), flags.begin(), flags.end());
+    for (const char *arg : {"-shared", "-fPIC", "-o"}) {
+        args.push_back(arg);
+    }
+    args.push_back(temp_output);
+    args.push_back("-x");
+    args.push_back(settings.language);
+    args.push_back(source_path);
+    std::vector<char *> argv;
+    for (std::string &arg : args) {
+        argv.push_back(arg.data());
+    }
+    argv.push_back(nullptr);
+
+    // Diagnostics go to the log, and the compiler reads nothing.
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, log_fd, STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, log_fd, STDERR_FILENO);
+    pid_t child;
+    int spawned = posix_spawnp(&child, argv[0], &actions, nullptr, argv.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (spawned != 0) {
+        error = "unable to run " + settings.compiler + ": " + std::strerror(spawned);
+        cleanup();
+        return false;
+    }
+    int status = 0;
+    while (waitpid(child, &status, 0) < 0 && errno == EINTR) {
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        error = read_head(log_fd, kMaxDiagnostics);
+        if (error.empty()) {
+            error = settings.compiler + " failed";
+        }
+        cleanup();
+        return false;
+    }
+    if (rename(temp_output.c_str(), output.c_str()) != 0) {
+        error = "unable to store " + output;
+        cleanup();
+        return false;
+    }
+    cleanup();
+    return true;
+}
+
+void CompileCache::enforce_limit() {
+    struct Entry {
+        std::string digest;
+        uint64_t bytes;
+        struct timespec used;
+    };
+    DIR *directory = opendir(settings.directory.c_str());
+    if (!directory) {
+        return;
+    }
+    std::vector<Entry> entries;
+    uint64_t total = 0;
+    size_t suffix = std::strlen(kObjectSuffix);
+    while (dirent *item = readdir(directory)) {
+        std::string name = item->d_name;
+        if (name.size() <= suffix || name.compare(name.size() - suffix, suffix, kObjectSuffix)) {
+            continue;
+        }
+        struct stat info;
+        if (fstatat(dirfd(directory), item->d_name, &info, AT_SYMLINK_NOFOLLOW) != 0 ||
+            !S_ISREG(info.st_mode)) {
+            continue;
+        }
+        entries.push_back({name.substr(0, name.size() - suffix),
+                           static_cast<uint64_t>(info.st_size), info.st_mtim});
+        total += static_cast<uint64_t>(info.st_size);
+    }
+    closedir(directory);
+    if (total <= settings.max_bytes) {
+        return;
+    }
+
+    std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) {
+        return a.used.tv_sec != b.used.tv_sec ? a.used.tv_sec < b.used.tv_sec
+                                              : a.used.tv_nsec < b.used.tv_nsec;
+    });
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const Entry &entry : entries) {
+        if (total <= settings.max_bytes) {
+            break;
+        }
+        if (loaded.count(entry.digest) || unlink(object_path(entry.digest).c_str()) != 0) {
+            continue;
+        }
+        total -= entry.bytes;
+        ++counters.evictions;
+    }
+}
@@ -0,0 +1,110 @@
+#include <algorithm>
+#include "../include/compute_pool.h"
+
+namespace {
+
+// Iterations a worker polls for the next job before it sleeps; roughly the
+// gap between two matmuls of one layer.
+constexpr int kSpinIterations = 20000;
+
+void cpu_relax() {
+#if defined(__x86_64__)
+    __builtin_ia32_pause();
+#endif
+}
+
+} // namespace
+
+ComputePool::ComputePool(size_t count) {
+    if (count == 0) {
+        count = std::thread::hardware_concurrency();
+    }
+    if (count == 0) {
+        count = 1;
+    }
+    workers.reserve(count - 1);
+    for (size_t i = 1; i < count; ++i) {
+        workers.emplace_back([this, i] { worker_loop(i); });
+    }
+}
+
+ComputePool::~ComputePool() {
+    stopping.store(true);
+    generation.fetch_add(1);
+    generation.notify_all();
+    for (auto &worker : workers) {
+        worker.join();
+    }
+}
+
+void ComputePool::run(const std::function<void(size_t, size_t)> &task) {
+    if (workers.empty()) {
+        task(0, 1);
+        return;
+    }
+    std::lock_guard<std::mutex> lock(run_mutex);
+    job = &task;
+    pending.store(static_cast<uint32_t>(workers.size()));
+    generation.fetch_add(1, std::memory_order_release);
+    generation.notify_all();
+
+    task(0, size());
+
+    for (int spin = 0; pending.load(std::memory_order_acquire) != 0; ++spin) {
+        if (spin < kSpinIterations) {
+            cpu_relax();
+            continue;
+        }
+        uint32_t left = pending.load(std::memory_order_acquire);
+        if (left != 0) {
+            pending.wait(left);
+        }
+    }
+    job = nullptr;
+}
+
+void ComputePool::parallel_for(size_t count, size_t grain,
+                               const std::function<void(size_t, size_t)> &body) {
+    if (grain == 0) {
+        grain = 1;
+    }
+    if (count <= grain || workers.empty()) {
+        if (count > 0) {
+            body(0, count);
+        }
+        return;
+    }
+    std::atomic<size_t> next{0};
+    run([&](size_t, size_t) {
+        while (true) {
+            size_t begin = next.fetch_add(grain, std::memory_order_relaxed);
+            if (begin >= count) {
+                return;
+            }
+            body(begin, std::min(count, begin + grain));
+        }
+    });
+}
+
+void ComputePool::worker_loop(size_t index) {
+    uint32_t seen = 0;
+    while (true) {
+        uint32_t current = generation.load(std::memory_order_acquire);
+        for (int spin = 0; current == seen && spin < kSpinIterations; ++spin) {
+            cpu_relax();
+            current = generation.load(std::memory_order_acquire);
+        }
+        if (current == seen) {
+            generation.wait(seen);
+            continue;
+        }
+        seen = current;
+        if (stopping.load()) {
+            return;
+        }
+        (*job)(index, size());
+        if (pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            pending.notify_one();
+        }
+    }
+}
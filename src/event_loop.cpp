@@ -0,0 +1,645 @@
+#include <iostream>
+#include <string>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <openssl/err.h>
+#include "../include/event_loop.h"
+
+namespace {
+
+constexpr int kMaxEvents = 256;
+constexpr int kMaxIov = 64;
+// Timeouts and buffer budgets are checked this often, so a connection may
+// outlive its deadline by up to this much.
+constexpr int kSweepIntervalMs = 1000;
+
+// Compact the input buffer only once the consumed prefix dominates it, so
+// pipelined requests do not pay a memmove each.
+constexpr size_t kCompactThreshold = 4096;
+
+} // namespace
+
+Connection::~Connection() {
+    if (ssl) {
+        SSL_free(ssl);
+    }
+}
+
+void Connection::consume(size_t n) {
+    in_offset += n;
+    if (in_offset >= in.size()) {
+        in.clear();
+        in_offset = 0;
+    } else if (in_offset >= kCompactThreshold && in_offset * 2 >= in.size()) {
+        in.erase(0, in_offset);
+        in_offset = 0;
+    }
+}
+
+void Connection::send(std::string_view data) {
+    output_buffer().append(data);
+}
+
+void Connection::send_shared(std::shared_ptr<const std::string> data, size_t offset,
+                             size_t size) {
+    if (size == 0) {
+        return;
+    }
+    // Anything already buffered must go out first, so it becomes a segment.
+    if (out_offset < out.size()) {
+        segments.emplace_back();
+        OutputSegment &head = segments.back();
+        head.owned = std::move(out);
+        head.data = std::string_view(head.owned).substr(out_offset);
+        segment_bytes += head.data.size();
+    }
+    out.clear();
+    out_offset = 0;
+
+    segments.emplace_back();
+    OutputSegment &segment = segments.back();
+    segment.data = std::string_view(*data).substr(offset, size);
+    segment.shared = std::move(data);
+    segment_bytes += segment.data.size();
+}
+
+void Connection::consume_output(size_t n) {
+    while (n > 0 && !segments.empty()) {
+        OutputSegment &front = segments.front();
+        size_t step = std::min(n, front.data.size());
+        front.data.remove_prefix(step);
+        segment_bytes -= step;
+        n -= step;
+        if (front.data.empty()) {
+            segments.pop_front();
+        }
+    }
+    out_offset += n;
+}
+
+void Connection::arm_deadline(uint32_t timeout_ms) {
+    if (deadline_ms == 0 && timeout_ms > 0) {
+        deadline_ms = monotonic_ms() + timeout_ms;
+    }
+}
+
+std::string &Connection::output_buffer() {
+    if (out_offset == out.size()) {
+        out.clear();
+        out_offset = 0;
+    }
+    return out;
+}
+
+int create_listen_socket(int port, bool reuse_port) {
+    int server_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server_socket < 0) {
+        std::cerr << "Error creating socket" << std::endl;
+        return -1;
+    }
+
+    int enable = 1;
+    setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+    if (reuse_port &&
+        setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0) {
+        std::cerr << "Error enabling SO_REUSEPORT" << std::endl;
+        close(server_socket);
+        return -1;
+    }
+
+    struct sockaddr_in server_addr;
+    std::memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(port);
+
+    if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        std::cerr << "Error binding socket" << std::endl;
+        close(server_socket);
+        return -1;
+    }
+
+    if (::listen(server_socket, SOMAXCONN) < 0) {
+        std::cerr << "Error listening on socket" << std::endl;
+        close(server_socket);
+        return -1;
+    }
+
+    return server_socket;
+}
+
+EventLoop::EventLoop() {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        std::cerr << "Error creating epoll instance" << std::endl;
+        return;
+    }
+
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd < 0) {
+        std::cerr << "Error creating wakeup eventfd" << std::endl;
+        close(epoll_fd);
+        epoll_fd = -1;
+        return;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = wake_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+}
+
+EventLoop::~EventLoop() {
+    for (auto &entry : clients) {
+        close(entry.first);
+    }
+    for (auto &entry : listeners) {
+        close(entry.first);
+    }
+    if (wake_fd >= 0) {
+        close(wake_fd);
+    }
+    if (epoll_fd >= 0) {
+        close(epoll_fd);
+    }
+}
+
+bool EventLoop::listen(int port, ConnectionHandler on_data, SSL_CTX *tls, bool reuse_port,
+                       std::shared_ptr<AdmissionControl> admission) {
+    if (!valid()) {
+        return false;
+    }
+
+    int server_socket = create_listen_socket(port, reuse_port);
+    if (server_socket < 0) {
+        return false;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = server_socket;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_socket, &ev) < 0) {
+        std::cerr << "Error registering listener with epoll" << std::endl;
+        close(server_socket);
+        return false;
+    }
+
+    listeners.emplace(server_socket,
+                      Listener{server_socket, std::move(on_data), tls, std::move(admission)});
+    return true;
+}
+
+void EventLoop::run() {
+    if (!valid()) {
+        return;
+    }
+
+    struct epoll_event events[kMaxEvents];
+
+    while (!stopping) {
+        int count = epoll_wait(epoll_fd, events, kMaxEvents, kSweepIntervalMs);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "Error waiting for events: " << std::strerror(errno) << std::endl;
+            break;
+        }
+        uint64_t now = monotonic_ms();
+
+        for (int i = 0; i < count; ++i) {
+            int fd = events[i].data.fd;
+            uint32_t flags = events[i].events;
+
+            if (fd == wake_fd) {
+                uint64_t value;
+                while (read(wake_fd, &value, sizeof(value)) > 0) {
+                }
+                run_posted();
+                continue;
+            }
+
+            auto listener = listeners.find(fd);
+            if (listener != listeners.end()) {
+                accept_all(listener->second);
+                continue;
+            }
+
+            auto client = clients.find(fd);
+            if (client == clients.end()) {
+                continue;
+            }
+            Connection &conn = *client->second.conn;
+            const ConnectionHandler &on_data = listeners[client->second.listener_fd].on_data;
+            conn.last_active_ms = now;
+
+            if (conn.ssl && !conn.handshake_done) {
+                drive_handshake(conn, on_data);
+            } else if (flags & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                handle_readable(conn, on_data);
+            } else if (flags & EPOLLOUT) {
+                after_io(conn, on_data);
+            }
+            if (conn.closed) {
+                close_connection(fd);
+            }
+        }
+
+        if (now - last_sweep >= kSweepIntervalMs) {
+            sweep(now);
+            last_sweep = now;
+        }
+    }
+}
+
+void EventLoop::stop() {
+    stopping = true;
+    if (wake_fd >= 0) {
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) < 0) {
+            std::cerr << "Error waking event loop" << std::endl;
+        }
+    }
+}
+
+void EventLoop::post(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(posted_mutex);
+        posted.push_back(std::move(task));
+    }
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0) {
+        std::cerr << "Error waking event loop" << std::endl;
+    }
+}
+
+void EventLoop::post_to(ConnectionRef ref, std::function<void(Connection &)> task) {
+    post([this, ref, task = std::move(task)]() {
+        auto client = clients.find(ref.fd);
+        if (client == clients.end() || client->second.conn->id != ref.id) {
+            return;
+        }
+        Connection &conn = *client->second.conn;
+        if (!conn.closed) {
+            conn.last_active_ms = monotonic_ms();
+            task(conn);
+            after_io(conn, listeners[client->second.listener_fd].on_data);
+        }
+        if (conn.closed) {
+            close_connection(ref.fd);
+        }
+    });
+}
+
+void EventLoop::run_posted() {
+    std::vector<std::function<void()>> tasks;
+    {
+        std::lock_guard<std::mutex> lock(posted_mutex);
+        tasks.swap(posted);
+    }
+    for (auto &task : tasks) {
+        task();
+    }
+}
+
+void EventLoop::accept_all(Listener &listener) {
+    while (true) {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        int client_socket = accept4(listener.fd, (struct sockaddr *)&client_addr, &client_len,
+                                    SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_socket < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                std::cerr << "Error accepting connection: " << std::strerror(errno) << std::endl;
+            }
+            return;
+        }
+
+        uint64_t now = monotonic_ms();
+        uint32_t peer = ntohl(client_addr.sin_addr.s_addr);
+        if (listener.admission && !listener.admission->admit(peer, now)) {
+            // Best effort: the reply fits any fresh socket buffer, and a
+            // refused client gets no second chance to read it.
+            const std::string &reply = listener.admission->limits().reject_response;
+            if (!listener.tls && !reply.empty()) {
+                ::send(client_socket, reply.data(), reply.size(), MSG_NOSIGNAL);
+            }
+            close(client_socket);
+            counters.rejected.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+
+        int enable = 1;
+        setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+        // Registered once for both directions: with EPOLLET the EPOLLOUT
+        // notification only fires when the send buffer drains, so it costs
+        // nothing while there is no pending output.
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.fd = client_socket;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_socket, &ev) < 0) {
+            std::cerr << "Error registering connection with epoll" << std::endl;
+            close(client_socket);
+            if (listener.admission) {
+                listener.admission->release(peer);
+            }
+            continue;
+        }
+
+        auto conn = std::make_unique<Connection>();
+        conn->fd = client_socket;
+        conn->id = next_connection_id++;
+        conn->loop = this;
+        conn->last_active_ms = now;
+        if (listener.admission) {
+            conn->limits = &listener.admission->limits();
+        }
+        if (listener.tls) {
+            conn->ssl = SSL_new(listener.tls);
+            if (!conn->ssl || SSL_set_fd(conn->ssl, client_socket) != 1) {
+                std::cerr << "Error creating TLS session" << std::endl;
+                ERR_clear_error();
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client_socket, nullptr);
+                close(client_socket);
+                if (listener.admission) {
+                    listener.admission->release(peer);
+                }
+                continue;
+            }
+            SSL_set_accept_state(conn->ssl);
+            if (conn->limits) {
+                conn->arm_deadline(conn->limits->request_timeout_ms);
+            }
+        }
+        clients[client_socket] = Client{std::move(conn), listener.fd, peer};
+        counters.accepted.fetch_add(1, std::memory_order_relaxed);
+        counters.active.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void EventLoop::drive_handshake(Connection &conn, const ConnectionHandler &on_data) {
+    ERR_clear_error();
+    int result = SSL_do_handshake(conn.ssl);
+    if (result == 1) {
+        conn.handshake_done = true;
+        conn.clear_deadline();
+        // The client's first request may already sit in the TLS buffers.
+        handle_readable(conn, on_data);
+        return;
+    }
+
+    int error = SSL_get_error(conn.ssl, result);
+    if (error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE) {
+        ERR_clear_error();
+        conn.closed = true;
+    }
+}
+
+// Returns bytes read, 0 when nothing more is available right now, or -1 on
+// a fatal error. peer_closed is set on an orderly shutdown.
+ssize_t EventLoop::read_some(Connection &conn, bool &peer_closed) {
+    while (true) {
+        if (conn.ssl) {
+            ERR_clear_error();
+            int n = SSL_read(conn.ssl, read_buffer.data(), static_cast<int>(read_buffer.size()));
+            if (n > 0) {
+                return n;
+            }
+            int error = SSL_get_error(conn.ssl, n);
+            if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+                return 0;
+            }
+            if (error == SSL_ERROR_ZERO_RETURN) {
+                peer_closed = true;
+                return 0;
+            }
+            ERR_clear_error();
+            return -1;
+        }
+
+        ssize_t n = recv(conn.fd, read_buffer.data(), read_buffer.size(), 0);
+        if (n > 0) {
+            return n;
+        }
+        if (n == 0) {
+            peer_closed = true;
+            return 0;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+}
+
+// Returns bytes written, 0 when the socket cannot take more right now, or
+// -1 on a fatal error.
+ssize_t EventLoop::write_some(Connection &conn) {
+    while (true) {
+        if (conn.ssl) {
+            ERR_clear_error();
+            std::string_view next = conn.segments.empty()
+                                        ? std::string_view(conn.out).substr(conn.out_offset)
+                                        : conn.segments.front().data;
+            int n = SSL_write(conn.ssl, next.data(),
+                              static_cast<int>(std::min<size_t>(next.size(), 1 << 30)));
+            if (n > 0) {
+                return n;
+            }
+            int error = SSL_get_error(conn.ssl, n);
+            if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+                return 0;
+            }
+            ERR_clear_error();
+            return -1;
+        }
+
+        ssize_t n;
+        if (conn.segments.empty()) {
+            n = ::send(conn.fd, conn.out.data() + conn.out_offset, conn.pending_output(),
+                       MSG_NOSIGNAL);
+        } else {
+            struct iovec iov[kMaxIov];
+            int count = 0;
+            for (const auto &segment : conn.segments) {
+                if (count == kMaxIov - 1) {
+                    break;
+                }
+                iov[count].iov_base = const_cast<char *>(segment.data.data());
+                iov[count].iov_len = segment.data.size();
+                ++count;
+            }
+            // out is queued behind every segment, so it only joins the
+            // batch when all segments fit.
+            if (static_cast<size_t>(count) == conn.segments.size() &&
+                conn.out_offset < conn.out.size()) {
+                iov[count].iov_base = conn.out.data() + conn.out_offset;
+                iov[count].iov_len = conn.out.size() - conn.out_offset;
+                ++count;
+            }
+            struct msghdr message;
+            std::memset(&message, 0, sizeof(message));
+            message.msg_iov = iov;
+            message.msg_iovlen = count;
+            n = sendmsg(conn.fd, &message, MSG_NOSIGNAL);
+        }
+        if (n > 0) {
+            return n;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+}
+
+void EventLoop::handle_readable(Connection &conn, const ConnectionHandler &on_data) {
+    bool peer_closed = false;
+
+    // With a full input buffer the rest stays in the kernel, where TCP flow
+    // control slows the peer down; reading resumes whenever the handler
+    // makes room.
+    do {
+        bool received = false;
+        conn.read_paused = false;
+        while (!peer_closed) {
+            if (conn.input_full()) {
+                conn.read_paused = true;
+                break;
+            }
+            ssize_t n = read_some(conn, peer_closed);
+            if (n < 0) {
+                conn.closed = true;
+                return;
+            }
+            if (n == 0) {
+                break;
+            }
+            conn.in.append(read_buffer.data(), n);
+            counters.bytes_read.fetch_add(n, std::memory_order_relaxed);
+            received = true;
+        }
+
+        if (received && on_data) {
+            on_data(conn);
+        }
+
+        // A half-closed peer still gets the replies to what it already sent.
+        if (peer_closed) {
+            conn.close_after_write = true;
+        }
+
+        drain_output(conn, on_data);
+    } while (conn.read_paused && !conn.closed && !conn.input_full());
+}
+
+void EventLoop::drain_output(Connection &conn, const ConnectionHandler &on_data) {
+    flush(conn);
+    if (!conn.closed && conn.notify_on_drain && conn.pending_output() == 0) {
+        conn.notify_on_drain = false;
+        if (on_data) {
+            on_data(conn);
+        }
+        flush(conn);
+    }
+}
+
+void EventLoop::after_io(Connection &conn, const ConnectionHandler &on_data) {
+    drain_output(conn, on_data);
+    if (conn.read_paused && !conn.closed && !conn.input_full()) {
+        handle_readable(conn, on_data);
+    }
+}
+
+void EventLoop::sweep(uint64_t now) {
+    for (auto &entry : listeners) {
+        entry.second.buffered = 0;
+    }
+
+    std::vector<int> expired;
+    for (auto &entry : clients) {
+        const Connection &conn = *entry.second.conn;
+        const ConnectionLimits *limits = conn.limits;
+        if (!limits) {
+            continue;
+        }
+        bool idle = limits->idle_timeout_ms > 0 &&
+                    now - conn.last_active_ms >= limits->idle_timeout_ms;
+        bool late = conn.deadline_ms > 0 && now >= conn.deadline_ms;
+        if (idle || late) {
+            expired.push_back(entry.first);
+            continue;
+        }
+        listeners[entry.second.listener_fd].buffered +=
+            conn.in.capacity() + conn.pending_output();
+    }
+
+    for (int fd : expired) {
+        counters.timed_out.fetch_add(1, std::memory_order_relaxed);
+        close_connection(fd);
+    }
+
+    for (auto &entry : listeners) {
+        Listener &listener = entry.second;
+        if (listener.admission && listener.buffered != listener.reported_buffered) {
+            listener.admission->update_buffered(listener.reported_buffered, listener.buffered);
+            listener.reported_buffered = listener.buffered;
+        }
+    }
+}
+
+void EventLoop::flush(Connection &conn) {
+    while (conn.pending_output() > 0) {
+        ssize_t n = write_some(conn);
+        if (n < 0) {
+            conn.closed = true;
+            return;
+        }
+        if (n == 0) {
+            return;
+        }
+        conn.consume_output(n);
+        counters.bytes_written.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    conn.out.clear();
+    conn.out_offset = 0;
+    if (conn.close_after_write) {
+        conn.closed = true;
+    }
+}
+
+void EventLoop::close_connection(int fd) {
+    auto client = clients.find(fd);
+    if (client != clients.end() && client->second.conn->ssl &&
+        client->second.conn->handshake_done) {
+        // Best effort close_notify; a non-blocking socket never waits for
+        // the peer's reply.
+        ERR_clear_error();
+        SSL_shutdown(client->second.conn->ssl);
+        ERR_clear_error();
+    }
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    close(fd);
+    if (client == clients.end()) {
+        return;
+    }
+    auto listener = listeners.find(client->second.listener_fd);
+    if (listener != listeners.end() && listener->second.admission) {
+        listener->second.admission->release(client->second.peer);
+    }
+    clients.erase(client);
+    counters.active.fetch_sub(1, std::memory_order_relaxed);
+}
@@ -3,8 +3,3 @@
 void display_final_summary() {
     std::cout << "Final Summary: A completely private, local-first, scalable AI system with elite-level cognitive abilities, able to run flawlessly on extremely limited hardware without sacrificing functionality, reasoning, or model quality — and able to scale upward with optional, modular expansions." << std::endl;
 }
-
-int main() {
-    display_final_summary();
-    return 0;
-}
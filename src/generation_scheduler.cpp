@@ -0,0 +1,286 @@
+#include <iostream>
+#include <string>
+#include <algorithm>
+#include <chrono>
+#include <string_view>
+#include "../include/generation_scheduler.h"
+
+namespace {
+
+// A generation whose reader has this much text outstanding leaves the
+// batch until the reader catches up.
+constexpr size_t kMaxUnreadText = 64 * 1024;
+
+// How often an idle scheduler looks again at generations that sat out.
+constexpr auto kBackloggedRetry = std::chrono::milliseconds(5);
+
+// Length of the longest prefix of text that does not end inside a UTF-8
+// sequence; a token may carry only part of a character.
+size_t complete_utf8(std::string_view text) {
+    size_t end = text.size();
+    for (size_t back = 1; back <= std::min<size_t>(4, text.size()); ++back) {
+        unsigned char c = static_cast<unsigned char>(text[end - back]);
+        if ((c & 0xC0) == 0x80) {
+            continue;
+        }
+        size_t length = c < 0x80 ? 1 : c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+        return back < length ? end - back : end;
+    }
+    return end;
+}
+
+// Admission order: priority class, then submission order.
+bool runs_before(const std::shared_ptr<Generation> &a, const std::shared_ptr<Generation> &b) {
+    return a->priority() != b->priority() ? a->priority() < b->priority()
+                                          : a->sequence() < b->sequence();
+}
+
+} // namespace
+
+bool Generation::next(std::string &out) {
+    std::unique_lock<std::mutex> lock(mutex);
+    ready.wait(lock, [this] { return finished || !text.empty(); });
+    if (text.empty()) {
+        return false;
+    }
+    out.append(text);
+    text.clear();
+    return true;
+}
+
+bool Generation::poll(std::string &out) {
+    std::lock_guard<std::mutex> lock(mutex);
+    out.append(text);
+    text.clear();
+    return !finished;
+}
+
+GenerationScheduler::GenerationScheduler(const TransformerModel &transformer,
+                                         const Tokenizer &vocabulary, KvBlockPool &blocks,
+                                         ComputePool &threads, const Options &settings)
+    : model(transformer), tokenizer(vocabulary), cache(blocks), pool(threads),
+      options(settings), prefix(blocks, settings.prefix_cache_bytes) {
+    options.max_batch = std::max<size_t>(1, options.max_batch);
+    options.prefill_chunk = std::max<size_t>(1, options.prefill_chunk);
+    worker = std::thread([this] { run(); });
+}
+
+GenerationScheduler::~GenerationScheduler() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    worker.join();
+}
+
+std::shared_ptr<Generation> GenerationScheduler::submit(std::vector<uint32_t> prompt,
+                                                        const GenerationParams &params) {
+    auto generation = std::make_shared<Generation>();
+    generation->prompt = std::move(prompt);
+    generation->params = params;
+    bool ended;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        generation->order = submitted++;
+        generation->rng.seed(static_cast<uint32_t>(
+            std::chrono::steady_clock::now().time_since_epoch().count() + generation->order));
+        ended = stopping || generation->prompt.empty();
+        if (ended) {
+            generation->finished = true;
+        } else {
+            waiting.push_back(generation);
+        }
+    }
+    if (!ended) {
+        wake.notify_one();
+    } else if (params.on_text) {
+        params.on_text();
+    }
+    return generation;
+}
+
+void GenerationScheduler::run() {
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [this] { return stopping || !waiting.empty() || !active.empty(); });
+            if (stopping) {
+                break;
+            }
+        }
+        admit();
+        if (!step()) {
+            // Everyone in the batch is waiting on a slow reader.
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait_for(lock, kBackloggedRetry, [this] { return stopping; });
+        }
+    }
+
+    for (const std::shared_ptr<Generation> &generation : active) {
+        finish(*generation);
+    }
+    active.clear();
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const std::shared_ptr<Generation> &generation : waiting) {
+        finish(*generation);
+    }
+    waiting.clear();
+}
+
+void GenerationScheduler::admit() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        while (active.size() < options.max_batch && !waiting.empty()) {
+            auto next = std::min_element(waiting.begin(), waiting.end(), runs_before);
+            active.push_back(std::move(*next));
+            waiting.erase(next);
+        }
+    }
+    for (auto it = active.begin(); it != active.end();) {
+        Generation &generation = **it;
+        if (generation.cancelled) {
+            finish(generation);
+            it = active.erase(it);
+            continue;
+        }
+        if (!generation.state) {
+            generation.state = std::make_unique<InferenceState>(model.config(), cache,
+                                                                options.context_tokens);
+            if (options.prefix_cache_bytes > 0) {
+                generation.prefilled = prefix.lookup(generation.prompt, *generation.state);
+            }
+        }
+        ++it;
+    }
+    // Prompt slices go to the most urgent generations first.
+    std::sort(active.begin(), active.end(), runs_before);
+}
+
+bool GenerationScheduler::step() {
+    members.clear();
+    batch.clear();
+    tokens.clear();
+    size_t prefill_left = options.prefill_chunk;
+    for (const std::shared_ptr<Generation> &pointer : active) {
+        Generation &generation = *pointer;
+        {
+            std::lock_guard<std::mutex> lock(generation.mutex);
+            if (generation.text.size() >= kMaxUnreadText) {
+                continue;
+            }
+        }
+        size_t remaining = generation.prompt.size() - generation.prefilled;
+        size_t take = std::min(remaining, prefill_left);
+        if (remaining > 0 && take == 0) {
+            continue;
+        }
+        if (remaining > 0) {
+            prefill_left -= take;
+            auto first = generation.prompt.begin() + generation.prefilled;
+            tokens.insert(tokens.end(), first, first + take);
+        } else {
+            take = 1;
+            tokens.push_back(generation.next_token);
+        }
+        members.push_back(&generation);
+        batch.push_back({generation.state.get(), take});
+    }
+    if (batch.empty()) {
+        return false;
+    }
+
+    size_t vocab = model.config().vocab;
+    logits.resize(batch.size() * vocab);
+    if (model.forward_batch(batch, tokens, logits.data(), scratch, pool)) {
+        for (size_t i = 0; i < members.size(); ++i) {
+            advance(*members[i], batch[i].tokens, logits.data() + i * vocab);
+        }
+    } else {
+        // Retry one at a time so only the generation that cannot go on
+        // (its context or the cache is full) is ended.
+        size_t offset = 0;
+        for (size_t i = 0; i < members.size(); ++i) {
+            std::span<const uint32_t> own(tokens.data() + offset, batch[i].tokens);
+            offset += batch[i].tokens;
+            if (model.forward_batch(std::span<const BatchEntry>(&batch[i], 1), own,
+                                    logits.data(), scratch, pool)) {
+                advance(*members[i], batch[i].tokens, logits.data());
+            } else {
+                finish(*members[i]);
+            }
+        }
+    }
+    active.erase(std::remove_if(active.begin(), active.end(),
+                                [](const std::shared_ptr<Generation> &generation) {
+                                    return !generation->state;
+                                }),
+                 active.end());
+    return true;
+}
+
+void GenerationScheduler::advance(Generation &generation, size_t fed, float *row) {
+    if (generation.prefilled < generation.prompt.size()) {
+        generation.prefilled += fed;
+        if (generation.prefilled < generation.prompt.size()) {
+            return;
+        }
+        if (options.prefix_cache_bytes > 0) {
+            prefix.insert(generation.prompt, *generation.state);
+        }
+    }
+    const ModelConfig &config = model.config();
+    if (generation.produced >= generation.params.max_tokens) {
+        finish(generation);
+        return;
+    }
+    uint32_t token = sample_token(row, config.vocab, generation.params.sampling,
+                                  generation.rng);
+    if (static_cast<int64_t>(token) == config.eos_token) {
+        finish(generation);
+        return;
+    }
+    emit(generation, token);
+    ++generation.produced;
+    if (generation.produced >= generation.params.max_tokens ||
+        generation.state->position() >= generation.state->capacity()) {
+        finish(generation);
+        return;
+    }
+    generation.next_token = token;
+}
+
+void GenerationScheduler::emit(Generation &generation, uint32_t token) {
+    generation.partial.append(tokenizer.token_bytes(token));
+    size_t complete = complete_utf8(generation.partial);
+    if (complete == 0) {
+        return;
+    }
+    bool was_empty;
+    {
+        std::lock_guard<std::mutex> lock(generation.mutex);
+        was_empty = generation.text.empty();
+        generation.text.append(generation.partial, 0, complete);
+    }
+    generation.partial.erase(0, complete);
+    generation.ready.notify_all();
+    // A reader that has not polled yet takes the new text along with the rest.
+    if (was_empty && generation.params.on_text) {
+        generation.params.on_text();
+    }
+}
+
+void GenerationScheduler::finish(Generation &generation) {
+    // Gives the cache blocks back before the reader is told.
+    generation.state.reset();
+    {
+        std::lock_guard<std::mutex> lock(generation.mutex);
+        generation.text.append(generation.partial);
+        generation.finished = true;
+    }
+    generation.partial.clear();
+    generation.ready.notify_all();
+    if (generation.params.on_text) {
+        generation.params.on_text();
+    }
+}
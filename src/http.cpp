@@ -0,0 +1,616 @@
+#include <charconv>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include "../include/http.h"
+
+namespace {
+
+bool iequals(std::string_view a, std::string_view b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); ++i) {
+        char x = a[i];
+        char y = b[i];
+        if (x >= 'A' && x <= 'Z') {
+            x = static_cast<char>(x - 'A' + 'a');
+        }
+        if (y >= 'A' && y <= 'Z') {
+            y = static_cast<char>(y - 'A' + 'a');
+        }
+        if (x != y) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Value of a hexadecimal digit, or -1.
+int hex_digit(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+std::string_view trim(std::string_view value) {
+    while (!value.empty() && (value.front() == ' ' || value.front() == '\t')) {
+        value.remove_prefix(1);
+    }
+    while (!value.empty() && (value.back() == ' ' || value.back() == '\t')) {
+        value.remove_suffix(1);
+    }
+    return value;
+}
+
+// Parses the size of a chunk-size line, ignoring chunk extensions and
+// surrounding whitespace. Both decoding passes go through here so that they
+// always agree on where each chunk starts.
+bool parse_chunk_size(std::string_view line, size_t &size) {
+    line = trim(line.substr(0, line.find(';')));
+    size = 0;
+    auto result = std::from_chars(line.data(), line.data() + line.size(), size, 16);
+    return !line.empty() && result.ec == std::errc() && result.ptr == line.data() + line.size();
+}
+
+// The final coding of a Transfer-Encoding value, which must be chunked for the
+// message length to be known (RFC 9112 6.3).
+std::string_view last_coding(std::string_view value) {
+    size_t comma = value.rfind(',');
+    return trim(comma == std::string_view::npos ? value : value.substr(comma + 1));
+}
+
+void append_number(std::string &out, size_t value) {
+    char digits[24];
+    auto result = std::to_chars(digits, digits + sizeof(digits), value);
+    out.append(digits, result.ptr);
+}
+
+void write_head(std::string &out, const HttpResponse &response, bool keep_alive) {
+    out.append("HTTP/1.1 ");
+    append_number(out, response.status);
+    out.push_back(' ');
+    out.append(http_status_text(response.status));
+    out.append("\r\nContent-Type: ");
+    out.append(response.content_type);
+    out.append(keep_alive ? "\r\nConnection: keep-alive" : "\r\nConnection: close");
+    for (const auto &header : response.headers) {
+        out.append("\r\n");
+        out.append(header.first);
+        out.append(": ");
+        out.append(header.second);
+    }
+    out.append("\r\n");
+}
+
+// 1xx, 204 and 304 responses never carry a body or a Content-Length.
+bool status_has_body(int status) {
+    return status >= 200 && status != 204 && status != 304;
+}
+
+struct HttpConnectionState : ConnectionState {
+    HttpParser parser;
+    HttpRequest request;
+    TokenBucket requests;
+    // Set while an asynchronous route has yet to reply.
+    bool awaiting_reply = false;
+};
+
+void reject(Connection &conn, int status) {
+    HttpResponse response;
+    response.status = status;
+    response.body = http_status_text(status);
+    if (status == 503) {
+        response.set_header("Retry-After", "1");
+    }
+    http_write_response(conn.output_buffer(), response, false);
+    conn.consume(conn.input().size());
+    conn.close_after_write = true;
+}
+
+} // namespace
+
+bool http_header_has_token(std::string_view value, std::string_view token) {
+    while (!value.empty()) {
+        size_t comma = value.find(',');
+        std::string_view item = value.substr(0, comma);
+        while (!item.empty() && (item.front() == ' ' || item.front() == '\t')) {
+            item.remove_prefix(1);
+        }
+        while (!item.empty() && (item.back() == ' ' || item.back() == '\t')) {
+            item.remove_suffix(1);
+        }
+        if (iequals(item, token)) {
+            return true;
+        }
+        if (comma == std::string_view::npos) {
+            break;
+        }
+        value.remove_prefix(comma + 1);
+    }
+    return false;
+}
+
+bool http_query_param(std::string_view query, std::string_view name, std::string &value) {
+    while (!query.empty()) {
+        size_t amp = query.find('&');
+        std::string_view pair = query.substr(0, amp);
+        query.remove_prefix(amp == std::string_view::npos ? query.size() : amp + 1);
+        size_t equals = pair.find('=');
+        if (pair.substr(0, equals) != name) {
+            continue;
+        }
+        std::string_view raw =
+            equals == std::string_view::npos ? std::string_view() : pair.substr(equals + 1);
+        value.clear();
+        for (size_t i = 0; i < raw.size(); ++i) {
+            if (raw[i] == '+') {
+                value.push_back(' ');
+            } else if (raw[i] != '%') {
+                value.push_back(raw[i]);
+            } else {
+                int high = i + 2 < raw.size() ? hex_digit(raw[i + 1]) : -1;
+                int low = high >= 0 ? hex_digit(raw[i + 2]) : -1;
+                if (low < 0) {
+                    return false;
+                }
+                value.push_back(static_cast<char>(high * 16 + low));
+                i += 2;
+            }
+        }
+        return true;
+    }
+    return false;
+}
+
+std::string_view HttpRequest::header(std::string_view name) const {
+    for (const auto &entry : headers) {
+        if (iequals(entry.name, name)) {
+            return entry.value;
+        }
+    }
+    return {};
+}
+
+HttpParseResult HttpParser::parse(std::string &buffer, size_t offset, HttpRequest &request,
+                                  size_t &consumed) {
+    char *base = buffer.data() + offset;
+    std::string_view data(base, buffer.size() - offset);
+
+    // Tolerate stray CRLFs between pipelined requests (RFC 9112 2.2).
+    size_t start = 0;
+    while (start + 1 < data.size() && data[start] == '\r' && data[start + 1] == '\n') {
+        start += 2;
+    }
+
+    size_t resume = scanned > start + 3 ? scanned - 3 : start;
+    size_t header_end = data.find("\r\n\r\n", resume);
+    if (header_end == std::string_view::npos) {
+        scanned = data.size();
+        return data.size() - start > max_header_bytes ? HttpParseResult::HeaderTooLarge
+                                                      : HttpParseResult::Incomplete;
+    }
+    scanned = header_end;
+    if (header_end - start > max_header_bytes) {
+        return HttpParseResult::HeaderTooLarge;
+    }
+
+    std::string_view head = data.substr(start, header_end - start);
+    size_t line_end = head.find("\r\n");
+    std::string_view request_line = head.substr(0, line_end);
+
+    size_t sp1 = request_line.find(' ');
+    size_t sp2 = sp1 == std::string_view::npos ? sp1 : request_line.find(' ', sp1 + 1);
+    if (sp1 == 0 || sp2 == std::string_view::npos || sp2 == sp1 + 1) {
+        return HttpParseResult::Error;
+    }
+
+    std::string_view version = request_line.substr(sp2 + 1);
+    if (version == "HTTP/1.1") {
+        request.version_minor = 1;
+    } else if (version == "HTTP/1.0") {
+        request.version_minor = 0;
+    } else {
+        return HttpParseResult::Error;
+    }
+
+    request.method = request_line.substr(0, sp1);
+    request.target = request_line.substr(sp1 + 1, sp2 - sp1 - 1);
+    size_t question = request.target.find('?');
+    request.path = request.target.substr(0, question);
+    request.query = question == std::string_view::npos ? std::string_view()
+                                                       : request.target.substr(question + 1);
+
+    request.headers.clear();
+    request.keep_alive = request.version_minor == 1;
+    request.chunked = false;
+    request.body = {};
+
+    bool has_length = false;
+    bool has_encoding = false;
+    size_t content_length = 0;
+
+    size_t pos = line_end == std::string_view::npos ? head.size() : line_end + 2;
+    while (pos < head.size()) {
+        size_t eol = head.find("\r\n", pos);
+        if (eol == std::string_view::npos) {
+            eol = head.size();
+        }
+        std::string_view line = head.substr(pos, eol - pos);
+        pos = eol + 2;
+
+        size_t colon = line.find(':');
+        if (colon == 0 || colon == std::string_view::npos) {
+            return HttpParseResult::Error;
+        }
+        std::string_view name = line.substr(0, colon);
+        if (name.back() == ' ' || name.back() == '\t') {
+            return HttpParseResult::Error;
+        }
+        std::string_view value = trim(line.substr(colon + 1));
+        request.headers.push_back({name, value});
+
+        if (iequals(name, "Content-Length")) {
+            size_t parsed = 0;
+            auto result = std::from_chars(value.data(), value.data() + value.size(), parsed);
+            if (result.ec != std::errc() || result.ptr != value.data() + value.size() ||
+                (has_length && parsed != content_length)) {
+                return HttpParseResult::Error;
+            }
+            has_length = true;
+            content_length = parsed;
+        } else if (iequals(name, "Transfer-Encoding")) {
+            // Repeated fields form one list, so only the last one decides.
+            has_encoding = true;
+            request.chunked = iequals(last_coding(value), "chunked");
+        } else if (iequals(name, "Connection")) {
+            if (http_header_has_token(value, "close")) {
+                request.keep_alive = false;
+            } else if (http_header_has_token(value, "keep-alive")) {
+                request.keep_alive = true;
+            }
+        }
+    }
+
+    // Both framing headers at once is the classic request smuggling vector,
+    // and a request whose final coding is not chunked has no knowable length.
+    if (has_encoding && (has_length || !request.chunked)) {
+        return HttpParseResult::Error;
+    }
+
+    size_t body_start = header_end + 4;
+
+    if (!request.chunked) {
+        if (content_length > max_body_bytes) {
+            return HttpParseResult::BodyTooLarge;
+        }
+        if (data.size() - body_start < content_length) {
+            return HttpParseResult::Incomplete;
+        }
+        request.body = data.substr(body_start, content_length);
+        consumed = body_start + content_length;
+        return HttpParseResult::Complete;
+    }
+
+    // First pass validates that every chunk has arrived without touching the
+    // buffer; only a complete body is compacted in place.
+    size_t cursor = body_start;
+    size_t decoded = 0;
+    while (true) {
+        size_t eol = data.find("\r\n", cursor);
+        if (eol == std::string_view::npos) {
+            return HttpParseResult::Incomplete;
+        }
+        size_t chunk_size = 0;
+        if (!parse_chunk_size(data.substr(cursor, eol - cursor), chunk_size)) {
+            return HttpParseResult::Error;
+        }
+        cursor = eol + 2;
+
+        if (chunk_size == 0) {
+            // Skip trailer fields up to the terminating empty line.
+            while (true) {
+                size_t trailer_end = data.find("\r\n", cursor);
+                if (trailer_end == std::string_view::npos) {
+                    return HttpParseResult::Incomplete;
+                }
+                bool empty = trailer_end == cursor;
+                cursor = trailer_end + 2;
+                if (empty) {
+                    break;
+                }
+            }
+            break;
+        }
+
+        if (chunk_size > max_body_bytes || decoded + chunk_size > max_body_bytes) {
+            return HttpParseResult::BodyTooLarge;
+        }
+        if (data.size() - cursor < chunk_size + 2) {
+            return HttpParseResult::Incomplete;
+        }
+        if (data[cursor + chunk_size] != '\r' || data[cursor + chunk_size + 1] != '\n') {
+            return HttpParseResult::Error;
+        }
+        cursor += chunk_size + 2;
+        decoded += chunk_size;
+    }
+    consumed = cursor;
+
+    char *write = base + body_start;
+    size_t read = body_start;
+    while (true) {
+        size_t eol = data.find("\r\n", read);
+        size_t chunk_size = 0;
+        parse_chunk_size(data.substr(read, eol - read), chunk_size);
+        read = eol + 2;
+        if (chunk_size == 0) {
+            break;
+        }
+        std::memmove(write, base + read, chunk_size);
+        write += chunk_size;
+        read += chunk_size + 2;
+    }
+    request.body = std::string_view(base + body_start, decoded);
+    return HttpParseResult::Complete;
+}
+
+void HttpRouter::add(std::string_view method, std::string_view path, HttpHandler handler) {
+    std::string key(method);
+    key.push_back(' ');
+    key.append(path);
+    routes[std::move(key)] = std::move(handler);
+}
+
+void HttpRouter::add_prefix(std::string_view method, std::string_view prefix,
+                            HttpHandler handler) {
+    std::string key(method);
+    key.push_back(' ');
+    key.append(prefix);
+    prefix_routes.emplace_back(std::move(key), std::move(handler));
+}
+
+void HttpRouter::add_async(std::string_view method, std::string_view path,
+                           HttpAsyncHandler handler) {
+    std::string key(method);
+    key.push_back(' ');
+    key.append(path);
+    async_routes[std::move(key)] = std::move(handler);
+}
+
+const HttpAsyncHandler *HttpRouter::dispatch(const HttpRequest &request,
+                                             HttpResponse &response) const {
+    if (guard && !guard(request, response)) {
+        return nullptr;
+    }
+
+    // Route keys are "METHOD /path"; build the lookup key on the stack.
+    char key_buffer[512];
+    size_t key_size = request.method.size() + 1 + request.path.size();
+    if (key_size <= sizeof(key_buffer)) {
+        std::memcpy(key_buffer, request.method.data(), request.method.size());
+        key_buffer[request.method.size()] = ' ';
+        std::memcpy(key_buffer + request.method.size() + 1, request.path.data(),
+                    request.path.size());
+        std::string_view key(key_buffer, key_size);
+
+        auto route = routes.find(key);
+        if (route != routes.end()) {
+            route->second(request, response);
+            return nullptr;
+        }
+        auto async_route = async_routes.find(key);
+        if (async_route != async_routes.end()) {
+            return &async_route->second;
+        }
+
+        const HttpHandler *best = nullptr;
+        size_t best_length = 0;
+        for (const auto &entry : prefix_routes) {
+            if (key.starts_with(entry.first) && entry.first.size() > best_length) {
+                best = &entry.second;
+                best_length = entry.first.size();
+            }
+        }
+        if (best) {
+            (*best)(request, response);
+            return nullptr;
+        }
+    }
+
+    if (fallback) {
+        fallback(request, response);
+        return nullptr;
+    }
+
+    response.status = 404;
+    response.body = http_status_text(404);
+    return nullptr;
+}
+
+const char *http_status_text(int status) {
+    switch (status) {
+    case 100: return "Continue";
+    case 101: return "Switching Protocols";
+    case 200: return "OK";
+    case 201: return "Created";
+    case 204: return "No Content";
+    case 206: return "Partial Content";
+    case 304: return "Not Modified";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 408: return "Request Timeout";
+    case 413: return "Content Too Large";
+    case 416: return "Range Not Satisfiable";
+    case 429: return "Too Many Requests";
+    case 431: return "Request Header Fields Too Large";
+    case 500: return "Internal Server Error";
+    case 503: return "Service Unavailable";
+    default: return "Unknown";
+    }
+}
+
+void http_write_response(std::string &out, const HttpResponse &response, bool keep_alive) {
+    write_head(out, response, keep_alive);
+    if (!status_has_body(response.status)) {
+        out.append("\r\n");
+        return;
+    }
+    out.append("Content-Length: ");
+    append_number(out, response.body.size());
+    out.append("\r\n\r\n");
+    out.append(response.body);
+}
+
+void http_send_response(Connection &conn, const HttpResponse &response, bool keep_alive,
+                        bool head_only) {
+    std::string &out = conn.output_buffer();
+    write_head(out, response, keep_alive);
+    if (!status_has_body(response.status)) {
+        out.append("\r\n");
+        return;
+    }
+
+    bool shared = response.shared_body != nullptr;
+    out.append("Content-Length: ");
+    append_number(out, shared ? response.shared_size : response.body.size());
+    out.append("\r\n\r\n");
+    if (head_only) {
+        return;
+    }
+    if (shared) {
+        conn.send_shared(response.shared_body, response.shared_offset, response.shared_size);
+    } else {
+        out.append(response.body);
+    }
+}
+
+void http_write_chunked_head(std::string &out, const HttpResponse &response, bool keep_alive) {
+    write_head(out, response, keep_alive);
+    out.append("Transfer-Encoding: chunked\r\n\r\n");
+}
+
+void http_write_chunk(std::string &out, std::string_view data) {
+    if (data.empty()) {
+        return;
+    }
+    char digits[16];
+    auto result = std::to_chars(digits, digits + sizeof(digits), data.size(), 16);
+    out.append(digits, result.ptr);
+    out.append("\r\n");
+    out.append(data);
+    out.append("\r\n");
+}
+
+void http_write_last_chunk(std::string &out) {
+    out.append("0\r\n\r\n");
+}
+
+namespace {
+
+// Runs an asynchronous route and stops serving the connection until its
+// reply has been sent; the loop then calls the handler again for any
+// requests pipelined behind it.
+void defer_reply(Connection &conn, HttpConnectionState &state, const HttpAsyncHandler &handler,
+                 size_t consumed) {
+    state.awaiting_reply = true;
+    bool keep_alive = state.request.keep_alive;
+    bool head_only = state.request.method == "HEAD";
+    EventLoop *loop = conn.loop;
+    ConnectionRef ref = conn.ref();
+    handler(state.request, [loop, ref, keep_alive, head_only](HttpResponse response) {
+        loop->post_to(ref, [response = std::move(response), keep_alive,
+                            head_only](Connection &conn) {
+            auto *state = dynamic_cast<HttpConnectionState *>(conn.state.get());
+            if (!state || !state->awaiting_reply) {
+                return;
+            }
+            state->awaiting_reply = false;
+            bool keep = keep_alive && !response.close;
+            http_send_response(conn, response, keep, head_only);
+            if (keep) {
+                conn.notify_on_drain = true;
+            } else {
+                conn.close_after_write = true;
+            }
+        });
+    });
+    conn.consume(consumed);
+    state.parser.reset();
+}
+
+} // namespace
+
+void serve_http(Connection &conn, const HttpRouter &router) {
+    auto *state = dynamic_cast<HttpConnectionState *>(conn.state.get());
+    if (!state) {
+        conn.state = std::make_unique<HttpConnectionState>();
+        state = static_cast<HttpConnectionState *>(conn.state.get());
+        if (conn.limits) {
+            state->parser.set_limits(conn.limits->max_header_bytes, conn.limits->max_body_bytes);
+            state->requests = TokenBucket(conn.limits->request_rate, conn.limits->request_burst);
+        }
+    }
+
+    while (!conn.close_after_write && !state->awaiting_reply && !conn.input().empty()) {
+        // A client that pipelines without reading its responses waits here
+        // until they drain; its further requests stay in the socket.
+        if (conn.limits && conn.pending_output() >= conn.limits->max_output_bytes) {
+            conn.notify_on_drain = true;
+            return;
+        }
+
+        size_t consumed = 0;
+        HttpParseResult result = state->parser.parse(conn.in, conn.in_offset, state->request,
+                                                     consumed);
+        if (result == HttpParseResult::Incomplete) {
+            if (conn.limits) {
+                conn.arm_deadline(conn.limits->request_timeout_ms);
+            }
+            return;
+        }
+        conn.clear_deadline();
+        if (result == HttpParseResult::Error) {
+            reject(conn, 400);
+            return;
+        }
+        if (result == HttpParseResult::HeaderTooLarge) {
+            reject(conn, 431);
+            return;
+        }
+        if (result == HttpParseResult::BodyTooLarge) {
+            reject(conn, 413);
+            return;
+        }
+
+        if (conn.limits && !state->requests.take(monotonic_ms())) {
+            reject(conn, 503);
+            return;
+        }
+
+        HttpResponse response;
+        if (const HttpAsyncHandler *deferred = router.dispatch(state->request, response)) {
+            defer_reply(conn, *state, *deferred, consumed);
+            return;
+        }
+        bool keep_alive = state->request.keep_alive && !response.close;
+        http_send_response(conn, response, keep_alive, state->request.method == "HEAD");
+
+        conn.consume(consumed);
+        state->parser.reset();
+        if (!keep_alive) {
+            conn.close_after_write = true;
+        }
+    }
+}
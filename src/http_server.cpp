@@ -2,55 +2,37 @@
 #include <string>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <unistd.h>
-#include <cstring>
+#include "../include/auth_middleware.h"
+#include "../include/event_loop.h"
+#include "../include/http.h"
 #include "../include/openssl_init.h"
-
-void handle_client(int client_socket) {
-    const char *response = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n\r\nHello, World!";
-    send(client_socket, response, strlen(response), 0);
-    close(client_socket);
+#include "../include/server_runtime.h"
+
+namespace {
+
+HttpRouter build_http_routes() {
+    HttpRouter router;
+    router.add("GET", "/", [](const HttpRequest &, HttpResponse &response) {
+        response.body = "Hello, World!";
+    });
+    router.add("GET", "/health", [](const HttpRequest &, HttpResponse &response) {
+        response.body = "OK";
+    });
+    install_auth(router, auth_service(), {"/health"});
+    return router;
 }
 
-void start_server(int port) {
-    int server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket < 0) {
-        std::cerr << "Error creating socket" << std::endl;
-        return;
-    }
+void handle_client(Connection &conn) {
+    static const HttpRouter router = build_http_routes();
+    serve_http(conn, router);
+}
 
-    struct sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(port);
+} // namespace
 
-    if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        std::cerr << "Error binding socket" << std::endl;
-        close(server_socket);
-        return;
-    }
-
-    if (listen(server_socket, 3) < 0) {
-        std::cerr << "Error listening on socket" << std::endl;
-        close(server_socket);
+void register_http_server(ServerRuntime &runtime, int port) {
+    if (!runtime.add_service(port, handle_client)) {
         return;
     }
 
     std::cout << "Server listening on port " << port << std::endl;
-
-    while (true) {
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
-        int client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &client_len);
-        if (client_socket < 0) {
-            std::cerr << "Error accepting connection" << std::endl;
-            continue;
-        }
-
-        handle_client(client_socket);
-    }
-
-    close(server_socket);
 }
@@ -0,0 +1,401 @@
+#include <iostream>
+#include <string>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <numeric>
+#include "../include/inference.h"
+#include "../include/tensor_ops.h"
+
+namespace {
+
+constexpr size_t kDefaultHeadDim = 64;
+
+bool check_shape(const WeightTensor *tensor, const std::string &name, size_t rows, size_t cols) {
+    if (!tensor) {
+        std::cerr << "Model is missing tensor " << name << std::endl;
+        return false;
+    }
+    if (tensor->rows != rows || tensor->cols != cols) {
+        std::cerr << "Tensor " << name << " is " << tensor->rows << "x" << tensor->cols
+                  << ", expected " << rows << "x" << cols << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool check_vector(const WeightTensor *tensor, const std::string &name, size_t size) {
+    if (!check_shape(tensor, name, 1, size)) {
+        return false;
+    }
+    if (tensor->type != WeightType::F32) {
+        std::cerr << "Tensor " << name << " must be F32" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// A count stored as a float in hparams: finite, whole and at most limit.
+// Casting anything else to size_t is undefined or yields nonsense shapes.
+bool read_count(float value, size_t limit, size_t &count) {
+    if (!std::isfinite(value) || value < 0.0f || value != std::floor(value) ||
+        value > static_cast<float>(limit)) {
+        return false;
+    }
+    count = static_cast<size_t>(value);
+    return true;
+}
+
+} // namespace
+
+InferenceState::InferenceState(const ModelConfig &model_config, KvBlockPool &blocks,
+                               size_t positions)
+    : config(model_config), max_positions(positions), cache(blocks) {}
+
+InferenceState InferenceState::fork() const {
+    InferenceState copy(config, cache.pool(), max_positions);
+    copy.length = length;
+    copy.cache = cache.fork();
+    return copy;
+}
+
+void ForwardScratch::reserve(const ModelConfig &config, size_t count) {
+    if (count <= rows) {
+        return;
+    }
+    rows = count;
+    x.resize(count * config.dim);
+    xb.resize(count * config.dim);
+    q.resize(count * config.dim);
+    k.resize(count * config.kv_dim());
+    v.resize(count * config.kv_dim());
+    attention.resize(count * config.dim);
+    gate.resize(count * config.hidden);
+    up.resize(count * config.hidden);
+    out.resize(count * config.dim);
+    owner.resize(count);
+    visible.resize(count);
+}
+
+bool TransformerModel::load(const ModelWeights &weights) {
+    embeddings = nullptr;
+    layers.clear();
+
+    ModelConfig config;
+    const WeightTensor *tokens = weights.find("tok_embeddings");
+    if (!tokens) {
+        std::cerr << "Model is missing tensor tok_embeddings" << std::endl;
+        return false;
+    }
+    config.vocab = tokens->rows;
+    config.dim = tokens->cols;
+    while (weights.find("layers." + std::to_string(config.layers) + ".wq")) {
+        ++config.layers;
+    }
+    if (config.layers == 0) {
+        std::cerr << "Model has no layers" << std::endl;
+        return false;
+    }
+
+    config.heads = config.dim / kDefaultHeadDim;
+    if (const WeightTensor *hparams = weights.find("hparams")) {
+        if (hparams->type != WeightType::F32 || hparams->cols < 4) {
+            std::cerr << "Tensor hparams must be F32 with at least 4 values" << std::endl;
+            return false;
+        }
+        const float *values = hparams->f32_row(0);
+        // A kv_heads of 0 means as many as layer 0's wk holds.
+        if (!read_count(values[0], config.dim, config.heads) ||
+            !read_count(values[1], config.dim, config.kv_heads)) {
+            std::cerr << "Tensor hparams has head counts " << values[0] << " and " << values[1]
+                      << "; they must be whole numbers up to " << config.dim << std::endl;
+            return false;
+        }
+        if (!std::isfinite(values[2]) || values[2] <= 0.0f || !std::isfinite(values[3]) ||
+            values[3] <= 0.0f || values[3] >= 1.0f) {
+            std::cerr << "Tensor hparams has RoPE theta " << values[2] << " and norm epsilon "
+                      << values[3] << "; theta must be positive and epsilon in (0, 1)"
+                      << std::endl;
+            return false;
+        }
+        config.rope_theta = values[2];
+        config.norm_eps = values[3];
+        // A negative end-of-sequence token means the model has none.
+        if (hparams->cols > 4 && !(values[4] < 0.0f)) {
+            size_t eos = 0;
+            if (!read_count(values[4], config.vocab - 1, eos)) {
+                std::cerr << "Tensor hparams has end-of-sequence token " << values[4]
+                          << " outside the vocabulary of " << config.vocab << std::endl;
+                return false;
+            }
+            config.eos_token = static_cast<int64_t>(eos);
+        }
+    }
+    if (config.heads == 0 || config.dim % config.heads != 0) {
+        std::cerr << "Model width " << config.dim << " does not split into " << config.heads
+                  << " heads" << std::endl;
+        return false;
+    }
+    config.head_dim = config.dim / config.heads;
+    const WeightTensor *first_wk = weights.find("layers.0.wk");
+    const WeightTensor *first_w1 = weights.find("layers.0.w1");
+    if (!first_wk || !first_w1) {
+        std::cerr << "Model is missing layer 0 tensors" << std::endl;
+        return false;
+    }
+    if (config.kv_heads == 0) {
+        config.kv_heads = first_wk->rows / config.head_dim;
+    }
+    config.hidden = first_w1->rows;
+    if (config.kv_heads == 0 || config.heads % config.kv_heads != 0 ||
+        config.head_dim % 2 != 0 || config.head_dim > 512) {
+        std::cerr << "Unsupported attention shape: " << config.heads << " heads, "
+                  << config.kv_heads << " key/value heads of " << config.head_dim << std::endl;
+        return false;
+    }
+
+    std::vector<Layer> bound(config.layers);
+    for (size_t i = 0; i < config.layers; ++i) {
+        std::string prefix = "layers." + std::to_string(i) + ".";
+        auto find = [&](const char *name) { return weights.find(prefix + name); };
+        Layer &layer = bound[i];
+        layer.attention_norm = find("attention_norm");
+        layer.wq = find("wq");
+        layer.wk = find("wk");
+        layer.wv = find("wv");
+        layer.wo = find("wo");
+        layer.ffn_norm = find("ffn_norm");
+        layer.w1 = find("w1");
+        layer.w2 = find("w2");
+        layer.w3 = find("w3");
+        if (!check_vector(layer.attention_norm, prefix + "attention_norm", config.dim) ||
+            !check_shape(layer.wq, prefix + "wq", config.dim, config.dim) ||
+            !check_shape(layer.wk, prefix + "wk", config.kv_dim(), config.dim) ||
+            !check_shape(layer.wv, prefix + "wv", config.kv_dim(), config.dim) ||
+            !check_shape(layer.wo, prefix + "wo", config.dim, config.dim) ||
+            !check_vector(layer.ffn_norm, prefix + "ffn_norm", config.dim) ||
+            !check_shape(layer.w1, prefix + "w1", config.hidden, config.dim) ||
+            !check_shape(layer.w2, prefix + "w2", config.dim, config.hidden) ||
+            !check_shape(layer.w3, prefix + "w3", config.hidden, config.dim)) {
+            return false;
+        }
+    }
+
+    const WeightTensor *norm = weights.find("norm");
+    const WeightTensor *head = weights.find("output");
+    if (!check_vector(norm, "norm", config.dim) ||
+        !check_shape(head ? head : tokens, "output", config.vocab, config.dim)) {
+        return false;
+    }
+
+    inv_freq.resize(config.head_dim / 2);
+    for (size_t i = 0; i < inv_freq.size(); ++i) {
+        inv_freq[i] = std::pow(config.rope_theta,
+                               -2.0f * static_cast<float>(i) / static_cast<float>(config.head_dim));
+    }
+    model_config = config;
+    layers = std::move(bound);
+    final_norm = norm;
+    output = head ? head : tokens;
+    embeddings = tokens;
+    return true;
+}
+
+bool TransformerModel::forward(InferenceState &state, std::span<const uint32_t> tokens,
+                               float *logits, ComputePool &pool) const {
+    BatchEntry entry{&state, tokens.size()};
+    return forward_batch(std::span<const BatchEntry>(&entry, 1), tokens, logits, state.scratch,
+                         pool);
+}
+
+bool TransformerModel::forward_batch(std::span<const BatchEntry> batch,
+                                     std::span<const uint32_t> tokens, float *logits,
+                                     ForwardScratch &scratch, ComputePool &pool) const {
+    const ModelConfig &c = model_config;
+    size_t n = tokens.size();
+    if (n == 0 || batch.empty() || !loaded()) {
+        return false;
+    }
+    size_t total = 0;
+    for (const BatchEntry &entry : batch) {
+        total += entry.tokens;
+    }
+    if (total != n) {
+        std::cerr << "Batch entries take " << total << " tokens but " << n << " were given"
+                  << std::endl;
+        return false;
+    }
+    scratch.reserve(c, n);
+    size_t row = 0;
+    for (size_t e = 0; e < batch.size(); ++e) {
+        InferenceState &state = *batch[e].state;
+        size_t count = batch[e].tokens;
+        if (count == 0) {
+            std::cerr << "Batch entry " << e << " has no tokens" << std::endl;
+            return false;
+        }
+        if (state.length + count > state.max_positions) {
+            std::cerr << "Context of " << state.max_positions << " tokens is full" << std::endl;
+            return false;
+        }
+        const KvCacheOptions &kv_options = state.cache.pool().options();
+        if (kv_options.layers != c.layers || kv_options.kv_dim != c.kv_dim()) {
+            std::cerr << "KV cache is not set up for this model" << std::endl;
+            return false;
+        }
+        if (!state.cache.prepare(state.length, count)) {
+            return false;
+        }
+        size_t block_tokens = kv_options.block_tokens;
+        state.block_data.resize((state.length + count + block_tokens - 1) / block_tokens);
+        for (size_t i = 0; i < count; ++i, ++row) {
+            scratch.owner[row] = static_cast<uint32_t>(e);
+            scratch.visible[row] = state.length + i + 1;
+        }
+    }
+
+    size_t dim = c.dim;
+    size_t kv_dim = c.kv_dim();
+    size_t head_dim = c.head_dim;
+    size_t group = c.heads / c.kv_heads;
+    float *x = scratch.x.data();
+    float *xb = scratch.xb.data();
+
+    for (size_t i = 0; i < n; ++i) {
+        if (tokens[i] >= c.vocab) {
+            std::cerr << "Token " << tokens[i] << " is outside the vocabulary" << std::endl;
+            return false;
+        }
+        embeddings->dequantize_row(tokens[i], x + i * dim);
+    }
+
+    // Unpins the blocks of the first count entries for layer l.
+    auto unpin = [&](size_t l, size_t count) {
+        for (size_t e = 0; e < count; ++e) {
+            InferenceState &state = *batch[e].state;
+            state.cache.pool().unpin(state.cache.blocks(l).first(state.block_data.size()));
+        }
+    };
+
+    for (size_t l = 0; l < layers.size(); ++l) {
+        const Layer &layer = layers[l];
+        // Only this layer's blocks need to be in memory; the new positions
+        // are written to the blocks from each state's length on.
+        for (size_t e = 0; e < batch.size(); ++e) {
+            InferenceState &state = *batch[e].state;
+            size_t block_tokens = state.cache.pool().options().block_tokens;
+            std::span<const uint32_t> ids = state.cache.blocks(l).first(state.block_data.size());
+            if (!state.cache.pool().pin(ids, state.block_data.data(),
+                                        state.length / block_tokens)) {
+                unpin(l, e);
+                return false;
+            }
+        }
+
+        for (size_t i = 0; i < n; ++i) {
+            rmsnorm(x + i * dim, layer.attention_norm->f32_row(0), dim, c.norm_eps, xb + i * dim);
+        }
+        matmul(*layer.wq, xb, n, dim, scratch.q.data(), dim, pool);
+        matmul(*layer.wk, xb, n, dim, scratch.k.data(), kv_dim, pool);
+        matmul(*layer.wv, xb, n, dim, scratch.v.data(), kv_dim, pool);
+        row = 0;
+        for (const BatchEntry &entry : batch) {
+            InferenceState &state = *entry.state;
+            size_t block_tokens = state.cache.pool().options().block_tokens;
+            for (size_t i = 0; i < entry.tokens; ++i, ++row) {
+                size_t pos = state.length + i;
+                rope(scratch.q.data() + row * dim, c.heads, head_dim, pos, inv_freq.data());
+                rope(scratch.k.data() + row * kv_dim, c.kv_heads, head_dim, pos, inv_freq.data());
+                float *key = state.block_data[pos / block_tokens] + (pos % block_tokens) * kv_dim;
+                std::memcpy(key, scratch.k.data() + row * kv_dim, kv_dim * sizeof(float));
+                std::memcpy(key + block_tokens * kv_dim, scratch.v.data() + row * kv_dim,
+                            kv_dim * sizeof(float));
+            }
+        }
+
+        // Each row attends to everything of its own sequence up to and
+        // including itself.
+        pool.parallel_for(n * c.heads, 1, [&](size_t begin, size_t end) {
+            for (size_t task = begin; task < end; ++task) {
+                size_t i = task / c.heads;
+                size_t h = task % c.heads;
+                const InferenceState &state = *batch[scratch.owner[i]].state;
+                KvBlocks kv{state.block_data.data(), state.cache.pool().options().block_tokens,
+                            kv_dim};
+                attend(scratch.q.data() + i * dim + h * head_dim, kv, (h / group) * head_dim,
+                       scratch.visible[i], head_dim,
+                       scratch.attention.data() + i * dim + h * head_dim);
+            }
+        });
+        unpin(l, batch.size());
+        matmul(*layer.wo, scratch.attention.data(), n, dim, scratch.out.data(), dim, pool);
+        for (size_t j = 0; j < n * dim; ++j) {
+            x[j] += scratch.out[j];
+        }
+
+        for (size_t i = 0; i < n; ++i) {
+            rmsnorm(x + i * dim, layer.ffn_norm->f32_row(0), dim, c.norm_eps, xb + i * dim);
+        }
+        matmul(*layer.w1, xb, n, dim, scratch.gate.data(), c.hidden, pool);
+        matmul(*layer.w3, xb, n, dim, scratch.up.data(), c.hidden, pool);
+        silu_mul(scratch.gate.data(), scratch.up.data(), n * c.hidden);
+        matmul(*layer.w2, scratch.gate.data(), n, c.hidden, scratch.out.data(), dim, pool);
+        for (size_t j = 0; j < n * dim; ++j) {
+            x[j] += scratch.out[j];
+        }
+    }
+
+    // Only the last row of each entry predicts its next token.
+    row = 0;
+    for (size_t e = 0; e < batch.size(); ++e) {
+        row += batch[e].tokens;
+        batch[e].state->length += batch[e].tokens;
+        rmsnorm(x + (row - 1) * dim, final_norm->f32_row(0), dim, c.norm_eps, xb + e * dim);
+    }
+    matmul(*output, xb, batch.size(), dim, logits, c.vocab, pool);
+    return true;
+}
+
+uint32_t sample_token(float *logits, size_t vocab, const SamplingParams &params,
+                      std::mt19937 &rng) {
+    if (params.temperature <= 0.0f || vocab < 2) {
+        return static_cast<uint32_t>(std::max_element(logits, logits + vocab) - logits);
+    }
+
+    thread_local std::vector<uint32_t> candidates;
+    candidates.resize(vocab);
+    std::iota(candidates.begin(), candidates.end(), 0u);
+    size_t keep = params.top_k == 0 ? vocab : std::min(params.top_k, vocab);
+    auto by_logit = [logits](uint32_t a, uint32_t b) { return logits[a] > logits[b]; };
+    std::partial_sort(candidates.begin(), candidates.begin() + keep, candidates.end(), by_logit);
+
+    float max = logits[candidates[0]];
+    float total = 0.0f;
+    for (size_t i = 0; i < keep; ++i) {
+        float p = std::exp((logits[candidates[i]] - max) / params.temperature);
+        logits[candidates[i]] = p;
+        total += p;
+    }
+    // Smallest prefix whose probability reaches top_p.
+    float cumulative = 0.0f;
+    size_t nucleus = keep;
+    for (size_t i = 0; i < keep; ++i) {
+        cumulative += logits[candidates[i]] / total;
+        if (cumulative >= params.top_p) {
+            nucleus = i + 1;
+            break;
+        }
+    }
+    float mass = 0.0f;
+    for (size_t i = 0; i < nucleus; ++i) {
+        mass += logits[candidates[i]];
+    }
+    float pick = std::uniform_real_distribution<float>(0.0f, mass)(rng);
+    for (size_t i = 0; i < nucleus; ++i) {
+        pick -= logits[candidates[i]];
+        if (pick <= 0.0f) {
+            return candidates[i];
+        }
+    }
+    return candidates[nucleus - 1];
+}
@@ -23,15 +23,3 @@ void apply_firewall_security_profiles() {
     // Placeholder for applying firewall security profiles logic
     std::cout << "Firewall security profiles applied" << std::endl;
 }
-
-int main() {
-    init_openssl();
-
-    confirm_system_paths();
-    verify_networking_components();
-    install_dependencies();
-    apply_firewall_security_profiles();
-
-    cleanup_openssl();
-    return 0;
-}
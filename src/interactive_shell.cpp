@@ -1,5 +1,6 @@
 #include <iostream>
 #include <string>
+#include <cstdlib>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include "../include/openssl_init.h"
@@ -63,3 +64,17 @@ void handle_choice(int choice) {
             std::cout << "Invalid choice. Please try again." << std::endl;
     }
 }
+
+// Reads menu choices from standard input until 10 or the end of input.
+void run_shell() {
+    std::string line;
+    display_menu();
+    while (std::getline(std::cin, line)) {
+        int choice = std::atoi(line.c_str());
+        handle_choice(choice);
+        if (choice == 10) {
+            break;
+        }
+        display_menu();
+    }
+}
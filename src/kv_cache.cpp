@@ -0,0 +1,404 @@
+#include <iostream>
+#include <string>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "../include/kv_cache.h"
+
+namespace {
+
+// The spill file grows by at least this many blocks at a time.
+constexpr size_t kSpillGrowth = 64;
+
+} // namespace
+
+KvBlockPool::~KvBlockPool() {
+    reset();
+}
+
+void KvBlockPool::reset() {
+    if (arena) {
+        munmap(arena, slot_count * block_bytes);
+        arena = nullptr;
+    }
+    if (spill_map) {
+        munmap(spill_map, spill_capacity * block_bytes);
+        spill_map = nullptr;
+    }
+    if (spill_fd >= 0) {
+        ::close(spill_fd);
+        spill_fd = -1;
+    }
+    blocks.clear();
+    free_ids.clear();
+    free_slots.clear();
+    free_spills.clear();
+    slot_count = slots_used = 0;
+    spill_capacity = spills_used = 0;
+    lru_head = lru_tail = kNoBlock;
+    spill_count = reload_count = 0;
+}
+
+bool KvBlockPool::init(const KvCacheOptions &options) {
+    std::lock_guard<std::mutex> guard(lock);
+    reset();
+    config = options;
+    block_bytes = block_floats() * sizeof(float);
+    if (block_bytes == 0 || config.layers == 0) {
+        std::cerr << "KV cache needs a layer count, width and block size" << std::endl;
+        return false;
+    }
+    slot_count = std::max<size_t>(1, config.memory_budget / block_bytes);
+    void *mapping = mmap(nullptr, slot_count * block_bytes, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mapping == MAP_FAILED) {
+        std::cerr << "Unable to reserve " << config.memory_budget
+                  << " bytes for the KV cache: " << std::strerror(errno) << std::endl;
+        slot_count = 0;
+        return false;
+    }
+    arena = static_cast<float *>(mapping);
+
+    if (!config.spill_dir.empty()) {
+        std::string path = config.spill_dir + "/svaklaai-kv-XXXXXX";
+        spill_fd = mkostemp(path.data(), O_CLOEXEC);
+        if (spill_fd < 0) {
+            std::cerr << "Unable to create a KV spill file in " << config.spill_dir << ": "
+                      << std::strerror(errno) << std::endl;
+        } else {
+            // Nothing else needs the name, and the space is reclaimed on exit.
+            unlink(path.c_str());
+        }
+    }
+    return true;
+}
+
+float *KvBlockPool::slot_data(uint32_t slot) const {
+    return arena + static_cast<size_t>(slot) * block_floats();
+}
+
+float *KvBlockPool::spill_data(uint32_t spill) const {
+    return spill_map + static_cast<size_t>(spill) * block_floats();
+}
+
+void KvBlockPool::lru_unlink(uint32_t id) {
+    Block &block = blocks[id];
+    if (block.prev != kNoBlock) {
+        blocks[block.prev].next = block.next;
+    } else {
+        lru_head = block.next;
+    }
+    if (block.next != kNoBlock) {
+        blocks[block.next].prev = block.prev;
+    } else {
+        lru_tail = block.prev;
+    }
+    block.prev = block.next = kNoBlock;
+}
+
+void KvBlockPool::lru_append(uint32_t id) {
+    Block &block = blocks[id];
+    block.prev = lru_tail;
+    block.next = kNoBlock;
+    if (lru_tail != kNoBlock) {
+        blocks[lru_tail].next = id;
+    } else {
+        lru_head = id;
+    }
+    lru_tail = id;
+}
+
+void KvBlockPool::pin_locked(uint32_t id) {
+    if (blocks[id].pins++ == 0) {
+        lru_unlink(id);
+    }
+}
+
+void KvBlockPool::unpin_locked(uint32_t id) {
+    if (--blocks[id].pins == 0) {
+        lru_append(id);
+    }
+}
+
+uint32_t KvBlockPool::take_spill() {
+    if (!free_spills.empty()) {
+        uint32_t spill = free_spills.back();
+        free_spills.pop_back();
+        return spill;
+    }
+    if (spills_used == spill_capacity) {
+        size_t capacity = std::max(kSpillGrowth, spill_capacity * 2);
+        if (ftruncate(spill_fd, static_cast<off_t>(capacity * block_bytes)) != 0) {
+            std::cerr << "Unable to grow the KV spill file: " << std::strerror(errno)
+                      << std::endl;
+            return kNoBlock;
+        }
+        void *mapping = spill_map
+            ? mremap(spill_map, spill_capacity * block_bytes, capacity * block_bytes,
+                     MREMAP_MAYMOVE)
+            : mmap(nullptr, capacity * block_bytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   spill_fd, 0);
+        if (mapping == MAP_FAILED) {
+            std::cerr << "Unable to map the KV spill file: " << std::strerror(errno)
+                      << std::endl;
+            return kNoBlock;
+        }
+        spill_map = static_cast<float *>(mapping);
+        spill_capacity = capacity;
+    }
+    return static_cast<uint32_t>(spills_used++);
+}
+
+uint32_t KvBlockPool::take_slot() {
+    if (!free_slots.empty()) {
+        uint32_t slot = free_slots.back();
+        free_slots.pop_back();
+        return slot;
+    }
+    if (slots_used < slot_count) {
+        return static_cast<uint32_t>(slots_used++);
+    }
+    uint32_t victim = lru_head;
+    if (victim == kNoBlock || spill_fd < 0) {
+        return kNoBlock;
+    }
+    Block &block = blocks[victim];
+    if (block.spill == kNoBlock) {
+        block.spill = take_spill();
+        if (block.spill == kNoBlock) {
+            return kNoBlock;
+        }
+        block.dirty = true;
+    }
+    if (block.dirty) {
+        std::memcpy(spill_data(block.spill), slot_data(block.slot), block_bytes);
+        block.dirty = false;
+        ++spill_count;
+    }
+    lru_unlink(victim);
+    uint32_t slot = block.slot;
+    block.slot = kNoBlock;
+    return slot;
+}
+
+bool KvBlockPool::make_resident(uint32_t id) {
+    if (blocks[id].slot != kNoBlock) {
+        return true;
+    }
+    uint32_t slot = take_slot();
+    if (slot == kNoBlock) {
+        return false;
+    }
+    Block &block = blocks[id];
+    std::memcpy(slot_data(slot), spill_data(block.spill), block_bytes);
+    block.slot = slot;
+    block.dirty = false;
+    ++reload_count;
+    lru_append(id);
+    return true;
+}
+
+uint32_t KvBlockPool::allocate() {
+    std::lock_guard<std::mutex> guard(lock);
+    uint32_t slot = arena ? take_slot() : kNoBlock;
+    if (slot == kNoBlock) {
+        std::cerr << "KV cache is full (" << slot_count << " blocks in memory"
+                  << (spill_fd < 0 ? ", no spill file" : "") << ")" << std::endl;
+        return kNoBlock;
+    }
+    uint32_t id;
+    if (!free_ids.empty()) {
+        id = free_ids.back();
+        free_ids.pop_back();
+    } else {
+        id = static_cast<uint32_t>(blocks.size());
+        blocks.emplace_back();
+    }
+    blocks[id] = Block();
+    blocks[id].refs = 1;
+    blocks[id].slot = slot;
+    lru_append(id);
+    return id;
+}
+
+void KvBlockPool::retain(uint32_t id) {
+    std::lock_guard<std::mutex> guard(lock);
+    ++blocks[id].refs;
+}
+
+void KvBlockPool::release(uint32_t id) {
+    std::lock_guard<std::mutex> guard(lock);
+    release_locked(id);
+}
+
+void KvBlockPool::release_locked(uint32_t id) {
+    Block &block = blocks[id];
+    if (--block.refs > 0) {
+        return;
+    }
+    if (block.slot != kNoBlock) {
+        lru_unlink(id);
+        free_slots.push_back(block.slot);
+    }
+    if (block.spill != kNoBlock) {
+        free_spills.push_back(block.spill);
+    }
+    block = Block();
+    free_ids.push_back(id);
+}
+
+uint32_t KvBlockPool::make_private(uint32_t id) {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (blocks[id].refs == 1) {
+            return id;
+        }
+    }
+    // allocate() may evict the source, so it stays pinned until copied.
+    float *source = nullptr;
+    if (!pin(std::span<const uint32_t>(&id, 1), &source, 1)) {
+        return kNoBlock;
+    }
+    uint32_t copy = allocate();
+    std::lock_guard<std::mutex> guard(lock);
+    unpin_locked(id);
+    if (copy == kNoBlock) {
+        return kNoBlock;
+    }
+    if (blocks[id].refs == 1) {
+        // The other holders let go in the meantime.
+        release_locked(copy);
+        return id;
+    }
+    std::memcpy(slot_data(blocks[copy].slot), source, block_bytes);
+    --blocks[id].refs;
+    return copy;
+}
+
+bool KvBlockPool::pin(std::span<const uint32_t> ids, float **data, size_t written_from) {
+    std::lock_guard<std::mutex> guard(lock);
+    for (size_t i = 0; i < ids.size(); ++i) {
+        if (!make_resident(ids[i])) {
+            std::cerr << "KV cache budget of " << slot_count << " blocks cannot hold "
+                      << ids.size() << " more at once" << std::endl;
+            for (size_t j = 0; j < i; ++j) {
+                unpin_locked(ids[j]);
+            }
+            return false;
+        }
+        pin_locked(ids[i]);
+        Block &block = blocks[ids[i]];
+        if (i >= written_from) {
+            block.dirty = true;
+        }
+        data[i] = slot_data(block.slot);
+    }
+    return true;
+}
+
+void KvBlockPool::unpin(std::span<const uint32_t> ids) {
+    std::lock_guard<std::mutex> guard(lock);
+    for (uint32_t id : ids) {
+        unpin_locked(id);
+    }
+}
+
+KvBlockPool::Stats KvBlockPool::stats() const {
+    std::lock_guard<std::mutex> guard(lock);
+    Stats stats;
+    stats.blocks = blocks.size() - free_ids.size();
+    for (const Block &block : blocks) {
+        if (block.refs == 0) {
+            continue;
+        }
+        stats.resident += block.slot != kNoBlock;
+        stats.spilled += block.slot == kNoBlock;
+        stats.shared += block.refs > 1;
+    }
+    stats.spills = spill_count;
+    stats.reloads = reload_count;
+    return stats;
+}
+
+KvSequence::KvSequence(KvBlockPool &pool) : owner(&pool), tables(pool.options().layers) {}
+
+KvSequence::~KvSequence() {
+    truncate(0);
+}
+
+KvSequence::KvSequence(KvSequence &&other) noexcept
+    : owner(other.owner), tables(std::move(other.tables)) {
+    other.tables.clear();
+}
+
+KvSequence &KvSequence::operator=(KvSequence &&other) noexcept {
+    if (this != &other) {
+        truncate(0);
+        owner = other.owner;
+        tables = std::move(other.tables);
+        other.tables.clear();
+    }
+    return *this;
+}
+
+KvSequence KvSequence::fork() const {
+    KvSequence copy(*owner);
+    copy.tables = tables;
+    for (const std::vector<uint32_t> &table : tables) {
+        for (uint32_t id : table) {
+            owner->retain(id);
+        }
+    }
+    return copy;
+}
+
+void KvSequence::attach(size_t layer, uint32_t id) {
+    owner->retain(id);
+    tables[layer].push_back(id);
+}
+
+bool KvSequence::prepare(size_t first, size_t count) {
+    size_t block_tokens = owner->options().block_tokens;
+    if (!owner->ready() || tables.size() != owner->options().layers) {
+        std::cerr << "KV cache is not configured for this model" << std::endl;
+        return false;
+    }
+    if (count == 0) {
+        return true;
+    }
+    size_t begin = first / block_tokens;
+    size_t end = (first + count - 1) / block_tokens + 1;
+    for (std::vector<uint32_t> &table : tables) {
+        if (table.size() < begin) {
+            std::cerr << "KV cache positions must be written in order" << std::endl;
+            return false;
+        }
+        for (size_t b = begin; b < end; ++b) {
+            uint32_t id = b < table.size() ? owner->make_private(table[b]) : owner->allocate();
+            if (id == KvBlockPool::kNoBlock) {
+                return false;
+            }
+            if (b < table.size()) {
+                table[b] = id;
+            } else {
+                table.push_back(id);
+            }
+        }
+    }
+    return true;
+}
+
+void KvSequence::truncate(size_t positions) {
+    size_t block_tokens = std::max<size_t>(1, owner->options().block_tokens);
+    size_t keep = (positions + block_tokens - 1) / block_tokens;
+    for (std::vector<uint32_t> &table : tables) {
+        while (table.size() > keep) {
+            owner->release(table.back());
+            table.pop_back();
+        }
+    }
+}
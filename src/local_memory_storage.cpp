@@ -1,33 +1,608 @@
 #include <iostream>
 #include <string>
-#include <fstream>
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
 #include <openssl/rand.h>
+#include "../include/local_memory_storage.h"
+#include "../include/async_io.h"
 #include "../include/openssl_init.h"
 
-void save_context(const std::string &filename, const std::string &context) {
-    std::ofstream file(filename);
-    if (file.is_open()) {
-        file << context;
-        file.close();
-    } else {
-        std::cerr << "Unable to open file for writing" << std::endl;
+namespace {
+
+constexpr uint32_t kRecordMagic = 0x4b4e4843; // "CHNK"
+constexpr uint32_t kRecordCommit = 1;
+constexpr size_t kMinChunkBytes = 64;
+constexpr size_t kMaxChunkBytes = 1 << 24;
+// Superseded records are tolerated up to the size of the live ones, and
+// always up to this, before the file is rewritten.
+constexpr uint64_t kCompactSlack = 1 << 20;
+
+// File I/O goes through the shared storage backend, and waits for it: a
+// request handler reaches the store from a storage_io() thread (see
+// save_context_async()), never from the network thread.
+bool transfer(IoOp op, int fd, uint64_t offset, void *data, size_t size) {
+    std::vector<IoRequest> requests(1);
+    requests[0].op = op;
+    requests[0].fd = fd;
+    requests[0].offset = offset;
+    requests[0].data = data;
+    requests[0].size = size;
+    return storage_io().run(requests);
+}
+
+bool read_all(int fd, unsigned char *data, size_t size) {
+    return transfer(IoOp::Read, fd, 0, data, size);
+}
+
+bool write_fd(int fd, uint64_t offset, const void *data, size_t size) {
+    return transfer(IoOp::Write, fd, offset, const_cast<void *>(data), size);
+}
+
+bool sync_fd(int fd, IoOp op = IoOp::DataSync) {
+    return transfer(op, fd, 0, nullptr, 0);
+}
+
+// GCM tag of an empty message under key, bound to file_id.
+bool key_check(EVP_CIPHER_CTX *context, const unsigned char *key, const unsigned char *file_id,
+               const unsigned char *nonce, unsigned char *tag) {
+    int length = 0;
+    return EVP_EncryptInit_ex(context, EVP_aes_256_gcm(), nullptr, key, nonce) == 1 &&
+           EVP_EncryptUpdate(context, nullptr, &length, file_id, 16) == 1 &&
+           EVP_EncryptFinal_ex(context, nullptr, &length) == 1 &&
+           EVP_CIPHER_CTX_ctrl(context, EVP_CTRL_GCM_GET_TAG, 16, tag) == 1;
+}
+
+} // namespace
+
+ContextStore::~ContextStore() {
+    close();
+}
+
+void ContextStore::close() {
+    if (fd >= 0) {
+        // Later checkpoints of the log no longer cover this file.
+        if (wal) {
+            fdatasync(fd);
+        }
+        ::close(fd);
+        fd = -1;
+    }
+    if (cipher) {
+        EVP_CIPHER_CTX_free(cipher);
+        cipher = nullptr;
     }
+    OPENSSL_cleanse(key, sizeof(key));
+    current.clear();
+    end = 0;
+    live_records = 0;
+    chunk = 0;
+    wal = nullptr;
 }
 
-std::string load_context(const std::string &filename) {
-    std::ifstream file(filename);
+bool ContextStore::open(const std::string &file, const unsigned char (&secret)[kContextKeyBytes],
+                        size_t chunk_bytes, Wal *log) {
+    close();
+    path = file;
+    std::memcpy(key, secret, sizeof(key));
+    cipher = EVP_CIPHER_CTX_new();
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    struct stat info;
+    if (!cipher || fd < 0 || fstat(fd, &info) != 0) {
+        std::cerr << "Unable to open context file " << path << std::endl;
+        close();
+        return false;
+    }
+    if (info.st_size == 0) {
+        chunk = std::clamp(chunk_bytes, kMinChunkBytes, kMaxChunkBytes);
+        unsigned char id[16];
+        if (RAND_bytes(id, sizeof(id)) != 1 || !create(id)) {
+            close();
+            return false;
+        }
+        wal = log;
+        return true;
+    }
     std::string context;
-    if (file.is_open()) {
-        std::string line;
-        while (std::getline(file, line)) {
-            context += line + "\n";
+    if (!load(context)) {
+        close();
+        return false;
+    }
+    // Drop what an interrupted save left behind, so it cannot be mistaken
+    // for part of a later one.
+    uint64_t size = static_cast<uint64_t>(info.st_size);
+    if (size > end && ftruncate(fd, static_cast<off_t>(end)) != 0) {
+        std::cerr << "Unable to trim " << path << std::endl;
+    }
+    wal = log;
+    return true;
+}
+
+bool ContextStore::create(const unsigned char *id) {
+    ContextFileHeader header{};
+    std::memcpy(header.magic, kContextMagic, sizeof(kContextMagic));
+    header.version = kContextVersion;
+    header.chunk_bytes = static_cast<uint32_t>(chunk);
+    std::memcpy(header.file_id, id, sizeof(header.file_id));
+    if (RAND_bytes(header.check_nonce, sizeof(header.check_nonce)) != 1 ||
+        !key_check(cipher, key, header.file_id, header.check_nonce, header.check_tag) ||
+        !write_at(0, &header, sizeof(header)) || !sync_fd(fd)) {
+        std::cerr << "Unable to write context file header: " << path << std::endl;
+        return false;
+    }
+    std::memcpy(file_id, id, sizeof(file_id));
+    end = sizeof(header);
+    live_records = 0;
+    current.clear();
+    return true;
+}
+
+bool ContextStore::write_at(uint64_t offset, const void *data, size_t size) {
+    if (!write_fd(fd, offset, data, size)) {
+        std::cerr << "Unable to write " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void ContextStore::authenticate(const ContextRecordHeader &header, uint64_t slot) {
+    int length = 0;
+    EVP_CipherUpdate(cipher, nullptr, &length, file_id, sizeof(file_id));
+    EVP_CipherUpdate(cipher, nullptr, &length, reinterpret_cast<const unsigned char *>(&slot),
+                     sizeof(slot));
+    EVP_CipherUpdate(cipher, nullptr, &length, reinterpret_cast<const unsigned char *>(&header),
+                     offsetof(ContextRecordHeader, nonce));
+}
+
+bool ContextStore::encrypt(ContextRecordHeader &header, uint64_t slot, const char *plain,
+                           unsigned char *out) {
+    int length = 0;
+    if (RAND_bytes(header.nonce, sizeof(header.nonce)) != 1 ||
+        EVP_EncryptInit_ex(cipher, EVP_aes_256_gcm(), nullptr, key, header.nonce) != 1) {
+        return false;
+    }
+    authenticate(header, slot);
+    return EVP_EncryptUpdate(cipher, out, &length, reinterpret_cast<const unsigned char *>(plain),
+                             static_cast<int>(header.length)) == 1 &&
+           EVP_EncryptFinal_ex(cipher, out + length, &length) == 1 &&
+           EVP_CIPHER_CTX_ctrl(cipher, EVP_CTRL_GCM_GET_TAG, sizeof(header.tag), header.tag) == 1;
+}
+
+bool ContextStore::decrypt(const ContextRecordHeader &header, uint64_t slot,
+                           const unsigned char *in, char *plain) {
+    int length = 0;
+    if (EVP_DecryptInit_ex(cipher, EVP_aes_256_gcm(), nullptr, key, header.nonce) != 1) {
+        return false;
+    }
+    authenticate(header, slot);
+    unsigned char tag[sizeof(header.tag)];
+    std::memcpy(tag, header.tag, sizeof(tag));
+    return EVP_DecryptUpdate(cipher, reinterpret_cast<unsigned char *>(plain), &length, in,
+                             static_cast<int>(header.length)) == 1 &&
+           EVP_CIPHER_CTX_ctrl(cipher, EVP_CTRL_GCM_SET_TAG, sizeof(tag), tag) == 1 &&
+           EVP_DecryptFinal_ex(cipher, reinterpret_cast<unsigned char *>(plain) + length,
+                               &length) == 1;
+}
+
+bool ContextStore::load(std::string &context) {
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        return false;
+    }
+    size_t size = static_cast<size_t>(info.st_size);
+    auto fail = [&](const char *reason) {
+        std::cerr << "Invalid context file (" << reason << "): " << path << std::endl;
+        return false;
+    };
+    if (size < sizeof(ContextFileHeader)) {
+        return fail("truncated");
+    }
+    buffer.resize(size);
+    if (!read_all(fd, buffer.data(), size)) {
+        return fail("unreadable");
+    }
+
+    ContextFileHeader header;
+    std::memcpy(&header, buffer.data(), sizeof(header));
+    if (std::memcmp(header.magic, kContextMagic, sizeof(kContextMagic)) != 0) {
+        return fail("bad magic");
+    }
+    if (header.version != kContextVersion) {
+        return fail("unsupported version");
+    }
+    if (header.chunk_bytes < kMinChunkBytes || header.chunk_bytes > kMaxChunkBytes) {
+        return fail("bad chunk size");
+    }
+    unsigned char tag[16];
+    if (!key_check(cipher, key, header.file_id, header.check_nonce, tag) ||
+        CRYPTO_memcmp(tag, header.check_tag, sizeof(tag)) != 0) {
+        std::cerr << "Wrong key for context file " << path << std::endl;
+        return false;
+    }
+    std::memcpy(file_id, header.file_id, sizeof(file_id));
+    chunk = header.chunk_bytes;
+
+    // Newest committed slot of each chunk; slot + 1, so 0 means none.
+    std::vector<uint64_t> latest;
+    std::vector<std::pair<uint64_t, uint64_t>> uncommitted;
+    uint64_t slots = (size - sizeof(header)) / slot_bytes();
+    uint64_t total = 0;
+    uint64_t committed = sizeof(header);
+    for (uint64_t slot = 0; slot < slots; ++slot) {
+        uint64_t offset = sizeof(header) + slot * slot_bytes();
+        ContextRecordHeader record;
+        std::memcpy(&record, buffer.data() + offset, sizeof(record));
+        // Not yet authenticated: anything implausible ends the log here.
+        if (record.magic != kRecordMagic || record.index >= slots || record.length > chunk) {
+            break;
+        }
+        uncommitted.push_back({record.index, slot});
+        if (record.flags & kRecordCommit) {
+            for (const auto &[index, written_slot] : uncommitted) {
+                if (index >= latest.size()) {
+                    latest.resize(index + 1, 0);
+                }
+                latest[index] = written_slot + 1;
+            }
+            uncommitted.clear();
+            total = record.total_bytes;
+            committed = offset + slot_bytes();
+        }
+    }
+
+    uint64_t chunks = (total + chunk - 1) / chunk;
+    if (chunks > latest.size()) {
+        return fail("missing chunk");
+    }
+    context.resize(total);
+    for (uint64_t i = 0; i < chunks; ++i) {
+        if (latest[i] == 0) {
+            return fail("missing chunk");
+        }
+        uint64_t slot = latest[i] - 1;
+        const unsigned char *record = buffer.data() + sizeof(header) + slot * slot_bytes();
+        ContextRecordHeader entry;
+        std::memcpy(&entry, record, sizeof(entry));
+        if (entry.length != std::min<uint64_t>(chunk, total - i * chunk) ||
+            !decrypt(entry, slot, record + sizeof(entry), context.data() + i * chunk)) {
+            return fail("chunk failed authentication");
+        }
+    }
+    end = committed;
+    live_records = chunks;
+    current = context;
+    return true;
+}
+
+bool ContextStore::save(const std::string &context) {
+    if (fd < 0) {
+        return false;
+    }
+    uint64_t chunks = (context.size() + chunk - 1) / chunk;
+    std::vector<uint64_t> changed;
+    for (uint64_t i = 0; i < chunks; ++i) {
+        size_t offset = i * chunk;
+        size_t length = std::min(chunk, context.size() - offset);
+        size_t before = offset < current.size() ? std::min(chunk, current.size() - offset) : 0;
+        if (length != before ||
+            std::memcmp(context.data() + offset, current.data() + offset, length) != 0) {
+            changed.push_back(i);
+        }
+    }
+    if (changed.empty()) {
+        if (context.size() == current.size()) {
+            return true;
+        }
+        // Cut back to a chunk boundary: nothing to write but the length,
+        // which rides on a rewrite of the last chunk, or an empty record.
+        changed.push_back(chunks > 0 ? chunks - 1 : 0);
+    }
+
+    std::vector<unsigned char> records(changed.size() * slot_bytes());
+    uint64_t first_slot = (end - sizeof(ContextFileHeader)) / slot_bytes();
+    for (size_t k = 0; k < changed.size(); ++k) {
+        uint64_t index = changed[k];
+        size_t offset = index * chunk;
+        ContextRecordHeader header{};
+        header.magic = kRecordMagic;
+        header.flags = k + 1 == changed.size() ? kRecordCommit : 0;
+        header.index = index;
+        header.total_bytes = context.size();
+        header.length = static_cast<uint32_t>(
+            offset < context.size() ? std::min(chunk, context.size() - offset) : 0);
+        unsigned char *slot = records.data() + k * slot_bytes();
+        if (!encrypt(header, first_slot + k, context.data() + offset, slot + sizeof(header))) {
+            std::cerr << "Unable to encrypt context for " << path << std::endl;
+            return false;
+        }
+        std::memcpy(slot, &header, sizeof(header));
+    }
+    if (wal) {
+        // Once the log has the records a crash cannot lose them, so the
+        // file itself is written in one go and left for a checkpoint to sync.
+        uint64_t offset = end;
+        uint16_t path_bytes = static_cast<uint16_t>(std::min<size_t>(path.size(), UINT16_MAX));
+        uint64_t lsn = wal->append(
+            kContextWalWrite,
+            {std::string_view(reinterpret_cast<const char *>(file_id), sizeof(file_id)),
+             std::string_view(reinterpret_cast<const char *>(&offset), sizeof(offset)),
+             std::string_view(reinterpret_cast<const char *>(&path_bytes), sizeof(path_bytes)),
+             std::string_view(path).substr(0, path_bytes),
+             std::string_view(reinterpret_cast<const char *>(records.data()), records.size())});
+        if (lsn == 0 || !wal->commit(lsn) || !write_at(end, records.data(), records.size())) {
+            std::cerr << "Unable to save context to " << path << std::endl;
+            return false;
         }
-        file.close();
     } else {
+        // The commit goes down only once the records it commits are on
+        // disk, so a crash never leaves a commit covering a torn record.
+        size_t body = records.size() - slot_bytes();
+        if ((body > 0 && (!write_at(end, records.data(), body) || !sync_fd(fd))) ||
+            !write_at(end + body, records.data() + body, slot_bytes()) || !sync_fd(fd)) {
+            std::cerr << "Unable to save context to " << path << std::endl;
+            return false;
+        }
+    }
+    end += records.size();
+    written += changed.size();
+    live_records = chunks;
+
+    current.resize(context.size());
+    for (uint64_t index : changed) {
+        size_t offset = index * chunk;
+        if (offset < context.size()) {
+            std::memcpy(current.data() + offset, context.data() + offset,
+                        std::min(chunk, context.size() - offset));
+        }
+    }
+    uint64_t live_bytes = std::max<uint64_t>(live_records, 1) * slot_bytes();
+    if (end - sizeof(ContextFileHeader) > 2 * live_bytes + kCompactSlack) {
+        compact();
+    }
+    return true;
+}
+
+bool ContextStore::sync() {
+    return fd >= 0 && sync_fd(fd);
+}
+
+bool ContextStore::compact() {
+    std::string temp_path = path + ".tmp";
+    int temp = ::open(temp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (temp < 0) {
+        std::cerr << "Unable to create " << temp_path << std::endl;
+        return false;
+    }
+    int old_fd = fd;
+    uint64_t old_end = end;
+    uint64_t old_live = live_records;
+    unsigned char old_id[16];
+    std::memcpy(old_id, file_id, sizeof(old_id));
+    std::string context = std::move(current);
+
+    // Save the whole context into a fresh file under a new ID, so no record
+    // of the old file can be replayed into it, here or from the log. The
+    // new file is synced before it replaces the old, so it skips the log.
+    fd = temp;
+    Wal *log = std::exchange(wal, nullptr);
+    unsigned char id[16];
+    bool rewritten = RAND_bytes(id, sizeof(id)) == 1 && create(id) && save(context) &&
+                     sync_fd(fd, IoOp::Sync) && rename(temp_path.c_str(), path.c_str()) == 0;
+    wal = log;
+    if (!rewritten) {
+        ::close(temp);
+        unlink(temp_path.c_str());
+        fd = old_fd;
+        end = old_end;
+        live_records = old_live;
+        std::memcpy(file_id, old_id, sizeof(file_id));
+        current = std::move(context);
+        std::cerr << "Unable to compact " << path << std::endl;
+        return false;
+    }
+    ::close(old_fd);
+    return true;
+}
+
+bool replay_context_record(std::string_view payload) {
+    unsigned char id[16];
+    uint64_t offset;
+    uint16_t path_bytes;
+    constexpr size_t fixed = sizeof(id) + sizeof(offset) + sizeof(path_bytes);
+    if (payload.size() < fixed) {
+        return true;
+    }
+    std::memcpy(id, payload.data(), sizeof(id));
+    std::memcpy(&offset, payload.data() + sizeof(id), sizeof(offset));
+    std::memcpy(&path_bytes, payload.data() + sizeof(id) + sizeof(offset), sizeof(path_bytes));
+    if (payload.size() < fixed + path_bytes) {
+        return true;
+    }
+    std::string file(payload.substr(fixed, path_bytes));
+    std::string_view records = payload.substr(fixed + path_bytes);
+
+    int fd = ::open(file.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        return true;
+    }
+    ContextFileHeader header;
+    bool applied = true;
+    if (read_all(fd, reinterpret_cast<unsigned char *>(&header), sizeof(header)) &&
+        std::memcmp(header.magic, kContextMagic, sizeof(kContextMagic)) == 0 &&
+        std::memcmp(header.file_id, id, sizeof(id)) == 0) {
+        applied = write_fd(fd, offset, records.data(), records.size()) && sync_fd(fd);
+        if (!applied) {
+            std::cerr << "Unable to replay context into " << file << std::endl;
+        }
+    }
+    ::close(fd);
+    return applied;
+}
+
+namespace {
+
+// The log is checkpointed once it holds this much.
+constexpr uint64_t kContextWalCheckpointBytes = 64ull << 20;
+
+struct OpenStore {
+    std::mutex mutex;
+    ContextStore store;
+};
+
+// Declared before the stores so that they are closed first at exit.
+Wal context_wal;
+std::mutex stores_mutex;
+std::unordered_map<std::string, std::unique_ptr<OpenStore>> stores;
+
+// The shared log, opened and replayed on first use; null if it cannot be
+// used, in which case stores sync their own files.
+Wal *shared_wal() {
+    static std::once_flag opened;
+    std::call_once(opened, [] {
+        const char *configured = std::getenv("SVAKLA_CONTEXT_WAL");
+        bool replayed = true;
+        auto replay = [&replayed](uint16_t type, uint64_t, std::string_view payload) {
+            if (type == kContextWalWrite && !replay_context_record(payload)) {
+                replayed = false;
+            }
+        };
+        if (context_wal.open(configured ? configured : "context.wal", wal_options_from_env(),
+                             replay) &&
+            replayed) {
+            context_wal.checkpoint(context_wal.last_lsn());
+        }
+    });
+    return context_wal.is_open() ? &context_wal : nullptr;
+}
+
+// Syncs every store and drops the log records they cover. Each store's
+// lock is taken in turn, so every save logged up to lsn has also been
+// written to its file by the time that file is synced.
+void checkpoint_stores() {
+    std::lock_guard<std::mutex> lock(stores_mutex);
+    if (context_wal.size_bytes() < kContextWalCheckpointBytes) {
+        return;
+    }
+    uint64_t lsn = context_wal.last_lsn();
+    for (auto &[filename, open] : stores) {
+        std::lock_guard<std::mutex> store_lock(open->mutex);
+        if (!open->store.sync()) {
+            std::cerr << "Unable to sync " << filename << std::endl;
+            return;
+        }
+    }
+    context_wal.checkpoint(lsn);
+}
+
+bool read_key(const std::string &filename, unsigned char (&key)[kContextKeyBytes]) {
+    const char *configured = std::getenv("SVAKLA_CONTEXT_KEY_FILE");
+    std::string key_path = configured ? configured : filename + ".key";
+    int fd = ::open(key_path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd >= 0) {
+        bool made = RAND_bytes(key, sizeof(key)) == 1 && write_fd(fd, 0, key, sizeof(key)) &&
+                    sync_fd(fd, IoOp::Sync);
+        ::close(fd);
+        if (!made) {
+            unlink(key_path.c_str());
+            std::cerr << "Unable to create context key " << key_path << std::endl;
+        }
+        return made;
+    }
+    fd = ::open(key_path.c_str(), O_RDONLY | O_CLOEXEC);
+    bool found = fd >= 0 && read_all(fd, key, sizeof(key));
+    if (fd >= 0) {
+        ::close(fd);
+    }
+    if (!found) {
+        std::cerr << "Unable to read context key " << key_path << std::endl;
+    }
+    return found;
+}
+
+OpenStore *store_for(const std::string &filename) {
+    Wal *log = shared_wal();
+    std::lock_guard<std::mutex> lock(stores_mutex);
+    std::unique_ptr<OpenStore> &entry = stores[filename];
+    if (!entry) {
+        unsigned char key[kContextKeyBytes];
+        auto opened = std::make_unique<OpenStore>();
+        bool ready = read_key(filename, key) && opened->store.open(filename, key, 4096, log);
+        OPENSSL_cleanse(key, sizeof(key));
+        if (!ready) {
+            stores.erase(filename);
+            return nullptr;
+        }
+        entry = std::move(opened);
+    }
+    return entry.get();
+}
+
+bool save_into(const std::string &filename, const std::string &context) {
+    OpenStore *open = store_for(filename);
+    if (!open) {
+        std::cerr << "Unable to open file for writing" << std::endl;
+        return false;
+    }
+    bool saved;
+    {
+        std::lock_guard<std::mutex> lock(open->mutex);
+        saved = open->store.save(context);
+    }
+    if (context_wal.size_bytes() >= kContextWalCheckpointBytes) {
+        checkpoint_stores();
+    }
+    return saved;
+}
+
+bool load_from(const std::string &filename, std::string &context) {
+    OpenStore *open = store_for(filename);
+    if (!open) {
         std::cerr << "Unable to open file for reading" << std::endl;
+        return false;
     }
+    std::lock_guard<std::mutex> lock(open->mutex);
+    return open->store.load(context);
+}
+
+} // namespace
+
+void save_context(const std::string &filename, const std::string &context) {
+    save_into(filename, context);
+}
+
+std::string load_context(const std::string &filename) {
+    std::string context;
+    load_from(filename, context);
     return context;
 }
+
+void save_context_async(const std::string &filename, std::string context,
+                        std::function<void(bool saved)> done) {
+    storage_io().defer([filename, context = std::move(context), done = std::move(done)] {
+        done(save_into(filename, context));
+    });
+}
+
+void load_context_async(const std::string &filename,
+                        std::function<void(bool loaded, std::string context)> done) {
+    storage_io().defer([filename, done = std::move(done)] {
+        std::string context;
+        struct stat info;
+        bool loaded = stat(filename.c_str(), &info) == 0 && load_from(filename, context);
+        done(loaded, std::move(context));
+    });
+}
+
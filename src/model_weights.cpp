@@ -0,0 +1,433 @@
+#include <iostream>
+#include <string>
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "../include/model_weights.h"
+
+namespace {
+
+uint64_t align_up(uint64_t value) {
+    return (value + kWeightAlignment - 1) / kWeightAlignment * kWeightAlignment;
+}
+
+uint32_t crc_of(uint32_t crc, const void *data, size_t size) {
+    return static_cast<uint32_t>(crc32_z(crc, static_cast<const Bytef *>(data), size));
+}
+
+uint32_t header_crc(const WeightFileHeader &header) {
+    return crc_of(0, &header, offsetof(WeightFileHeader, header_crc));
+}
+
+bool valid_type(uint32_t type) {
+    return type <= static_cast<uint32_t>(WeightType::Q4);
+}
+
+// Bytes of the quants region and where the scales start, relative to the
+// tensor offset.
+void tensor_layout(WeightType type, uint64_t rows, uint64_t cols, uint64_t &scales_offset,
+                   uint64_t &bytes) {
+    uint64_t quants = rows * weight_row_bytes(type, cols);
+    if (type == WeightType::F32) {
+        scales_offset = 0;
+        bytes = quants;
+        return;
+    }
+    scales_offset = align_up(quants);
+    bytes = scales_offset + rows * weight_blocks_per_row(cols) * sizeof(float);
+}
+
+float block_scale(const float *src, size_t count, float levels) {
+    float max = 0.0f;
+    for (size_t i = 0; i < count; ++i) {
+        max = std::max(max, std::fabs(src[i]));
+    }
+    return max / levels;
+}
+
+int quantize(float value, float inverse, int low, int high) {
+    return std::clamp(static_cast<int>(std::lrintf(value * inverse)), low, high);
+}
+
+} // namespace
+
+size_t weight_blocks_per_row(size_t cols) {
+    return (cols + kWeightBlock - 1) / kWeightBlock;
+}
+
+size_t weight_row_bytes(WeightType type, size_t cols) {
+    switch (type) {
+    case WeightType::F32: return cols * sizeof(float);
+    case WeightType::Q8: return weight_blocks_per_row(cols) * kWeightBlock;
+    case WeightType::Q4: return weight_blocks_per_row(cols) * kWeightBlock / 2;
+    }
+    return 0;
+}
+
+void quantize_row_q8(const float *src, size_t cols, int8_t *quants, float *scales) {
+    for (size_t block = 0; block * kWeightBlock < cols; ++block) {
+        size_t begin = block * kWeightBlock;
+        size_t count = std::min(kWeightBlock, cols - begin);
+        float scale = block_scale(src + begin, count, 127.0f);
+        float inverse = scale > 0.0f ? 1.0f / scale : 0.0f;
+        scales[block] = scale;
+        for (size_t i = 0; i < kWeightBlock; ++i) {
+            quants[begin + i] = static_cast<int8_t>(
+                i < count ? quantize(src[begin + i], inverse, -127, 127) : 0);
+        }
+    }
+}
+
+void quantize_row_q4(const float *src, size_t cols, uint8_t *quants, float *scales) {
+    constexpr size_t kHalf = kWeightBlock / 2;
+    for (size_t block = 0; block * kWeightBlock < cols; ++block) {
+        size_t begin = block * kWeightBlock;
+        size_t count = std::min(kWeightBlock, cols - begin);
+        float scale = block_scale(src + begin, count, 7.0f);
+        float inverse = scale > 0.0f ? 1.0f / scale : 0.0f;
+        scales[block] = scale;
+        auto nibble = [&](size_t i) {
+            int value = i < count ? quantize(src[begin + i], inverse, -8, 7) : 0;
+            return static_cast<uint8_t>(value + 8);
+        };
+        for (size_t i = 0; i < kHalf; ++i) {
+            quants[block * kHalf + i] = static_cast<uint8_t>(nibble(i) | (nibble(i + kHalf) << 4));
+        }
+    }
+}
+
+void WeightTensor::dequantize_row(size_t row, float *out) const {
+    if (type == WeightType::F32) {
+        std::memcpy(out, f32_row(row), cols * sizeof(float));
+        return;
+    }
+    const float *row_scale = row_scales(row);
+    for (size_t i = 0; i < cols; ++i) {
+        size_t block = i / kWeightBlock;
+        int value;
+        if (type == WeightType::Q8) {
+            value = q8_row(row)[i];
+        } else {
+            size_t within = i % kWeightBlock;
+            uint8_t packed = q4_row(row)[block * kWeightBlock / 2 + within % (kWeightBlock / 2)];
+            value = (within < kWeightBlock / 2 ? packed & 0xF : packed >> 4) - 8;
+        }
+        out[i] = static_cast<float>(value) * row_scale[block];
+    }
+}
+
+ModelWeights::~ModelWeights() {
+    close();
+}
+
+bool ModelWeights::open(const std::string &path) {
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        std::cerr << "Unable to open model weights: " << path << std::endl;
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(WeightFileHeader)) {
+        std::cerr << "Model weights are truncated: " << path << std::endl;
+        ::close(fd);
+        return false;
+    }
+    length = static_cast<size_t>(info.st_size);
+    void *mapping = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+        std::cerr << "Unable to map model weights: " << path << std::endl;
+        length = 0;
+        return false;
+    }
+    base = static_cast<uint8_t *>(mapping);
+
+    auto fail = [&](const char *reason) {
+        std::cerr << "Invalid model weights (" << reason << "): " << path << std::endl;
+        close();
+        return false;
+    };
+
+    WeightFileHeader header;
+    std::memcpy(&header, base, sizeof(header));
+    if (std::memcmp(header.magic, kWeightMagic, sizeof(kWeightMagic)) != 0) {
+        return fail("bad magic");
+    }
+    if (header.version != kWeightVersion) {
+        return fail("unsupported version");
+    }
+    if (header.header_crc != header_crc(header)) {
+        return fail("header checksum");
+    }
+    uint64_t table_bytes = static_cast<uint64_t>(header.tensor_count) *
+                           sizeof(WeightTensorEntry);
+    if (header.file_bytes != length || header.table_offset < sizeof(header) ||
+        header.table_offset + table_bytes > header.data_offset || header.data_offset > length) {
+        return fail("truncated");
+    }
+    if (crc_of(0, base + header.table_offset, table_bytes) != header.table_crc) {
+        return fail("table checksum");
+    }
+
+    table.reserve(header.tensor_count);
+    for (uint32_t i = 0; i < header.tensor_count; ++i) {
+        WeightTensorEntry entry;
+        std::memcpy(&entry, base + header.table_offset + i * sizeof(entry), sizeof(entry));
+        if (entry.name[kWeightNameBytes - 1] != '\0' || !valid_type(entry.type)) {
+            return fail("bad tensor entry");
+        }
+        WeightType type = static_cast<WeightType>(entry.type);
+        uint64_t scales_offset = 0;
+        uint64_t bytes = 0;
+        tensor_layout(type, entry.rows, entry.cols, scales_offset, bytes);
+        if (entry.offset % kWeightAlignment != 0 || entry.offset < header.data_offset ||
+            entry.bytes != bytes || entry.scales_offset != scales_offset ||
+            entry.offset + bytes > length) {
+            return fail("tensor out of bounds");
+        }
+
+        WeightTensor tensor;
+        tensor.name = std::string_view(reinterpret_cast<const char *>(base) +
+                                       header.table_offset + i * sizeof(entry));
+        tensor.type = type;
+        tensor.rows = entry.rows;
+        tensor.cols = entry.cols;
+        tensor.row_bytes = weight_row_bytes(type, entry.cols);
+        tensor.data = base + entry.offset;
+        tensor.scales = type == WeightType::F32 ? nullptr :
+            reinterpret_cast<const float *>(base + entry.offset + scales_offset);
+        tensor.bytes = bytes;
+        tensor.crc = entry.crc;
+        if (!by_name.emplace(tensor.name, table.size()).second) {
+            return fail("duplicate tensor name");
+        }
+        table.push_back(tensor);
+    }
+    return true;
+}
+
+void ModelWeights::close() {
+    if (base) {
+        munmap(base, length);
+    }
+    base = nullptr;
+    length = 0;
+    table.clear();
+    by_name.clear();
+}
+
+const WeightTensor *ModelWeights::find(std::string_view name) const {
+    auto it = by_name.find(name);
+    return it == by_name.end() ? nullptr : &table[it->second];
+}
+
+bool ModelWeights::verify(const WeightTensor &tensor) const {
+    if (crc_of(0, tensor.data, tensor.bytes) != tensor.crc) {
+        std::cerr << "Checksum mismatch in tensor " << tensor.name << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool ModelWeights::verify_all() const {
+    bool ok = true;
+    for (const WeightTensor &tensor : table) {
+        ok = verify(tensor) && ok;
+        // Verification should not leave the whole model resident.
+        evict(tensor);
+    }
+    return ok;
+}
+
+void ModelWeights::prefetch(const WeightTensor &tensor) const {
+    uintptr_t page = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+    uintptr_t begin = reinterpret_cast<uintptr_t>(tensor.data) & ~(page - 1);
+    uintptr_t end = reinterpret_cast<uintptr_t>(tensor.data) + tensor.bytes;
+    madvise(reinterpret_cast<void *>(begin), end - begin, MADV_WILLNEED);
+}
+
+void ModelWeights::evict(const WeightTensor &tensor) const {
+    // Only whole pages inside the tensor, so neighbours are left alone.
+    uintptr_t page = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+    uintptr_t begin = (reinterpret_cast<uintptr_t>(tensor.data) + page - 1) & ~(page - 1);
+    uintptr_t end = (reinterpret_cast<uintptr_t>(tensor.data) + tensor.bytes) & ~(page - 1);
+    if (end > begin) {
+        madvise(reinterpret_cast<void *>(begin), end - begin, MADV_DONTNEED);
+    }
+}
+
+WeightWriter::~WeightWriter() {
+    if (fd >= 0) {
+        ::close(fd);
+        unlink(temp_path.c_str());
+    }
+}
+
+bool WeightWriter::open(const std::string &target, const std::vector<WeightTensorSpec> &specs) {
+    path = target;
+    temp_path = target + ".tmp";
+    entries.assign(specs.size(), WeightTensorEntry{});
+    std::memcpy(header.magic, kWeightMagic, sizeof(kWeightMagic));
+    header.version = kWeightVersion;
+    header.tensor_count = static_cast<uint32_t>(specs.size());
+    header.table_offset = sizeof(WeightFileHeader);
+    header.data_offset = align_up(header.table_offset + specs.size() * sizeof(WeightTensorEntry));
+
+    uint64_t cursor = header.data_offset;
+    size_t widest = 0;
+    for (size_t i = 0; i < specs.size(); ++i) {
+        const WeightTensorSpec &spec = specs[i];
+        if (spec.name.empty() || spec.name.size() >= kWeightNameBytes) {
+            std::cerr << "Tensor name must be 1-" << kWeightNameBytes - 1 << " bytes: "
+                      << spec.name << std::endl;
+            return false;
+        }
+        WeightTensorEntry &entry = entries[i];
+        std::memcpy(entry.name, spec.name.data(), spec.name.size());
+        entry.type = static_cast<uint32_t>(spec.type);
+        entry.rows = spec.rows;
+        entry.cols = spec.cols;
+        entry.offset = align_up(cursor);
+        tensor_layout(spec.type, spec.rows, spec.cols, entry.scales_offset, entry.bytes);
+        cursor = entry.offset + entry.bytes;
+        widest = std::max(widest, spec.cols);
+    }
+    header.file_bytes = align_up(cursor);
+
+    fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        std::cerr << "Unable to create " << temp_path << std::endl;
+        return false;
+    }
+    // Padding is left as holes and reads back as zeros.
+    if (ftruncate(fd, static_cast<off_t>(header.file_bytes)) != 0) {
+        std::cerr << "Unable to size " << temp_path << std::endl;
+        return false;
+    }
+    row.resize(weight_row_bytes(WeightType::Q8, widest));
+    scales.resize(weight_blocks_per_row(widest));
+    current = 0;
+    rows_written = 0;
+    quants_crc = 0;
+    scales_crc = 0;
+    while (current < entries.size() && entries[current].rows == 0) {
+        close_tensor();
+    }
+    return true;
+}
+
+bool WeightWriter::write_at(uint64_t offset, const void *data, size_t size) {
+    const char *bytes = static_cast<const char *>(data);
+    while (size > 0) {
+        ssize_t written = pwrite(fd, bytes, size, static_cast<off_t>(offset));
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "Unable to write " << temp_path << std::endl;
+            return false;
+        }
+        bytes += written;
+        offset += static_cast<uint64_t>(written);
+        size -= static_cast<size_t>(written);
+    }
+    return true;
+}
+
+bool WeightWriter::write_row(const float *values) {
+    if (fd < 0 || current >= entries.size()) {
+        std::cerr << "No tensor left to write in " << path << std::endl;
+        return false;
+    }
+    WeightTensorEntry &entry = entries[current];
+    WeightType type = static_cast<WeightType>(entry.type);
+    size_t row_bytes = weight_row_bytes(type, entry.cols);
+    size_t blocks = weight_blocks_per_row(entry.cols);
+
+    const void *quants = values;
+    if (type == WeightType::Q8) {
+        quantize_row_q8(values, entry.cols, reinterpret_cast<int8_t *>(row.data()), scales.data());
+        quants = row.data();
+    } else if (type == WeightType::Q4) {
+        quantize_row_q4(values, entry.cols, row.data(), scales.data());
+        quants = row.data();
+    }
+    if (!write_at(entry.offset + rows_written * row_bytes, quants, row_bytes)) {
+        return false;
+    }
+    quants_crc = crc_of(quants_crc, quants, row_bytes);
+    if (type != WeightType::F32) {
+        uint64_t offset = entry.offset + entry.scales_offset +
+                          rows_written * blocks * sizeof(float);
+        if (!write_at(offset, scales.data(), blocks * sizeof(float))) {
+            return false;
+        }
+        scales_crc = crc_of(scales_crc, scales.data(), blocks * sizeof(float));
+    }
+
+    if (++rows_written == entry.rows) {
+        close_tensor();
+        while (current < entries.size() && entries[current].rows == 0) {
+            close_tensor();
+        }
+    }
+    return true;
+}
+
+void WeightWriter::close_tensor() {
+    WeightTensorEntry &entry = entries[current];
+    WeightType type = static_cast<WeightType>(entry.type);
+    uint32_t crc = quants_crc;
+    if (type != WeightType::F32) {
+        // The zero padding between quants and scales is covered as well.
+        static const uint8_t zeros[kWeightAlignment] = {};
+        uint64_t quants = entry.rows * weight_row_bytes(type, entry.cols);
+        crc = crc_of(crc, zeros, entry.scales_offset - quants);
+        crc = static_cast<uint32_t>(crc32_combine64(crc, scales_crc,
+                                                    entry.bytes - entry.scales_offset));
+    }
+    entry.crc = crc;
+    ++current;
+    rows_written = 0;
+    quants_crc = 0;
+    scales_crc = 0;
+}
+
+bool WeightWriter::finish() {
+    if (fd < 0) {
+        return false;
+    }
+    if (current != entries.size()) {
+        std::cerr << "Tensor " << entries[current].name << " is incomplete in " << path
+                  << std::endl;
+        return false;
+    }
+    size_t table_bytes = entries.size() * sizeof(WeightTensorEntry);
+    header.table_crc = crc_of(0, entries.data(), table_bytes);
+    header.header_crc = header_crc(header);
+    if (!write_at(header.table_offset, entries.data(), table_bytes) ||
+        !write_at(0, &header, sizeof(header))) {
+        return false;
+    }
+    if (fsync(fd) != 0 || ::close(fd) != 0) {
+        fd = -1;
+        unlink(temp_path.c_str());
+        std::cerr << "Unable to flush " << temp_path << std::endl;
+        return false;
+    }
+    fd = -1;
+    if (rename(temp_path.c_str(), path.c_str()) != 0) {
+        unlink(temp_path.c_str());
+        std::cerr << "Unable to rename " << temp_path << " to " << path << std::endl;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,20 @@
+#include <iostream>
+#include <string>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include "../include/openssl_init.h"
+
+void init_openssl() {
+    // OpenSSL initialises itself on first use; doing it up front keeps that
+    // out of the first handshake and reports a broken installation early.
+    if (OPENSSL_init_ssl(OPENSSL_INIT_LOAD_SSL_STRINGS | OPENSSL_INIT_LOAD_CRYPTO_STRINGS,
+                         nullptr) != 1) {
+        std::cerr << "Error initialising OpenSSL" << std::endl;
+        ERR_print_errors_fp(stderr);
+    }
+}
+
+void cleanup_openssl() {
+    // OpenSSL frees its global state at exit; releasing it earlier would
+    // pull it from under threads that are still shutting down.
+}
@@ -0,0 +1,147 @@
+#include <iostream>
+#include <string>
+#include <algorithm>
+#include "../include/prefix_cache.h"
+
+namespace {
+
+// FNV-1a over the token IDs of one block.
+uint64_t hash_tokens(std::span<const uint32_t> tokens) {
+    uint64_t hash = 14695981039346656037ull;
+    for (uint32_t token : tokens) {
+        hash = (hash ^ token) * 1099511628211ull;
+    }
+    return hash;
+}
+
+} // namespace
+
+PrefixCache::PrefixCache(KvBlockPool &blocks, size_t byte_budget)
+    : pool(blocks), budget(byte_budget),
+      node_bytes(blocks.options().layers * blocks.block_floats() * sizeof(float)) {}
+
+PrefixCache::~PrefixCache() {
+    for (Node *node : recency) {
+        for (uint32_t id : node->blocks) {
+            pool.release(id);
+        }
+    }
+}
+
+PrefixCache::Node *PrefixCache::child(Node *node, std::span<const uint32_t> tokens,
+                                      uint64_t hash) const {
+    auto it = node->children.find(hash);
+    if (it == node->children.end() ||
+        !std::equal(tokens.begin(), tokens.end(), it->second->tokens.begin(),
+                    it->second->tokens.end())) {
+        return nullptr;
+    }
+    return it->second.get();
+}
+
+void PrefixCache::touch(Node *node) {
+    recency.splice(recency.end(), recency, node->recency);
+}
+
+size_t PrefixCache::lookup(std::span<const uint32_t> tokens, InferenceState &state) {
+    std::lock_guard<std::mutex> guard(lock);
+    size_t block_tokens = pool.options().block_tokens;
+    size_t layers = pool.options().layers;
+    std::vector<Node *> path;
+    if (state.position() == 0 && block_tokens > 0) {
+        Node *node = &root;
+        for (size_t b = 0; b < tokens.size() / block_tokens; ++b) {
+            std::span<const uint32_t> chunk = tokens.subspan(b * block_tokens, block_tokens);
+            node = child(node, chunk, hash_tokens(chunk));
+            if (!node) {
+                break;
+            }
+            touch(node);
+            path.push_back(node);
+        }
+    }
+    if (path.empty()) {
+        ++counters.misses;
+        return 0;
+    }
+
+    for (Node *node : path) {
+        for (size_t l = 0; l < layers; ++l) {
+            state.blocks().attach(l, node->blocks[l]);
+        }
+    }
+    size_t reused = std::min(path.size() * block_tokens, tokens.size() - 1);
+    state.adopt_prefix(reused);
+    ++counters.hits;
+    counters.reused_tokens += reused;
+    return reused;
+}
+
+void PrefixCache::insert(std::span<const uint32_t> tokens, const InferenceState &state) {
+    std::lock_guard<std::mutex> guard(lock);
+    size_t block_tokens = pool.options().block_tokens;
+    size_t layers = pool.options().layers;
+    if (block_tokens == 0) {
+        return;
+    }
+    size_t whole = std::min(tokens.size(), state.position()) / block_tokens;
+    Node *node = &root;
+    for (size_t b = 0; b < whole; ++b) {
+        std::span<const uint32_t> chunk = tokens.subspan(b * block_tokens, block_tokens);
+        uint64_t hash = hash_tokens(chunk);
+        Node *next = child(node, chunk, hash);
+        if (!next) {
+            if (node->children.count(hash)) {
+                // Another prefix with the same hash got here first.
+                break;
+            }
+            auto created = std::make_unique<Node>();
+            created->parent = node;
+            created->hash = hash;
+            created->tokens.assign(chunk.begin(), chunk.end());
+            created->blocks.resize(layers);
+            for (size_t l = 0; l < layers; ++l) {
+                created->blocks[l] = state.blocks().blocks(l)[b];
+                pool.retain(created->blocks[l]);
+            }
+            next = created.get();
+            next->recency = recency.insert(recency.end(), next);
+            node->children.emplace(hash, std::move(created));
+            ++counters.nodes;
+            counters.bytes += node_bytes;
+        } else {
+            touch(next);
+        }
+        node = next;
+    }
+    evict();
+}
+
+void PrefixCache::evict() {
+    auto it = recency.begin();
+    while (counters.bytes > budget && it != recency.end()) {
+        Node *node = *it;
+        if (!node->children.empty()) {
+            ++it;
+            continue;
+        }
+        it = recency.erase(it);
+        for (uint32_t id : node->blocks) {
+            pool.release(id);
+        }
+        --counters.nodes;
+        counters.bytes -= node_bytes;
+        ++counters.evictions;
+        Node *parent = node->parent;
+        parent->children.erase(node->hash);
+        if (parent != &root && parent->children.empty()) {
+            // The parent is a leaf now and may be older than the scan point.
+            it = recency.begin();
+        }
+    }
+}
+
+PrefixCache::Stats PrefixCache::stats() const {
+    std::lock_guard<std::mutex> guard(lock);
+    return counters;
+}
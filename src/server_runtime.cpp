@@ -0,0 +1,184 @@
+#include <iostream>
+#include <string>
+#include <csignal>
+#include <cstdlib>
+#include <future>
+#include <pthread.h>
+#include <sched.h>
+#include "../include/server_runtime.h"
+
+namespace {
+
+std::vector<int> allowed_cpus() {
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &set)) {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+    if (cpus.empty()) {
+        unsigned count = std::thread::hardware_concurrency();
+        for (unsigned cpu = 0; cpu < (count ? count : 1); ++cpu) {
+            cpus.push_back(static_cast<int>(cpu));
+        }
+    }
+    return cpus;
+}
+
+void pin_current_thread(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        std::cerr << "Error pinning shard to CPU " << cpu << std::endl;
+    }
+}
+
+} // namespace
+
+ShardOptions shard_options_from_env() {
+    ShardOptions options;
+    if (const char *shards = std::getenv("SVAKLA_SHARDS")) {
+        options.shards = static_cast<unsigned>(std::strtoul(shards, nullptr, 10));
+    }
+    if (const char *pin = std::getenv("SVAKLA_PIN_CPUS")) {
+        options.pin_cpus = std::string(pin) == "1";
+    }
+    return options;
+}
+
+ServerRuntime::ServerRuntime(ShardOptions options, size_t worker_threads)
+    : options(options), limits(connection_limits_from_env()), pool(worker_threads) {
+    std::vector<int> cpus = allowed_cpus();
+    size_t count = options.shards ? options.shards : cpus.size();
+    shards.resize(count);
+    for (size_t i = 0; i < count; ++i) {
+        shards[i].loop = std::make_unique<EventLoop>();
+        shards[i].cpu = options.pin_cpus ? cpus[i % cpus.size()] : -1;
+    }
+}
+
+ServerRuntime::~ServerRuntime() {
+    stop();
+    wait();
+    for (SSL_CTX *ctx : tls_contexts) {
+        SSL_CTX_free(ctx);
+    }
+}
+
+bool ServerRuntime::add_service(int port, ConnectionHandler handler) {
+    return bind_service(port, handler, nullptr, limits);
+}
+
+bool ServerRuntime::add_service(int port, ConnectionHandler handler,
+                                const ConnectionLimits &service_limits) {
+    return bind_service(port, handler, nullptr, service_limits);
+}
+
+bool ServerRuntime::add_tls_service(int port, ConnectionHandler handler,
+                                    const TlsConfig &config) {
+    return add_tls_service(port, std::move(handler), config, limits);
+}
+
+bool ServerRuntime::add_tls_service(int port, ConnectionHandler handler, const TlsConfig &config,
+                                    const ConnectionLimits &service_limits) {
+    SSL_CTX *ctx = create_tls_server_context(config);
+    if (!ctx) {
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        tls_contexts.push_back(ctx);
+    }
+    return bind_service(port, handler, ctx, service_limits);
+}
+
+bool ServerRuntime::bind_service(int port, const ConnectionHandler &handler, SSL_CTX *tls,
+                                 const ConnectionLimits &service_limits) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (stopped) {
+        return false;
+    }
+    // One admission state per port, so its limits hold across all shards.
+    auto admission = std::make_shared<AdmissionControl>(service_limits);
+    // A single shard keeps exclusive binding so a second process on the
+    // same port still fails loudly.
+    bool reuse_port = shards.size() > 1;
+
+    bool bound = true;
+    for (auto &shard : shards) {
+        if (!started) {
+            bound = shard.loop->listen(port, handler, tls, reuse_port, admission) && bound;
+            continue;
+        }
+        // Running loops own their listener table; bind from the loop thread.
+        std::promise<bool> result;
+        EventLoop *loop = shard.loop.get();
+        loop->post([&result, loop, port, &handler, tls, reuse_port, admission]() {
+            result.set_value(loop->listen(port, handler, tls, reuse_port, admission));
+        });
+        bound = result.get_future().get() && bound;
+    }
+    return bound;
+}
+
+bool ServerRuntime::start() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (started) {
+        return false;
+    }
+    started = true;
+    // SSL_write goes through write(2), which has no MSG_NOSIGNAL; a peer
+    // that closes mid-reply must cost the connection, not the process.
+    std::signal(SIGPIPE, SIG_IGN);
+
+    for (auto &shard : shards) {
+        EventLoop *loop = shard.loop.get();
+        int cpu = shard.cpu;
+        shard.thread = std::thread([loop, cpu]() {
+            if (cpu >= 0) {
+                pin_current_thread(cpu);
+            }
+            loop->run();
+        });
+    }
+    return true;
+}
+
+void ServerRuntime::wait() {
+    for (auto &shard : shards) {
+        if (shard.thread.joinable()) {
+            shard.thread.join();
+        }
+    }
+}
+
+void ServerRuntime::stop() {
+    stopped = true;
+    for (auto &shard : shards) {
+        shard.loop->stop();
+    }
+}
+
+std::vector<ShardStats> ServerRuntime::stats() const {
+    std::vector<ShardStats> result;
+    result.reserve(shards.size());
+    for (size_t i = 0; i < shards.size(); ++i) {
+        const EventLoopStats &counters = shards[i].loop->stats();
+        result.push_back(ShardStats{
+            static_cast<unsigned>(i),
+            shards[i].cpu,
+            counters.accepted.load(std::memory_order_relaxed),
+            counters.active.load(std::memory_order_relaxed),
+            counters.bytes_read.load(std::memory_order_relaxed),
+            counters.bytes_written.load(std::memory_order_relaxed),
+            counters.rejected.load(std::memory_order_relaxed),
+            counters.timed_out.load(std::memory_order_relaxed),
+        });
+    }
+    return result;
+}
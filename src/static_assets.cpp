@@ -0,0 +1,307 @@
+#include <iostream>
+#include <string>
+#include <charconv>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <zlib.h>
+#include "../include/static_assets.h"
+
+namespace {
+
+// Kept only when it saves at least this fraction of the original size.
+constexpr double kMinGzipSaving = 0.1;
+
+std::string gzip_compress(const std::string &input) {
+    z_stream stream{};
+    if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) !=
+        Z_OK) {
+        return {};
+    }
+
+    std::string output(deflateBound(&stream, input.size()), '\0');
+    stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(input.data()));
+    stream.avail_in = static_cast<uInt>(input.size());
+    stream.next_out = reinterpret_cast<Bytef *>(output.data());
+    stream.avail_out = static_cast<uInt>(output.size());
+
+    int result = deflate(&stream, Z_FINISH);
+    output.resize(stream.total_out);
+    deflateEnd(&stream);
+    return result == Z_STREAM_END ? output : std::string();
+}
+
+bool compressible(std::string_view content_type) {
+    return content_type.starts_with("text/") || content_type.starts_with("application/json") ||
+           content_type.starts_with("application/javascript") ||
+           content_type.starts_with("image/svg+xml");
+}
+
+// FNV-1a is plenty to tell two versions of an asset apart.
+std::string make_etag(const std::string &content) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : content) {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    char digits[17];
+    auto result = std::to_chars(digits, digits + 16, hash, 16);
+    std::string etag = "\"";
+    etag.append(16 - (result.ptr - digits), '0');
+    etag.append(digits, result.ptr);
+    etag.push_back('"');
+    return etag;
+}
+
+bool etag_matches(std::string_view header, const std::string &etag) {
+    if (header.empty()) {
+        return false;
+    }
+    while (!header.empty()) {
+        size_t comma = header.find(',');
+        std::string_view item = header.substr(0, comma);
+        while (!item.empty() && item.front() == ' ') {
+            item.remove_prefix(1);
+        }
+        while (!item.empty() && item.back() == ' ') {
+            item.remove_suffix(1);
+        }
+        // If-None-Match uses weak comparison (RFC 9110 13.1.2).
+        if (item.starts_with("W/")) {
+            item.remove_prefix(2);
+        }
+        if (item == "*" || item == etag) {
+            return true;
+        }
+        if (comma == std::string_view::npos) {
+            break;
+        }
+        header.remove_prefix(comma + 1);
+    }
+    return false;
+}
+
+bool accepts_gzip(std::string_view header) {
+    while (!header.empty()) {
+        size_t comma = header.find(',');
+        std::string_view item = header.substr(0, comma);
+        while (!item.empty() && item.front() == ' ') {
+            item.remove_prefix(1);
+        }
+        if (item.starts_with("gzip")) {
+            size_t q = item.find("q=");
+            return q == std::string_view::npos || item.substr(q + 2).find_first_not_of("0.") !=
+                                                      std::string_view::npos;
+        }
+        if (comma == std::string_view::npos) {
+            break;
+        }
+        header.remove_prefix(comma + 1);
+    }
+    return false;
+}
+
+enum class RangeResult {
+    None,
+    Satisfiable,
+    Unsatisfiable,
+};
+
+// Parses a single "bytes=" range; multiple ranges are answered with the
+// full body, which RFC 9110 14.2 allows.
+RangeResult parse_range(std::string_view header, size_t total, size_t &first, size_t &last) {
+    if (!header.starts_with("bytes=")) {
+        return RangeResult::None;
+    }
+    std::string_view spec = header.substr(6);
+    if (spec.find(',') != std::string_view::npos) {
+        return RangeResult::None;
+    }
+    size_t dash = spec.find('-');
+    if (dash == std::string_view::npos) {
+        return RangeResult::None;
+    }
+    std::string_view start_text = spec.substr(0, dash);
+    std::string_view end_text = spec.substr(dash + 1);
+
+    auto parse = [](std::string_view text, size_t &value) {
+        auto result = std::from_chars(text.data(), text.data() + text.size(), value);
+        return result.ec == std::errc() && result.ptr == text.data() + text.size();
+    };
+
+    if (start_text.empty()) {
+        size_t suffix = 0;
+        if (!parse(end_text, suffix)) {
+            return RangeResult::None;
+        }
+        if (suffix == 0 || total == 0) {
+            return RangeResult::Unsatisfiable;
+        }
+        first = suffix >= total ? 0 : total - suffix;
+        last = total - 1;
+        return RangeResult::Satisfiable;
+    }
+
+    if (!parse(start_text, first)) {
+        return RangeResult::None;
+    }
+    if (end_text.empty()) {
+        last = total - 1;
+    } else if (!parse(end_text, last) || last < first) {
+        return RangeResult::None;
+    }
+    if (first >= total) {
+        return RangeResult::Unsatisfiable;
+    }
+    last = std::min(last, total - 1);
+    return RangeResult::Satisfiable;
+}
+
+} // namespace
+
+std::string static_content_type(std::string_view path) {
+    static const std::unordered_map<std::string_view, std::string_view> types = {
+        {".html", "text/html; charset=utf-8"},
+        {".css", "text/css; charset=utf-8"},
+        {".js", "application/javascript; charset=utf-8"},
+        {".json", "application/json"},
+        {".svg", "image/svg+xml"},
+        {".png", "image/png"},
+        {".jpg", "image/jpeg"},
+        {".ico", "image/x-icon"},
+        {".woff2", "font/woff2"},
+        {".txt", "text/plain; charset=utf-8"},
+    };
+    size_t dot = path.rfind('.');
+    if (dot != std::string_view::npos) {
+        auto type = types.find(path.substr(dot));
+        if (type != types.end()) {
+            return std::string(type->second);
+        }
+    }
+    return "application/octet-stream";
+}
+
+size_t StaticAssetCache::load_directory(const std::string &root) {
+    std::error_code error;
+    if (!std::filesystem::is_directory(root, error)) {
+        return 0;
+    }
+
+    size_t loaded = 0;
+    for (const auto &entry : std::filesystem::recursive_directory_iterator(root, error)) {
+        if (!entry.is_regular_file()) {
+            continue;
+        }
+        std::ifstream file(entry.path(), std::ios::binary);
+        if (!file.is_open()) {
+            std::cerr << "Unable to open asset: " << entry.path() << std::endl;
+            continue;
+        }
+        std::string content((std::istreambuf_iterator<char>(file)),
+                            std::istreambuf_iterator<char>());
+        std::string path = "/";
+        path += std::filesystem::relative(entry.path(), root).generic_string();
+        add(std::move(path), std::move(content));
+        ++loaded;
+    }
+    return loaded;
+}
+
+void StaticAssetCache::add(std::string path, std::string content) {
+    StaticAsset asset;
+    asset.content_type = static_content_type(path);
+    asset.etag = make_etag(content);
+    if (compressible(asset.content_type)) {
+        std::string compressed = gzip_compress(content);
+        if (!compressed.empty() &&
+            compressed.size() < content.size() * (1.0 - kMinGzipSaving)) {
+            asset.gzip_body = std::make_shared<const std::string>(std::move(compressed));
+            asset.gzip_etag = asset.etag;
+            asset.gzip_etag.insert(asset.gzip_etag.size() - 1, "-gz");
+        }
+    }
+    asset.body = std::make_shared<const std::string>(std::move(content));
+    assets[std::move(path)] = std::move(asset);
+}
+
+const StaticAsset *StaticAssetCache::find(std::string_view path) const {
+    auto asset = assets.find(path);
+    if (asset != assets.end()) {
+        return &asset->second;
+    }
+    if (path.empty() || path.back() == '/') {
+        std::string index(path);
+        index.append("index.html");
+        asset = assets.find(index);
+        if (asset != assets.end()) {
+            return &asset->second;
+        }
+    }
+    return nullptr;
+}
+
+void StaticAssetCache::serve(const HttpRequest &request, HttpResponse &response) const {
+    const StaticAsset *asset = find(request.path);
+    if (!asset) {
+        response.status = 404;
+        response.body = http_status_text(404);
+        return;
+    }
+
+    response.content_type = asset->content_type;
+    // Always revalidate: a repeat load then costs one 304 round trip.
+    response.set_header("Cache-Control", "no-cache");
+    response.set_header("Accept-Ranges", "bytes");
+    if (asset->gzip_body) {
+        response.set_header("Vary", "Accept-Encoding");
+    }
+
+    // Validators are compared against the representation this request
+    // would get; a range is always a slice of the identity body.
+    size_t total = asset->body->size();
+    size_t first = 0;
+    size_t last = 0;
+    RangeResult range = RangeResult::None;
+    // If-Range needs a strong match (RFC 9110 13.1.5), so a weak tag or the
+    // gzip tag falls through to a full response.
+    std::string_view if_range = request.header("If-Range");
+    if (if_range.empty() || if_range == asset->etag) {
+        range = parse_range(request.header("Range"), total, first, last);
+    }
+    bool gzip = range == RangeResult::None && asset->gzip_body &&
+                accepts_gzip(request.header("Accept-Encoding"));
+    const std::string &etag = gzip ? asset->gzip_etag : asset->etag;
+    response.set_header("ETag", etag);
+
+    if (etag_matches(request.header("If-None-Match"), etag)) {
+        response.status = 304;
+        return;
+    }
+
+    if (range == RangeResult::Unsatisfiable) {
+        response.status = 416;
+        response.set_header("Content-Range", "bytes */" + std::to_string(total));
+        return;
+    }
+    if (range == RangeResult::Satisfiable) {
+        response.status = 206;
+        response.set_header("Content-Range", "bytes " + std::to_string(first) + "-" +
+                                                 std::to_string(last) + "/" +
+                                                 std::to_string(total));
+        response.shared_body = asset->body;
+        response.shared_offset = first;
+        response.shared_size = last - first + 1;
+        return;
+    }
+
+    if (gzip) {
+        response.set_header("Content-Encoding", "gzip");
+        response.shared_body = asset->gzip_body;
+        response.shared_size = asset->gzip_body->size();
+        return;
+    }
+
+    response.shared_body = asset->body;
+    response.shared_size = total;
+}
@@ -0,0 +1,395 @@
+#include <iostream>
+#include <string>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include "../include/tensor_ops.h"
+
+namespace {
+
+// Rows of a weight band and inputs of a tile that are multiplied together
+// while both are in cache: 16 rows of a 4096-wide Q8 matrix are 64 KiB.
+constexpr size_t kRowBand = 16;
+constexpr size_t kBatchTile = 8;
+
+// Keys scored at once by attend() before the running softmax is rescaled.
+constexpr size_t kAttentionChunk = 32;
+constexpr size_t kMaxHeadDim = 512;
+
+struct DotKernels {
+    const char *name;
+    float (*q8)(const int8_t *w, const float *w_scales, const int8_t *x, const float *x_scales,
+                size_t blocks);
+    float (*q4)(const uint8_t *w, const float *w_scales, const int8_t *x, const float *x_scales,
+                size_t blocks);
+    float (*f32)(const float *a, const float *b, size_t n);
+};
+
+float dot_q8_scalar(const int8_t *w, const float *w_scales, const int8_t *x,
+                    const float *x_scales, size_t blocks) {
+    float total = 0.0f;
+    for (size_t block = 0; block < blocks; ++block) {
+        int32_t sum = 0;
+        for (size_t i = 0; i < kWeightBlock; ++i) {
+            sum += w[block * kWeightBlock + i] * x[block * kWeightBlock + i];
+        }
+        total += static_cast<float>(sum) * w_scales[block] * x_scales[block];
+    }
+    return total;
+}
+
+float dot_q4_scalar(const uint8_t *w, const float *w_scales, const int8_t *x,
+                    const float *x_scales, size_t blocks) {
+    constexpr size_t kHalf = kWeightBlock / 2;
+    float total = 0.0f;
+    for (size_t block = 0; block < blocks; ++block) {
+        const uint8_t *packed = w + block * kHalf;
+        const int8_t *values = x + block * kWeightBlock;
+        int32_t sum = 0;
+        for (size_t i = 0; i < kHalf; ++i) {
+            sum += ((packed[i] & 0xF) - 8) * values[i];
+            sum += ((packed[i] >> 4) - 8) * values[i + kHalf];
+        }
+        total += static_cast<float>(sum) * w_scales[block] * x_scales[block];
+    }
+    return total;
+}
+
+float dot_f32_scalar(const float *a, const float *b, size_t n) {
+    float sum = 0.0f;
+    for (size_t i = 0; i < n; ++i) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+#if defined(__x86_64__)
+// maddubs and dpbusd multiply unsigned by signed bytes, so the sign of each
+// weight is moved onto the activation first.
+
+__attribute__((target("avx2,fma"))) float hsum_avx2(__m256 v) {
+    __m128 sum = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    sum = _mm_hadd_ps(sum, sum);
+    sum = _mm_hadd_ps(sum, sum);
+    return _mm_cvtss_f32(sum);
+}
+
+__attribute__((target("avx2,fma"))) __m256i unpack_q4_low(__m256i packed) {
+    return _mm256_sub_epi8(_mm256_and_si256(packed, _mm256_set1_epi8(0x0F)),
+                           _mm256_set1_epi8(8));
+}
+
+__attribute__((target("avx2,fma"))) __m256i unpack_q4_high(__m256i packed) {
+    return _mm256_sub_epi8(_mm256_and_si256(_mm256_srli_epi16(packed, 4),
+                                            _mm256_set1_epi8(0x0F)),
+                           _mm256_set1_epi8(8));
+}
+
+__attribute__((target("avx2,fma"))) __m256i dot_bytes_avx2(__m256i w, __m256i x) {
+    __m256i pairs = _mm256_maddubs_epi16(_mm256_sign_epi8(w, w), _mm256_sign_epi8(x, w));
+    return _mm256_madd_epi16(pairs, _mm256_set1_epi16(1));
+}
+
+__attribute__((target("avx2,fma"))) float dot_q8_avx2(const int8_t *w, const float *w_scales,
+                                                      const int8_t *x, const float *x_scales,
+                                                      size_t blocks) {
+    __m256 acc = _mm256_setzero_ps();
+    for (size_t block = 0; block < blocks; ++block) {
+        const __m256i *wv = reinterpret_cast<const __m256i *>(w + block * kWeightBlock);
+        const __m256i *xv = reinterpret_cast<const __m256i *>(x + block * kWeightBlock);
+        __m256i sum = _mm256_add_epi32(
+            dot_bytes_avx2(_mm256_loadu_si256(wv), _mm256_loadu_si256(xv)),
+            dot_bytes_avx2(_mm256_loadu_si256(wv + 1), _mm256_loadu_si256(xv + 1)));
+        acc = _mm256_fmadd_ps(_mm256_cvtepi32_ps(sum),
+                              _mm256_set1_ps(w_scales[block] * x_scales[block]), acc);
+    }
+    return hsum_avx2(acc);
+}
+
+__attribute__((target("avx2,fma"))) float dot_q4_avx2(const uint8_t *w, const float *w_scales,
+                                                      const int8_t *x, const float *x_scales,
+                                                      size_t blocks) {
+    __m256 acc = _mm256_setzero_ps();
+    for (size_t block = 0; block < blocks; ++block) {
+        __m256i packed = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i *>(w + block * kWeightBlock / 2));
+        const __m256i *xv = reinterpret_cast<const __m256i *>(x + block * kWeightBlock);
+        __m256i sum = _mm256_add_epi32(
+            dot_bytes_avx2(unpack_q4_low(packed), _mm256_loadu_si256(xv)),
+            dot_bytes_avx2(unpack_q4_high(packed), _mm256_loadu_si256(xv + 1)));
+        acc = _mm256_fmadd_ps(_mm256_cvtepi32_ps(sum),
+                              _mm256_set1_ps(w_scales[block] * x_scales[block]), acc);
+    }
+    return hsum_avx2(acc);
+}
+
+__attribute__((target("avx2,fma"))) float dot_f32_avx2(const float *a, const float *b, size_t n) {
+    __m256 acc = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc);
+    }
+    float sum = hsum_avx2(acc);
+    for (; i < n; ++i) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+__attribute__((target("avxvnni,avx2,fma"))) __m256i dot_bytes_vnni(__m256i sum, __m256i w,
+                                                                   __m256i x) {
+    return _mm256_dpbusd_avx_epi32(sum, _mm256_sign_epi8(w, w), _mm256_sign_epi8(x, w));
+}
+
+__attribute__((target("avxvnni,avx2,fma"))) float dot_q8_vnni(const int8_t *w,
+                                                              const float *w_scales,
+                                                              const int8_t *x,
+                                                              const float *x_scales,
+                                                              size_t blocks) {
+    __m256 acc = _mm256_setzero_ps();
+    for (size_t block = 0; block < blocks; ++block) {
+        const __m256i *wv = reinterpret_cast<const __m256i *>(w + block * kWeightBlock);
+        const __m256i *xv = reinterpret_cast<const __m256i *>(x + block * kWeightBlock);
+        __m256i sum = dot_bytes_vnni(_mm256_setzero_si256(), _mm256_loadu_si256(wv),
+                                     _mm256_loadu_si256(xv));
+        sum = dot_bytes_vnni(sum, _mm256_loadu_si256(wv + 1), _mm256_loadu_si256(xv + 1));
+        acc = _mm256_fmadd_ps(_mm256_cvtepi32_ps(sum),
+                              _mm256_set1_ps(w_scales[block] * x_scales[block]), acc);
+    }
+    return hsum_avx2(acc);
+}
+
+__attribute__((target("avxvnni,avx2,fma"))) float dot_q4_vnni(const uint8_t *w,
+                                                              const float *w_scales,
+                                                              const int8_t *x,
+                                                              const float *x_scales,
+                                                              size_t blocks) {
+    __m256 acc = _mm256_setzero_ps();
+    for (size_t block = 0; block < blocks; ++block) {
+        __m256i packed = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i *>(w + block * kWeightBlock / 2));
+        const __m256i *xv = reinterpret_cast<const __m256i *>(x + block * kWeightBlock);
+        __m256i sum = dot_bytes_vnni(_mm256_setzero_si256(), unpack_q4_low(packed),
+                                     _mm256_loadu_si256(xv));
+        sum = dot_bytes_vnni(sum, unpack_q4_high(packed), _mm256_loadu_si256(xv + 1));
+        acc = _mm256_fmadd_ps(_mm256_cvtepi32_ps(sum),
+                              _mm256_set1_ps(w_scales[block] * x_scales[block]), acc);
+    }
+    return hsum_avx2(acc);
+}
+
+// GCC 12's AVX-512 headers trip its own uninitialized-variable warnings.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+// A block of 64 bytes is exactly one zmm register.
+__attribute__((target("avx512f,avx512bw,avx512vnni"))) __m512i dot_block_avx512(__m512i w,
+                                                                                __m512i x) {
+    __mmask64 negative = _mm512_movepi8_mask(w);
+    __m512i signed_x = _mm512_mask_sub_epi8(x, negative, _mm512_setzero_si512(), x);
+    return _mm512_dpbusd_epi32(_mm512_setzero_si512(), _mm512_abs_epi8(w), signed_x);
+}
+
+__attribute__((target("avx512f,avx512bw,avx512vnni"))) float dot_q8_avx512(
+    const int8_t *w, const float *w_scales, const int8_t *x, const float *x_scales,
+    size_t blocks) {
+    __m512 acc = _mm512_setzero_ps();
+    for (size_t block = 0; block < blocks; ++block) {
+        __m512i sum = dot_block_avx512(_mm512_loadu_si512(w + block * kWeightBlock),
+                                       _mm512_loadu_si512(x + block * kWeightBlock));
+        acc = _mm512_fmadd_ps(_mm512_cvtepi32_ps(sum),
+                              _mm512_set1_ps(w_scales[block] * x_scales[block]), acc);
+    }
+    return _mm512_reduce_add_ps(acc);
+}
+
+__attribute__((target("avx512f,avx512bw,avx512vnni"))) float dot_q4_avx512(
+    const uint8_t *w, const float *w_scales, const int8_t *x, const float *x_scales,
+    size_t blocks) {
+    const __m256i low_mask = _mm256_set1_epi8(0x0F);
+    const __m256i bias = _mm256_set1_epi8(8);
+    __m512 acc = _mm512_setzero_ps();
+    for (size_t block = 0; block < blocks; ++block) {
+        __m256i packed = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i *>(w + block * kWeightBlock / 2));
+        __m256i low = _mm256_sub_epi8(_mm256_and_si256(packed, low_mask), bias);
+        __m256i high = _mm256_sub_epi8(
+            _mm256_and_si256(_mm256_srli_epi16(packed, 4), low_mask), bias);
+        __m512i wv = _mm512_inserti64x4(_mm512_castsi256_si512(low), high, 1);
+        __m512i sum = dot_block_avx512(wv, _mm512_loadu_si512(x + block * kWeightBlock));
+        acc = _mm512_fmadd_ps(_mm512_cvtepi32_ps(sum),
+                              _mm512_set1_ps(w_scales[block] * x_scales[block]), acc);
+    }
+    return _mm512_reduce_add_ps(acc);
+}
+
+#pragma GCC diagnostic pop
+#endif
+
+const DotKernels &dot_kernels() {
+    static const DotKernels kernels = [] {
+#if defined(__x86_64__)
+        if (__builtin_cpu_supports("avx512vnni") && __builtin_cpu_supports("avx512bw")) {
+            return DotKernels{"avx512-vnni", dot_q8_avx512, dot_q4_avx512, dot_f32_avx2};
+        }
+        if (__builtin_cpu_supports("avxvnni")) {
+            return DotKernels{"avx-vnni", dot_q8_vnni, dot_q4_vnni, dot_f32_avx2};
+        }
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+            return DotKernels{"avx2", dot_q8_avx2, dot_q4_avx2, dot_f32_avx2};
+        }
+#endif
+        return DotKernels{"scalar", dot_q8_scalar, dot_q4_scalar, dot_f32_scalar};
+    }();
+    return kernels;
+}
+
+} // namespace
+
+const char *tensor_ops_isa() {
+    return dot_kernels().name;
+}
+
+void matmul(const WeightTensor &w, const float *x, size_t batch, size_t x_stride, float *y,
+            size_t y_stride, ComputePool &pool) {
+    const DotKernels &kernels = dot_kernels();
+    if (w.type == WeightType::F32) {
+        pool.parallel_for(w.rows, kRowBand, [&](size_t begin, size_t end) {
+            for (size_t r = begin; r < end; ++r) {
+                for (size_t b = 0; b < batch; ++b) {
+                    y[b * y_stride + r] = kernels.f32(w.f32_row(r), x + b * x_stride, w.cols);
+                }
+            }
+        });
+        return;
+    }
+
+    // The workers read the quantized inputs through these pointers; the
+    // buffers themselves belong to the calling thread.
+    thread_local std::vector<int8_t> quants;
+    thread_local std::vector<float> scales;
+    size_t blocks = weight_blocks_per_row(w.cols);
+    size_t padded = blocks * kWeightBlock;
+    quants.resize(batch * padded);
+    scales.resize(batch * blocks);
+    for (size_t b = 0; b < batch; ++b) {
+        quantize_row_q8(x + b * x_stride, w.cols, quants.data() + b * padded,
+                        scales.data() + b * blocks);
+    }
+    const int8_t *xq = quants.data();
+    const float *xs = scales.data();
+
+    pool.parallel_for(w.rows, kRowBand, [&](size_t begin, size_t end) {
+        for (size_t tile = 0; tile < batch; tile += kBatchTile) {
+            size_t tile_end = std::min(batch, tile + kBatchTile);
+            for (size_t r = begin; r < end; ++r) {
+                const float *w_scales = w.row_scales(r);
+                for (size_t b = tile; b < tile_end; ++b) {
+                    float value = w.type == WeightType::Q8
+                        ? kernels.q8(w.q8_row(r), w_scales, xq + b * padded, xs + b * blocks,
+                                     blocks)
+                        : kernels.q4(w.q4_row(r), w_scales, xq + b * padded, xs + b * blocks,
+                                     blocks);
+                    y[b * y_stride + r] = value;
+                }
+            }
+        }
+    });
+}
+
+void rmsnorm(const float *x, const float *weight, size_t n, float eps, float *out) {
+    float sum = dot_kernels().f32(x, x, n);
+    float scale = 1.0f / std::sqrt(sum / static_cast<float>(n) + eps);
+    for (size_t i = 0; i < n; ++i) {
+        out[i] = x[i] * scale * weight[i];
+    }
+}
+
+void softmax(float *x, size_t n) {
+    float max = *std::max_element(x, x + n);
+    float sum = 0.0f;
+    for (size_t i = 0; i < n; ++i) {
+        x[i] = std::exp(x[i] - max);
+        sum += x[i];
+    }
+    for (size_t i = 0; i < n; ++i) {
+        x[i] /= sum;
+    }
+}
+
+void silu_mul(float *gate, const float *up, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        gate[i] = gate[i] / (1.0f + std::exp(-gate[i])) * up[i];
+    }
+}
+
+void rope(float *x, size_t heads, size_t head_dim, size_t pos, const float *inv_freq) {
+    float cosines[kMaxHeadDim / 2];
+    float sines[kMaxHeadDim / 2];
+    size_t pairs = std::min(head_dim, kMaxHeadDim) / 2;
+    for (size_t i = 0; i < pairs; ++i) {
+        float angle = static_cast<float>(pos) * inv_freq[i];
+        cosines[i] = std::cos(angle);
+        sines[i] = std::sin(angle);
+    }
+    for (size_t h = 0; h < heads; ++h) {
+        float *head = x + h * head_dim;
+        for (size_t i = 0; i < pairs; ++i) {
+            float a = head[2 * i];
+            float b = head[2 * i + 1];
+            head[2 * i] = a * cosines[i] - b * sines[i];
+            head[2 * i + 1] = a * sines[i] + b * cosines[i];
+        }
+    }
+}
+
+void attend(const float *q, const KvBlocks &kv, size_t offset, size_t positions,
+            size_t head_dim, float *out) {
+    const DotKernels &kernels = dot_kernels();
+    float scale = 1.0f / std::sqrt(static_cast<float>(head_dim));
+    float running_max = -std::numeric_limits<float>::infinity();
+    float total = 0.0f;
+    float scores[kAttentionChunk];
+    std::fill(out, out + head_dim, 0.0f);
+
+    size_t count = 0;
+    for (size_t first = 0; first < positions; first += count) {
+        // A chunk never crosses into the next block.
+        size_t row = first % kv.rows;
+        count = std::min({kAttentionChunk, kv.rows - row, positions - first});
+        const float *keys = kv.blocks[first / kv.rows] + row * kv.stride + offset;
+        const float *values = keys + kv.rows * kv.stride;
+        float chunk_max = -std::numeric_limits<float>::infinity();
+        for (size_t i = 0; i < count; ++i) {
+            scores[i] = kernels.f32(q, keys + i * kv.stride, head_dim) * scale;
+            chunk_max = std::max(chunk_max, scores[i]);
+        }
+        if (chunk_max > running_max) {
+            // Earlier weights were relative to a smaller maximum.
+            float correction = std::exp(running_max - chunk_max);
+            total *= correction;
+            for (size_t d = 0; d < head_dim; ++d) {
+                out[d] *= correction;
+            }
+            running_max = chunk_max;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            float weight = std::exp(scores[i] - running_max);
+            total += weight;
+            const float *value = values + i * kv.stride;
+            for (size_t d = 0; d < head_dim; ++d) {
+                out[d] += weight * value[d];
+            }
+        }
+    }
+    if (total > 0.0f) {
+        for (size_t d = 0; d < head_dim; ++d) {
+            out[d] /= total;
+        }
+    }
+}
@@ -0,0 +1,69 @@
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include "../include/tls.h"
+
+namespace {
+
+const unsigned char kSessionIdContext[] = "svaklaai";
+
+} // namespace
+
+TlsConfig tls_config_from_env() {
+    TlsConfig config;
+    if (const char *path = std::getenv("SVAKLA_TLS_CERT")) {
+        config.certificate_path = path;
+    }
+    if (const char *path = std::getenv("SVAKLA_TLS_KEY")) {
+        config.private_key_path = path;
+    }
+    return config;
+}
+
+SSL_CTX *create_tls_server_context(const TlsConfig &config) {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx) {
+        std::cerr << "Error creating SSL context" << std::endl;
+        return nullptr;
+    }
+
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(ctx, SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE);
+
+    // The event loop retries writes from a buffer that may have grown or
+    // moved since the SSL_write that returned WANT_WRITE.
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                              SSL_MODE_RELEASE_BUFFERS);
+
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, static_cast<long>(config.session_cache_size));
+    SSL_CTX_set_timeout(ctx, config.session_timeout_seconds);
+    SSL_CTX_set_session_id_context(ctx, kSessionIdContext, sizeof(kSessionIdContext) - 1);
+    SSL_CTX_set_num_tickets(ctx, config.session_tickets);
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, config.certificate_path.c_str()) <= 0) {
+        std::cerr << "Error loading certificate " << config.certificate_path
+                  << "; set SVAKLA_TLS_CERT" << std::endl;
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(ctx);
+        return nullptr;
+    }
+
+    if (SSL_CTX_use_PrivateKey_file(ctx, config.private_key_path.c_str(), SSL_FILETYPE_PEM) <= 0) {
+        std::cerr << "Error loading private key " << config.private_key_path
+                  << "; set SVAKLA_TLS_KEY" << std::endl;
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(ctx);
+        return nullptr;
+    }
+
+    if (SSL_CTX_check_private_key(ctx) != 1) {
+        std::cerr << "Private key does not match the certificate" << std::endl;
+        SSL_CTX_free(ctx);
+        return nullptr;
+    }
+
+    return ctx;
+}
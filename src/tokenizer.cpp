@@ -0,0 +1,594 @@
+#include <iostream>
+#include <string>
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <unordered_map>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include "../include/tokenizer.h"
+
+namespace {
+
+enum ByteClass : uint8_t {
+    Letter,
+    Digit,
+    Space,
+    Other,
+};
+
+// Longer pieces are cut; it bounds both the held-back input of a stream
+// and the merge work for runaway runs such as base64 blobs.
+constexpr size_t kMaxPieceBytes = 1024;
+constexpr uint32_t kNoRank = ~0u;
+
+// Pieces up to this size are merged with a linear scan; longer ones use a
+// heap so a single piece never goes quadratic.
+constexpr size_t kLinearMergeBytes = 16;
+
+// The piece cache is only worth allocating once a stream has seen this
+// much input.
+constexpr size_t kCacheThreshold = 16 * 1024;
+constexpr size_t kCacheEntries = 2048;
+constexpr size_t kCachedPieceBytes = 22;
+constexpr size_t kCachedPieceTokens = 8;
+
+constexpr std::array<uint8_t, 256> make_class_table() {
+    std::array<uint8_t, 256> table{};
+    for (int c = 0; c < 256; ++c) {
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c >= 0x80) {
+            table[c] = Letter;
+        } else if (c >= '0' && c <= '9') {
+            table[c] = Digit;
+        } else if (c == ' ' || (c >= '\t' && c <= '\r')) {
+            table[c] = Space;
+        } else {
+            table[c] = Other;
+        }
+    }
+    return table;
+}
+
+constexpr std::array<uint8_t, 256> kByteClass = make_class_table();
+
+ByteClass byte_class(char c) {
+    return static_cast<ByteClass>(kByteClass[static_cast<uint8_t>(c)]);
+}
+
+#if defined(__x86_64__)
+// Bit i of each mask is set when byte i belongs to the class; the SSE2 and
+// AVX2 versions compute the same thing 16 or 32 bytes at a time.
+uint32_t class_mask_sse2(__m128i block, ByteClass cls) {
+    auto in_range = [](__m128i value, char low, char count) {
+        __m128i offset = _mm_sub_epi8(value, _mm_set1_epi8(low));
+        return _mm_cmpeq_epi8(_mm_min_epu8(offset, _mm_set1_epi8(count - 1)), offset);
+    };
+    auto letters = [&] {
+        __m128i alpha = in_range(_mm_or_si128(block, _mm_set1_epi8(0x20)), 'a', 26);
+        return static_cast<uint32_t>(_mm_movemask_epi8(alpha) | _mm_movemask_epi8(block));
+    };
+    auto digits = [&] {
+        return static_cast<uint32_t>(_mm_movemask_epi8(in_range(block, '0', 10)));
+    };
+    auto spaces = [&] {
+        __m128i space = _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8(' ')),
+                                     in_range(block, '\t', 5));
+        return static_cast<uint32_t>(_mm_movemask_epi8(space));
+    };
+    switch (cls) {
+    case Letter: return letters();
+    case Digit: return digits();
+    case Space: return spaces();
+    default: return ~(letters() | digits() | spaces()) & 0xFFFF;
+    }
+}
+
+__attribute__((target("avx2"))) __m256i in_range_avx2(__m256i value, char low, char count) {
+    __m256i offset = _mm256_sub_epi8(value, _mm256_set1_epi8(low));
+    return _mm256_cmpeq_epi8(_mm256_min_epu8(offset, _mm256_set1_epi8(count - 1)), offset);
+}
+
+__attribute__((target("avx2"))) uint32_t class_mask_avx2(__m256i block, ByteClass cls) {
+    __m256i alpha = in_range_avx2(_mm256_or_si256(block, _mm256_set1_epi8(0x20)), 'a', 26);
+    uint32_t letters = static_cast<uint32_t>(_mm256_movemask_epi8(alpha)) |
+                       static_cast<uint32_t>(_mm256_movemask_epi8(block));
+    uint32_t digits = static_cast<uint32_t>(_mm256_movemask_epi8(in_range_avx2(block, '0', 10)));
+    __m256i space = _mm256_or_si256(_mm256_cmpeq_epi8(block, _mm256_set1_epi8(' ')),
+                                    in_range_avx2(block, '\t', 5));
+    uint32_t spaces = static_cast<uint32_t>(_mm256_movemask_epi8(space));
+    switch (cls) {
+    case Letter: return letters;
+    case Digit: return digits;
+    case Space: return spaces;
+    default: return ~(letters | digits | spaces);
+    }
+}
+
+__attribute__((target("avx2"))) size_t scan_avx2(const char *data, size_t size, ByteClass cls) {
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+        uint32_t mask = class_mask_avx2(block, cls);
+        if (mask != 0xFFFFFFFFu) {
+            return i + __builtin_ctz(~mask);
+        }
+    }
+    return i;
+}
+
+size_t scan_sse2(const char *data, size_t size, ByteClass cls) {
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+        uint32_t mask = class_mask_sse2(block, cls);
+        if (mask != 0xFFFFu) {
+            return i + __builtin_ctz(~mask);
+        }
+    }
+    return i;
+}
+#endif
+
+// Length of the run of cls bytes at the start of data. The vector scans
+// stop at the first block holding another class; the tail is scalar.
+size_t scan_run(const char *data, size_t size, ByteClass cls) {
+    size_t i = 0;
+#if defined(__x86_64__)
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    if (has_avx2 && size >= 32) {
+        i = scan_avx2(data, size, cls);
+    }
+    if (size - i >= 16) {
+        i += scan_sse2(data + i, size - i, cls);
+    }
+#endif
+    while (i < size && byte_class(data[i]) == cls) {
+        ++i;
+    }
+    return i;
+}
+
+// Length of the piece at the start of data, or 0 when it may continue past
+// size and more input is coming.
+size_t next_piece(const char *data, size_t size, bool final) {
+    if (data[0] == '\'') {
+        if (size < 3 && !final) {
+            return 0;
+        }
+        if (size >= 2) {
+            char a = data[1];
+            if (a == 's' || a == 't' || a == 'm' || a == 'd') {
+                return 2;
+            }
+            char b = size >= 3 ? data[2] : '\0';
+            if ((a == 'r' && b == 'e') || (a == 'v' && b == 'e') || (a == 'l' && b == 'l')) {
+                return 3;
+            }
+        }
+    }
+
+    // A single space joins the word, number or punctuation after it.
+    size_t start = 0;
+    if (data[0] == ' ') {
+        if (size == 1) {
+            return final ? 1 : 0;
+        }
+        if (byte_class(data[1]) != Space) {
+            start = 1;
+        }
+    }
+
+    ByteClass cls = byte_class(data[start]);
+    size_t run = start + scan_run(data + start, size - start, cls);
+    if (run == size) {
+        return final ? size : 0;
+    }
+    // Whitespace before a word leaves its last character to that word.
+    if (cls == Space && run > 1) {
+        return run - 1;
+    }
+    return run;
+}
+
+uint64_t hash_bytes(std::string_view data) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : data) {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+bool base64_decode(std::string_view text, std::string &out) {
+    auto value = [](char c) -> int {
+        if (c >= 'A' && c <= 'Z') return c - 'A';
+        if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+        if (c >= '0' && c <= '9') return c - '0' + 52;
+        if (c == '+') return 62;
+        if (c == '/') return 63;
+        return -1;
+    };
+    out.clear();
+    uint32_t buffer = 0;
+    int bits = 0;
+    for (char c : text) {
+        if (c == '=') {
+            break;
+        }
+        int v = value(c);
+        if (v < 0) {
+            return false;
+        }
+        buffer = (buffer << 6) | static_cast<uint32_t>(v);
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out.push_back(static_cast<char>((buffer >> bits) & 0xFF));
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+struct TokenStream::CacheEntry {
+    uint64_t hash;
+    uint8_t length;
+    uint8_t count;
+    char bytes[kCachedPieceBytes];
+    uint32_t ids[kCachedPieceTokens];
+};
+
+Tokenizer::Tokenizer() {
+    bytes.resize(256);
+    offsets.resize(257);
+    for (uint32_t i = 0; i < 256; ++i) {
+        bytes[i] = static_cast<char>(i);
+        offsets[i] = i;
+        byte_ids[i] = i;
+    }
+    offsets[256] = 256;
+}
+
+bool Tokenizer::load(const std::string &path) {
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        std::cerr << "Unable to open vocabulary: " << path << std::endl;
+        return false;
+    }
+
+    std::vector<std::pair<std::string, uint32_t>> entries;
+    uint32_t max_id = 0;
+    std::string line;
+    std::string decoded;
+    while (std::getline(file, line)) {
+        size_t space = line.find(' ');
+        if (line.empty() || space == std::string::npos) {
+            continue;
+        }
+        uint32_t id = 0;
+        auto result = std::from_chars(line.data() + space + 1, line.data() + line.size(), id);
+        if (result.ec != std::errc() || !base64_decode(std::string_view(line).substr(0, space),
+                                                       decoded) || decoded.empty()) {
+            std::cerr << "Malformed vocabulary line: " << line << std::endl;
+            return false;
+        }
+        max_id = std::max(max_id, id);
+        entries.emplace_back(decoded, id);
+    }
+    if (entries.empty()) {
+        std::cerr << "Empty vocabulary: " << path << std::endl;
+        return false;
+    }
+
+    // Lay the tokens out by ID so decoding is a single slice.
+    std::sort(entries.begin(), entries.end(),
+              [](const auto &a, const auto &b) { return a.second < b.second; });
+    std::string new_bytes;
+    std::vector<uint32_t> new_offsets(static_cast<size_t>(max_id) + 2, 0);
+    size_t next = 0;
+    for (uint32_t id = 0; id <= max_id; ++id) {
+        new_offsets[id] = static_cast<uint32_t>(new_bytes.size());
+        if (next < entries.size() && entries[next].second == id) {
+            new_bytes.append(entries[next].first);
+            ++next;
+        }
+        while (next < entries.size() && entries[next].second == id) {
+            ++next;
+        }
+    }
+    new_offsets[max_id + 1] = static_cast<uint32_t>(new_bytes.size());
+
+    std::unordered_map<std::string_view, uint32_t> ids;
+    ids.reserve(entries.size());
+    for (uint32_t id = 0; id <= max_id; ++id) {
+        std::string_view token(new_bytes.data() + new_offsets[id],
+                               new_offsets[id + 1] - new_offsets[id]);
+        if (!token.empty()) {
+            ids.emplace(token, id);
+        }
+    }
+
+    uint32_t new_byte_ids[256];
+    for (int b = 0; b < 256; ++b) {
+        char c = static_cast<char>(b);
+        auto id = ids.find(std::string_view(&c, 1));
+        if (id == ids.end()) {
+            std::cerr << "Vocabulary lacks byte token " << b << ": " << path << std::endl;
+            return false;
+        }
+        new_byte_ids[b] = id->second;
+    }
+
+    // A token merges from every split into two tokens that both exist; its
+    // rank is its ID, as in tiktoken.
+    std::vector<Merge> pairs;
+    for (const auto &entry : ids) {
+        std::string_view token = entry.first;
+        for (size_t split = 1; split < token.size(); ++split) {
+            auto left = ids.find(token.substr(0, split));
+            auto right = ids.find(token.substr(split));
+            if (left != ids.end() && right != ids.end()) {
+                uint64_t pair = (static_cast<uint64_t>(left->second) << 32) | right->second;
+                pairs.push_back(Merge{pair, entry.second, entry.second});
+            }
+        }
+    }
+
+    size_t capacity = 16;
+    unsigned bits = 4;
+    while (capacity < pairs.size() * 2) {
+        capacity *= 2;
+        ++bits;
+    }
+    std::vector<Merge> table(capacity, Merge{kEmptyPair, 0, kNoRank});
+    unsigned shift = 64 - bits;
+    for (const Merge &merge : pairs) {
+        size_t slot = (merge.pair * 0x9E3779B97F4A7C15ULL) >> shift;
+        while (table[slot].pair != kEmptyPair && table[slot].pair != merge.pair) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        if (table[slot].pair == kEmptyPair || merge.rank < table[slot].rank) {
+            table[slot] = merge;
+        }
+    }
+
+    bytes = std::move(new_bytes);
+    offsets = std::move(new_offsets);
+    std::memcpy(byte_ids, new_byte_ids, sizeof(byte_ids));
+    merges = std::move(table);
+    merge_shift = shift;
+    return true;
+}
+
+const Tokenizer::Merge *Tokenizer::find_merge(uint32_t left, uint32_t right) const {
+    if (merges.empty()) {
+        return nullptr;
+    }
+    uint64_t pair = (static_cast<uint64_t>(left) << 32) | right;
+    size_t slot = (pair * 0x9E3779B97F4A7C15ULL) >> merge_shift;
+    while (true) {
+        const Merge &entry = merges[slot];
+        if (entry.pair == pair) {
+            return &entry;
+        }
+        if (entry.pair == kEmptyPair) {
+            return nullptr;
+        }
+        slot = (slot + 1) & (merges.size() - 1);
+    }
+}
+
+void Tokenizer::encode_piece(std::string_view piece, std::vector<uint32_t> &out) const {
+    if (piece.size() == 1 || merges.empty()) {
+        for (char c : piece) {
+            out.push_back(byte_ids[static_cast<uint8_t>(c)]);
+        }
+        return;
+    }
+
+    auto rank_of = [this](uint32_t left, uint32_t right) {
+        const Merge *merge = find_merge(left, right);
+        return merge ? merge->rank : kNoRank;
+    };
+
+    if (piece.size() <= kLinearMergeBytes) {
+        // Merge the leftmost lowest-ranked pair until none is left.
+        uint32_t parts[kLinearMergeBytes];
+        uint32_t ranks[kLinearMergeBytes];
+        size_t count = piece.size();
+        for (size_t i = 0; i < count; ++i) {
+            parts[i] = byte_ids[static_cast<uint8_t>(piece[i])];
+        }
+        for (size_t i = 0; i + 1 < count; ++i) {
+            ranks[i] = rank_of(parts[i], parts[i + 1]);
+        }
+        while (count > 1) {
+            size_t best = 0;
+            for (size_t i = 1; i + 1 < count; ++i) {
+                if (ranks[i] < ranks[best]) {
+                    best = i;
+                }
+            }
+            if (ranks[best] == kNoRank) {
+                break;
+            }
+            parts[best] = find_merge(parts[best], parts[best + 1])->merged;
+            for (size_t i = best + 1; i + 1 < count; ++i) {
+                parts[i] = parts[i + 1];
+                ranks[i] = ranks[i + 1];
+            }
+            --count;
+            if (best + 1 < count) {
+                ranks[best] = rank_of(parts[best], parts[best + 1]);
+            }
+            if (best > 0) {
+                ranks[best - 1] = rank_of(parts[best - 1], parts[best]);
+            }
+        }
+        out.insert(out.end(), parts, parts + count);
+        return;
+    }
+
+    // Same order of merges, with a doubly linked list of parts and a heap
+    // of candidate pairs; stale candidates are skipped when popped.
+    struct Part {
+        uint32_t id;
+        int32_t prev;
+        int32_t next;
+    };
+    struct Candidate {
+        uint32_t rank;
+        int32_t pos;
+        uint32_t left;
+        uint32_t right;
+        bool operator>(const Candidate &other) const {
+            return rank != other.rank ? rank > other.rank : pos > other.pos;
+        }
+    };
+    std::vector<Part> parts(piece.size());
+    std::vector<Candidate> heap;
+    for (size_t i = 0; i < piece.size(); ++i) {
+        parts[i] = Part{byte_ids[static_cast<uint8_t>(piece[i])], static_cast<int32_t>(i) - 1,
+                        i + 1 < piece.size() ? static_cast<int32_t>(i + 1) : -1};
+    }
+    auto push = [&](int32_t pos) {
+        if (pos < 0 || parts[pos].next < 0) {
+            return;
+        }
+        uint32_t left = parts[pos].id;
+        uint32_t right = parts[parts[pos].next].id;
+        uint32_t rank = rank_of(left, right);
+        if (rank != kNoRank) {
+            heap.push_back(Candidate{rank, pos, left, right});
+            std::push_heap(heap.begin(), heap.end(), std::greater<>());
+        }
+    };
+    for (size_t i = 0; i + 1 < piece.size(); ++i) {
+        push(static_cast<int32_t>(i));
+    }
+
+    constexpr uint32_t kDead = ~0u;
+    while (!heap.empty()) {
+        std::pop_heap(heap.begin(), heap.end(), std::greater<>());
+        Candidate candidate = heap.back();
+        heap.pop_back();
+        Part &part = parts[candidate.pos];
+        if (part.id != candidate.left || part.next < 0 ||
+            parts[part.next].id != candidate.right) {
+            continue;
+        }
+        int32_t removed = part.next;
+        part.id = find_merge(candidate.left, candidate.right)->merged;
+        part.next = parts[removed].next;
+        if (part.next >= 0) {
+            parts[part.next].prev = candidate.pos;
+        }
+        parts[removed].id = kDead;
+        push(part.prev);
+        push(candidate.pos);
+    }
+
+    for (int32_t pos = 0; pos >= 0; pos = parts[pos].next) {
+        out.push_back(parts[pos].id);
+    }
+}
+
+std::vector<uint32_t> Tokenizer::tokenize(std::string_view text) const {
+    std::vector<uint32_t> ids;
+    encode(text, ids);
+    return ids;
+}
+
+void Tokenizer::encode(std::string_view text, std::vector<uint32_t> &out) const {
+    TokenStream stream(*this);
+    stream.feed(text, out);
+    stream.finish(out);
+}
+
+std::string_view Tokenizer::token_bytes(uint32_t id) const {
+    if (id >= vocab_size()) {
+        return {};
+    }
+    return std::string_view(bytes.data() + offsets[id], offsets[id + 1] - offsets[id]);
+}
+
+std::string Tokenizer::decode(const std::vector<uint32_t> &ids) const {
+    std::string text;
+    for (uint32_t id : ids) {
+        text.append(token_bytes(id));
+    }
+    return text;
+}
+
+TokenStream::TokenStream(const Tokenizer &tokenizer) : tokenizer(tokenizer) {}
+
+TokenStream::~TokenStream() = default;
+
+void TokenStream::feed(std::string_view chunk, std::vector<uint32_t> &out) {
+    if (!cache && chunk.size() + carry.size() >= kCacheThreshold) {
+        cache = std::make_unique<CacheEntry[]>(kCacheEntries);
+    }
+    if (carry.empty()) {
+        size_t used = encode_pieces(chunk, false, out);
+        carry.assign(chunk.substr(used));
+        return;
+    }
+    carry.append(chunk);
+    size_t used = encode_pieces(carry, false, out);
+    carry.erase(0, used);
+}
+
+void TokenStream::finish(std::vector<uint32_t> &out) {
+    encode_pieces(carry, true, out);
+    carry.clear();
+}
+
+size_t TokenStream::encode_pieces(std::string_view data, bool final,
+                                  std::vector<uint32_t> &out) {
+    size_t pos = 0;
+    while (pos < data.size()) {
+        size_t remaining = data.size() - pos;
+        size_t length = next_piece(data.data() + pos, remaining, final);
+        if (length == 0) {
+            if (remaining < kMaxPieceBytes) {
+                break;
+            }
+            length = kMaxPieceBytes;
+        }
+        length = std::min(length, kMaxPieceBytes);
+        encode_cached(data.substr(pos, length), out);
+        pos += length;
+    }
+    return pos;
+}
+
+void TokenStream::encode_cached(std::string_view piece, std::vector<uint32_t> &out) {
+    if (!cache || piece.size() > kCachedPieceBytes || piece.size() == 1) {
+        tokenizer.encode_piece(piece, out);
+        return;
+    }
+
+    uint64_t hash = hash_bytes(piece);
+    CacheEntry &entry = cache[hash & (kCacheEntries - 1)];
+    if (entry.hash == hash && entry.length == piece.size() &&
+        std::memcmp(entry.bytes, piece.data(), piece.size()) == 0) {
+        out.insert(out.end(), entry.ids, entry.ids + entry.count);
+        return;
+    }
+
+    size_t first = out.size();
+    tokenizer.encode_piece(piece, out);
+    size_t count = out.size() - first;
+    if (count <= kCachedPieceTokens) {
+        entry.hash = hash;
+        entry.length = static_cast<uint8_t>(piece.size());
+        entry.count = static_cast<uint8_t>(count);
+        std::memcpy(entry.bytes, piece.data(), piece.size());
+        std::copy(out.begin() + first, out.end(), entry.ids);
+    }
+}
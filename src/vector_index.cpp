@@ -0,0 +1,772 @@
+#include <iostream>
+#include <string>
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <limits>
+#include <mutex>
+#include <queue>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include "../include/vector_index.h"
+
+namespace {
+
+constexpr size_t kFloatsPerLine = kVectorAlignment / sizeof(float);
+constexpr size_t kSectionAlignment = 64;
+// Levels fall off geometrically; this is never reached in practice but
+// bounds the upper links of a pathological draw.
+constexpr size_t kMaxLevel = 16;
+
+// Dot product of two cache-line aligned rows of n floats, n a multiple of
+// kFloatsPerLine.
+using DotKernel = float (*)(const float *a, const float *b, size_t n);
+
+float dot_scalar(const float *a, const float *b, size_t n) {
+    float sum = 0.0f;
+    for (size_t i = 0; i < n; ++i) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2,fma"))) float dot_avx2(const float *a, const float *b, size_t n) {
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    for (size_t i = 0; i < n; i += 16) {
+        acc0 = _mm256_fmadd_ps(_mm256_load_ps(a + i), _mm256_load_ps(b + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_load_ps(a + i + 8), _mm256_load_ps(b + i + 8), acc1);
+    }
+    __m256 sum = _mm256_add_ps(acc0, acc1);
+    __m128 half = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+    half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+    half = _mm_add_ss(half, _mm_movehdup_ps(half));
+    return _mm_cvtss_f32(half);
+}
+
+// GCC 12's AVX-512 headers trip its own uninitialized-variable warnings.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+__attribute__((target("avx512f"))) float dot_avx512(const float *a, const float *b, size_t n) {
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        acc0 = _mm512_fmadd_ps(_mm512_load_ps(a + i), _mm512_load_ps(b + i), acc0);
+        acc1 = _mm512_fmadd_ps(_mm512_load_ps(a + i + 16), _mm512_load_ps(b + i + 16), acc1);
+    }
+    if (i < n) {
+        acc0 = _mm512_fmadd_ps(_mm512_load_ps(a + i), _mm512_load_ps(b + i), acc0);
+    }
+    return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+}
+
+#pragma GCC diagnostic pop
+#endif
+
+DotKernel dot_kernel() {
+    static const DotKernel kernel = [] {
+#if defined(__x86_64__)
+        if (__builtin_cpu_supports("avx512f")) {
+            return dot_avx512;
+        }
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+            return dot_avx2;
+        }
+#endif
+        return dot_scalar;
+    }();
+    return kernel;
+}
+
+// Marks nodes seen by the current search. Bumping the epoch clears it, so a
+// search costs nothing for the nodes it never touches.
+struct VisitedSet {
+    std::vector<uint32_t> marks;
+    uint32_t epoch = 0;
+
+    void begin(size_t nodes) {
+        if (marks.size() < nodes) {
+            marks.resize(nodes, 0);
+        }
+        if (++epoch == 0) {
+            std::fill(marks.begin(), marks.end(), 0);
+            epoch = 1;
+        }
+    }
+    bool visit(uint32_t node) {
+        if (marks[node] == epoch) {
+            return false;
+        }
+        marks[node] = epoch;
+        return true;
+    }
+};
+
+thread_local VisitedSet visited;
+
+size_t align_section(size_t offset) {
+    return (offset + kSectionAlignment - 1) / kSectionAlignment * kSectionAlignment;
+}
+
+uint32_t header_crc(const HnswFileHeader &header) {
+    return static_cast<uint32_t>(crc32(0, reinterpret_cast<const Bytef *>(&header),
+                                       offsetof(HnswFileHeader, header_crc)));
+}
+
+// True if every link list of a mapped index names only existing nodes and
+// every node's upper layers lie inside the upper section, so searches can
+// follow the graph without further checks.
+bool graph_in_bounds(const HnswFileHeader &header, const uint8_t *bytes) {
+    uint64_t upper_links = 1 + static_cast<uint64_t>(header.max_neighbors);
+    uint64_t base_links = 1 + 2 * static_cast<uint64_t>(header.max_neighbors);
+    auto list_ok = [&](const uint32_t *list, uint64_t limit) {
+        if (list[0] > limit) {
+            return false;
+        }
+        for (uint32_t i = 1; i <= list[0]; ++i) {
+            if (list[i] >= header.count) {
+                return false;
+            }
+        }
+        return true;
+    };
+    const uint32_t *links = reinterpret_cast<const uint32_t *>(bytes + header.links_offset);
+    const uint8_t *levels = bytes + header.levels_offset;
+    const uint64_t *upper_index =
+        reinterpret_cast<const uint64_t *>(bytes + header.upper_index_offset);
+    const uint32_t *upper = reinterpret_cast<const uint32_t *>(bytes + header.upper_offset);
+    if (header.count > 0 && levels[header.entry] < header.top_level) {
+        return false;
+    }
+    for (uint64_t node = 0; node < header.count; ++node) {
+        if (levels[node] > header.top_level ||
+            !list_ok(links + node * base_links, 2 * header.max_neighbors)) {
+            return false;
+        }
+        if (levels[node] == 0) {
+            continue;
+        }
+        uint64_t start = upper_index[node];
+        if (start > header.upper_count ||
+            levels[node] * upper_links > header.upper_count - start) {
+            return false;
+        }
+        for (uint64_t level = 0; level < levels[node]; ++level) {
+            if (!list_ok(upper + start + level * upper_links, header.max_neighbors)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Copies vector into a zero-padded row of unit length; false for a zero
+// vector, which has no direction to compare.
+bool normalize(const float *vector, size_t dim, float *row, size_t stride) {
+    double norm = 0.0;
+    for (size_t i = 0; i < dim; ++i) {
+        norm += static_cast<double>(vector[i]) * vector[i];
+    }
+    if (!(norm > 0.0) || !std::isfinite(norm)) {
+        return false;
+    }
+    float scale = static_cast<float>(1.0 / std::sqrt(norm));
+    for (size_t i = 0; i < dim; ++i) {
+        row[i] = vector[i] * scale;
+    }
+    std::fill(row + dim, row + stride, 0.0f);
+    return true;
+}
+
+uint64_t split_mix(uint64_t &state) {
+    uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+} // namespace
+
+HnswIndex::~HnswIndex() {
+    unmap();
+}
+
+void HnswIndex::init(size_t dim, HnswOptions options) {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    unmap();
+    width = dim;
+    row_stride = (dim + kFloatsPerLine - 1) / kFloatsPerLine * kFloatsPerLine;
+    settings = options;
+    settings.max_neighbors = std::max<size_t>(2, settings.max_neighbors);
+    settings.ef_construction = std::max<size_t>(1, settings.ef_construction);
+    level_scale = 1.0 / std::log(static_cast<double>(settings.max_neighbors));
+    level_state = settings.seed;
+    count = 0;
+    deleted_count = 0;
+    entry = 0;
+    top_level = 0;
+    capacity = 0;
+    vector_data.reset();
+    link_data.clear();
+    key_data.clear();
+    level_data.clear();
+    deleted_data.clear();
+    upper_index_data.clear();
+    upper_data.clear();
+    nodes_by_key.clear();
+    upper_count = 0;
+    refresh_view();
+}
+
+size_t HnswIndex::size() const {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    return count - deleted_count;
+}
+
+size_t HnswIndex::deleted() const {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    return deleted_count;
+}
+
+size_t HnswIndex::max_links(size_t level) const {
+    return level == 0 ? 2 * settings.max_neighbors : settings.max_neighbors;
+}
+
+const uint32_t *HnswIndex::links_of(uint32_t node, size_t level) const {
+    if (level == 0) {
+        return view.links + static_cast<size_t>(node) * (1 + max_links(0));
+    }
+    return view.upper + view.upper_index[node] + (level - 1) * (1 + max_links(1));
+}
+
+uint32_t *HnswIndex::mutable_links(uint32_t node, size_t level) {
+    if (level == 0) {
+        return link_data.data() + static_cast<size_t>(node) * (1 + max_links(0));
+    }
+    return upper_data.data() + upper_index_data[node] + (level - 1) * (1 + max_links(1));
+}
+
+float HnswIndex::distance(const float *query, uint32_t node) const {
+    return 1.0f - dot_kernel()(query, view.vectors + static_cast<size_t>(node) * row_stride,
+                               row_stride);
+}
+
+uint32_t HnswIndex::greedy_descend(const float *query, uint32_t node, size_t from,
+                                   size_t to) const {
+    float best = distance(query, node);
+    for (size_t level = from; level > to; --level) {
+        bool moved = true;
+        while (moved) {
+            moved = false;
+            const uint32_t *links = links_of(node, level);
+            for (uint32_t i = 1; i <= links[0]; ++i) {
+                float d = distance(query, links[i]);
+                if (d < best) {
+                    best = d;
+                    node = links[i];
+                    moved = true;
+                }
+            }
+        }
+    }
+    return node;
+}
+
+std::vector<HnswIndex::Candidate> HnswIndex::search_layer(const float *query,
+                                                          uint32_t entry_node, size_t ef,
+                                                          size_t level, bool live_only) const {
+    visited.begin(count);
+    // Nearest first for expansion; the results keep the farthest on top so
+    // it can be dropped when a closer node turns up.
+    std::priority_queue<Candidate, std::vector<Candidate>, std::greater<>> frontier;
+    std::priority_queue<Candidate> results;
+    auto bound = [&] {
+        return results.empty() ? std::numeric_limits<float>::infinity() : results.top().distance;
+    };
+
+    visited.visit(entry_node);
+    Candidate start{distance(query, entry_node), entry_node};
+    frontier.push(start);
+    if (!live_only || !view.deleted[entry_node]) {
+        results.push(start);
+    }
+    while (!frontier.empty()) {
+        Candidate current = frontier.top();
+        if (current.distance > bound() && results.size() >= ef) {
+            break;
+        }
+        frontier.pop();
+        const uint32_t *links = links_of(current.node, level);
+        uint32_t degree = links[0];
+        if (degree > 0) {
+            __builtin_prefetch(view.vectors + static_cast<size_t>(links[1]) * row_stride);
+        }
+        for (uint32_t i = 1; i <= degree; ++i) {
+            uint32_t neighbor = links[i];
+            // Random nodes defeat the hardware prefetcher; fetch the next
+            // row while this one is compared.
+            if (i < degree) {
+                __builtin_prefetch(view.vectors + static_cast<size_t>(links[i + 1]) * row_stride);
+            }
+            if (!visited.visit(neighbor)) {
+                continue;
+            }
+            float d = distance(query, neighbor);
+            if (results.size() < ef || d < bound()) {
+                frontier.push({d, neighbor});
+                // Deleted nodes still route the search but are not returned.
+                if (!live_only || !view.deleted[neighbor]) {
+                    results.push({d, neighbor});
+                    if (results.size() > ef) {
+                        results.pop();
+                    }
+                }
+            }
+        }
+    }
+
+    std::vector<Candidate> nearest(results.size());
+    for (size_t i = nearest.size(); i-- > 0;) {
+        nearest[i] = results.top();
+        results.pop();
+    }
+    return nearest;
+}
+
+std::vector<uint32_t> HnswIndex::select_neighbors(std::vector<Candidate> candidates,
+                                                  size_t limit) const {
+    std::sort(candidates.begin(), candidates.end());
+    std::vector<uint32_t> chosen;
+    // Keep a candidate only if it is closer to the base than to every node
+    // already chosen, which spreads links across directions instead of
+    // spending them all on one tight cluster (the paper's heuristic).
+    for (const Candidate &candidate : candidates) {
+        if (chosen.size() == limit) {
+            break;
+        }
+        const float *row = view.vectors + static_cast<size_t>(candidate.node) * row_stride;
+        bool diverse = true;
+        for (uint32_t other : chosen) {
+            if (distance(row, other) < candidate.distance) {
+                diverse = false;
+                break;
+            }
+        }
+        if (diverse) {
+            chosen.push_back(candidate.node);
+        }
+    }
+    return chosen;
+}
+
+void HnswIndex::link(uint32_t node, uint32_t neighbor, size_t level) {
+    uint32_t *links = mutable_links(node, level);
+    size_t limit = max_links(level);
+    if (links[0] < limit) {
+        links[1 + links[0]++] = neighbor;
+        return;
+    }
+    const float *row = view.vectors + static_cast<size_t>(node) * row_stride;
+    std::vector<Candidate> candidates;
+    candidates.reserve(limit + 1);
+    for (uint32_t i = 1; i <= links[0]; ++i) {
+        candidates.push_back({distance(row, links[i]), links[i]});
+    }
+    candidates.push_back({distance(row, neighbor), neighbor});
+    std::vector<uint32_t> kept = select_neighbors(std::move(candidates), limit);
+    links[0] = static_cast<uint32_t>(kept.size());
+    std::copy(kept.begin(), kept.end(), links + 1);
+}
+
+void HnswIndex::reserve_nodes(size_t nodes) {
+    if (nodes <= capacity) {
+        return;
+    }
+    size_t grown = std::max({nodes, capacity * 2, static_cast<size_t>(1024)});
+    AlignedFloats vectors = allocate_aligned_floats(grown * row_stride);
+    if (count > 0) {
+        std::memcpy(vectors.get(), vector_data.get(), count * row_stride * sizeof(float));
+    }
+    vector_data = std::move(vectors);
+    link_data.resize(grown * (1 + max_links(0)), 0);
+    key_data.resize(grown, 0);
+    level_data.resize(grown, 0);
+    deleted_data.resize(grown, 0);
+    upper_index_data.resize(grown, 0);
+    capacity = grown;
+}
+
+void HnswIndex::refresh_view() {
+    if (mapping) {
+        return;
+    }
+    view.vectors = vector_data.get();
+    view.links = link_data.data();
+    view.keys = key_data.data();
+    view.levels = level_data.data();
+    view.deleted = deleted_data.data();
+    view.upper_index = upper_index_data.data();
+    view.upper = upper_data.data();
+}
+
+bool HnswIndex::insert_locked(uint64_t key, const float *normalized) {
+    reserve_nodes(count + 1);
+    if (!vector_data) {
+        return false;
+    }
+    auto existing = nodes_by_key.find(key);
+    if (existing != nodes_by_key.end()) {
+        deleted_data[existing->second] = 1;
+        ++deleted_count;
+    }
+
+    uint32_t node = static_cast<uint32_t>(count);
+    std::memcpy(vector_data.get() + static_cast<size_t>(node) * row_stride, normalized,
+                row_stride * sizeof(float));
+    // Level l is reached with probability M^-l.
+    double uniform = (static_cast<double>(split_mix(level_state) >> 11) + 1.0) * 0x1p-53;
+    size_t level = std::min(kMaxLevel, static_cast<size_t>(-std::log(uniform) * level_scale));
+    key_data[node] = key;
+    level_data[node] = static_cast<uint8_t>(level);
+    deleted_data[node] = 0;
+    mutable_links(node, 0)[0] = 0;
+    if (level > 0) {
+        upper_index_data[node] = upper_data.size();
+        upper_data.resize(upper_data.size() + level * (1 + max_links(1)), 0);
+        upper_count = upper_data.size();
+    }
+    ++count;
+    nodes_by_key[key] = node;
+    refresh_view();
+
+    if (count == 1) {
+        entry = node;
+        top_level = level;
+        return true;
+    }
+    const float *row = view.vectors + static_cast<size_t>(node) * row_stride;
+    uint32_t nearest = greedy_descend(row, entry, top_level, level);
+    for (size_t l = std::min(level, top_level) + 1; l-- > 0;) {
+        std::vector<Candidate> found = search_layer(row, nearest, settings.ef_construction, l,
+                                                    false);
+        nearest = found.front().node;
+        std::vector<uint32_t> neighbors = select_neighbors(std::move(found), max_links(l));
+        uint32_t *links = mutable_links(node, l);
+        links[0] = static_cast<uint32_t>(neighbors.size());
+        std::copy(neighbors.begin(), neighbors.end(), links + 1);
+        for (uint32_t neighbor : neighbors) {
+            link(neighbor, node, l);
+        }
+    }
+    if (level > top_level) {
+        entry = node;
+        top_level = level;
+    }
+    return true;
+}
+
+bool HnswIndex::insert(uint64_t key, const float *vector, size_t size) {
+    if (size != width || width == 0) {
+        std::cerr << "Vector index expects " << width << " dimensions, got " << size << std::endl;
+        return false;
+    }
+    AlignedFloats row = allocate_aligned_floats(row_stride);
+    if (!row || !normalize(vector, width, row.get(), row_stride)) {
+        return false;
+    }
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    materialize();
+    if (count >= std::numeric_limits<uint32_t>::max()) {
+        std::cerr << "Vector index is full" << std::endl;
+        return false;
+    }
+    return insert_locked(key, row.get());
+}
+
+bool HnswIndex::remove(uint64_t key) {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    materialize();
+    auto found = nodes_by_key.find(key);
+    if (found == nodes_by_key.end()) {
+        return false;
+    }
+    deleted_data[found->second] = 1;
+    ++deleted_count;
+    nodes_by_key.erase(found);
+    return true;
+}
+
+std::vector<HnswMatch> HnswIndex::search(const float *query, size_t size, size_t k,
+                                         size_t ef) const {
+    std::vector<HnswMatch> matches;
+    if (size != width || width == 0 || k == 0) {
+        return matches;
+    }
+    thread_local AlignedFloats row;
+    thread_local size_t row_floats = 0;
+    if (row_floats < row_stride) {
+        row = allocate_aligned_floats(row_stride);
+        row_floats = row ? row_stride : 0;
+    }
+    if (!row || !normalize(query, width, row.get(), row_stride)) {
+        return matches;
+    }
+
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    if (count == deleted_count) {
+        return matches;
+    }
+    ef = std::max(k, ef ? ef : settings.ef_search);
+    uint32_t start = greedy_descend(row.get(), entry, top_level, 0);
+    std::vector<Candidate> nearest = search_layer(row.get(), start, ef, 0, true);
+    nearest.resize(std::min(nearest.size(), k));
+    matches.reserve(nearest.size());
+    for (const Candidate &candidate : nearest) {
+        matches.push_back({view.keys[candidate.node], 1.0f - candidate.distance});
+    }
+    return matches;
+}
+
+void HnswIndex::compact() {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    materialize();
+    if (deleted_count == 0) {
+        return;
+    }
+    size_t old_count = count;
+    AlignedFloats old_vectors = std::move(vector_data);
+    std::vector<uint64_t> old_keys = std::move(key_data);
+    std::vector<uint8_t> old_deleted = std::move(deleted_data);
+
+    count = 0;
+    deleted_count = 0;
+    entry = 0;
+    top_level = 0;
+    capacity = 0;
+    link_data.clear();
+    key_data.clear();
+    level_data.clear();
+    deleted_data.clear();
+    upper_index_data.clear();
+    upper_data.clear();
+    upper_count = 0;
+    nodes_by_key.clear();
+    level_state = settings.seed;
+    reserve_nodes(old_count);
+    for (size_t node = 0; node < old_count; ++node) {
+        if (!old_deleted[node]) {
+            insert_locked(old_keys[node], old_vectors.get() + node * row_stride);
+        }
+    }
+}
+
+bool HnswIndex::save(const std::string &path) const {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    HnswFileHeader header{};
+    std::memcpy(header.magic, kHnswMagic, sizeof(kHnswMagic));
+    header.version = kHnswVersion;
+    header.dim = static_cast<uint32_t>(width);
+    header.stride = static_cast<uint32_t>(row_stride);
+    header.max_neighbors = static_cast<uint32_t>(settings.max_neighbors);
+    header.count = count;
+    header.deleted_count = deleted_count;
+    header.entry = entry;
+    header.top_level = static_cast<uint32_t>(top_level);
+    header.upper_count = upper_count;
+
+    struct Section {
+        uint64_t &offset;
+        const void *data;
+        size_t bytes;
+    };
+    Section sections[] = {
+        {header.vectors_offset, view.vectors, count * row_stride * sizeof(float)},
+        {header.links_offset, view.links, count * (1 + max_links(0)) * sizeof(uint32_t)},
+        {header.keys_offset, view.keys, count * sizeof(uint64_t)},
+        {header.levels_offset, view.levels, count},
+        {header.deleted_offset, view.deleted, count},
+        {header.upper_index_offset, view.upper_index, count * sizeof(uint64_t)},
+        {header.upper_offset, view.upper, upper_count * sizeof(uint32_t)},
+    };
+    size_t cursor = sizeof(header);
+    for (Section &section : sections) {
+        section.offset = align_section(cursor);
+        cursor = section.offset + section.bytes;
+    }
+    header.file_bytes = align_section(cursor);
+    header.header_crc = header_crc(header);
+
+    std::string temp_path = path + ".tmp";
+    int fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        std::cerr << "Unable to create " << temp_path << std::endl;
+        return false;
+    }
+    auto write_at = [&](uint64_t offset, const void *data, size_t size) {
+        const char *bytes = static_cast<const char *>(data);
+        while (size > 0) {
+            ssize_t written = pwrite(fd, bytes, size, static_cast<off_t>(offset));
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            bytes += written;
+            offset += static_cast<uint64_t>(written);
+            size -= static_cast<size_t>(written);
+        }
+        return true;
+    };
+    // Padding is left as holes and reads back as zeros.
+    bool written = ftruncate(fd, static_cast<off_t>(header.file_bytes)) == 0 &&
+                   write_at(0, &header, sizeof(header));
+    for (const Section &section : sections) {
+        written = written && (section.bytes == 0 ||
+                              write_at(section.offset, section.data, section.bytes));
+    }
+    if (!written || fsync(fd) != 0) {
+        ::close(fd);
+        unlink(temp_path.c_str());
+        std::cerr << "Unable to write " << temp_path << std::endl;
+        return false;
+    }
+    ::close(fd);
+    if (rename(temp_path.c_str(), path.c_str()) != 0) {
+        unlink(temp_path.c_str());
+        std::cerr << "Unable to rename " << temp_path << " to " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool HnswIndex::open(const std::string &path, HnswOptions options) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        std::cerr << "Unable to open vector index: " << path << std::endl;
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(HnswFileHeader)) {
+        std::cerr << "Vector index is truncated: " << path << std::endl;
+        ::close(fd);
+        return false;
+    }
+    size_t length = static_cast<size_t>(info.st_size);
+    void *base = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (base == MAP_FAILED) {
+        std::cerr << "Unable to map vector index: " << path << std::endl;
+        return false;
+    }
+
+    HnswFileHeader header;
+    std::memcpy(&header, base, sizeof(header));
+    const char *problem = nullptr;
+    uint64_t links_per_node = 1 + 2 * static_cast<uint64_t>(header.max_neighbors);
+    auto section_fits = [&](uint64_t offset, uint64_t bytes) {
+        return offset % kSectionAlignment == 0 && offset >= sizeof(header) &&
+               offset <= length && bytes <= length - offset;
+    };
+    if (std::memcmp(header.magic, kHnswMagic, sizeof(kHnswMagic)) != 0) {
+        problem = "bad magic";
+    } else if (header.version != kHnswVersion) {
+        problem = "unsupported version";
+    } else if (header.header_crc != header_crc(header)) {
+        problem = "header checksum";
+    } else if (header.dim == 0 || header.max_neighbors < 2 ||
+               header.stride != (header.dim + kFloatsPerLine - 1) / kFloatsPerLine *
+                                    kFloatsPerLine ||
+               header.count >= std::numeric_limits<uint32_t>::max() ||
+               header.deleted_count > header.count || header.top_level > kMaxLevel ||
+               (header.count > 0 && header.entry >= header.count)) {
+        problem = "bad header";
+    } else if (header.file_bytes != length ||
+               !section_fits(header.vectors_offset,
+                             header.count * header.stride * sizeof(float)) ||
+               !section_fits(header.links_offset,
+                             header.count * links_per_node * sizeof(uint32_t)) ||
+               !section_fits(header.keys_offset, header.count * sizeof(uint64_t)) ||
+               !section_fits(header.levels_offset, header.count) ||
+               !section_fits(header.deleted_offset, header.count) ||
+               !section_fits(header.upper_index_offset, header.count * sizeof(uint64_t)) ||
+               !section_fits(header.upper_offset, header.upper_count * sizeof(uint32_t))) {
+        problem = "truncated";
+    } else if (!graph_in_bounds(header, static_cast<const uint8_t *>(base))) {
+        problem = "bad links";
+    }
+    if (problem) {
+        std::cerr << "Invalid vector index (" << problem << "): " << path << std::endl;
+        munmap(base, length);
+        return false;
+    }
+    // Searches hop between unrelated nodes; readahead would only waste I/O.
+    madvise(base, length, MADV_RANDOM);
+
+    HnswOptions loaded = options;
+    loaded.max_neighbors = header.max_neighbors;
+    init(header.dim, loaded);
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    const uint8_t *bytes = static_cast<const uint8_t *>(base);
+    mapping = base;
+    mapping_bytes = length;
+    count = header.count;
+    deleted_count = header.deleted_count;
+    entry = header.entry;
+    top_level = header.top_level;
+    upper_count = header.upper_count;
+    view.vectors = reinterpret_cast<const float *>(bytes + header.vectors_offset);
+    view.links = reinterpret_cast<const uint32_t *>(bytes + header.links_offset);
+    view.keys = reinterpret_cast<const uint64_t *>(bytes + header.keys_offset);
+    view.levels = bytes + header.levels_offset;
+    view.deleted = bytes + header.deleted_offset;
+    view.upper_index = reinterpret_cast<const uint64_t *>(bytes + header.upper_index_offset);
+    view.upper = reinterpret_cast<const uint32_t *>(bytes + header.upper_offset);
+    return true;
+}
+
+void HnswIndex::materialize() {
+    if (!mapping) {
+        return;
+    }
+    size_t nodes = count;
+    capacity = 0;
+    count = 0;
+    reserve_nodes(nodes);
+    count = nodes;
+    std::memcpy(vector_data.get(), view.vectors, count * row_stride * sizeof(float));
+    std::copy_n(view.links, count * (1 + max_links(0)), link_data.begin());
+    std::copy_n(view.keys, count, key_data.begin());
+    std::copy_n(view.levels, count, level_data.begin());
+    std::copy_n(view.deleted, count, deleted_data.begin());
+    std::copy_n(view.upper_index, count, upper_index_data.begin());
+    upper_data.assign(view.upper, view.upper + upper_count);
+    nodes_by_key.clear();
+    for (uint32_t node = 0; node < count; ++node) {
+        if (!deleted_data[node]) {
+            nodes_by_key[key_data[node]] = node;
+        }
+    }
+    unmap();
+    refresh_view();
+}
+
+void HnswIndex::unmap() {
+    if (mapping) {
+        munmap(mapping, mapping_bytes);
+        mapping = nullptr;
+        mapping_bytes = 0;
+    }
+}
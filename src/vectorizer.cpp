@@ -0,0 +1,167 @@
+#include <iostream>
+#include <string>
+#include <cstring>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include "../include/vectorizer.h"
+
+namespace {
+
+constexpr size_t kFloatsPerLine = kVectorAlignment / sizeof(float);
+
+// How many rows ahead of the one being read to prefetch; IDs are random, so
+// the hardware prefetcher cannot follow them.
+constexpr size_t kPrefetchDistance = 4;
+
+// Row kernels; n is always a multiple of kFloatsPerLine and both pointers
+// are cache-line aligned.
+struct RowKernels {
+    void (*copy)(const float *src, float *dst, size_t n);
+    void (*add)(const float *src, float *dst, size_t n);
+    void (*scale)(float *dst, float factor, size_t n);
+};
+
+void copy_scalar(const float *src, float *dst, size_t n) {
+    std::memcpy(dst, src, n * sizeof(float));
+}
+
+void add_scalar(const float *src, float *dst, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        dst[i] += src[i];
+    }
+}
+
+void scale_scalar(float *dst, float factor, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        dst[i] *= factor;
+    }
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2"))) void copy_avx2(const float *src, float *dst, size_t n) {
+    for (size_t i = 0; i < n; i += 8) {
+        _mm256_store_ps(dst + i, _mm256_load_ps(src + i));
+    }
+}
+
+__attribute__((target("avx2"))) void add_avx2(const float *src, float *dst, size_t n) {
+    for (size_t i = 0; i < n; i += 8) {
+        _mm256_store_ps(dst + i, _mm256_add_ps(_mm256_load_ps(dst + i), _mm256_load_ps(src + i)));
+    }
+}
+
+__attribute__((target("avx2"))) void scale_avx2(float *dst, float factor, size_t n) {
+    __m256 scale = _mm256_set1_ps(factor);
+    for (size_t i = 0; i < n; i += 8) {
+        _mm256_store_ps(dst + i, _mm256_mul_ps(_mm256_load_ps(dst + i), scale));
+    }
+}
+
+__attribute__((target("avx512f"))) void copy_avx512(const float *src, float *dst, size_t n) {
+    for (size_t i = 0; i < n; i += 16) {
+        _mm512_store_ps(dst + i, _mm512_load_ps(src + i));
+    }
+}
+
+__attribute__((target("avx512f"))) void add_avx512(const float *src, float *dst, size_t n) {
+    for (size_t i = 0; i < n; i += 16) {
+        _mm512_store_ps(dst + i, _mm512_add_ps(_mm512_load_ps(dst + i), _mm512_load_ps(src + i)));
+    }
+}
+
+__attribute__((target("avx512f"))) void scale_avx512(float *dst, float factor, size_t n) {
+    __m512 scale = _mm512_set1_ps(factor);
+    for (size_t i = 0; i < n; i += 16) {
+        _mm512_store_ps(dst + i, _mm512_mul_ps(_mm512_load_ps(dst + i), scale));
+    }
+}
+#endif
+
+const RowKernels &row_kernels() {
+    static const RowKernels kernels = [] {
+#if defined(__x86_64__)
+        if (__builtin_cpu_supports("avx512f")) {
+            return RowKernels{copy_avx512, add_avx512, scale_avx512};
+        }
+        if (__builtin_cpu_supports("avx2")) {
+            return RowKernels{copy_avx2, add_avx2, scale_avx2};
+        }
+#endif
+        return RowKernels{copy_scalar, add_scalar, scale_scalar};
+    }();
+    return kernels;
+}
+
+void prefetch_row(const EmbeddingTable &table, std::span<const uint32_t> ids, size_t i) {
+    if (i < ids.size() && ids[i] < table.rows()) {
+        __builtin_prefetch(table.row(ids[i]));
+    }
+}
+
+} // namespace
+
+AlignedFloats allocate_aligned_floats(size_t count) {
+    size_t bytes = (count * sizeof(float) + kVectorAlignment - 1) / kVectorAlignment *
+                   kVectorAlignment;
+    if (bytes == 0) {
+        return nullptr;
+    }
+    void *pointer = std::aligned_alloc(kVectorAlignment, bytes);
+    if (!pointer) {
+        std::cerr << "Unable to allocate " << bytes << " bytes for vectors" << std::endl;
+        return nullptr;
+    }
+    std::memset(pointer, 0, bytes);
+    return AlignedFloats(static_cast<float *>(pointer));
+}
+
+EmbeddingTable::EmbeddingTable(size_t rows, size_t dim)
+    : row_count(rows), width(dim),
+      row_stride((dim + kFloatsPerLine - 1) / kFloatsPerLine * kFloatsPerLine),
+      data(allocate_aligned_floats(rows * row_stride)) {
+    if (!data) {
+        row_count = 0;
+    }
+}
+
+Vectorizer::Vectorizer(EmbeddingTable table) : embeddings(std::move(table)) {}
+
+void Vectorizer::lookup(std::span<const uint32_t> ids, float *out) const {
+    const RowKernels &kernels = row_kernels();
+    size_t stride = embeddings.stride();
+    for (size_t i = 0; i < kPrefetchDistance; ++i) {
+        prefetch_row(embeddings, ids, i);
+    }
+    for (size_t i = 0; i < ids.size(); ++i, out += stride) {
+        prefetch_row(embeddings, ids, i + kPrefetchDistance);
+        if (ids[i] < embeddings.rows()) {
+            kernels.copy(embeddings.row(ids[i]), out, stride);
+        } else {
+            std::memset(out, 0, stride * sizeof(float));
+        }
+    }
+}
+
+void Vectorizer::vectorize(std::span<const std::span<const uint32_t>> batch, float *out) const {
+    const RowKernels &kernels = row_kernels();
+    size_t stride = embeddings.stride();
+    for (std::span<const uint32_t> ids : batch) {
+        std::memset(out, 0, stride * sizeof(float));
+        for (size_t i = 0; i < kPrefetchDistance; ++i) {
+            prefetch_row(embeddings, ids, i);
+        }
+        size_t found = 0;
+        for (size_t i = 0; i < ids.size(); ++i) {
+            prefetch_row(embeddings, ids, i + kPrefetchDistance);
+            if (ids[i] < embeddings.rows()) {
+                kernels.add(embeddings.row(ids[i]), out, stride);
+                ++found;
+            }
+        }
+        if (found > 1) {
+            kernels.scale(out, 1.0f / static_cast<float>(found), stride);
+        }
+        out += stride;
+    }
+}
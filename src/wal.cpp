@@ -0,0 +1,492 @@
+#include <iostream>
+#include <string>
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "../include/wal.h"
+
+namespace {
+
+constexpr const char *kWalSuffix = ".wal";
+constexpr size_t kLsnDigits = 16;
+constexpr uint32_t kCheckpointMagic = 0x504b4843; // "CHKP"
+
+struct CheckpointFile {
+    uint64_t lsn;
+    uint32_t magic;
+    uint32_t crc;
+};
+
+bool write_fd(int fd, uint64_t offset, const void *data, size_t size) {
+    const char *bytes = static_cast<const char *>(data);
+    while (size > 0) {
+        ssize_t written = pwrite(fd, bytes, size, static_cast<off_t>(offset));
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        bytes += written;
+        offset += static_cast<uint64_t>(written);
+        size -= static_cast<size_t>(written);
+    }
+    return true;
+}
+
+bool read_file(const std::string &path, std::vector<char> &contents) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        return false;
+    }
+    contents.resize(static_cast<size_t>(info.st_size));
+    size_t done = 0;
+    while (done < contents.size()) {
+        ssize_t got = pread(fd, contents.data() + done, contents.size() - done,
+                            static_cast<off_t>(done));
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            break;
+        }
+        done += static_cast<size_t>(got);
+    }
+    ::close(fd);
+    contents.resize(done);
+    return true;
+}
+
+// A new or renamed file survives a crash only once its directory is synced.
+bool sync_directory(const std::string &directory) {
+    int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    bool synced = fsync(fd) == 0;
+    ::close(fd);
+    return synced;
+}
+
+uint32_t crc_of(uint32_t crc, const void *data, size_t size) {
+    // zlib returns 0 rather than crc for a null buffer, which an empty
+    // string_view may have.
+    if (size == 0) {
+        return crc;
+    }
+    return static_cast<uint32_t>(crc32_z(crc, static_cast<const Bytef *>(data), size));
+}
+
+// CRC of a record from its header and the CRC of its payload.
+uint32_t record_crc(const WalRecordHeader &header, uint32_t payload_crc) {
+    size_t skip = offsetof(WalRecordHeader, crc) + sizeof(header.crc);
+    uint32_t crc = crc_of(0, reinterpret_cast<const char *>(&header) + skip,
+                          sizeof(header) - skip);
+    return static_cast<uint32_t>(crc32_combine(crc, payload_crc, header.length));
+}
+
+} // namespace
+
+WalOptions wal_options_from_env() {
+    WalOptions options;
+    if (const char *durability = std::getenv("SVAKLA_WAL_DURABILITY")) {
+        std::string_view name = durability;
+        if (name == "none") {
+            options.durability = WalDurability::None;
+        } else if (name == "interval") {
+            options.durability = WalDurability::Interval;
+        } else if (name != "commit") {
+            std::cerr << "Unknown SVAKLA_WAL_DURABILITY " << name << ", using commit"
+                      << std::endl;
+        }
+    }
+    if (const char *interval = std::getenv("SVAKLA_WAL_SYNC_MS")) {
+        long milliseconds = std::strtol(interval, nullptr, 10);
+        if (milliseconds > 0) {
+            options.sync_interval = std::chrono::milliseconds(milliseconds);
+        }
+    }
+    return options;
+}
+
+Wal::~Wal() {
+    close();
+}
+
+std::string Wal::segment_path(uint64_t first_lsn) const {
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016" PRIx64 "%s", first_lsn, kWalSuffix);
+    return root + "/" + name;
+}
+
+bool Wal::open(const std::string &directory, WalOptions options, const Replay &replay) {
+    close();
+    root = directory;
+    settings = options;
+    if (mkdir(root.c_str(), 0700) != 0 && errno != EEXIST) {
+        std::cerr << "Unable to create log directory " << root << ": " << std::strerror(errno)
+                  << std::endl;
+        return false;
+    }
+    if (!scan(replay)) {
+        close();
+        return false;
+    }
+    failed = false;
+    stopping = false;
+    writer = std::thread([this] { writer_loop(); });
+    return true;
+}
+
+bool Wal::scan(const Replay &replay) {
+    std::vector<char> contents;
+    checkpoint_lsn = 0;
+    if (read_file(root + "/checkpoint", contents) && contents.size() == sizeof(CheckpointFile)) {
+        CheckpointFile checkpoint;
+        std::memcpy(&checkpoint, contents.data(), sizeof(checkpoint));
+        if (checkpoint.magic == kCheckpointMagic &&
+            checkpoint.crc == crc_of(0, &checkpoint.lsn, sizeof(checkpoint.lsn))) {
+            checkpoint_lsn = checkpoint.lsn;
+        }
+    }
+
+    std::vector<uint64_t> found;
+    DIR *listing = opendir(root.c_str());
+    if (!listing) {
+        std::cerr << "Unable to read log directory " << root << std::endl;
+        return false;
+    }
+    size_t suffix = std::strlen(kWalSuffix);
+    while (dirent *item = readdir(listing)) {
+        std::string name = item->d_name;
+        if (name.size() == kLsnDigits + suffix && name.ends_with(kWalSuffix) &&
+            std::all_of(name.begin(), name.begin() + kLsnDigits, ::isxdigit)) {
+            found.push_back(std::stoull(name.substr(0, kLsnDigits), nullptr, 16));
+        }
+    }
+    closedir(listing);
+    std::sort(found.begin(), found.end());
+
+    uint64_t expected = found.empty() ? checkpoint_lsn + 1 : found.front();
+    if (expected > checkpoint_lsn + 1) {
+        std::cerr << "Log " << root << " is missing records " << checkpoint_lsn + 1 << " to "
+                  << expected - 1 << std::endl;
+    }
+    bool broken = false;
+    for (size_t i = 0; i < found.size(); ++i) {
+        uint64_t first_lsn = found[i];
+        std::string path = segment_path(first_lsn);
+        // After damage nothing later can be replayed in order.
+        if (broken || first_lsn != expected || !read_file(path, contents)) {
+            if (!broken) {
+                std::cerr << "Log segment " << path << " does not follow on from LSN "
+                          << expected - 1 << "; discarding it and any after it" << std::endl;
+            }
+            broken = true;
+            unlink(path.c_str());
+            continue;
+        }
+        size_t offset = 0;
+        while (offset + sizeof(WalRecordHeader) <= contents.size()) {
+            WalRecordHeader header;
+            std::memcpy(&header, contents.data() + offset, sizeof(header));
+            size_t payload = offset + sizeof(header);
+            if (header.magic != kWalRecordMagic || header.lsn != expected ||
+                header.length > contents.size() - payload ||
+                record_crc(header, crc_of(0, contents.data() + payload, header.length)) !=
+                    header.crc) {
+                break;
+            }
+            if (replay && header.lsn > checkpoint_lsn) {
+                replay(header.type, header.lsn,
+                       std::string_view(contents.data() + payload, header.length));
+            }
+            ++expected;
+            offset = payload + header.length;
+        }
+        if (offset < contents.size()) {
+            std::cerr << "Discarding " << contents.size() - offset << " bytes after LSN "
+                      << expected - 1 << " in " << path << std::endl;
+            broken = i + 1 < found.size();
+            if (truncate(path.c_str(), static_cast<off_t>(offset)) != 0) {
+                return false;
+            }
+        }
+        files.push_back({first_lsn, offset});
+        sealed_bytes += offset;
+    }
+    if (!files.empty()) {
+        sealed_bytes -= files.back().bytes;
+    }
+
+    next_lsn = std::max(expected, checkpoint_lsn + 1);
+    written_lsn = durable_lsn = next_lsn - 1;
+    pending_first = next_lsn;
+    if (files.empty()) {
+        return start_segment(next_lsn);
+    }
+    fd = ::open(segment_path(files.back().first_lsn).c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        std::cerr << "Unable to open log segment in " << root << std::endl;
+        return false;
+    }
+    active_bytes = files.back().bytes;
+    return true;
+}
+
+bool Wal::start_segment(uint64_t first_lsn) {
+    std::string path = segment_path(first_lsn);
+    int created = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (created < 0 || !sync_directory(root)) {
+        std::cerr << "Unable to create log segment " << path << ": " << std::strerror(errno)
+                  << std::endl;
+        if (created >= 0) {
+            ::close(created);
+        }
+        return false;
+    }
+    if (fd >= 0) {
+        ::close(fd);
+    }
+    fd = created;
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!files.empty()) {
+        files.back().bytes = active_bytes;
+        sealed_bytes += active_bytes;
+    }
+    files.push_back({first_lsn, 0});
+    active_bytes = 0;
+    return true;
+}
+
+void Wal::close() {
+    if (writer.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        work_wanted.notify_all();
+        writer.join();
+    }
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    files.clear();
+    pending.clear();
+    sealed_bytes = 0;
+    active_bytes = 0;
+    next_lsn = 1;
+    written_lsn = durable_lsn = sync_wanted = 0;
+    // Anyone still waiting gives up.
+    failed = true;
+    progress.notify_all();
+}
+
+bool Wal::is_open() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return writer.joinable() && !stopping;
+}
+
+uint64_t Wal::append(uint16_t type, std::initializer_list<std::string_view> parts) {
+    WalRecordHeader header{};
+    header.magic = kWalRecordMagic;
+    header.type = type;
+    uint64_t length = 0;
+    uint32_t payload_crc = 0;
+    for (std::string_view part : parts) {
+        length += part.size();
+        payload_crc = crc_of(payload_crc, part.data(), part.size());
+    }
+    if (length > UINT32_MAX) {
+        return 0;
+    }
+    header.length = static_cast<uint32_t>(length);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (failed || stopping || !writer.joinable()) {
+            return 0;
+        }
+        header.lsn = next_lsn++;
+        header.crc = record_crc(header, payload_crc);
+        const char *bytes = reinterpret_cast<const char *>(&header);
+        pending.insert(pending.end(), bytes, bytes + sizeof(header));
+        for (std::string_view part : parts) {
+            pending.insert(pending.end(), part.begin(), part.end());
+        }
+    }
+    work_wanted.notify_one();
+    return header.lsn;
+}
+
+bool Wal::commit(uint64_t lsn) {
+    std::unique_lock<std::mutex> lock(mutex);
+    const uint64_t &done = settings.durability == WalDurability::Commit ? durable_lsn
+                                                                        : written_lsn;
+    progress.wait(lock, [&] { return failed || done >= lsn; });
+    return done >= lsn;
+}
+
+bool Wal::sync() {
+    std::unique_lock<std::mutex> lock(mutex);
+    uint64_t target = next_lsn - 1;
+    sync_wanted = std::max(sync_wanted, target);
+    work_wanted.notify_one();
+    progress.wait(lock, [&] { return failed || durable_lsn >= target; });
+    return durable_lsn >= target;
+}
+
+uint64_t Wal::last_lsn() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return next_lsn - 1;
+}
+
+uint64_t Wal::size_bytes() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return sealed_bytes + active_bytes;
+}
+
+bool Wal::write_batch(const std::vector<char> &batch, uint64_t first_lsn) {
+    if (active_bytes > 0 && active_bytes + batch.size() > settings.segment_bytes) {
+        // The old segment is synced before anything is written after it.
+        if (fdatasync(fd) != 0 || !start_segment(first_lsn)) {
+            return false;
+        }
+    }
+    if (!write_fd(fd, active_bytes, batch.data(), batch.size())) {
+        std::cerr << "Unable to write log " << root << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    active_bytes += batch.size();
+    return true;
+}
+
+void Wal::writer_loop() {
+    std::vector<char> batch;
+    auto last_sync = std::chrono::steady_clock::now();
+    while (true) {
+        uint64_t first_lsn;
+        uint64_t last_lsn;
+        bool sync_now;
+        bool stop;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            auto ready = [this] {
+                return stopping || !pending.empty() || sync_wanted > durable_lsn;
+            };
+            if (settings.durability == WalDurability::Interval && written_lsn > durable_lsn) {
+                work_wanted.wait_until(lock, last_sync + settings.sync_interval, ready);
+            } else {
+                work_wanted.wait(lock, ready);
+            }
+            batch.swap(pending);
+            pending.clear();
+            first_lsn = pending_first;
+            last_lsn = next_lsn - 1;
+            pending_first = next_lsn;
+            stop = stopping;
+            bool interval_due = settings.durability == WalDurability::Interval &&
+                                std::chrono::steady_clock::now() - last_sync >=
+                                    settings.sync_interval;
+            sync_now = settings.durability == WalDurability::Commit || interval_due || stop ||
+                       sync_wanted > durable_lsn;
+        }
+        // Appends arriving while this batch is written and synced queue up
+        // for the next pass, which flushes them all together.
+        bool ok = batch.empty() || write_batch(batch, first_lsn);
+        bool synced = false;
+        if (ok && sync_now) {
+            ok = fdatasync(fd) == 0;
+            synced = ok;
+            last_sync = std::chrono::steady_clock::now();
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!ok) {
+                std::cerr << "Log " << root << " failed; no more records are accepted"
+                          << std::endl;
+                failed = true;
+            } else {
+                written_lsn = last_lsn;
+                if (synced) {
+                    durable_lsn = last_lsn;
+                }
+            }
+        }
+        progress.notify_all();
+        if (stop || !ok) {
+            return;
+        }
+    }
+}
+
+bool Wal::write_checkpoint(uint64_t lsn) {
+    CheckpointFile checkpoint{lsn, kCheckpointMagic, crc_of(0, &lsn, sizeof(lsn))};
+    return write_file_durably(root + "/checkpoint",
+                              std::string_view(reinterpret_cast<const char *>(&checkpoint),
+                                               sizeof(checkpoint)),
+                              0600);
+}
+
+bool Wal::checkpoint(uint64_t lsn) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        lsn = std::min(lsn, next_lsn - 1);
+        if (lsn <= checkpoint_lsn) {
+            return true;
+        }
+    }
+    if (!write_checkpoint(lsn)) {
+        std::cerr << "Unable to write checkpoint in " << root << std::endl;
+        return false;
+    }
+    std::vector<uint64_t> dropped;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        checkpoint_lsn = lsn;
+        // A segment can go once the one after it starts at or before the
+        // first record still needed; the active segment always stays.
+        size_t keep = 0;
+        while (keep + 1 < files.size() && files[keep + 1].first_lsn <= lsn + 1) {
+            dropped.push_back(files[keep].first_lsn);
+            sealed_bytes -= files[keep].bytes;
+            ++keep;
+        }
+        files.erase(files.begin(), files.begin() + static_cast<std::ptrdiff_t>(keep));
+    }
+    for (uint64_t first_lsn : dropped) {
+        unlink(segment_path(first_lsn).c_str());
+    }
+    return true;
+}
+
+bool write_file_durably(const std::string &path, std::string_view data, mode_t mode) {
+    std::string temp_path = path + ".tmp";
+    int fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+    bool written = fd >= 0 && fchmod(fd, mode) == 0 &&
+                   write_fd(fd, 0, data.data(), data.size()) && fsync(fd) == 0;
+    if (fd >= 0) {
+        written = ::close(fd) == 0 && written;
+    }
+    if (!written || rename(temp_path.c_str(), path.c_str()) != 0) {
+        std::cerr << "Unable to write " << path << ": " << std::strerror(errno) << std::endl;
+        unlink(temp_path.c_str());
+        return false;
+    }
+    size_t slash = path.rfind('/');
+    return sync_directory(slash == std::string::npos ? "." : path.substr(0, slash + 1));
+}
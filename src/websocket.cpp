@@ -0,0 +1,339 @@
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <openssl/evp.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include "../include/websocket.h"
+
+namespace {
+
+constexpr std::string_view kWebSocketGuid = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+#if defined(__x86_64__)
+__attribute__((target("avx2"))) size_t unmask_avx2(char *data, size_t size, uint32_t mask) {
+    __m256i key = _mm256_set1_epi32(static_cast<int>(mask));
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(data + i), _mm256_xor_si256(block, key));
+    }
+    return i;
+}
+
+size_t unmask_sse2(char *data, size_t size, uint32_t mask) {
+    __m128i key = _mm_set1_epi32(static_cast<int>(mask));
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(data + i), _mm_xor_si128(block, key));
+    }
+    return i;
+}
+#endif
+
+uint16_t read_u16(const char *p) {
+    return static_cast<uint16_t>((static_cast<uint8_t>(p[0]) << 8) | static_cast<uint8_t>(p[1]));
+}
+
+uint64_t read_u64(const char *p) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; ++i) {
+        value = (value << 8) | static_cast<uint8_t>(p[i]);
+    }
+    return value;
+}
+
+// Whether a peer may send code in a close frame (RFC 6455 7.4): 1004-1006
+// and 1015 are reserved, 1016-2999 are kept for future extensions.
+bool valid_close_code(uint16_t code) {
+    if (code < 1000 || code >= 5000) {
+        return false;
+    }
+    if (code >= 1004 && code <= 1006) {
+        return false;
+    }
+    return code < 1015 || code >= 3000;
+}
+
+} // namespace
+
+std::string websocket_accept_key(std::string_view client_key) {
+    std::string input(client_key);
+    input.append(kWebSocketGuid);
+
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_size = 0;
+    EVP_Digest(input.data(), input.size(), digest, &digest_size, EVP_sha1(), nullptr);
+
+    unsigned char encoded[64];
+    int encoded_size = EVP_EncodeBlock(encoded, digest, static_cast<int>(digest_size));
+    return std::string(reinterpret_cast<char *>(encoded), encoded_size);
+}
+
+bool websocket_is_upgrade(const HttpRequest &request) {
+    return request.method == "GET" &&
+           http_header_has_token(request.header("Upgrade"), "websocket") &&
+           http_header_has_token(request.header("Connection"), "upgrade") &&
+           request.header("Sec-WebSocket-Version") == "13" &&
+           !request.header("Sec-WebSocket-Key").empty();
+}
+
+void websocket_write_handshake(std::string &out, const HttpRequest &request) {
+    out.append("HTTP/1.1 101 Switching Protocols\r\n"
+               "Upgrade: websocket\r\n"
+               "Connection: Upgrade\r\n"
+               "Sec-WebSocket-Accept: ");
+    out.append(websocket_accept_key(request.header("Sec-WebSocket-Key")));
+    out.append("\r\n\r\n");
+}
+
+void websocket_unmask(char *data, size_t size, const uint8_t mask[4]) {
+    uint32_t mask32;
+    std::memcpy(&mask32, mask, sizeof(mask32));
+
+    // Every vector step is a multiple of four bytes, so the key stays in
+    // phase for the scalar tail.
+    size_t i = 0;
+#if defined(__x86_64__)
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    i = has_avx2 ? unmask_avx2(data, size, mask32) : 0;
+    i += unmask_sse2(data + i, size - i, mask32);
+#endif
+
+    uint64_t mask64 = (static_cast<uint64_t>(mask32) << 32) | mask32;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t block;
+        std::memcpy(&block, data + i, sizeof(block));
+        block ^= mask64;
+        std::memcpy(data + i, &block, sizeof(block));
+    }
+    for (; i < size; ++i) {
+        data[i] = static_cast<char>(data[i] ^ mask[i & 3]);
+    }
+}
+
+bool websocket_valid_utf8(std::string_view data) {
+    size_t i = 0;
+    while (i < data.size()) {
+        // Skip ASCII eight bytes at a time.
+        if (i + 8 <= data.size()) {
+            uint64_t block;
+            std::memcpy(&block, data.data() + i, sizeof(block));
+            if ((block & 0x8080808080808080ULL) == 0) {
+                i += 8;
+                continue;
+            }
+        }
+        uint8_t c = static_cast<uint8_t>(data[i]);
+        if (c < 0x80) {
+            ++i;
+            continue;
+        }
+        size_t length;
+        uint8_t low = 0x80;
+        uint8_t high = 0xBF;
+        if (c >= 0xC2 && c <= 0xDF) {
+            length = 2;
+        } else if (c >= 0xE0 && c <= 0xEF) {
+            length = 3;
+            low = c == 0xE0 ? 0xA0 : 0x80;
+            high = c == 0xED ? 0x9F : 0xBF;
+        } else if (c >= 0xF0 && c <= 0xF4) {
+            length = 4;
+            low = c == 0xF0 ? 0x90 : 0x80;
+            high = c == 0xF4 ? 0x8F : 0xBF;
+        } else {
+            return false;
+        }
+        if (data.size() - i < length) {
+            return false;
+        }
+        // The first continuation byte carries the overlong, surrogate and
+        // range restrictions; the rest only need to be continuation bytes.
+        uint8_t second = static_cast<uint8_t>(data[i + 1]);
+        if (second < low || second > high) {
+            return false;
+        }
+        for (size_t k = 2; k < length; ++k) {
+            if ((static_cast<uint8_t>(data[i + k]) & 0xC0) != 0x80) {
+                return false;
+            }
+        }
+        i += length;
+    }
+    return true;
+}
+
+void websocket_write_frame(std::string &out, WebSocketOpcode opcode, std::string_view payload,
+                           bool fin) {
+    char header[10];
+    size_t header_size = 2;
+    header[0] = static_cast<char>((fin ? 0x80 : 0x00) | static_cast<uint8_t>(opcode));
+    if (payload.size() < 126) {
+        header[1] = static_cast<char>(payload.size());
+    } else if (payload.size() <= 0xFFFF) {
+        header[1] = 126;
+        header[2] = static_cast<char>(payload.size() >> 8);
+        header[3] = static_cast<char>(payload.size());
+        header_size = 4;
+    } else {
+        header[1] = 127;
+        uint64_t size = payload.size();
+        for (int i = 0; i < 8; ++i) {
+            header[2 + i] = static_cast<char>(size >> (56 - 8 * i));
+        }
+        header_size = 10;
+    }
+    out.append(header, header_size);
+    out.append(payload);
+}
+
+void websocket_write_close(std::string &out, uint16_t code) {
+    char payload[2] = {static_cast<char>(code >> 8), static_cast<char>(code)};
+    websocket_write_frame(out, WebSocketOpcode::Close, std::string_view(payload, 2));
+}
+
+void WebSocketReader::fail(Connection &conn, uint16_t code) {
+    websocket_write_close(conn.output_buffer(), code);
+    conn.consume(conn.input().size());
+    pending_consume = 0;
+    conn.close_after_write = true;
+}
+
+WebSocketReader::Status WebSocketReader::next(Connection &conn, WebSocketOpcode &opcode,
+                                              std::string_view &message) {
+    if (pending_consume > 0) {
+        conn.consume(pending_consume);
+        pending_consume = 0;
+    }
+    if (!in_fragment) {
+        fragments.clear();
+    }
+
+    while (!conn.close_after_write) {
+        char *data = conn.in.data() + conn.in_offset;
+        size_t available = conn.in.size() - conn.in_offset;
+        if (available < 2) {
+            return Status::Incomplete;
+        }
+
+        uint8_t b0 = static_cast<uint8_t>(data[0]);
+        uint8_t b1 = static_cast<uint8_t>(data[1]);
+        bool fin = b0 & 0x80;
+        auto frame_opcode = static_cast<WebSocketOpcode>(b0 & 0x0F);
+        bool masked = b1 & 0x80;
+        uint64_t payload_size = b1 & 0x7F;
+
+        // Extensions are never negotiated, so RSV bits must be clear, and
+        // every client frame must be masked (RFC 6455 5.1).
+        if ((b0 & 0x70) != 0 || !masked) {
+            fail(conn, 1002);
+            return Status::Closed;
+        }
+
+        size_t header_size = 2;
+        if (payload_size == 126) {
+            if (available < 4) {
+                return Status::Incomplete;
+            }
+            payload_size = read_u16(data + 2);
+            header_size = 4;
+        } else if (payload_size == 127) {
+            if (available < 10) {
+                return Status::Incomplete;
+            }
+            payload_size = read_u64(data + 2);
+            header_size = 10;
+        }
+
+        bool control = static_cast<uint8_t>(frame_opcode) & 0x08;
+        if (control && (!fin || payload_size > 125)) {
+            fail(conn, 1002);
+            return Status::Closed;
+        }
+        if (payload_size > kMaxWebSocketMessageBytes ||
+            fragments.size() + payload_size > kMaxWebSocketMessageBytes) {
+            fail(conn, 1009);
+            return Status::Closed;
+        }
+
+        size_t frame_size = header_size + 4 + payload_size;
+        if (available < frame_size) {
+            return Status::Incomplete;
+        }
+
+        uint8_t mask[4];
+        std::memcpy(mask, data + header_size, 4);
+        char *payload = data + header_size + 4;
+        websocket_unmask(payload, payload_size, mask);
+        std::string_view body(payload, payload_size);
+
+        switch (frame_opcode) {
+        case WebSocketOpcode::Ping:
+            websocket_write_frame(conn.output_buffer(), WebSocketOpcode::Pong, body);
+            conn.consume(frame_size);
+            continue;
+        case WebSocketOpcode::Pong:
+            conn.consume(frame_size);
+            continue;
+        case WebSocketOpcode::Close: {
+            // An empty close carries no code; anything else must start
+            // with a valid one.
+            uint16_t code = body.size() >= 2 ? read_u16(payload) : 1000;
+            if (body.size() == 1 || !valid_close_code(code)) {
+                code = 1002;
+            }
+            conn.consume(frame_size);
+            websocket_write_close(conn.output_buffer(), code);
+            conn.close_after_write = true;
+            return Status::Closed;
+        }
+        case WebSocketOpcode::Text:
+        case WebSocketOpcode::Binary:
+            if (in_fragment) {
+                fail(conn, 1002);
+                return Status::Closed;
+            }
+            if (fin) {
+                if (frame_opcode == WebSocketOpcode::Text && !websocket_valid_utf8(body)) {
+                    fail(conn, 1007);
+                    return Status::Closed;
+                }
+                opcode = frame_opcode;
+                message = body;
+                pending_consume = frame_size;
+                return Status::Message;
+            }
+            in_fragment = true;
+            fragment_opcode = frame_opcode;
+            fragments.assign(body);
+            conn.consume(frame_size);
+            continue;
+        case WebSocketOpcode::Continuation:
+            if (!in_fragment) {
+                fail(conn, 1002);
+                return Status::Closed;
+            }
+            fragments.append(body);
+            conn.consume(frame_size);
+            if (fin) {
+                in_fragment = false;
+                if (fragment_opcode == WebSocketOpcode::Text &&
+                    !websocket_valid_utf8(fragments)) {
+                    fail(conn, 1007);
+                    return Status::Closed;
+                }
+                opcode = fragment_opcode;
+                message = fragments;
+                return Status::Message;
+            }
+            continue;
+        default:
+            fail(conn, 1002);
+            return Status::Closed;
+        }
+    }
+    return Status::Closed;
+}
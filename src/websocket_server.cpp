@@ -1,62 +1,366 @@
 #include <iostream>
 #include <string>
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <unistd.h>
-#include <cstring>
+#include "../include/ai_core.h"
+#include "../include/auth_middleware.h"
+#include "../include/event_loop.h"
+#include "../include/http.h"
+#include "../include/json.h"
 #include "../include/openssl_init.h"
+#include "../include/server_runtime.h"
+#include "../include/thread_pool.h"
+#include "../include/tls.h"
+#include "../include/websocket.h"
+#include "chat_storage.h"
 
-void handle_client(int client_socket) {
-    // WebSocket handshake and communication code here
-    close(client_socket);
+namespace {
+
+// Frames stop being taken from a reply once this many bytes are queued for
+// a client that is not reading; the scheduler then pauses the generation
+// until the output drains.
+constexpr size_t kStreamHighWatermark = 256 * 1024;
+
+// Prompts received while a reply streams wait here, up to this many bytes,
+// so the connection keeps answering pings and closes in the meantime.
+constexpr size_t kMaxQueuedPromptBytes = kMaxWebSocketMessageBytes;
+
+// A chat tab may sit open between prompts far longer than an HTTP client.
+constexpr uint32_t kWebSocketIdleTimeoutMs = 10 * 60 * 1000;
+
+// Messages of a saved chat replayed to a client that reconnects to it.
+constexpr size_t kHistoryMessages = 100;
+constexpr size_t kMaxChatNameBytes = 255;
+
+// One reply, shared between the event loop, the worker that starts it and
+// the scheduler thread that reports its progress.
+struct StreamControl {
+    std::mutex mutex;
+    std::shared_ptr<Generation> generation;
+    bool cancelled = false;
+
+    // Hands over the started generation, or stops it if the client is gone.
+    void attach(std::shared_ptr<Generation> started) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (cancelled) {
+            started->cancel();
+            return;
+        }
+        generation = std::move(started);
+    }
+
+    std::shared_ptr<Generation> current() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return generation;
+    }
+
+    // Posts task to the connection unless the reply was cancelled; holding
+    // the lock keeps a closing connection from cancelling it meanwhile.
+    void post(EventLoop *loop, ConnectionRef ref, std::function<void(Connection &)> task) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!cancelled) {
+            loop->post_to(ref, std::move(task));
+        }
+    }
+
+    void cancel() {
+        std::lock_guard<std::mutex> lock(mutex);
+        cancelled = true;
+        if (generation) {
+            generation->cancel();
+        }
+    }
+};
+
+struct WebSocketConnectionState : ConnectionState {
+    bool upgraded = false;
+    HttpParser http_parser;
+    HttpRequest request;
+    WebSocketReader reader;
+    std::shared_ptr<StreamControl> stream;
+    std::deque<std::string> prompts;
+    size_t queued_bytes = 0;
+    // Chat named by the upgrade's chat=... parameter: its last messages are
+    // sent on connecting and each exchange is appended to it. Empty for a
+    // conversation that is not kept.
+    std::string chat;
+    // Its history is loading or the last exchange is being saved; prompts
+    // wait until that is done, so the chat stays in order.
+    bool storage_pending = false;
+    // The exchange under way, saved once the reply ends.
+    std::string prompt;
+    std::string reply;
+
+    ~WebSocketConnectionState() override {
+        if (stream) {
+            stream->cancel();
+        }
+    }
+};
+
+AIEngine &engine() {
+    static AIEngine instance;
+    return instance;
+}
+
+// Queues {"type": type, key: value} as one text frame.
+void write_message(std::string &out, std::string_view type, std::string_view key,
+                   std::string_view value) {
+    std::string json = "{\"type\":";
+    append_json_string(json, type);
+    json.push_back(',');
+    append_json_string(json, key);
+    json.push_back(':');
+    append_json_string(json, value);
+    json.push_back('}');
+    websocket_write_frame(out, WebSocketOpcode::Text, json);
+}
+
+void handle_client(Connection &conn, ThreadPool &workers);
+
+// Runs task on the connection once a storage operation has finished, from
+// whichever thread it finished on, then lets the connection go on with
+// its queued prompts.
+void finish_storage(EventLoop *loop, ConnectionRef ref, ThreadPool &workers,
+                    std::function<void(Connection &)> task) {
+    loop->post_to(ref, [task = std::move(task), &workers](Connection &conn) {
+        auto *state = dynamic_cast<WebSocketConnectionState *>(conn.state.get());
+        if (!state || !state->storage_pending) {
+            return;
+        }
+        state->storage_pending = false;
+        task(conn);
+        handle_client(conn, workers);
+    });
 }
 
-void start_server(int port) {
-    int server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket < 0) {
-        std::cerr << "Error creating socket" << std::endl;
+// Sends the chat's last messages, read as one batch on a storage thread.
+void load_history(Connection &conn, WebSocketConnectionState &state, ThreadPool &workers) {
+    state.storage_pending = true;
+    EventLoop *loop = conn.loop;
+    ConnectionRef ref = conn.ref();
+    loadRecentMessagesAsync(state.chat, kHistoryMessages,
+                            [loop, ref, &workers](std::vector<std::string> messages) {
+        finish_storage(loop, ref, workers, [messages = std::move(messages)](Connection &conn) {
+            for (const std::string &message : messages) {
+                write_message(conn.output_buffer(), "history", "data", message);
+            }
+        });
+    });
+}
+
+// Appends the finished exchange to the chat, as the panel shows it.
+void save_exchange(Connection &conn, WebSocketConnectionState &state, ThreadPool &workers) {
+    state.storage_pending = true;
+    std::vector<std::string> messages = {"> " + state.prompt + "\n", state.reply + "\n"};
+    state.prompt.clear();
+    state.reply.clear();
+    EventLoop *loop = conn.loop;
+    ConnectionRef ref = conn.ref();
+    appendChatMessagesAsync(state.chat, std::move(messages), [loop, ref, &workers](bool saved) {
+        finish_storage(loop, ref, workers, [saved](Connection &conn) {
+            if (!saved) {
+                write_message(conn.output_buffer(), "error", "message",
+                              "Unable to save the chat");
+            }
+        });
+    });
+}
+
+// Sends whatever text the reply has produced, unless the client is still
+// behind; the drain notification brings us back here once it catches up.
+void pump(Connection &conn, WebSocketConnectionState &state, ThreadPool &workers) {
+    std::shared_ptr<Generation> generation = state.stream ? state.stream->current() : nullptr;
+    if (!generation || conn.close_after_write) {
         return;
     }
+    if (conn.pending_output() >= kStreamHighWatermark) {
+        conn.notify_on_drain = true;
+        return;
+    }
+    std::string text;
+    bool more = generation->poll(text);
+    if (!text.empty()) {
+        write_message(conn.output_buffer(), "token", "data", text);
+        if (!state.chat.empty()) {
+            state.reply += text;
+        }
+    }
+    if (!more) {
+        websocket_write_frame(conn.output_buffer(), WebSocketOpcode::Text, "{\"type\":\"done\"}");
+        state.stream.reset();
+        if (!state.chat.empty()) {
+            save_exchange(conn, state, workers);
+        }
+        handle_client(conn, workers);
+    }
+}
 
-    struct sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(port);
+// Tokenizes the prompt and submits it on a runtime worker. The scheduler
+// then reports new text through the loop, which takes it as fast as the
+// client reads, so no thread ever waits on a slow client.
+void start_generation(Connection &conn, WebSocketConnectionState &state, ThreadPool &workers,
+                      std::string prompt) {
+    auto stream = std::make_shared<StreamControl>();
+    state.stream = stream;
+    if (!state.chat.empty()) {
+        state.prompt = prompt;
+    }
 
-    if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        std::cerr << "Error binding socket" << std::endl;
-        close(server_socket);
-        return;
+    EventLoop *loop = conn.loop;
+    ConnectionRef ref = conn.ref();
+    auto resume = [stream, &workers](Connection &conn) {
+        auto *state = dynamic_cast<WebSocketConnectionState *>(conn.state.get());
+        if (state && state->stream == stream) {
+            pump(conn, *state, workers);
+        }
+    };
+    workers.submit([loop, ref, stream, resume, &workers, prompt = std::move(prompt)]() {
+        std::shared_ptr<Generation> generation = engine().start_generation(
+            prompt, [loop, ref, stream, resume] { stream->post(loop, ref, resume); },
+            GenerationPriority::Interactive);
+        if (generation) {
+            stream->attach(std::move(generation));
+            stream->post(loop, ref, resume);
+            return;
+        }
+        stream->post(loop, ref, [stream, &workers](Connection &conn) {
+            auto *state = dynamic_cast<WebSocketConnectionState *>(conn.state.get());
+            if (!state || state->stream != stream) {
+                return;
+            }
+            write_message(conn.output_buffer(), "error", "message", "No model is loaded");
+            state->stream.reset();
+            state->prompt.clear();
+            handle_client(conn, workers);
+        });
+    });
+}
+
+bool complete_handshake(Connection &conn, WebSocketConnectionState &state) {
+    size_t consumed = 0;
+    HttpParseResult result = state.http_parser.parse(conn.in, conn.in_offset, state.request,
+                                                     consumed);
+    if (result == HttpParseResult::Incomplete) {
+        if (conn.limits) {
+            conn.arm_deadline(conn.limits->request_timeout_ms);
+        }
+        return false;
     }
+    conn.clear_deadline();
 
-    if (listen(server_socket, 3) < 0) {
-        std::cerr << "Error listening on socket" << std::endl;
-        close(server_socket);
-        return;
+    if (result != HttpParseResult::Complete || !websocket_is_upgrade(state.request)) {
+        HttpResponse response;
+        response.status = result == HttpParseResult::Complete ? 426 : 400;
+        response.body = "WebSocket upgrade required";
+        response.set_header("Sec-WebSocket-Version", "13");
+        http_write_response(conn.output_buffer(), response, false);
+        conn.consume(conn.input().size());
+        conn.close_after_write = true;
+        return false;
     }
 
-    std::cout << "WebSocket server listening on port " << port << std::endl;
+    AuthService &auth = auth_service();
+    if (auth.enabled() && !auth.verify_token(auth_request_token(state.request, true))) {
+        HttpResponse response;
+        response.status = 401;
+        response.body = "Authentication required";
+        response.set_header("WWW-Authenticate", "Bearer");
+        http_write_response(conn.output_buffer(), response, false);
+        conn.consume(conn.input().size());
+        conn.close_after_write = true;
+        return false;
+    }
+
+    if (http_query_param(state.request.query, "chat", state.chat) &&
+        state.chat.size() > kMaxChatNameBytes) {
+        state.chat.clear();
+    }
+    websocket_write_handshake(conn.output_buffer(), state.request);
+    conn.consume(consumed);
+    state.upgraded = true;
+    return true;
+}
+
+void handle_client(Connection &conn, ThreadPool &workers) {
+    auto *state = dynamic_cast<WebSocketConnectionState *>(conn.state.get());
+    if (!state) {
+        conn.state = std::make_unique<WebSocketConnectionState>();
+        state = static_cast<WebSocketConnectionState *>(conn.state.get());
+    }
 
-    while (true) {
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
-        int client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &client_len);
-        if (client_socket < 0) {
-            std::cerr << "Error accepting connection" << std::endl;
-            continue;
+    if (!state->upgraded) {
+        if (!complete_handshake(conn, *state)) {
+            return;
         }
+        if (!state->chat.empty()) {
+            load_history(conn, *state, workers);
+        }
+    }
+
+    // The output may have drained: let the reply go on.
+    pump(conn, *state, workers);
 
-        handle_client(client_socket);
+    // Reading continues while a reply streams, so control frames are
+    // answered at once; prompts queue until the reply has finished.
+    while (!conn.close_after_write && state->queued_bytes < kMaxQueuedPromptBytes) {
+        WebSocketOpcode opcode;
+        std::string_view message;
+        WebSocketReader::Status status = state->reader.next(conn, opcode, message);
+        if (status == WebSocketReader::Status::Incomplete && !conn.input().empty() &&
+            conn.limits) {
+            // Part of a frame is buffered: the rest must follow promptly.
+            conn.arm_deadline(conn.limits->request_timeout_ms);
+        }
+        if (status != WebSocketReader::Status::Message) {
+            break;
+        }
+        conn.clear_deadline();
+        if (opcode == WebSocketOpcode::Text) {
+            state->queued_bytes += message.size();
+            state->prompts.emplace_back(message);
+        }
     }
 
-    close(server_socket);
+    if (conn.close_after_write) {
+        if (state->stream) {
+            state->stream->cancel();
+            state->stream.reset();
+        }
+        return;
+    }
+    if (!state->stream && !state->storage_pending && !state->prompts.empty()) {
+        std::string prompt = std::move(state->prompts.front());
+        state->prompts.pop_front();
+        state->queued_bytes -= prompt.size();
+        start_generation(conn, *state, workers, std::move(prompt));
+    }
 }
 
-int main() {
-    init_openssl();
-    start_server(776);
-    cleanup_openssl();
-    return 0;
+} // namespace
+
+void register_websocket_server(ServerRuntime &runtime, int port) {
+    ConnectionLimits limits = runtime.default_limits();
+    // A whole frame has to fit in the receive buffer before it is unmasked.
+    limits.max_input_bytes = std::max(limits.max_input_bytes, kMaxWebSocketMessageBytes + 14);
+    if (limits.idle_timeout_ms > 0) {
+        limits.idle_timeout_ms = std::max(limits.idle_timeout_ms, kWebSocketIdleTimeoutMs);
+    }
+
+    // TLS, so the panel (itself served over HTTPS) can connect with wss://
+    // and the browser sends its Secure session cookie with the upgrade.
+    ThreadPool *workers = &runtime.workers();
+    bool bound = runtime.add_tls_service(port, [workers](Connection &conn) {
+        handle_client(conn, *workers);
+    }, tls_config_from_env(), limits);
+    if (!bound) {
+        return;
+    }
+
+    std::cout << "WebSocket server listening on port " << port << std::endl;
 }
@@ -0,0 +1,196 @@
+// Throughput of the storage I/O backends. Fills a scratch file whose every
+// 8-byte word holds its own offset, then has several threads submit
+// batches of random block reads through each backend, checks every block
+// read back and reports reads per second and batch latency percentiles,
+// one JSON line per backend.
+//
+//   bench_async_io [--file-mb 256] [--block 4096] [--batch 32]
+//                  [--batches 2000] [--submitters 4] [--direct 0]
+//
+// The file is usually in the page cache, so this measures submission and
+// completion overhead; --direct 1 reads with O_DIRECT to measure the disk.
+
+#include <iostream>
+#include <string>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include "../include/async_io.h"
+
+namespace {
+
+const char kUsage[] =
+    "usage: bench_async_io [--file-mb 256] [--block 4096] [--batch 32]\n"
+    "                      [--batches 2000] [--submitters 4] [--direct 0]\n";
+
+struct Options {
+    size_t file_mb = 256;
+    size_t block = 4096;
+    size_t batch = 32;
+    size_t batches = 2000;
+    size_t submitters = 4;
+    bool direct = false;
+};
+
+bool parse(int argc, char **argv, Options &options) {
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string flag = argv[i];
+        size_t value = std::strtoull(argv[i + 1], nullptr, 10);
+        if (flag == "--file-mb") {
+            options.file_mb = value;
+        } else if (flag == "--block") {
+            options.block = value;
+        } else if (flag == "--batch") {
+            options.batch = value;
+        } else if (flag == "--batches") {
+            options.batches = value;
+        } else if (flag == "--submitters") {
+            options.submitters = value;
+        } else if (flag == "--direct") {
+            options.direct = value != 0;
+        } else {
+            std::cerr << "Unknown option " << flag << std::endl;
+            return false;
+        }
+    }
+    if (argc % 2 == 0) {
+        std::cerr << "Missing value for " << argv[argc - 1] << std::endl;
+        return false;
+    }
+    return options.file_mb > 0 && options.block >= 4096 && options.block % 4096 == 0 &&
+           options.batch > 0 && options.submitters > 0;
+}
+
+bool fill(int fd, uint64_t bytes, IoBackend &io) {
+    std::vector<uint64_t> words((1 << 20) / sizeof(uint64_t));
+    for (uint64_t offset = 0; offset < bytes; offset += words.size() * sizeof(uint64_t)) {
+        for (size_t i = 0; i < words.size(); ++i) {
+            words[i] = offset + i * sizeof(uint64_t);
+        }
+        std::vector<IoRequest> write(1);
+        write[0] = {IoOp::Write, fd, offset, words.data(), words.size() * sizeof(uint64_t)};
+        if (!io.run(write)) {
+            return false;
+        }
+    }
+    std::vector<IoRequest> sync(1);
+    sync[0] = {IoOp::DataSync, fd};
+    return io.run(sync);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    for (int i = 1; i < argc; ++i) {
+        if (std::string(argv[i]) == "--help") {
+            std::cout << kUsage;
+            return 0;
+        }
+    }
+    Options options;
+    if (!parse(argc, argv, options)) {
+        return 1;
+    }
+    std::string path = "/var/tmp/bench_async_io." + std::to_string(getpid());
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        std::cerr << "Unable to create " << path << std::endl;
+        return 1;
+    }
+    uint64_t file_bytes = static_cast<uint64_t>(options.file_mb) << 20;
+    uint64_t blocks = file_bytes / options.block;
+    // Direct reads need aligned buffers and a descriptor of their own.
+    int read_fd = fd;
+
+    int status = 0;
+    bool filled = false;
+    for (IoBackendKind kind : {IoBackendKind::Uring, IoBackendKind::Threads}) {
+        IoBackendOptions settings;
+        settings.kind = kind;
+        std::unique_ptr<IoBackend> io = make_io_backend(settings);
+        if (kind == IoBackendKind::Uring && std::strcmp(io->name(), "io_uring") != 0) {
+            continue;
+        }
+        if (!filled && !(filled = fill(fd, file_bytes, *io))) {
+            std::cerr << "Unable to fill " << path << std::endl;
+            status = 1;
+            break;
+        }
+        if (options.direct && read_fd == fd) {
+            read_fd = open(path.c_str(), O_RDONLY | O_DIRECT | O_CLOEXEC);
+            if (read_fd < 0) {
+                std::cerr << "O_DIRECT is not supported for " << path << std::endl;
+                status = 1;
+                break;
+            }
+        }
+
+        std::atomic<size_t> bad{0};
+        std::vector<std::vector<double>> latencies(options.submitters);
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < options.submitters; ++t) {
+            threads.emplace_back([&, t] {
+                std::mt19937_64 rng(t + 1);
+                size_t bytes = options.batch * options.block;
+                std::unique_ptr<char, decltype(&std::free)> buffer(
+                    static_cast<char *>(std::aligned_alloc(4096, bytes)), &std::free);
+                for (size_t b = t; b < options.batches; b += options.submitters) {
+                    std::vector<IoRequest> requests(options.batch);
+                    for (size_t i = 0; i < options.batch; ++i) {
+                        requests[i] = {IoOp::Read, read_fd, (rng() % blocks) * options.block,
+                                       buffer.get() + i * options.block, options.block};
+                    }
+                    auto begin = std::chrono::steady_clock::now();
+                    bool ok = io->run(requests);
+                    latencies[t].push_back(std::chrono::duration<double, std::micro>(
+                                               std::chrono::steady_clock::now() - begin)
+                                               .count());
+                    for (const IoRequest &request : requests) {
+                        uint64_t first;
+                        std::memcpy(&first, request.data, sizeof(first));
+                        if (!ok || first != request.offset) {
+                            ++bad;
+                        }
+                    }
+                }
+            });
+        }
+        for (std::thread &thread : threads) {
+            thread.join();
+        }
+        double seconds =
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        std::vector<double> all;
+        for (const auto &part : latencies) {
+            all.insert(all.end(), part.begin(), part.end());
+        }
+        std::sort(all.begin(), all.end());
+        auto percentile = [&](double p) {
+            return all.empty() ? 0.0 : all[static_cast<size_t>(p * (all.size() - 1))];
+        };
+        std::printf("{\"backend\": \"%s\", \"reads_per_s\": %.0f, \"batch_p50_us\": %.1f, "
+                    "\"batch_p99_us\": %.1f, \"bad_reads\": %zu}\n",
+                    io->name(), options.batches * options.batch / seconds, percentile(0.5),
+                    percentile(0.99), bad.load());
+        if (bad > 0) {
+            status = 1;
+        }
+    }
+    if (read_fd != fd) {
+        close(read_fd);
+    }
+    close(fd);
+    unlink(path.c_str());
+    return status;
+}
@@ -0,0 +1,288 @@
+// Throughput of the CPU inference engine. Each run feeds a prompt of random
+// tokens as one prefill, then decodes greedily one token at a time, and
+// reports time to first token, prefill and decode tokens per second (the
+// median over runs) as JSON on stdout.
+//
+//   bench_inference [--model weights.svw] [--prompt 128] [--generate 64]
+//                   [--runs 3] [--threads 0] [--kv-budget 512] [--batch 1]
+//
+// Without --model a random model is written to a temporary file first; its
+// shape is set with [--dim 512] [--layers 8] [--heads 8] [--kv-heads 8]
+// [--hidden 1408] [--vocab 32000] [--type q8|q4]. Random weights give
+// meaningless text but exactly the work of a trained model of that shape.
+//
+// --batch decodes that many sequences together through forward_batch, as
+// the generation scheduler does, and reports their combined decode rate.
+// --kv-budget is the KV cache memory in MiB; below what a run needs, the
+// cache spills to /var/tmp and the JSON shows how many blocks went there.
+
+#include <iostream>
+#include <string>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <random>
+#include <vector>
+#include <unistd.h>
+#include "../include/compute_pool.h"
+#include "../include/inference.h"
+#include "../include/kv_cache.h"
+#include "../include/model_weights.h"
+#include "../include/tensor_ops.h"
+
+namespace {
+
+const char kUsage[] =
+    "usage: bench_inference [--model weights.svw] [--prompt 128] [--generate 64]\n"
+    "                       [--runs 3] [--threads 0] [--kv-budget 512] [--batch 1]\n"
+    "                       [--dim 512] [--layers 8] [--heads 8] [--kv-heads 8]\n"
+    "                       [--hidden 1408] [--vocab 32000] [--type q8|q4]\n";
+
+struct Options {
+    std::string model;
+    size_t prompt = 128;
+    size_t generate = 64;
+    size_t runs = 3;
+    size_t threads = 0;
+    size_t kv_budget = 512;
+    size_t batch = 1;
+    size_t dim = 512;
+    size_t layers = 8;
+    size_t heads = 8;
+    size_t kv_heads = 8;
+    size_t hidden = 1408;
+    size_t vocab = 32000;
+    WeightType type = WeightType::Q8;
+};
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+double resident_mb() {
+    long pages = 0;
+    long resident = 0;
+    FILE *statm = std::fopen("/proc/self/statm", "r");
+    if (statm) {
+        if (std::fscanf(statm, "%ld %ld", &pages, &resident) != 2) {
+            resident = 0;
+        }
+        std::fclose(statm);
+    }
+    return static_cast<double>(resident) * sysconf(_SC_PAGESIZE) / (1024.0 * 1024.0);
+}
+
+bool write_random_model(const Options &options, const std::string &path) {
+    size_t kv_dim = options.dim / options.heads * options.kv_heads;
+    std::vector<WeightTensorSpec> specs;
+    specs.push_back({"hparams", WeightType::F32, 1, 4});
+    specs.push_back({"tok_embeddings", options.type, options.vocab, options.dim});
+    for (size_t i = 0; i < options.layers; ++i) {
+        std::string prefix = "layers." + std::to_string(i) + ".";
+        specs.push_back({prefix + "attention_norm", WeightType::F32, 1, options.dim});
+        specs.push_back({prefix + "wq", options.type, options.dim, options.dim});
+        specs.push_back({prefix + "wk", options.type, kv_dim, options.dim});
+        specs.push_back({prefix + "wv", options.type, kv_dim, options.dim});
+        specs.push_back({prefix + "wo", options.type, options.dim, options.dim});
+        specs.push_back({prefix + "ffn_norm", WeightType::F32, 1, options.dim});
+        specs.push_back({prefix + "w1", options.type, options.hidden, options.dim});
+        specs.push_back({prefix + "w2", options.type, options.dim, options.hidden});
+        specs.push_back({prefix + "w3", options.type, options.hidden, options.dim});
+    }
+    specs.push_back({"norm", WeightType::F32, 1, options.dim});
+    specs.push_back({"output", options.type, options.vocab, options.dim});
+
+    WeightWriter writer;
+    if (!writer.open(path, specs)) {
+        return false;
+    }
+    std::mt19937 rng(42);
+    std::normal_distribution<float> normal(0.0f, 0.02f);
+    std::vector<float> row(std::max(options.dim, options.hidden));
+    for (const WeightTensorSpec &spec : specs) {
+        for (size_t r = 0; r < spec.rows; ++r) {
+            if (spec.name == "hparams") {
+                row[0] = static_cast<float>(options.heads);
+                row[1] = static_cast<float>(options.kv_heads);
+                row[2] = 10000.0f;
+                row[3] = 1e-5f;
+            } else if (spec.type == WeightType::F32) {
+                std::fill(row.begin(), row.begin() + spec.cols, 1.0f);
+            } else {
+                std::generate(row.begin(), row.begin() + spec.cols, [&] { return normal(rng); });
+            }
+            if (!writer.write_row(row.data())) {
+                return false;
+            }
+        }
+    }
+    return writer.finish();
+}
+
+bool parse_options(int argc, char **argv, Options &options) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            std::cerr << "Missing value for " << arg << std::endl;
+            return false;
+        }
+        std::string value = argv[++i];
+        size_t number = std::strtoull(value.c_str(), nullptr, 10);
+        if (arg == "--model") {
+            options.model = value;
+        } else if (arg == "--prompt") {
+            options.prompt = number;
+        } else if (arg == "--generate") {
+            options.generate = number;
+        } else if (arg == "--runs") {
+            options.runs = number;
+        } else if (arg == "--threads") {
+            options.threads = number;
+        } else if (arg == "--batch") {
+            options.batch = number;
+        } else if (arg == "--kv-budget") {
+            options.kv_budget = number;
+        } else if (arg == "--dim") {
+            options.dim = number;
+        } else if (arg == "--layers") {
+            options.layers = number;
+        } else if (arg == "--heads") {
+            options.heads = number;
+        } else if (arg == "--kv-heads") {
+            options.kv_heads = number;
+        } else if (arg == "--hidden") {
+            options.hidden = number;
+        } else if (arg == "--vocab") {
+            options.vocab = number;
+        } else if (arg == "--type" && (value == "q8" || value == "q4")) {
+            options.type = value == "q8" ? WeightType::Q8 : WeightType::Q4;
+        } else {
+            std::cerr << "Unknown option: " << arg << " " << value << std::endl;
+            return false;
+        }
+    }
+    return options.prompt > 0 && options.generate > 0 && options.runs > 0 && options.batch > 0 &&
+           options.heads > 0 && options.kv_heads > 0;
+}
+
+double median(std::vector<double> values) {
+    std::sort(values.begin(), values.end());
+    return values[values.size() / 2];
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    for (int i = 1; i < argc; ++i) {
+        if (std::string(argv[i]) == "--help") {
+            std::cout << kUsage;
+            return 0;
+        }
+    }
+    Options options;
+    if (!parse_options(argc, argv, options)) {
+        return 2;
+    }
+
+    std::string path = options.model;
+    bool temporary = path.empty();
+    if (temporary) {
+        path = "/tmp/bench_inference_" + std::to_string(getpid()) + ".svw";
+        if (!write_random_model(options, path)) {
+            return 1;
+        }
+    }
+
+    ModelWeights weights;
+    TransformerModel model;
+    auto load_start = std::chrono::steady_clock::now();
+    bool loaded = weights.open(path) && model.load(weights);
+    double load_ms = seconds_since(load_start) * 1000.0;
+    if (temporary) {
+        unlink(path.c_str());
+    }
+    if (!loaded) {
+        return 1;
+    }
+
+    const ModelConfig &config = model.config();
+    ComputePool pool(options.threads);
+    KvBlockPool cache;
+    KvCacheOptions cache_options;
+    cache_options.layers = config.layers;
+    cache_options.kv_dim = config.kv_dim();
+    cache_options.memory_budget = options.kv_budget << 20;
+    cache_options.spill_dir = "/var/tmp";
+    if (!cache.init(cache_options)) {
+        return 1;
+    }
+    std::mt19937 rng(7);
+    std::vector<uint32_t> prompt(options.prompt);
+    for (uint32_t &token : prompt) {
+        token = static_cast<uint32_t>(rng() % config.vocab);
+    }
+    std::vector<float> logits(config.vocab * options.batch);
+    SamplingParams greedy;
+    greedy.temperature = 0.0f;
+
+    std::vector<double> ttft, prefill, decode;
+    ForwardScratch scratch;
+    for (size_t run = 0; run < options.runs; ++run) {
+        std::vector<InferenceState> states;
+        std::vector<BatchEntry> batch;
+        std::vector<uint32_t> tokens(options.batch);
+        for (size_t b = 0; b < options.batch; ++b) {
+            states.emplace_back(config, cache, options.prompt + options.generate);
+        }
+        auto start = std::chrono::steady_clock::now();
+        for (size_t b = 0; b < options.batch; ++b) {
+            if (!model.forward(states[b], prompt, logits.data(), pool)) {
+                return 1;
+            }
+            tokens[b] = sample_token(logits.data(), config.vocab, greedy, rng);
+            if (b == 0) {
+                ttft.push_back(seconds_since(start) * 1000.0);
+            }
+            batch.push_back({&states[b], 1});
+        }
+        double prefill_s = seconds_since(start);
+        prefill.push_back(static_cast<double>(options.prompt * options.batch) / prefill_s);
+
+        auto decode_start = std::chrono::steady_clock::now();
+        for (size_t i = 1; i < options.generate; ++i) {
+            if (!model.forward_batch(batch, tokens, logits.data(), scratch, pool)) {
+                return 1;
+            }
+            for (size_t b = 0; b < options.batch; ++b) {
+                tokens[b] = sample_token(logits.data() + b * config.vocab, config.vocab, greedy,
+                                         rng);
+            }
+        }
+        double decode_s = seconds_since(decode_start);
+        decode.push_back(options.generate > 1
+                             ? static_cast<double>((options.generate - 1) * options.batch) /
+                                   decode_s
+                             : 0.0);
+    }
+
+    KvBlockPool::Stats cache_stats = cache.stats();
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << "{\"model\":\"" << (temporary ? "random" : options.model)
+              << "\",\"layers\":" << config.layers << ",\"dim\":" << config.dim
+              << ",\"hidden\":" << config.hidden << ",\"vocab\":" << config.vocab
+              << ",\"mapped_mb\":" << weights.mapped_bytes() / (1024.0 * 1024.0)
+              << ",\"kernels\":\"" << tensor_ops_isa() << "\",\"threads\":" << pool.size()
+              << ",\"prompt_tokens\":" << options.prompt
+              << ",\"generated_tokens\":" << options.generate << ",\"batch\":" << options.batch
+              << ",\"runs\":" << options.runs
+              << ",\"load_ms\":" << load_ms << ",\"ttft_ms\":" << median(ttft)
+              << ",\"prefill_tokens_per_sec\":" << median(prefill)
+              << ",\"decode_tokens_per_sec\":" << median(decode)
+              << ",\"kv_budget_mb\":" << options.kv_budget
+              << ",\"kv_spills\":" << cache_stats.spills
+              << ",\"kv_reloads\":" << cache_stats.reloads
+              << ",\"rss_mb\":" << resident_mb() << "}" << std::endl;
+    return 0;
+}
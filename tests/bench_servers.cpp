@@ -0,0 +1,559 @@
+// Loopback load generator for the network services. Every target gets its
+// own run: worker threads each hold a share of the keep-alive connections
+// and keep exactly one request in flight on each, so the reported latency
+// is the server's turnaround and requests per second is what the given
+// concurrency sustains. Results are printed as JSON on stdout.
+//
+//   bench_servers [--host 127.0.0.1] [--duration 10] [--warmup 1]
+//                 [--connections 32] [--threads 4]
+//                 [--targets http,api,external,websocket,panel]
+//                 [--port name=port]...
+//
+// WebSocket connections exchange ping/pong frames, which measures the
+// framing path without running a generation. Start the server with
+// SVAKLA_REQUEST_RATE=0 and SVAKLA_AUTH=off, or the per-connection request
+// limit and the auth middleware answer most of the load with 503s and 401s.
+// Every connection comes from one address, which may open 40 at once by
+// default; add SVAKLA_CONNECTION_RATE=0 before raising --connections past
+// that. Responses other than 2xx count as errors and drop the connection.
+
+#include <iostream>
+#include <string>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <memory>
+#include <sstream>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+namespace {
+
+const char kUsage[] =
+    "usage: bench_servers [--host 127.0.0.1] [--duration 10] [--warmup 1]\n"
+    "                     [--connections 32] [--threads 4]\n"
+    "                     [--targets http,api,external,websocket,panel]\n"
+    "                     [--port name=port]...\n";
+
+enum class Protocol {
+    Http,
+    WebSocket,
+};
+
+struct Target {
+    std::string name;
+    int port;
+    bool tls;
+    Protocol protocol;
+    std::string path;
+};
+
+struct Options {
+    std::string host = "127.0.0.1";
+    double duration = 10;
+    double warmup = 1;
+    // Below the default per-address burst of admission.h.
+    size_t connections = 32;
+    size_t threads = 4;
+    std::vector<Target> targets = {
+        {"http", 992, false, Protocol::Http, "/health"},
+        {"api", 933, false, Protocol::Http, "/"},
+        {"external", 9999, false, Protocol::Http, "/"},
+        {"websocket", 776, true, Protocol::WebSocket, "/"},
+        {"panel", 8443, true, Protocol::Http, "/"},
+    };
+};
+
+struct BenchConnection {
+    int fd = -1;
+    SSL *ssl = nullptr;
+    std::string in;
+    std::string pending;
+    uint64_t sent_at = 0;
+    // Set by the first successful response.
+    bool answered = false;
+    bool failed = false;
+
+    ~BenchConnection() {
+        if (ssl) {
+            SSL_free(ssl);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+};
+
+struct ThreadResult {
+    uint64_t requests = 0;
+    uint64_t errors = 0;
+    // Connections that failed before any successful response, such as
+    // those the server accepted only to refuse with a 503.
+    uint64_t refused = 0;
+    uint64_t bytes = 0;
+    std::vector<uint32_t> latencies_us;
+};
+
+struct TargetResult {
+    uint64_t connected = 0;
+    uint64_t requests = 0;
+    uint64_t errors = 0;
+    uint64_t bytes = 0;
+    double seconds = 0;
+    std::vector<uint32_t> latencies_us;
+};
+
+uint64_t now_ns() {
+    using namespace std::chrono;
+    return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+std::string build_request(const Target &target, const std::string &host) {
+    if (target.protocol == Protocol::WebSocket) {
+        // Client frames must be masked; a zero key keeps the payload as is.
+        std::string frame = {static_cast<char>(0x89), static_cast<char>(0x80 | 16)};
+        frame.append(4, '\0');
+        frame.append("bench-ping-frame");
+        return frame;
+    }
+    return "GET " + target.path + " HTTP/1.1\r\nHost: " + host + "\r\n\r\n";
+}
+
+bool iequals(std::string_view a, std::string_view b) {
+    return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+               return std::tolower(static_cast<unsigned char>(x)) ==
+                      std::tolower(static_cast<unsigned char>(y));
+           });
+}
+
+// Size of the complete HTTP response at the front of data, or 0 if more
+// bytes are needed; success is set for a 2xx status. The services answer
+// with Content-Length only.
+size_t http_response_size(std::string_view data, bool &success) {
+    size_t header_end = data.find("\r\n\r\n");
+    if (header_end == std::string_view::npos) {
+        return 0;
+    }
+    size_t status = data.find(' ');
+    success = status != std::string_view::npos && status + 1 < header_end &&
+              data[status + 1] == '2';
+    size_t content_length = 0;
+    size_t line = data.find("\r\n") + 2;
+    while (line < header_end) {
+        size_t eol = data.find("\r\n", line);
+        std::string_view field = data.substr(line, eol - line);
+        size_t colon = field.find(':');
+        if (colon != std::string_view::npos && iequals(field.substr(0, colon), "Content-Length")) {
+            content_length = std::strtoull(std::string(field.substr(colon + 1)).c_str(), nullptr,
+                                           10);
+        }
+        line = eol + 2;
+    }
+    size_t total = header_end + 4 + content_length;
+    return data.size() >= total ? total : 0;
+}
+
+// Size of the first complete server frame, or 0 if more bytes are needed.
+// pong is set when that frame answers our ping.
+size_t websocket_frame_size(std::string_view data, bool &pong) {
+    if (data.size() < 2) {
+        return 0;
+    }
+    uint64_t payload = static_cast<uint8_t>(data[1]) & 0x7F;
+    size_t header = 2;
+    if (payload == 126) {
+        if (data.size() < 4) {
+            return 0;
+        }
+        payload = (static_cast<uint8_t>(data[2]) << 8) | static_cast<uint8_t>(data[3]);
+        header = 4;
+    } else if (payload == 127) {
+        if (data.size() < 10) {
+            return 0;
+        }
+        payload = 0;
+        for (int i = 0; i < 8; ++i) {
+            payload = (payload << 8) | static_cast<uint8_t>(data[2 + i]);
+        }
+        header = 10;
+    }
+    if (data.size() < header + payload) {
+        return 0;
+    }
+    pong = (static_cast<uint8_t>(data[0]) & 0x0F) == 0xA;
+    return header + payload;
+}
+
+bool write_all_blocking(BenchConnection &conn, std::string_view data) {
+    while (!data.empty()) {
+        int n = conn.ssl ? SSL_write(conn.ssl, data.data(), static_cast<int>(data.size()))
+                         : static_cast<int>(send(conn.fd, data.data(), data.size(), MSG_NOSIGNAL));
+        if (n <= 0) {
+            return false;
+        }
+        data.remove_prefix(n);
+    }
+    return true;
+}
+
+// Blocking setup: connect, finish the TLS handshake and the WebSocket
+// upgrade, then switch the socket to non-blocking for the measured phase.
+std::unique_ptr<BenchConnection> open_connection(const Options &options, const Target &target,
+                                                 SSL_CTX *tls) {
+    auto conn = std::make_unique<BenchConnection>();
+    conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (conn->fd < 0) {
+        return nullptr;
+    }
+
+    struct sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(target.port);
+    if (inet_pton(AF_INET, options.host.c_str(), &addr.sin_addr) != 1 ||
+        connect(conn->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        return nullptr;
+    }
+    int enable = 1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+    if (target.tls) {
+        conn->ssl = SSL_new(tls);
+        if (!conn->ssl || SSL_set_fd(conn->ssl, conn->fd) != 1 || SSL_connect(conn->ssl) != 1) {
+            ERR_clear_error();
+            return nullptr;
+        }
+    }
+
+    if (target.protocol == Protocol::WebSocket) {
+        std::string upgrade = "GET " + target.path + " HTTP/1.1\r\nHost: " + options.host +
+                              "\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                              "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                              "Sec-WebSocket-Version: 13\r\n\r\n";
+        if (!write_all_blocking(*conn, upgrade)) {
+            return nullptr;
+        }
+        char buffer[1024];
+        while (conn->in.find("\r\n\r\n") == std::string::npos) {
+            int n = conn->ssl ? SSL_read(conn->ssl, buffer, sizeof(buffer))
+                              : static_cast<int>(recv(conn->fd, buffer, sizeof(buffer), 0));
+            if (n <= 0) {
+                return nullptr;
+            }
+            conn->in.append(buffer, n);
+        }
+        if (conn->in.compare(0, 12, "HTTP/1.1 101") != 0) {
+            return nullptr;
+        }
+        conn->in.erase(0, conn->in.find("\r\n\r\n") + 4);
+    }
+
+    fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) | O_NONBLOCK);
+    return conn;
+}
+
+// Returns false on a fatal error; EAGAIN leaves the rest in pending.
+bool flush_pending(BenchConnection &conn) {
+    while (!conn.pending.empty()) {
+        int n;
+        if (conn.ssl) {
+            ERR_clear_error();
+            n = SSL_write(conn.ssl, conn.pending.data(), static_cast<int>(conn.pending.size()));
+            if (n <= 0) {
+                int error = SSL_get_error(conn.ssl, n);
+                return error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE;
+            }
+        } else {
+            n = static_cast<int>(send(conn.fd, conn.pending.data(), conn.pending.size(),
+                                      MSG_NOSIGNAL));
+            if (n < 0) {
+                return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+            }
+        }
+        conn.pending.erase(0, n);
+    }
+    return true;
+}
+
+// Reads until the socket would block. Returns false on error or EOF.
+bool read_available(BenchConnection &conn, uint64_t &bytes) {
+    char buffer[64 * 1024];
+    while (true) {
+        int n;
+        if (conn.ssl) {
+            ERR_clear_error();
+            n = SSL_read(conn.ssl, buffer, sizeof(buffer));
+            if (n <= 0) {
+                int error = SSL_get_error(conn.ssl, n);
+                return error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE;
+            }
+        } else {
+            n = static_cast<int>(recv(conn.fd, buffer, sizeof(buffer), 0));
+            if (n == 0) {
+                return false;
+            }
+            if (n < 0) {
+                return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+            }
+        }
+        conn.in.append(buffer, n);
+        bytes += n;
+    }
+}
+
+void drop(BenchConnection &conn, ThreadResult &result) {
+    conn.failed = true;
+    ++result.errors;
+    if (!conn.answered) {
+        ++result.refused;
+    }
+}
+
+void run_worker(const Target &target, const std::string &request,
+                std::vector<std::unique_ptr<BenchConnection>> &connections, uint64_t start,
+                uint64_t measure_from, uint64_t end, ThreadResult &result) {
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        std::cerr << "Error creating epoll instance" << std::endl;
+        return;
+    }
+
+    for (size_t i = 0; i < connections.size(); ++i) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.u64 = i;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, connections[i]->fd, &ev);
+        connections[i]->pending = request;
+        connections[i]->sent_at = start;
+        if (!flush_pending(*connections[i])) {
+            drop(*connections[i], result);
+        }
+    }
+
+    struct epoll_event events[256];
+    while (now_ns() < end) {
+        int count = epoll_wait(epoll_fd, events, 256, 100);
+        for (int i = 0; i < count; ++i) {
+            BenchConnection &conn = *connections[events[i].data.u64];
+            if (conn.failed) {
+                continue;
+            }
+            uint64_t bytes = 0;
+            if (!flush_pending(conn) || !read_available(conn, bytes)) {
+                drop(conn, result);
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn.fd, nullptr);
+                continue;
+            }
+
+            uint64_t now = now_ns();
+            if (now >= measure_from) {
+                result.bytes += bytes;
+            }
+            while (true) {
+                bool complete = false;
+                size_t size;
+                if (target.protocol == Protocol::WebSocket) {
+                    size = websocket_frame_size(conn.in, complete);
+                } else {
+                    size = http_response_size(conn.in, complete);
+                }
+                if (size == 0) {
+                    break;
+                }
+                conn.in.erase(0, size);
+                if (!complete && target.protocol == Protocol::Http) {
+                    // A refusal or a failed request, not a measured one.
+                    drop(conn, result);
+                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn.fd, nullptr);
+                    break;
+                }
+                if (!complete) {
+                    continue;
+                }
+                conn.answered = true;
+                if (conn.sent_at >= measure_from) {
+                    ++result.requests;
+                    result.latencies_us.push_back(
+                        static_cast<uint32_t>(std::min<uint64_t>((now - conn.sent_at) / 1000,
+                                                                 UINT32_MAX)));
+                }
+                conn.sent_at = now;
+                conn.pending.append(request);
+            }
+            if (!conn.failed && !flush_pending(conn)) {
+                drop(conn, result);
+            }
+        }
+    }
+    close(epoll_fd);
+}
+
+uint32_t percentile(const std::vector<uint32_t> &sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t index = static_cast<size_t>(p * (sorted.size() - 1));
+    return sorted[index];
+}
+
+TargetResult run_target(const Options &options, const Target &target, SSL_CTX *tls) {
+    TargetResult total;
+    size_t thread_count = std::max<size_t>(1, std::min(options.threads, options.connections));
+    std::vector<std::vector<std::unique_ptr<BenchConnection>>> shares(thread_count);
+    for (size_t i = 0; i < options.connections; ++i) {
+        auto conn = open_connection(options, target, tls);
+        if (!conn) {
+            ++total.errors;
+            continue;
+        }
+        shares[i % thread_count].push_back(std::move(conn));
+        ++total.connected;
+    }
+    if (total.connected == 0) {
+        return total;
+    }
+
+    std::string request = build_request(target, options.host);
+    uint64_t start = now_ns();
+    uint64_t measure_from = start + static_cast<uint64_t>(options.warmup * 1e9);
+    uint64_t end = measure_from + static_cast<uint64_t>(options.duration * 1e9);
+
+    std::vector<ThreadResult> results(thread_count);
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < thread_count; ++i) {
+        workers.emplace_back([&, i]() {
+            run_worker(target, request, shares[i], start, measure_from, end, results[i]);
+        });
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+
+    total.seconds = options.duration;
+    for (auto &result : results) {
+        total.connected -= result.refused;
+        total.requests += result.requests;
+        total.errors += result.errors;
+        total.bytes += result.bytes;
+        total.latencies_us.insert(total.latencies_us.end(), result.latencies_us.begin(),
+                                  result.latencies_us.end());
+    }
+    std::sort(total.latencies_us.begin(), total.latencies_us.end());
+    return total;
+}
+
+bool parse_options(int argc, char **argv, Options &options) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            std::cerr << "Missing value for " << arg << std::endl;
+            return false;
+        }
+        std::string value = argv[++i];
+        if (arg == "--host") {
+            options.host = value;
+        } else if (arg == "--duration") {
+            options.duration = std::strtod(value.c_str(), nullptr);
+        } else if (arg == "--warmup") {
+            options.warmup = std::strtod(value.c_str(), nullptr);
+        } else if (arg == "--connections") {
+            options.connections = std::strtoul(value.c_str(), nullptr, 10);
+        } else if (arg == "--threads") {
+            options.threads = std::strtoul(value.c_str(), nullptr, 10);
+        } else if (arg == "--targets") {
+            std::vector<Target> selected;
+            std::stringstream names(value);
+            std::string name;
+            while (std::getline(names, name, ',')) {
+                auto target = std::find_if(options.targets.begin(), options.targets.end(),
+                                           [&](const Target &t) { return t.name == name; });
+                if (target == options.targets.end()) {
+                    std::cerr << "Unknown target: " << name << std::endl;
+                    return false;
+                }
+                selected.push_back(*target);
+            }
+            options.targets = selected;
+        } else if (arg == "--port") {
+            size_t equals = value.find('=');
+            std::string name = value.substr(0, equals);
+            auto target = std::find_if(options.targets.begin(), options.targets.end(),
+                                       [&](const Target &t) { return t.name == name; });
+            if (equals == std::string::npos || target == options.targets.end()) {
+                std::cerr << "Expected --port name=port, got: " << value << std::endl;
+                return false;
+            }
+            target->port = std::atoi(value.c_str() + equals + 1);
+        } else {
+            std::cerr << "Unknown option: " << arg << std::endl;
+            return false;
+        }
+    }
+    return options.duration > 0 && options.connections > 0;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    for (int i = 1; i < argc; ++i) {
+        if (std::string(argv[i]) == "--help") {
+            std::cout << kUsage;
+            return 0;
+        }
+    }
+    Options options;
+    if (!parse_options(argc, argv, options)) {
+        return 2;
+    }
+
+    // Loopback only: the panel's certificate is not verified.
+    SSL_CTX *tls = SSL_CTX_new(TLS_client_method());
+    if (!tls) {
+        std::cerr << "Error creating TLS client context" << std::endl;
+        return 1;
+    }
+    SSL_CTX_set_verify(tls, SSL_VERIFY_NONE, nullptr);
+
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << "{\"host\":\"" << options.host << "\",\"duration_s\":" << options.duration
+              << ",\"warmup_s\":" << options.warmup << ",\"connections\":" << options.connections
+              << ",\"threads\":" << options.threads << ",\"targets\":[";
+    bool failed = false;
+    for (size_t i = 0; i < options.targets.size(); ++i) {
+        const Target &target = options.targets[i];
+        TargetResult result = run_target(options, target, tls);
+        failed = failed || result.connected == 0;
+        double seconds = result.seconds > 0 ? result.seconds : 1;
+        std::cout << (i ? "," : "") << "{\"name\":\"" << target.name
+                  << "\",\"port\":" << target.port << ",\"tls\":" << (target.tls ? "true" : "false")
+                  << ",\"connected\":" << result.connected << ",\"requests\":" << result.requests
+                  << ",\"errors\":" << result.errors
+                  << ",\"requests_per_sec\":" << result.requests / seconds
+                  << ",\"bytes_per_sec\":" << result.bytes / seconds << ",\"latency_us\":{"
+                  << "\"p50\":" << percentile(result.latencies_us, 0.50)
+                  << ",\"p99\":" << percentile(result.latencies_us, 0.99)
+                  << ",\"p999\":" << percentile(result.latencies_us, 0.999) << ",\"max\":"
+                  << (result.latencies_us.empty() ? 0 : result.latencies_us.back()) << "}}"
+                  << std::flush;
+    }
+    std::cout << "]}" << std::endl;
+
+    SSL_CTX_free(tls);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,196 @@
+// Build and query cost of the HNSW vector index. Inserts random clustered
+// vectors, saves the index, maps it again, then reports insert throughput,
+// open time, search latency percentiles and recall@k against exact
+// brute-force search as JSON on stdout.
+//
+//   bench_vector_index [--count 100000] [--dim 128] [--queries 1000] [--k 10]
+//                      [--ef 64] [--neighbors 16] [--ef-construction 200]
+//                      [--delete 0.0]
+//
+// --delete removes that fraction of the keys before querying, so recall
+// also covers searches routed through tombstones.
+
+#include <iostream>
+#include <string>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+#include <unistd.h>
+#include "../include/vector_index.h"
+
+namespace {
+
+const char kUsage[] =
+    "usage: bench_vector_index [--count 100000] [--dim 128] [--queries 1000] [--k 10]\n"
+    "                          [--ef 64] [--neighbors 16] [--ef-construction 200]\n"
+    "                          [--delete 0.0]\n";
+
+struct Options {
+    size_t count = 100000;
+    size_t dim = 128;
+    size_t queries = 1000;
+    size_t k = 10;
+    size_t ef = 64;
+    size_t neighbors = 16;
+    size_t ef_construction = 200;
+    double remove = 0.0;
+};
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+bool parse(int argc, char **argv, Options &options) {
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string flag = argv[i];
+        const char *value = argv[i + 1];
+        if (flag == "--count") {
+            options.count = std::strtoull(value, nullptr, 10);
+        } else if (flag == "--dim") {
+            options.dim = std::strtoull(value, nullptr, 10);
+        } else if (flag == "--queries") {
+            options.queries = std::strtoull(value, nullptr, 10);
+        } else if (flag == "--k") {
+            options.k = std::strtoull(value, nullptr, 10);
+        } else if (flag == "--ef") {
+            options.ef = std::strtoull(value, nullptr, 10);
+        } else if (flag == "--neighbors") {
+            options.neighbors = std::strtoull(value, nullptr, 10);
+        } else if (flag == "--ef-construction") {
+            options.ef_construction = std::strtoull(value, nullptr, 10);
+        } else if (flag == "--delete") {
+            options.remove = std::strtod(value, nullptr);
+        } else {
+            std::cerr << "Unknown option " << flag << std::endl;
+            return false;
+        }
+    }
+    if (argc % 2 == 0) {
+        std::cerr << "Missing value for " << argv[argc - 1] << std::endl;
+        return false;
+    }
+    return options.count > 0 && options.dim > 0 && options.k > 0;
+}
+
+// Points scattered around a few hundred centres, closer to what sentence
+// embeddings look like than uniform noise, which has no near neighbours.
+std::vector<float> clustered(size_t count, size_t dim, std::mt19937_64 &rng) {
+    std::normal_distribution<float> normal(0.0f, 1.0f);
+    size_t clusters = std::max<size_t>(1, count / 500);
+    std::vector<float> centres(clusters * dim);
+    for (float &value : centres) {
+        value = normal(rng);
+    }
+    std::vector<float> points(count * dim);
+    for (size_t i = 0; i < count; ++i) {
+        const float *centre = centres.data() + (rng() % clusters) * dim;
+        for (size_t d = 0; d < dim; ++d) {
+            points[i * dim + d] = centre[d] + 0.5f * normal(rng);
+        }
+    }
+    return points;
+}
+
+float cosine(const float *a, const float *b, size_t dim) {
+    double dot = 0.0, norm_a = 0.0, norm_b = 0.0;
+    for (size_t d = 0; d < dim; ++d) {
+        dot += static_cast<double>(a[d]) * b[d];
+        norm_a += static_cast<double>(a[d]) * a[d];
+        norm_b += static_cast<double>(b[d]) * b[d];
+    }
+    return static_cast<float>(dot / std::sqrt(norm_a * norm_b));
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    for (int i = 1; i < argc; ++i) {
+        if (std::string(argv[i]) == "--help") {
+            std::cout << kUsage;
+            return 0;
+        }
+    }
+    Options options;
+    if (!parse(argc, argv, options)) {
+        return 1;
+    }
+    std::mt19937_64 rng(7);
+    // Queries come from the same clusters as the indexed points.
+    std::vector<float> points = clustered(options.count + options.queries, options.dim, rng);
+    const float *queries = points.data() + options.count * options.dim;
+
+    HnswOptions settings;
+    settings.max_neighbors = options.neighbors;
+    settings.ef_construction = options.ef_construction;
+    settings.ef_search = options.ef;
+    std::vector<bool> removed(options.count, false);
+    auto start = std::chrono::steady_clock::now();
+    {
+        HnswIndex built;
+        built.init(options.dim, settings);
+        for (size_t i = 0; i < options.count; ++i) {
+            built.insert(i, points.data() + i * options.dim, options.dim);
+        }
+        for (size_t i = 0; i < options.count; ++i) {
+            if (static_cast<double>(rng() % 1000000) / 1e6 < options.remove) {
+                removed[i] = built.remove(i);
+            }
+        }
+        std::string path = "/var/tmp/bench_vector_index." + std::to_string(getpid());
+        double build_seconds = seconds_since(start);
+        if (!built.save(path)) {
+            return 1;
+        }
+        start = std::chrono::steady_clock::now();
+        HnswIndex index;
+        if (!index.open(path, settings)) {
+            return 1;
+        }
+        double open_seconds = seconds_since(start);
+        unlink(path.c_str());
+
+        std::vector<double> latencies;
+        size_t found = 0;
+        size_t expected = 0;
+        std::vector<std::pair<float, size_t>> exact;
+        for (size_t q = 0; q < options.queries; ++q) {
+            const float *query = queries + q * options.dim;
+            auto begin = std::chrono::steady_clock::now();
+            std::vector<HnswMatch> matches = index.search(query, options.dim, options.k);
+            latencies.push_back(seconds_since(begin) * 1e6);
+
+            // Exact answers, skipping removed keys as the index does.
+            exact.clear();
+            for (size_t i = 0; i < options.count; ++i) {
+                if (removed[i]) {
+                    continue;
+                }
+                exact.push_back({-cosine(query, points.data() + i * options.dim, options.dim), i});
+            }
+            size_t top = std::min(options.k, exact.size());
+            std::partial_sort(exact.begin(), exact.begin() + top, exact.end());
+            for (size_t j = 0; j < top; ++j) {
+                ++expected;
+                for (const HnswMatch &match : matches) {
+                    found += match.key == exact[j].second;
+                }
+            }
+        }
+        std::sort(latencies.begin(), latencies.end());
+        auto percentile = [&](double p) {
+            size_t last = latencies.size() - 1;
+            return latencies.empty() ? 0.0 : latencies[static_cast<size_t>(p * last)];
+        };
+        std::printf("{\"count\": %zu, \"live\": %zu, \"dim\": %zu, \"inserts_per_s\": %.0f, "
+                    "\"open_ms\": %.3f, \"search_p50_us\": %.1f, \"search_p99_us\": %.1f, "
+                    "\"recall_at_%zu\": %.4f}\n",
+                    options.count, index.size(), options.dim, options.count / build_seconds,
+                    open_seconds * 1e3, percentile(0.5), percentile(0.99), options.k,
+                    expected ? static_cast<double>(found) / expected : 0.0);
+    }
+    return 0;
+}
@@ -0,0 +1,189 @@
+// Storage I/O backend: batched writes, syncs and reads come back intact,
+// including transfers larger than a registered buffer and batches larger
+// than the ring; a read past the end of the file stops there; failures
+// report -errno; and the chat log's batched reads land in order. ctest runs
+// it once per backend, chosen by SVAKLA_IO_BACKEND like the server's.
+
+#include <iostream>
+#include <string>
+#include <cerrno>
+#include <future>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include "../chat/chat_log.h"
+#include "../include/async_io.h"
+#include "test_util.h"
+
+namespace {
+
+IoRequest request(IoOp op, int fd, uint64_t offset, void *data, size_t size) {
+    IoRequest request;
+    request.op = op;
+    request.fd = fd;
+    request.offset = offset;
+    request.data = data;
+    request.size = size;
+    return request;
+}
+
+// Submits requests and waits for the callback, returning what it was given.
+std::vector<IoRequest> submit_and_wait(IoBackend &backend, std::vector<IoRequest> requests) {
+    std::promise<std::vector<IoRequest>> finished;
+    std::future<std::vector<IoRequest>> result = finished.get_future();
+    backend.submit(std::move(requests), [&finished](std::vector<IoRequest> &done) {
+        finished.set_value(std::move(done));
+    });
+    return result.get();
+}
+
+std::string pattern(size_t size, char seed) {
+    std::string out(size, '\0');
+    for (size_t i = 0; i < size; ++i) {
+        out[i] = static_cast<char>(seed + i % 251);
+    }
+    return out;
+}
+
+void test_write_sync_read(IoBackend &backend, const std::string &directory) {
+    int fd = ::open((directory + "/data").c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    CHECK(fd >= 0);
+    // Small, unaligned and larger than a registered buffer.
+    std::vector<std::string> blocks = {pattern(100, 'a'), pattern(4096 + 7, 'b'),
+                                       pattern(200 * 1024, 'c')};
+    std::vector<uint64_t> offsets = {0, 100, 100 + 4096 + 7};
+    std::vector<IoRequest> writes;
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        writes.push_back(request(IoOp::Write, fd, offsets[i], blocks[i].data(), blocks[i].size()));
+    }
+    for (const IoRequest &done : submit_and_wait(backend, writes)) {
+        CHECK(done.result == static_cast<ssize_t>(done.size));
+    }
+
+    std::vector<IoRequest> syncs = {request(IoOp::DataSync, fd, 0, nullptr, 0),
+                                    request(IoOp::Sync, fd, 0, nullptr, 0)};
+    for (const IoRequest &done : submit_and_wait(backend, syncs)) {
+        CHECK(done.result == 0);
+    }
+
+    // Read back in reverse order, through run() as well as submit().
+    std::vector<std::string> read(blocks.size());
+    std::vector<IoRequest> reads;
+    for (size_t i = blocks.size(); i-- > 0;) {
+        read[i].assign(blocks[i].size(), '\0');
+        reads.push_back(request(IoOp::Read, fd, offsets[i], read[i].data(), read[i].size()));
+    }
+    std::vector<IoRequest> copy = reads;
+    for (const IoRequest &done : submit_and_wait(backend, reads)) {
+        CHECK(done.result == static_cast<ssize_t>(done.size));
+    }
+    CHECK(read == blocks);
+    for (std::string &block : read) {
+        std::fill(block.begin(), block.end(), '\0');
+    }
+    CHECK(backend.run(copy));
+    CHECK(read == blocks);
+    ::close(fd);
+}
+
+void test_short_reads(IoBackend &backend, const std::string &directory) {
+    std::string path = directory + "/short";
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    CHECK(fd >= 0);
+    std::string content = pattern(1000, 's');
+    CHECK(write(fd, content.data(), content.size()) == static_cast<ssize_t>(content.size()));
+
+    std::string tail(500, '\0');
+    std::string past(10, '\0');
+    std::vector<IoRequest> reads = {request(IoOp::Read, fd, 900, tail.data(), tail.size()),
+                                    request(IoOp::Read, fd, 1000, past.data(), past.size()),
+                                    request(IoOp::Read, fd, 5000, past.data(), past.size())};
+    std::vector<IoRequest> done = submit_and_wait(backend, reads);
+    CHECK(done.size() == 3);
+    if (done.size() == 3) {
+        CHECK(done[0].result == 100);
+        CHECK(done[1].result == 0);
+        CHECK(done[2].result == 0);
+    }
+    CHECK(tail.substr(0, 100) == content.substr(900));
+    // run() counts a short read as a failure.
+    CHECK(!backend.run(reads));
+    ::close(fd);
+}
+
+void test_errors(IoBackend &backend, const std::string &directory) {
+    int fd = ::open((directory + "/closed").c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    CHECK(fd >= 0);
+    ::close(fd);
+    char byte = 'x';
+    std::vector<IoRequest> requests = {request(IoOp::Write, fd, 0, &byte, 1),
+                                       request(IoOp::Read, fd, 0, &byte, 1),
+                                       request(IoOp::DataSync, fd, 0, nullptr, 0)};
+    for (const IoRequest &done : submit_and_wait(backend, requests)) {
+        CHECK(done.result == -EBADF);
+    }
+    CHECK(!backend.run(requests));
+    // An empty batch still completes.
+    CHECK(submit_and_wait(backend, {}).empty());
+}
+
+void test_large_batch(IoBackend &backend, const std::string &directory) {
+    int fd = ::open((directory + "/large").c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    CHECK(fd >= 0);
+    constexpr size_t kRequests = 3000;
+    std::vector<uint32_t> words(kRequests);
+    for (size_t i = 0; i < kRequests; ++i) {
+        words[i] = static_cast<uint32_t>(i * 7919);
+    }
+    CHECK(write(fd, words.data(), words.size() * sizeof(uint32_t)) ==
+          static_cast<ssize_t>(words.size() * sizeof(uint32_t)));
+    std::vector<uint32_t> read(kRequests, 0);
+    std::vector<IoRequest> reads;
+    for (size_t i = 0; i < kRequests; ++i) {
+        reads.push_back(request(IoOp::Read, fd, i * sizeof(uint32_t), &read[i], sizeof(uint32_t)));
+    }
+    CHECK(backend.run(reads));
+    CHECK(read == words);
+    ::close(fd);
+}
+
+void test_chat_history(const std::string &directory) {
+    ChatLog log;
+    CHECK(log.open(directory + "/chats"));
+    for (int i = 0; i < 20; ++i) {
+        CHECK(log.append(i % 2 == 0 ? "even" : "odd", "message " + std::to_string(i)));
+    }
+    auto read_last = [&log](std::string_view chat, size_t count) {
+        std::promise<std::vector<ChatMessage>> finished;
+        std::future<std::vector<ChatMessage>> result = finished.get_future();
+        log.read_last_async(chat, count, [&finished](std::vector<ChatMessage> messages) {
+            finished.set_value(std::move(messages));
+        });
+        return result.get();
+    };
+    std::vector<ChatMessage> last = read_last("odd", 3);
+    CHECK(last.size() == 3);
+    if (last.size() == 3) {
+        CHECK(last[0].text == "message 15");
+        CHECK(last[1].text == "message 17");
+        CHECK(last[2].text == "message 19");
+    }
+    CHECK(read_last("even", 100).size() == 10);
+    CHECK(read_last("missing", 3).empty());
+    std::vector<ChatMessage> waited = log.read_last("odd", 3);
+    CHECK(waited.size() == 3 && waited.back().text == "message 19");
+}
+
+} // namespace
+
+int main() {
+    ScratchDir dir("test_async_io");
+    IoBackend &backend = storage_io();
+    std::cout << "backend: " << backend.name() << std::endl;
+    test_write_sync_read(backend, dir.path);
+    test_short_reads(backend, dir.path);
+    test_errors(backend, dir.path);
+    test_large_batch(backend, dir.path);
+    test_chat_history(dir.path);
+    return test_result();
+}
@@ -0,0 +1,145 @@
+// Full-text chat index: the query language, deletes, results that stay the
+// same once the buffer has been written out, merged and reopened, and a
+// segment whose posting lists were damaged on disk.
+
+#include <iostream>
+#include <string>
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <vector>
+#include "../chat/chat_index.h"
+#include "test_util.h"
+
+namespace {
+
+// Hits as "chat:sequence", in rank order.
+std::vector<std::string> hits(const ChatIndex &index, std::string_view query) {
+    std::vector<std::string> names;
+    for (const ChatSearchHit &hit : index.search(query, 100)) {
+        names.push_back(hit.chat + ":" + std::to_string(hit.sequence));
+    }
+    return names;
+}
+
+std::vector<std::string> sorted(std::vector<std::string> names) {
+    std::sort(names.begin(), names.end());
+    return names;
+}
+
+void add_corpus(ChatIndex &index) {
+    CHECK(index.add("pets", 0, "The quick brown fox jumps over the lazy dog"));
+    CHECK(index.add("pets", 1, "A brown dog sleeps"));
+    CHECK(index.add("pets", 2, "Cats and dogs, cats and DOGS"));
+    CHECK(index.add("work", 0, "Quarterly report: brown bag lunch on Friday"));
+    CHECK(index.add("work", 1, "The fox project ships in Q3"));
+}
+
+void check_queries(const ChatIndex &index) {
+    CHECK(sorted(hits(index, "brown")) ==
+          std::vector<std::string>({"pets:0", "pets:1", "work:0"}));
+    CHECK(sorted(hits(index, "BROWN dog")) == std::vector<std::string>({"pets:0", "pets:1"}));
+    CHECK(hits(index, "\"quick brown\"") == std::vector<std::string>({"pets:0"}));
+    CHECK(hits(index, "\"brown quick\"").empty());
+    CHECK(sorted(hits(index, "fox -dog")) == std::vector<std::string>({"work:1"}));
+    CHECK(sorted(hits(index, "sleeps OR project")) ==
+          std::vector<std::string>({"pets:1", "work:1"}));
+    CHECK(hits(index, "unicorn").empty());
+    // Repeated terms rank the message that repeats them first.
+    std::vector<std::string> cats = hits(index, "cats");
+    CHECK(!cats.empty() && cats[0] == "pets:2");
+}
+
+void test_buffered_search() {
+    ScratchDir dir("test_chat_index_buffered");
+    ChatIndex index;
+    CHECK(index.open(dir.path));
+    add_corpus(index);
+    CHECK(index.document_count() == 5);
+    check_queries(index);
+
+    // Older sequence numbers are ignored once a chat has moved past them.
+    CHECK(index.next_sequence("pets") == 3);
+    index.add("pets", 1, "duplicate unicorn");
+    CHECK(hits(index, "unicorn").empty());
+    index.close();
+}
+
+void test_segments_and_reopen() {
+    ScratchDir dir("test_chat_index_segments");
+    ChatIndexOptions options;
+    options.flush_docs = 2;
+    options.merge_factor = 2;
+    ChatIndex index;
+    CHECK(index.open(dir.path, options));
+    add_corpus(index);
+    CHECK(index.flush());
+    CHECK(index.segment_count() >= 1);
+    check_queries(index);
+
+    index.merge();
+    check_queries(index);
+    index.close();
+
+    CHECK(index.open(dir.path, options));
+    CHECK(index.next_sequence("pets") == 3);
+    check_queries(index);
+    index.close();
+}
+
+void test_remove() {
+    ScratchDir dir("test_chat_index_remove");
+    ChatIndex index;
+    CHECK(index.open(dir.path));
+    add_corpus(index);
+    CHECK(index.flush());
+    CHECK(index.remove("pets", 2));
+    CHECK(sorted(hits(index, "brown")) == std::vector<std::string>({"work:0"}));
+    CHECK(hits(index, "cats") == std::vector<std::string>({"pets:2"}));
+    index.close();
+
+    CHECK(index.open(dir.path));
+    CHECK(sorted(hits(index, "brown")) == std::vector<std::string>({"work:0"}));
+    index.close();
+}
+
+void test_damaged_postings() {
+    ScratchDir dir("test_chat_index_damaged");
+    ChatIndex index;
+    CHECK(index.open(dir.path));
+    add_corpus(index);
+    CHECK(index.flush());
+    index.close();
+
+    // The first posting list starts right after the header.
+    std::string segment;
+    for (const auto &entry : std::filesystem::directory_iterator(dir.path)) {
+        if (entry.path().extension() == ".idx") {
+            segment = entry.path().string();
+        }
+    }
+    CHECK(!segment.empty());
+    {
+        std::fstream file(segment, std::ios::binary | std::ios::in | std::ios::out);
+        file.seekg(sizeof(IndexSegmentHeader));
+        char byte = 0;
+        file.get(byte);
+        file.seekp(sizeof(IndexSegmentHeader));
+        file.put(static_cast<char>(byte ^ 0x40));
+    }
+    // The damaged segment is refused rather than searched.
+    CHECK(index.open(dir.path));
+    CHECK(index.segment_count() == 0);
+    CHECK(hits(index, "brown").empty());
+    index.close();
+}
+
+} // namespace
+
+int main() {
+    test_buffered_search();
+    test_segments_and_reopen();
+    test_remove();
+    test_damaged_postings();
+    return test_result();
+}
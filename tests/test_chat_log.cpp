@@ -0,0 +1,200 @@
+// Segmented chat log: reading back the latest messages, store() appending
+// only the new tail, resets, compaction of mostly-dead segments (keeping one
+// it cannot read to the end), and recovery from a torn record at the end of
+// the log.
+
+#include <iostream>
+#include <string>
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <vector>
+#include "../chat/chat_log.h"
+#include "test_util.h"
+
+namespace {
+
+std::vector<std::string> segments(const std::string &directory) {
+    std::vector<std::string> names;
+    for (const auto &entry : std::filesystem::directory_iterator(directory)) {
+        if (entry.path().extension() == ".log") {
+            names.push_back(entry.path().string());
+        }
+    }
+    std::sort(names.begin(), names.end());
+    return names;
+}
+
+std::string last_segment(const std::string &directory) {
+    std::vector<std::string> names = segments(directory);
+    return names.empty() ? std::string() : names.back();
+}
+
+void test_append_and_read() {
+    ScratchDir dir("test_chat_log_read");
+    ChatLog log;
+    CHECK(log.open(dir.path));
+    for (int i = 0; i < 10; ++i) {
+        CHECK(log.append("a", "message " + std::to_string(i)));
+    }
+    CHECK(log.append("b", "other"));
+    std::vector<ChatMessage> last = log.read_last("a", 3);
+    CHECK(last.size() == 3);
+    if (last.size() == 3) {
+        CHECK(last[0].text == "message 7" && last[2].text == "message 9");
+        CHECK(last[0].sequence + 2 == last[2].sequence);
+    }
+    CHECK(log.read_last("missing", 3).empty());
+    CHECK(log.chat_count() == 2);
+
+    CHECK(log.reset("a"));
+    CHECK(log.read_last("a", 3).empty());
+    CHECK(log.append("a", "after reset"));
+    CHECK(log.flush());
+    log.close();
+
+    CHECK(log.open(dir.path));
+    CHECK(log.read_all("a") == "after reset");
+    CHECK(log.read_all("b") == "other");
+    log.close();
+}
+
+void test_store() {
+    ScratchDir dir("test_chat_log_store");
+    ChatLog log;
+    CHECK(log.open(dir.path));
+    CHECK(log.store("c", "hello"));
+    CHECK(log.store("c", "hello world"));
+    uint64_t base = 0;
+    uint64_t next = 0;
+    CHECK(log.sequence_range("c", base, next));
+    // The extension went in as one more message rather than a rewrite.
+    CHECK(next - base == 2);
+    CHECK(log.read_all("c") == "hello world");
+
+    CHECK(log.store("c", "goodbye"));
+    CHECK(log.read_all("c") == "goodbye");
+    CHECK(log.store("c", ""));
+    CHECK(log.read_all("c").empty());
+    log.close();
+
+    // After a restart the stored content is only known once read back.
+    CHECK(log.open(dir.path));
+    CHECK(log.store("c", "again"));
+    CHECK(log.store("c", "again and more"));
+    CHECK(log.read_all("c") == "again and more");
+    log.close();
+}
+
+void test_compaction() {
+    ScratchDir dir("test_chat_log_compact");
+    ChatLogOptions options;
+    options.segment_bytes = 512;
+    ChatLog log;
+    CHECK(log.open(dir.path, options));
+    for (int i = 0; i < 40; ++i) {
+        CHECK(log.append("dead", std::string(40, 'x')));
+        if (i % 8 == 0) {
+            CHECK(log.append("live", "keep " + std::to_string(i)));
+        }
+    }
+    size_t before = log.segment_count();
+    CHECK(before > 3);
+    CHECK(log.reset("dead"));
+    log.compact();
+    CHECK(log.segment_count() < before);
+
+    std::vector<ChatMessage> live = log.read_last("live", 10);
+    CHECK(live.size() == 5);
+    if (live.size() == 5) {
+        CHECK(live[0].text == "keep 0" && live[4].text == "keep 32");
+    }
+    log.close();
+
+    CHECK(log.open(dir.path, options));
+    CHECK(log.read_last("live", 10).size() == 5);
+    CHECK(log.read_last("dead", 10).empty());
+    log.close();
+}
+
+void test_store_same_length() {
+    ScratchDir dir("test_chat_log_store_same");
+    ChatLog log;
+    CHECK(log.open(dir.path));
+    CHECK(log.store("s", "abcd"));
+    // Same length, different bytes: a rewrite, not a no-op.
+    CHECK(log.store("s", "abce"));
+    CHECK(log.read_all("s") == "abce");
+    CHECK(log.store("s", "abcefg"));
+    CHECK(log.read_all("s") == "abcefg");
+    log.close();
+}
+
+void test_compaction_keeps_damaged_segment() {
+    ScratchDir dir("test_chat_log_damaged");
+    ChatLogOptions options;
+    options.segment_bytes = 512;
+    ChatLog log;
+    CHECK(log.open(dir.path, options));
+    for (int i = 0; i < 40; ++i) {
+        CHECK(log.append("dead", std::string(40, 'x')));
+        if (i % 8 == 0) {
+            CHECK(log.append("live", "keep " + std::to_string(i)));
+        }
+    }
+    CHECK(log.reset("dead"));
+    CHECK(log.flush());
+    log.close();
+
+    // Damage the first record of the first segment, ahead of "keep 0".
+    std::string first = segments(dir.path).front();
+    {
+        std::fstream file(first, std::ios::binary | std::ios::in | std::ios::out);
+        file.seekp(sizeof(ChatRecordHeader) + 4);
+        file.put('y');
+    }
+    CHECK(log.open(dir.path, options));
+    log.compact();
+    CHECK(std::filesystem::exists(first));
+    std::vector<ChatMessage> live = log.read_last("live", 10);
+    CHECK(live.size() == 5);
+    if (live.size() == 5) {
+        CHECK(live[0].text == "keep 0");
+    }
+    log.close();
+}
+
+void test_torn_tail() {
+    ScratchDir dir("test_chat_log_torn");
+    ChatLog log;
+    CHECK(log.open(dir.path));
+    CHECK(log.append("t", "first"));
+    CHECK(log.append("t", "second"));
+    CHECK(log.flush());
+    log.close();
+
+    {
+        std::ofstream file(last_segment(dir.path), std::ios::binary | std::ios::app);
+        file.write("CLOG\x01\x02\x03", 7);
+    }
+    CHECK(log.open(dir.path));
+    CHECK(log.read_all("t") == "firstsecond");
+    CHECK(log.append("t", "third"));
+    log.close();
+
+    CHECK(log.open(dir.path));
+    CHECK(log.read_all("t") == "firstsecondthird");
+    log.close();
+}
+
+} // namespace
+
+int main() {
+    test_append_and_read();
+    test_store();
+    test_store_same_length();
+    test_compaction();
+    test_compaction_keeps_damaged_segment();
+    test_torn_tail();
+    return test_result();
+}
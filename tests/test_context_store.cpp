@@ -0,0 +1,319 @@
+// Encrypted context store: saves come back after reopening, an interrupted
+// save is dropped, a wrong key or a tampered or moved record is refused,
+// compaction keeps the content under a new file ID, and log records for a
+// file that has since been compacted are not replayed into it.
+
+#include <iostream>
+#include <string>
+#include <cstddef>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <vector>
+#include "../include/local_memory_storage.h"
+#include "../include/wal.h"
+#include "test_util.h"
+
+namespace {
+
+constexpr size_t kChunk = 64;
+constexpr size_t kSlot = sizeof(ContextRecordHeader) + kChunk;
+
+const unsigned char kKey[kContextKeyBytes] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
+const unsigned char kOtherKey[kContextKeyBytes] = {9, 9, 9};
+
+std::string text(size_t size, char seed) {
+    std::string out(size, '\0');
+    for (size_t i = 0; i < size; ++i) {
+        out[i] = static_cast<char>(seed + i % 23);
+    }
+    return out;
+}
+
+std::string read_file(const std::string &path) {
+    std::ifstream file(path, std::ios::binary);
+    return std::string((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+}
+
+void write_file(const std::string &path, const std::string &content) {
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file.write(content.data(), static_cast<std::streamsize>(content.size()));
+}
+
+std::string file_id(const std::string &path) {
+    return read_file(path).substr(offsetof(ContextFileHeader, file_id), 16);
+}
+
+// Opens path afresh and loads it; empty with ok false if either fails.
+std::string reload(const std::string &path, bool &ok,
+                   const unsigned char (&key)[kContextKeyBytes] = kKey) {
+    ContextStore store;
+    std::string context;
+    ok = store.open(path, key, kChunk) && store.load(context);
+    return context;
+}
+
+void test_round_trip() {
+    ScratchDir dir("test_context_round_trip");
+    std::string path = dir.path + "/context";
+    std::string first = text(200, 'a');
+    std::string tail = text(100, 'z');
+    {
+        ContextStore store;
+        CHECK(store.open(path, kKey, kChunk));
+        CHECK(store.save(first));
+        CHECK(store.records_written() == 4);
+        // Appending rewrites only the last, partial chunk and adds one.
+        CHECK(store.save(first + tail));
+        CHECK(store.records_written() == 6);
+        // Saving the same text writes nothing.
+        CHECK(store.save(first + tail));
+        CHECK(store.records_written() == 6);
+    }
+    bool ok = false;
+    CHECK(reload(path, ok) == first + tail);
+    CHECK(ok);
+
+    // Shrinking to a chunk boundary changes no chunk, only the length.
+    {
+        ContextStore store;
+        CHECK(store.open(path, kKey, kChunk));
+        CHECK(store.save(first.substr(0, 2 * kChunk)));
+    }
+    CHECK(reload(path, ok) == first.substr(0, 2 * kChunk));
+    CHECK(ok);
+    {
+        ContextStore store;
+        CHECK(store.open(path, kKey, kChunk));
+        CHECK(store.save(""));
+    }
+    CHECK(reload(path, ok).empty());
+    CHECK(ok);
+
+    // An existing file keeps its chunk size whatever open() is given.
+    {
+        ContextStore store;
+        CHECK(store.open(path, kKey, 4096));
+        CHECK(store.save(first));
+        CHECK(store.records_written() == 4);
+    }
+}
+
+void test_wrong_key() {
+    ScratchDir dir("test_context_key");
+    std::string path = dir.path + "/context";
+    {
+        ContextStore store;
+        CHECK(store.open(path, kKey, kChunk));
+        CHECK(store.save(text(100, 'k')));
+    }
+    bool ok = true;
+    CHECK(reload(path, ok, kOtherKey).empty());
+    CHECK(!ok);
+    CHECK(reload(path, ok) == text(100, 'k'));
+    CHECK(ok);
+}
+
+void test_interrupted_save() {
+    ScratchDir dir("test_context_torn");
+    std::string path = dir.path + "/context";
+    std::string before = text(3 * kChunk, 'b');
+    std::string after = text(3 * kChunk, 'B');
+    {
+        ContextStore store;
+        CHECK(store.open(path, kKey, kChunk));
+        CHECK(store.save(before));
+    }
+    size_t committed = read_file(path).size();
+
+    // Half a record after the last commit, as a crash mid-write leaves it.
+    write_file(path, read_file(path) + std::string(kSlot / 2, 'x'));
+    bool ok = false;
+    CHECK(reload(path, ok) == before);
+    CHECK(ok);
+    CHECK(read_file(path).size() == committed);
+
+    // A save of three chunks that lost its commit record: the two records
+    // that made it are complete but uncommitted, so they are dropped too.
+    {
+        ContextStore store;
+        CHECK(store.open(path, kKey, kChunk));
+        CHECK(store.save(after));
+    }
+    std::string full = read_file(path);
+    CHECK(full.size() == committed + 3 * kSlot);
+    write_file(path, full.substr(0, full.size() - kSlot));
+    CHECK(reload(path, ok) == before);
+    CHECK(ok);
+    CHECK(read_file(path).size() == committed);
+
+    // The next save takes their place.
+    {
+        ContextStore store;
+        CHECK(store.open(path, kKey, kChunk));
+        CHECK(store.save(after));
+    }
+    CHECK(reload(path, ok) == after);
+    CHECK(ok);
+}
+
+void test_tampering() {
+    ScratchDir dir("test_context_tamper");
+    std::string path = dir.path + "/context";
+    {
+        ContextStore store;
+        CHECK(store.open(path, kKey, kChunk));
+        CHECK(store.save(text(2 * kChunk, 't')));
+    }
+    std::string good = read_file(path);
+    size_t first_record = sizeof(ContextFileHeader);
+
+    std::string flipped = good;
+    flipped[first_record + sizeof(ContextRecordHeader) + 5] ^= 0x01;
+    write_file(path, flipped);
+    bool ok = true;
+    reload(path, ok);
+    CHECK(!ok);
+
+    write_file(path, good);
+    CHECK(reload(path, ok) == text(2 * kChunk, 't'));
+    CHECK(ok);
+}
+
+void test_moved_record() {
+    ScratchDir dir("test_context_moved");
+    std::string path = dir.path + "/context";
+    {
+        ContextStore store;
+        CHECK(store.open(path, kKey, kChunk));
+        CHECK(store.save(text(kChunk, '1')));
+        CHECK(store.save(text(kChunk, '2')));
+    }
+    // Two committed records of the same chunk, each intact; swapped, the
+    // older one sits in the newest slot and must fail, as its tag binds
+    // it to the slot it was written to.
+    std::string good = read_file(path);
+    size_t first_record = sizeof(ContextFileHeader);
+    CHECK(good.size() == first_record + 2 * kSlot);
+    std::string swapped = good;
+    swapped.replace(first_record, kSlot, good, first_record + kSlot, kSlot);
+    swapped.replace(first_record + kSlot, kSlot, good, first_record, kSlot);
+    write_file(path, swapped);
+    bool ok = true;
+    reload(path, ok);
+    CHECK(!ok);
+
+    write_file(path, good);
+    CHECK(reload(path, ok) == text(kChunk, '2'));
+    CHECK(ok);
+}
+
+// Saves that each change one chunk of a two-chunk context until the store
+// compacts; returns the last context saved.
+std::string save_until_compacted(ContextStore &store, const std::string &path, size_t chunk) {
+    std::string id = file_id(path);
+    std::string context = text(2 * chunk, 'c');
+    for (int round = 0; round < 64 && file_id(path) == id; ++round) {
+        context[round % 2 == 0 ? 0 : chunk] = static_cast<char>('A' + round % 26);
+        CHECK(store.save(context));
+    }
+    CHECK(file_id(path) != id);
+    return context;
+}
+
+void test_compaction() {
+    ScratchDir dir("test_context_compact");
+    std::string path = dir.path + "/context";
+    constexpr size_t kLargeChunk = 64 * 1024;
+    std::string context;
+    {
+        ContextStore store;
+        CHECK(store.open(path, kKey, kLargeChunk));
+        context = save_until_compacted(store, path, kLargeChunk);
+        // Only the live records are left.
+        CHECK(store.file_bytes() ==
+              sizeof(ContextFileHeader) + 2 * (sizeof(ContextRecordHeader) + kLargeChunk));
+        CHECK(!std::filesystem::exists(path + ".tmp"));
+        // The store goes on saving into the new file.
+        context += "more";
+        CHECK(store.save(context));
+    }
+    ContextStore store;
+    std::string loaded;
+    CHECK(store.open(path, kKey) && store.load(loaded));
+    CHECK(loaded == context);
+}
+
+void test_replay() {
+    ScratchDir dir("test_context_replay");
+    std::string path = dir.path + "/context";
+    std::string log_dir = dir.path + "/wal";
+    std::filesystem::create_directories(log_dir);
+    constexpr size_t kLargeChunk = 64 * 1024;
+
+    Wal wal;
+    CHECK(wal.open(log_dir));
+    std::string saved = text(100, 'r');
+    {
+        ContextStore store;
+        CHECK(store.open(path, kKey, kLargeChunk, &wal));
+        CHECK(store.save(saved));
+    }
+    std::vector<std::string> payloads;
+    auto collect = [&](uint16_t type, uint64_t, std::string_view payload) {
+        CHECK(type == kContextWalWrite);
+        payloads.push_back(std::string(payload));
+    };
+    wal.close();
+    CHECK(wal.open(log_dir, WalOptions(), collect));
+    CHECK(payloads.size() == 1);
+
+    // A write the file lost in a crash comes back from the log, and
+    // replaying it again changes nothing.
+    std::string full = read_file(path);
+    write_file(path, full.substr(0, sizeof(ContextFileHeader)));
+    for (int pass = 0; pass < 2 && !payloads.empty(); ++pass) {
+        CHECK(replay_context_record(payloads[0]));
+        CHECK(read_file(path) == full);
+    }
+    bool ok = false;
+    CHECK(reload(path, ok) == saved);
+    CHECK(ok);
+
+    // Once the file is compacted under a new ID, the old record must not
+    // be written over it.
+    std::string context;
+    {
+        ContextStore store;
+        CHECK(store.open(path, kKey, kLargeChunk, &wal));
+        context = save_until_compacted(store, path, kLargeChunk);
+    }
+    std::string compacted = read_file(path);
+    for (const std::string &payload : payloads) {
+        CHECK(replay_context_record(payload));
+    }
+    CHECK(read_file(path) == compacted);
+    CHECK(reload(path, ok) == context);
+    CHECK(ok);
+
+    // Nor into a file that is gone.
+    std::filesystem::remove(path);
+    for (const std::string &payload : payloads) {
+        CHECK(replay_context_record(payload));
+    }
+    CHECK(!std::filesystem::exists(path));
+    wal.close();
+}
+
+} // namespace
+
+int main() {
+    test_round_trip();
+    test_wrong_key();
+    test_interrupted_save();
+    test_tampering();
+    test_moved_record();
+    test_compaction();
+    test_replay();
+    return test_result();
+}
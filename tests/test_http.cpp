@@ -0,0 +1,179 @@
+// Edge cases of the incremental HTTP/1.1 request parser: requests split over
+// reads, pipelining, both body framings, and the framing combinations that
+// must be refused because front ends could read them differently.
+
+#include <iostream>
+#include <string>
+#include <string_view>
+#include "../include/http.h"
+#include "test_util.h"
+
+namespace {
+
+struct Parsed {
+    HttpParseResult result;
+    HttpRequest request;
+    size_t consumed = 0;
+};
+
+Parsed parse(std::string &buffer, HttpParser &parser) {
+    Parsed parsed;
+    parsed.result = parser.parse(buffer, 0, parsed.request, parsed.consumed);
+    return parsed;
+}
+
+Parsed parse(std::string text) {
+    static std::string buffer;
+    buffer = std::move(text);
+    HttpParser parser;
+    return parse(buffer, parser);
+}
+
+void test_simple_get() {
+    Parsed parsed = parse("GET /search?q=hello&limit=5 HTTP/1.1\r\nHost: x\r\n\r\n");
+    CHECK(parsed.result == HttpParseResult::Complete);
+    CHECK(parsed.request.method == "GET");
+    CHECK(parsed.request.path == "/search");
+    CHECK(parsed.request.query == "q=hello&limit=5");
+    CHECK(parsed.request.header("host") == "x");
+    CHECK(parsed.request.keep_alive);
+    CHECK(parsed.request.body.empty());
+}
+
+void test_http10_and_connection() {
+    CHECK(!parse("GET / HTTP/1.0\r\n\r\n").request.keep_alive);
+    CHECK(parse("GET / HTTP/1.0\r\nConnection: keep-alive\r\n\r\n").request.keep_alive);
+    CHECK(!parse("GET / HTTP/1.1\r\nConnection: close\r\n\r\n").request.keep_alive);
+    CHECK(parse("GET / HTTP/2.0\r\n\r\n").result == HttpParseResult::Error);
+    CHECK(parse("GET /\r\n\r\n").result == HttpParseResult::Error);
+    CHECK(parse("GET / HTTP/1.1\r\nHost : x\r\n\r\n").result == HttpParseResult::Error);
+    CHECK(parse("GET / HTTP/1.1\r\nNoColon\r\n\r\n").result == HttpParseResult::Error);
+}
+
+void test_split_reads() {
+    std::string whole = "POST /chat HTTP/1.1\r\nContent-Length: 5\r\n\r\nhello";
+    std::string buffer;
+    HttpParser parser;
+    for (size_t i = 0; i < whole.size(); ++i) {
+        buffer.push_back(whole[i]);
+        Parsed parsed = parse(buffer, parser);
+        if (i + 1 < whole.size()) {
+            CHECK(parsed.result == HttpParseResult::Incomplete);
+        } else {
+            CHECK(parsed.result == HttpParseResult::Complete);
+            CHECK(parsed.request.body == "hello");
+            CHECK(parsed.consumed == whole.size());
+        }
+    }
+}
+
+void test_pipelining() {
+    std::string buffer = "GET /a HTTP/1.1\r\n\r\n\r\nGET /b HTTP/1.1\r\n\r\n";
+    HttpParser parser;
+    Parsed first = parse(buffer, parser);
+    CHECK(first.result == HttpParseResult::Complete);
+    CHECK(first.request.path == "/a");
+
+    HttpRequest second;
+    size_t consumed = 0;
+    parser.reset();
+    CHECK(parser.parse(buffer, first.consumed, second, consumed) == HttpParseResult::Complete);
+    CHECK(second.path == "/b");
+    CHECK(first.consumed + consumed == buffer.size());
+}
+
+void test_content_length() {
+    CHECK(parse("POST / HTTP/1.1\r\nContent-Length: 3\r\nContent-Length: 3\r\n\r\nabc")
+              .result == HttpParseResult::Complete);
+    CHECK(parse("POST / HTTP/1.1\r\nContent-Length: 3\r\nContent-Length: 4\r\n\r\nabcd")
+              .result == HttpParseResult::Error);
+    CHECK(parse("POST / HTTP/1.1\r\nContent-Length: 3x\r\n\r\nabc").result ==
+          HttpParseResult::Error);
+    CHECK(parse("POST / HTTP/1.1\r\nContent-Length: -1\r\n\r\n").result ==
+          HttpParseResult::Error);
+
+    std::string buffer = "POST / HTTP/1.1\r\nContent-Length: 100\r\n\r\n";
+    HttpParser parser;
+    parser.set_limits(kMaxHttpHeaderBytes, 10);
+    CHECK(parse(buffer, parser).result == HttpParseResult::BodyTooLarge);
+}
+
+void test_header_limit() {
+    std::string buffer = "GET / HTTP/1.1\r\nX: " + std::string(200, 'a');
+    HttpParser parser;
+    parser.set_limits(64, kMaxHttpBodyBytes);
+    CHECK(parse(buffer, parser).result == HttpParseResult::HeaderTooLarge);
+}
+
+void test_chunked() {
+    Parsed parsed = parse("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+                          "5\r\nhello\r\n"
+                          "6 ; name=value\r\n world\r\n"
+                          "0\r\nTrailer: x\r\n\r\n");
+    CHECK(parsed.result == HttpParseResult::Complete);
+    CHECK(parsed.request.chunked);
+    CHECK(parsed.request.body == "hello world");
+
+    // Whitespace around the size is accepted by both passes alike.
+    parsed = parse("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+                   " a \r\n0123456789\r\n0\r\n\r\n");
+    CHECK(parsed.result == HttpParseResult::Complete);
+    CHECK(parsed.request.body == "0123456789");
+
+    CHECK(parse("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nhel")
+              .result == HttpParseResult::Incomplete);
+    CHECK(parse("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\nzz\r\n")
+              .result == HttpParseResult::Error);
+    CHECK(parse("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n3\r\nabcd\r\n")
+              .result == HttpParseResult::Error);
+}
+
+void test_framing_conflicts() {
+    CHECK(parse("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\nContent-Length: 5\r\n\r\n"
+                "0\r\n\r\n")
+              .result == HttpParseResult::Error);
+    // A final coding other than chunked leaves the length unknown.
+    CHECK(parse("POST / HTTP/1.1\r\nTransfer-Encoding: chunked, gzip\r\n\r\n").result ==
+          HttpParseResult::Error);
+    CHECK(parse("POST / HTTP/1.1\r\nTransfer-Encoding: gzip\r\n\r\n").result ==
+          HttpParseResult::Error);
+    CHECK(parse("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n"
+                "Transfer-Encoding: identity\r\n\r\n")
+              .result == HttpParseResult::Error);
+    CHECK(parse("POST / HTTP/1.1\r\nTransfer-Encoding: gzip, chunked\r\n\r\n0\r\n\r\n")
+              .result == HttpParseResult::Complete);
+}
+
+void test_header_tokens() {
+    CHECK(http_header_has_token("keep-alive, Upgrade", "upgrade"));
+    CHECK(!http_header_has_token("upgrades", "upgrade"));
+    CHECK(!http_header_has_token("", "close"));
+}
+
+void test_query_params() {
+    std::string value;
+    CHECK(http_query_param("q=hello&limit=5", "limit", value) && value == "5");
+    CHECK(http_query_param("limit=3&limit=9", "limit", value) && value == "3");
+    CHECK(http_query_param("q=a+b%2Fc&x", "q", value) && value == "a b/c");
+    CHECK(http_query_param("q=a&x", "x", value) && value.empty());
+    CHECK(!http_query_param("q=hello&xlimit=5", "limit", value));
+    CHECK(!http_query_param("", "limit", value));
+    CHECK(!http_query_param("q=%2", "q", value));
+    CHECK(!http_query_param("q=%zz", "q", value));
+}
+
+} // namespace
+
+int main() {
+    test_simple_get();
+    test_http10_and_connection();
+    test_split_reads();
+    test_pipelining();
+    test_content_length();
+    test_header_limit();
+    test_chunked();
+    test_framing_conflicts();
+    test_header_tokens();
+    test_query_params();
+    return test_result();
+}
@@ -0,0 +1,252 @@
+// Paged KV cache and prefix cache: forked sequences copy a shared block
+// only when they write to it, spilled blocks come back unchanged, prefix
+// hits share blocks without letting the new sequence write into them, and
+// evicting a leaf lets its parent go too.
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include "../include/inference.h"
+#include "../include/kv_cache.h"
+#include "../include/prefix_cache.h"
+#include "test_util.h"
+
+namespace {
+
+constexpr size_t kLayers = 2;
+constexpr size_t kKvDim = 4;
+constexpr size_t kBlockTokens = 4;
+
+KvCacheOptions options(size_t budget_blocks, const std::string &spill_dir = "") {
+    KvCacheOptions options;
+    options.layers = kLayers;
+    options.kv_dim = kKvDim;
+    options.block_tokens = kBlockTokens;
+    options.memory_budget = budget_blocks * 2 * kBlockTokens * kKvDim * sizeof(float);
+    options.spill_dir = spill_dir;
+    return options;
+}
+
+ModelConfig model_config() {
+    ModelConfig config;
+    config.layers = kLayers;
+    config.kv_heads = 1;
+    config.head_dim = kKvDim;
+    return config;
+}
+
+// Fills block id with values derived from seed.
+void fill(KvBlockPool &pool, uint32_t id, float seed) {
+    float *data = nullptr;
+    CHECK(pool.pin(std::span<const uint32_t>(&id, 1), &data, 0));
+    for (size_t i = 0; i < pool.block_floats(); ++i) {
+        data[i] = seed + static_cast<float>(i);
+    }
+    pool.unpin(std::span<const uint32_t>(&id, 1));
+}
+
+// Whether block id still holds what fill(pool, id, seed) put there.
+bool holds(KvBlockPool &pool, uint32_t id, float seed) {
+    float *data = nullptr;
+    if (!pool.pin(std::span<const uint32_t>(&id, 1), &data, pool.block_floats())) {
+        return false;
+    }
+    bool same = true;
+    for (size_t i = 0; i < pool.block_floats(); ++i) {
+        same = same && data[i] == seed + static_cast<float>(i);
+    }
+    pool.unpin(std::span<const uint32_t>(&id, 1));
+    return same;
+}
+
+void fill_block(KvSequence &sequence, size_t block, float seed) {
+    for (size_t l = 0; l < kLayers; ++l) {
+        fill(sequence.pool(), sequence.blocks(l)[block], seed + 1000 * l + 100 * block);
+    }
+}
+
+void fill_sequence(KvSequence &sequence, float seed) {
+    for (size_t b = 0; b < sequence.blocks(0).size(); ++b) {
+        fill_block(sequence, b, seed);
+    }
+}
+
+bool sequence_holds(const KvSequence &sequence, size_t block, float seed) {
+    bool same = true;
+    for (size_t l = 0; l < kLayers; ++l) {
+        same = same && holds(sequence.pool(), sequence.blocks(l)[block],
+                             seed + 1000 * l + 100 * block);
+    }
+    return same;
+}
+
+void test_fork_copy_on_write() {
+    KvBlockPool pool;
+    CHECK(pool.init(options(64)));
+    KvSequence original(pool);
+    CHECK(original.prepare(0, 2 * kBlockTokens));
+    fill_sequence(original, 1);
+
+    KvSequence forked = original.fork();
+    CHECK(pool.stats().shared == 2 * kLayers);
+
+    // Writing the fork's second block gives it a copy in every layer; the
+    // first block stays shared.
+    std::vector<uint32_t> before(original.blocks(0).begin(), original.blocks(0).end());
+    CHECK(forked.prepare(kBlockTokens + 1, 1));
+    CHECK(forked.blocks(0)[0] == original.blocks(0)[0]);
+    CHECK(forked.blocks(0)[1] != original.blocks(0)[1]);
+    CHECK(original.blocks(0)[1] == before[1]);
+    CHECK(pool.stats().shared == kLayers);
+    CHECK(sequence_holds(forked, 1, 1));
+
+    fill_block(forked, 1, 50);
+    CHECK(sequence_holds(original, 1, 1));
+    CHECK(sequence_holds(forked, 1, 50));
+    CHECK(sequence_holds(original, 0, 1));
+
+    // A block that is no longer shared is written in place.
+    uint32_t own = original.blocks(0)[1];
+    CHECK(original.prepare(kBlockTokens, 1));
+    CHECK(original.blocks(0)[1] == own);
+}
+
+void test_spill_reload() {
+    ScratchDir dir("test_kv_cache");
+    KvBlockPool pool;
+    CHECK(pool.init(options(2, dir.path)));
+    std::vector<uint32_t> ids;
+    for (int i = 0; i < 6; ++i) {
+        uint32_t id = pool.allocate();
+        CHECK(id != KvBlockPool::kNoBlock);
+        fill(pool, id, 10.0f * i);
+        ids.push_back(id);
+    }
+    CHECK(pool.stats().spills >= 4);
+    CHECK(pool.stats().resident <= 2);
+    for (size_t i = 0; i < ids.size(); ++i) {
+        CHECK(holds(pool, ids[i], 10.0f * i));
+    }
+    CHECK(pool.stats().reloads >= 4);
+    // Twice through, so blocks that were read but not written come back
+    // from their earlier spill.
+    for (size_t i = 0; i < ids.size(); ++i) {
+        CHECK(holds(pool, ids[i], 10.0f * i));
+    }
+    // More than the budget cannot be pinned at once.
+    float *data[3];
+    CHECK(!pool.pin(std::span<const uint32_t>(ids.data(), 3), data, 0));
+    for (uint32_t id : ids) {
+        pool.release(id);
+    }
+    CHECK(pool.stats().blocks == 0);
+
+    // Without a spill directory the budget is a hard limit.
+    KvBlockPool bounded;
+    CHECK(bounded.init(options(2)));
+    uint32_t first = bounded.allocate();
+    uint32_t second = bounded.allocate();
+    CHECK(first != KvBlockPool::kNoBlock && second != KvBlockPool::kNoBlock);
+    CHECK(bounded.allocate() == KvBlockPool::kNoBlock);
+}
+
+std::vector<uint32_t> token_range(uint32_t first, size_t count) {
+    std::vector<uint32_t> tokens;
+    for (size_t i = 0; i < count; ++i) {
+        tokens.push_back(first + static_cast<uint32_t>(i));
+    }
+    return tokens;
+}
+
+void test_prefix_hit() {
+    KvBlockPool pool;
+    CHECK(pool.init(options(64)));
+    ModelConfig config = model_config();
+    size_t node_bytes = kLayers * pool.block_floats() * sizeof(float);
+    PrefixCache cache(pool, 16 * node_bytes);
+
+    std::vector<uint32_t> tokens = token_range(100, 2 * kBlockTokens);
+    {
+        InferenceState state(config, pool, 64);
+        CHECK(state.blocks().prepare(0, tokens.size()));
+        fill_sequence(state.blocks(), 7);
+        state.adopt_prefix(tokens.size());
+        cache.insert(tokens, state);
+    }
+    CHECK(cache.stats().nodes == 2);
+
+    // The whole prompt is cached, but its last token is left to compute.
+    InferenceState state(config, pool, 64);
+    CHECK(cache.lookup(tokens, state) == tokens.size() - 1);
+    CHECK(state.position() == tokens.size() - 1);
+    CHECK(state.blocks().blocks(0).size() == 2);
+
+    // Writing that last token must land in a copy of the cached block.
+    CHECK(state.blocks().prepare(state.position(), 1));
+    fill_block(state.blocks(), 1, 900);
+    InferenceState again(config, pool, 64);
+    CHECK(cache.lookup(tokens, again) == tokens.size() - 1);
+    CHECK(sequence_holds(again.blocks(), 0, 7));
+    CHECK(sequence_holds(again.blocks(), 1, 7));
+
+    std::vector<uint32_t> longer = tokens;
+    longer.push_back(1);
+    longer.push_back(2);
+    InferenceState extended(config, pool, 64);
+    CHECK(cache.lookup(longer, extended) == tokens.size());
+
+    std::vector<uint32_t> diverging = token_range(100, kBlockTokens);
+    diverging.insert(diverging.end(), {1, 2, 3, 4, 5});
+    InferenceState partial(config, pool, 64);
+    CHECK(cache.lookup(diverging, partial) == kBlockTokens);
+
+    InferenceState miss(config, pool, 64);
+    CHECK(cache.lookup(token_range(5, 2 * kBlockTokens), miss) == 0);
+    CHECK(cache.stats().hits == 4);
+    CHECK(cache.stats().misses == 1);
+}
+
+void test_prefix_eviction() {
+    KvBlockPool pool;
+    CHECK(pool.init(options(64)));
+    ModelConfig config = model_config();
+    size_t node_bytes = kLayers * pool.block_floats() * sizeof(float);
+    PrefixCache cache(pool, node_bytes);
+
+    auto insert = [&](const std::vector<uint32_t> &tokens) {
+        InferenceState state(config, pool, 64);
+        CHECK(state.blocks().prepare(0, tokens.size()));
+        state.adopt_prefix(tokens.size());
+        cache.insert(tokens, state);
+    };
+    // Only one node fits: a two-block prefix keeps its first block, since
+    // a node with children is never evicted.
+    std::vector<uint32_t> old_prefix = token_range(100, 2 * kBlockTokens);
+    insert(old_prefix);
+    CHECK(cache.stats().nodes == 1);
+    CHECK(cache.stats().evictions == 1);
+    InferenceState state(config, pool, 64);
+    CHECK(cache.lookup(old_prefix, state) == kBlockTokens);
+    state.reset();
+
+    // With its child gone that node is a leaf, and goes for the next one.
+    std::vector<uint32_t> new_prefix = token_range(200, kBlockTokens + 1);
+    insert(new_prefix);
+    PrefixCache::Stats stats = cache.stats();
+    CHECK(stats.nodes == 1);
+    CHECK(stats.evictions == 2);
+    CHECK(stats.bytes == node_bytes);
+    CHECK(pool.stats().blocks == kLayers);
+    CHECK(cache.lookup(old_prefix, state) == 0);
+    CHECK(cache.lookup(new_prefix, state) == kBlockTokens);
+}
+
+} // namespace
+
+int main() {
+    test_fork_copy_on_write();
+    test_spill_reload();
+    test_prefix_hit();
+    test_prefix_eviction();
+    return test_result();
+}
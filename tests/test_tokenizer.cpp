@@ -0,0 +1,174 @@
+// Byte-level BPE: merges follow the vocabulary's ranks whether a piece takes
+// the linear or the heap path, and a TokenStream fed any split of the input
+// gives the same IDs as tokenizing it whole.
+
+#include <iostream>
+#include <string>
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <string_view>
+#include <vector>
+#include "../include/tokenizer.h"
+#include "test_util.h"
+
+namespace {
+
+// Multi-byte tokens of the test vocabulary, by ID after the 256 bytes.
+const char *const kMerges[] = {"ab", "abab", "ba", "aab", "abababab", "ca", "cab", " ab", "ll",
+                               "'s", "12"};
+
+std::string base64(std::string_view data) {
+    static const char kDigits[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    for (size_t i = 0; i < data.size(); i += 3) {
+        size_t count = std::min<size_t>(3, data.size() - i);
+        uint32_t v = 0;
+        for (size_t k = 0; k < 3; ++k) {
+            v = (v << 8) | (k < count ? static_cast<uint8_t>(data[i + k]) : 0);
+        }
+        for (size_t k = 0; k < 4; ++k) {
+            out.push_back(k <= count ? kDigits[(v >> (18 - 6 * k)) & 63] : '=');
+        }
+    }
+    return out;
+}
+
+void write_vocabulary(const std::string &path) {
+    std::ofstream file(path);
+    for (int b = 0; b < 256; ++b) {
+        file << base64(std::string(1, static_cast<char>(b))) << " " << b << "\n";
+    }
+    uint32_t id = 256;
+    for (const char *token : kMerges) {
+        file << base64(token) << " " << id++ << "\n";
+    }
+}
+
+// Textbook BPE on one piece: merge the leftmost lowest-ranked adjacent
+// pair that forms a token, until none does.
+std::vector<uint32_t> reference_bpe(std::string_view piece) {
+    std::map<std::string, uint32_t> ranks;
+    for (int b = 0; b < 256; ++b) {
+        ranks[std::string(1, static_cast<char>(b))] = b;
+    }
+    uint32_t id = 256;
+    for (const char *token : kMerges) {
+        ranks[token] = id++;
+    }
+    std::vector<std::string> parts;
+    for (char c : piece) {
+        parts.emplace_back(1, c);
+    }
+    while (parts.size() > 1) {
+        size_t best = parts.size();
+        uint32_t best_rank = ~0u;
+        for (size_t i = 0; i + 1 < parts.size(); ++i) {
+            auto rank = ranks.find(parts[i] + parts[i + 1]);
+            if (rank != ranks.end() && rank->second < best_rank) {
+                best = i;
+                best_rank = rank->second;
+            }
+        }
+        if (best == parts.size()) {
+            break;
+        }
+        parts[best] += parts[best + 1];
+        parts.erase(parts.begin() + best + 1);
+    }
+    std::vector<uint32_t> ids;
+    for (const std::string &part : parts) {
+        ids.push_back(ranks[part]);
+    }
+    return ids;
+}
+
+std::vector<uint32_t> stream_chunks(const Tokenizer &tokenizer,
+                                    const std::vector<std::string_view> &chunks) {
+    TokenStream stream(tokenizer);
+    std::vector<uint32_t> ids;
+    for (std::string_view chunk : chunks) {
+        stream.feed(chunk, ids);
+    }
+    stream.finish(ids);
+    return ids;
+}
+
+void test_merge_paths(const Tokenizer &tokenizer) {
+    // A single run of letters is one piece, so its IDs are exactly the
+    // merges; pieces up to 16 bytes take the linear path, longer ones the
+    // heap, and both must agree with the reference.
+    for (const std::string unit : {"ab", "aab", "abc", "cab", "ba", "abba"}) {
+        std::string piece;
+        while (piece.size() < 48) {
+            piece += unit;
+            CHECK(tokenizer.tokenize(piece) == reference_bpe(piece));
+        }
+    }
+    std::string mixed = "caabababababbaabcabab";
+    for (size_t size = 1; size <= mixed.size(); ++size) {
+        std::string piece = mixed.substr(0, size);
+        CHECK(tokenizer.tokenize(piece) == reference_bpe(piece));
+    }
+    CHECK(tokenizer.decode(tokenizer.tokenize(mixed)) == mixed);
+}
+
+void test_pieces(const Tokenizer &tokenizer) {
+    // "it", "'s", " ab" and " ll", where " l" is no token, so that space
+    // stays a byte.
+    std::vector<uint32_t> expected = {'i', 't', 265, 263, ' ', 264};
+    CHECK(tokenizer.tokenize("it's ab ll") == expected);
+}
+
+void test_stream_splits(const Tokenizer &tokenizer) {
+    const std::string text = "ab's abababab, cab  aab\n\t1234 ababababababababab!! it'll"
+                             " caab   ba'";
+    std::vector<uint32_t> whole = tokenizer.tokenize(text);
+    CHECK(tokenizer.decode(whole) == text);
+    for (size_t i = 0; i <= text.size(); ++i) {
+        std::string_view view(text);
+        CHECK(stream_chunks(tokenizer, {view.substr(0, i), view.substr(i)}) == whole);
+        for (size_t j = i; j <= text.size(); j += 7) {
+            CHECK(stream_chunks(tokenizer, {view.substr(0, i), view.substr(i, j - i),
+                                            view.substr(j)}) == whole);
+        }
+    }
+    std::vector<std::string_view> bytes;
+    for (size_t i = 0; i < text.size(); ++i) {
+        bytes.push_back(std::string_view(text).substr(i, 1));
+    }
+    CHECK(stream_chunks(tokenizer, bytes) == whole);
+}
+
+void test_stream_cache(const Tokenizer &tokenizer) {
+    // Enough input in one feed for the piece cache, against small chunks
+    // that never allocate it.
+    std::string text;
+    while (text.size() < 40 * 1024) {
+        text += "cab aab abab ba's 12 ll, abababab caab ";
+    }
+    std::vector<uint32_t> whole = tokenizer.tokenize(text);
+    std::vector<std::string_view> chunks;
+    for (size_t i = 0; i < text.size(); i += 1000) {
+        chunks.push_back(std::string_view(text).substr(i, 1000));
+    }
+    CHECK(stream_chunks(tokenizer, chunks) == whole);
+    CHECK(tokenizer.decode(whole) == text);
+}
+
+} // namespace
+
+int main() {
+    ScratchDir dir("test_tokenizer");
+    std::string path = dir.path + "/vocab.tiktoken";
+    write_vocabulary(path);
+    Tokenizer tokenizer;
+    CHECK(tokenizer.load(path));
+    CHECK(tokenizer.vocab_size() == 256 + sizeof(kMerges) / sizeof(kMerges[0]));
+    test_merge_paths(tokenizer);
+    test_pieces(tokenizer);
+    test_stream_splits(tokenizer);
+    test_stream_cache(tokenizer);
+    return test_result();
+}
@@ -0,0 +1,52 @@
+#ifndef TEST_UTIL_H
+#define TEST_UTIL_H
+
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+
+// Minimal checks for the unit tests, which are plain executables run by
+// ctest: a failed CHECK reports where it failed and the test goes on, then
+// test_result() turns any failure into a non-zero exit status.
+inline int test_failures = 0;
+
+#define CHECK(condition)                                                                   \
+    do {                                                                                   \
+        if (!(condition)) {                                                                \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #condition ") failed"   \
+                      << std::endl;                                                        \
+            ++test_failures;                                                               \
+        }                                                                                  \
+    } while (0)
+
+inline int test_result() {
+    if (test_failures > 0) {
+        std::cerr << test_failures << " check(s) failed" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+// An empty directory under TMPDIR, removed with everything in it when the
+// test is done.
+class ScratchDir {
+public:
+    explicit ScratchDir(const std::string &name) {
+        const char *temp = std::getenv("TMPDIR");
+        path = std::string(temp ? temp : "/tmp") + "/" + name + "." + std::to_string(getpid());
+        std::filesystem::remove_all(path);
+        std::filesystem::create_directories(path);
+    }
+    ~ScratchDir() {
+        std::error_code error;
+        std::filesystem::remove_all(path, error);
+    }
+    ScratchDir(const ScratchDir &) = delete;
+    ScratchDir &operator=(const ScratchDir &) = delete;
+
+    std::string path;
+};
+
+#endif // TEST_UTIL_H
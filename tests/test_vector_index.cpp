@@ -0,0 +1,88 @@
+// HNSW vector index: nearest matches, removal, and that open() accepts a
+// saved index but refuses one whose links point outside it.
+
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <vector>
+#include "../include/vector_index.h"
+#include "test_util.h"
+
+namespace {
+
+constexpr size_t kDim = 16;
+constexpr size_t kCount = 300;
+
+std::vector<float> random_vector(std::mt19937 &rng) {
+    std::normal_distribution<float> normal;
+    std::vector<float> vector(kDim);
+    for (float &value : vector) {
+        value = normal(rng);
+    }
+    return vector;
+}
+
+void fill(HnswIndex &index, std::vector<std::vector<float>> &vectors) {
+    std::mt19937 rng(7);
+    index.init(kDim);
+    for (size_t i = 0; i < kCount; ++i) {
+        vectors.push_back(random_vector(rng));
+        CHECK(index.insert(i, vectors.back().data(), kDim));
+    }
+}
+
+void test_search_and_remove() {
+    HnswIndex index;
+    std::vector<std::vector<float>> vectors;
+    fill(index, vectors);
+    CHECK(index.size() == kCount);
+    std::vector<HnswMatch> matches = index.search(vectors[42].data(), kDim, 3);
+    CHECK(!matches.empty() && matches[0].key == 42 && matches[0].similarity > 0.999f);
+    CHECK(index.remove(42));
+    matches = index.search(vectors[42].data(), kDim, 3);
+    CHECK(!matches.empty() && matches[0].key != 42);
+    std::vector<float> zeros(kDim);
+    CHECK(!index.insert(1000, zeros.data(), kDim));
+    CHECK(!index.insert(1000, vectors[0].data(), kDim - 1));
+}
+
+void test_save_and_open() {
+    ScratchDir dir("test_vector_index_open");
+    std::string path = dir.path + "/index";
+    HnswIndex index;
+    std::vector<std::vector<float>> vectors;
+    fill(index, vectors);
+    CHECK(index.save(path));
+
+    HnswIndex opened;
+    CHECK(opened.open(path));
+    CHECK(opened.mapped() && opened.size() == kCount);
+    std::vector<HnswMatch> matches = opened.search(vectors[7].data(), kDim, 1);
+    CHECK(!matches.empty() && matches[0].key == 7);
+
+    // Point node 0's first neighbour past the last node. The header
+    // checksum does not cover the links, so only the graph check sees it.
+    HnswFileHeader header;
+    {
+        std::ifstream file(path, std::ios::binary);
+        file.read(reinterpret_cast<char *>(&header), sizeof(header));
+    }
+    {
+        std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+        uint32_t bad = kCount + 5;
+        file.seekp(static_cast<std::streamoff>(header.links_offset + sizeof(uint32_t)));
+        file.write(reinterpret_cast<const char *>(&bad), sizeof(bad));
+    }
+    HnswIndex damaged;
+    CHECK(!damaged.open(path));
+}
+
+} // namespace
+
+int main() {
+    test_search_and_remove();
+    test_save_and_open();
+    return test_result();
+}
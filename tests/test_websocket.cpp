@@ -0,0 +1,196 @@
+// WebSocket framing: the opening handshake key, unmasking, reassembly of
+// fragmented messages, inline control frames and the close codes sent for
+// protocol errors and malformed text.
+
+#include <iostream>
+#include <string>
+#include <string_view>
+#include "../include/websocket.h"
+#include "test_util.h"
+
+namespace {
+
+// A masked client frame, as browsers send them.
+std::string client_frame(WebSocketOpcode opcode, std::string_view payload, bool fin = true,
+                         bool masked = true) {
+    std::string frame;
+    frame.push_back(static_cast<char>((fin ? 0x80 : 0x00) | static_cast<uint8_t>(opcode)));
+    uint8_t mask_bit = masked ? 0x80 : 0x00;
+    if (payload.size() < 126) {
+        frame.push_back(static_cast<char>(mask_bit | payload.size()));
+    } else {
+        frame.push_back(static_cast<char>(mask_bit | 126));
+        frame.push_back(static_cast<char>(payload.size() >> 8));
+        frame.push_back(static_cast<char>(payload.size()));
+    }
+    const uint8_t mask[4] = {0x12, 0x34, 0x56, 0x78};
+    if (masked) {
+        frame.append(reinterpret_cast<const char *>(mask), 4);
+    }
+    for (size_t i = 0; i < payload.size(); ++i) {
+        frame.push_back(masked ? static_cast<char>(payload[i] ^ mask[i & 3]) : payload[i]);
+    }
+    return frame;
+}
+
+// The close code of the close frame at the start of out, or 0.
+uint16_t close_code(std::string_view out) {
+    if (out.size() < 4 || static_cast<uint8_t>(out[0]) != 0x88) {
+        return 0;
+    }
+    return static_cast<uint16_t>((static_cast<uint8_t>(out[2]) << 8) |
+                                 static_cast<uint8_t>(out[3]));
+}
+
+void test_accept_key() {
+    // The example of RFC 6455 1.3.
+    CHECK(websocket_accept_key("dGhlIHNhbXBsZSBub25jZQ==") == "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=");
+}
+
+void test_unmask() {
+    const uint8_t mask[4] = {1, 2, 3, 4};
+    std::string data(77, '\0');
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = static_cast<char>(i);
+    }
+    std::string masked = data;
+    websocket_unmask(masked.data(), masked.size(), mask);
+    for (size_t i = 0; i < data.size(); ++i) {
+        CHECK(masked[i] == static_cast<char>(data[i] ^ mask[i & 3]));
+    }
+    websocket_unmask(masked.data(), masked.size(), mask);
+    CHECK(masked == data);
+}
+
+void test_single_message() {
+    Connection conn;
+    WebSocketReader reader;
+    conn.in = client_frame(WebSocketOpcode::Text, "hello");
+    WebSocketOpcode opcode;
+    std::string_view message;
+    CHECK(reader.next(conn, opcode, message) == WebSocketReader::Status::Message);
+    CHECK(opcode == WebSocketOpcode::Text);
+    CHECK(message == "hello");
+    CHECK(reader.next(conn, opcode, message) == WebSocketReader::Status::Incomplete);
+    CHECK(conn.input().empty());
+}
+
+void test_partial_frame() {
+    Connection conn;
+    WebSocketReader reader;
+    std::string frame = client_frame(WebSocketOpcode::Binary, std::string(300, 'x'));
+    conn.in = frame.substr(0, 100);
+    WebSocketOpcode opcode;
+    std::string_view message;
+    CHECK(reader.next(conn, opcode, message) == WebSocketReader::Status::Incomplete);
+    conn.in.append(frame.substr(100));
+    CHECK(reader.next(conn, opcode, message) == WebSocketReader::Status::Message);
+    CHECK(opcode == WebSocketOpcode::Binary);
+    CHECK(message == std::string(300, 'x'));
+}
+
+void test_fragments_and_ping() {
+    Connection conn;
+    WebSocketReader reader;
+    // A ping between fragments is answered without disturbing reassembly;
+    // the euro sign is split across the two fragments.
+    conn.in = client_frame(WebSocketOpcode::Text, "price \xE2\x82", false) +
+              client_frame(WebSocketOpcode::Ping, "p") +
+              client_frame(WebSocketOpcode::Continuation, "\xAC 5", true);
+    WebSocketOpcode opcode;
+    std::string_view message;
+    CHECK(reader.next(conn, opcode, message) == WebSocketReader::Status::Message);
+    CHECK(opcode == WebSocketOpcode::Text);
+    CHECK(message == "price \xE2\x82\xAC 5");
+    std::string pong;
+    websocket_write_frame(pong, WebSocketOpcode::Pong, "p");
+    CHECK(conn.out == pong);
+}
+
+void test_close_handshake() {
+    Connection conn;
+    WebSocketReader reader;
+    conn.in = client_frame(WebSocketOpcode::Close, std::string("\x03\xE8", 2));
+    WebSocketOpcode opcode;
+    std::string_view message;
+    CHECK(reader.next(conn, opcode, message) == WebSocketReader::Status::Closed);
+    CHECK(close_code(conn.out) == 1000);
+    CHECK(conn.close_after_write);
+}
+
+uint16_t fail_code(const std::string &input) {
+    Connection conn;
+    WebSocketReader reader;
+    conn.in = input;
+    WebSocketOpcode opcode;
+    std::string_view message;
+    if (reader.next(conn, opcode, message) != WebSocketReader::Status::Closed ||
+        !conn.close_after_write) {
+        return 0;
+    }
+    return close_code(conn.out);
+}
+
+void test_protocol_errors() {
+    CHECK(fail_code(client_frame(WebSocketOpcode::Text, "x", true, false)) == 1002);
+    CHECK(fail_code(client_frame(WebSocketOpcode::Continuation, "x")) == 1002);
+    CHECK(fail_code(client_frame(WebSocketOpcode::Ping, "x", false)) == 1002);
+    CHECK(fail_code(client_frame(WebSocketOpcode::Text, "a", false) +
+                    client_frame(WebSocketOpcode::Text, "b")) == 1002);
+    CHECK(fail_code(client_frame(static_cast<WebSocketOpcode>(0x3), "x")) == 1002);
+}
+
+std::string close_payload(uint16_t code) {
+    return {static_cast<char>(code >> 8), static_cast<char>(code & 0xFF)};
+}
+
+void test_close_codes() {
+    CHECK(fail_code(client_frame(WebSocketOpcode::Close, "")) == 1000);
+    CHECK(fail_code(client_frame(WebSocketOpcode::Close, close_payload(1001))) == 1001);
+    CHECK(fail_code(client_frame(WebSocketOpcode::Close, close_payload(4000) + "bye")) == 4000);
+    // A lone byte cannot hold a code; reserved and unassigned codes are
+    // protocol errors rather than something to echo.
+    CHECK(fail_code(client_frame(WebSocketOpcode::Close, "\x03")) == 1002);
+    for (uint16_t code : {0, 999, 1004, 1005, 1006, 1015, 1016, 2999, 5000}) {
+        CHECK(fail_code(client_frame(WebSocketOpcode::Close, close_payload(code))) == 1002);
+    }
+}
+
+void test_invalid_utf8() {
+    CHECK(fail_code(client_frame(WebSocketOpcode::Text, "bad \xFF")) == 1007);
+    CHECK(fail_code(client_frame(WebSocketOpcode::Text, "cut \xE2\x82", false) +
+                    client_frame(WebSocketOpcode::Continuation, "!")) == 1007);
+    // Binary messages are not text and pass as they are.
+    CHECK(fail_code(client_frame(WebSocketOpcode::Binary, "\xFF")) == 0);
+}
+
+void test_utf8_validation() {
+    CHECK(websocket_valid_utf8(""));
+    CHECK(websocket_valid_utf8("plain ascii that is longer than eight bytes"));
+    CHECK(websocket_valid_utf8("\xC3\xA9t\xC3\xA9 \xE2\x82\xAC \xF0\x9F\x98\x80"));
+    CHECK(websocket_valid_utf8("\xEF\xBF\xBF\xF4\x8F\xBF\xBF"));
+    CHECK(!websocket_valid_utf8("\x80"));
+    CHECK(!websocket_valid_utf8("\xC0\xAF"));             // overlong '/'
+    CHECK(!websocket_valid_utf8("\xE0\x80\xAF"));         // overlong
+    CHECK(!websocket_valid_utf8("\xED\xA0\x80"));         // surrogate
+    CHECK(!websocket_valid_utf8("\xF4\x90\x80\x80"));     // past U+10FFFF
+    CHECK(!websocket_valid_utf8("\xF5\x80\x80\x80"));
+    CHECK(!websocket_valid_utf8("abcdefgh\xE2\x82"));     // truncated
+    CHECK(!websocket_valid_utf8("\xE2\x28\xA1"));
+}
+
+} // namespace
+
+int main() {
+    test_accept_key();
+    test_unmask();
+    test_single_message();
+    test_partial_frame();
+    test_fragments_and_ping();
+    test_close_handshake();
+    test_protocol_errors();
+    test_close_codes();
+    test_invalid_utf8();
+    test_utf8_validation();
+    return test_result();
+}
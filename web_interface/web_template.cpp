@@ -0,0 +1,56 @@
+#include "web_template.h"
+
+// Built-in control panel page, served when no asset directory is installed.
+const char* getWebTemplate() {
+    return R"HTML(<!DOCTYPE html>
+<html lang="en">
+<head>
+<meta charset="utf-8">
+<meta name="viewport" content="width=device-width, initial-scale=1">
+<title>SvaklaAI Control Panel</title>
+<style>
+body { margin: 0; font-family: system-ui, sans-serif; background: #101418; color: #e6e6e6; }
+header { padding: 1rem 2rem; background: #1a2027; border-bottom: 1px solid #2c343d; }
+main { max-width: 48rem; margin: 2rem auto; padding: 0 1rem; }
+#log { min-height: 16rem; padding: 1rem; background: #1a2027; border-radius: 4px; white-space: pre-wrap; }
+form { display: flex; gap: 0.5rem; margin-top: 1rem; }
+input { flex: 1; padding: 0.5rem; background: #0c0f12; color: inherit; border: 1px solid #2c343d; }
+button { padding: 0.5rem 1rem; }
+</style>
+</head>
+<body>
+<header><h1>SvaklaAI Control Panel</h1></header>
+<main>
+<div id="log"></div>
+<form id="prompt">
+<input id="text" autocomplete="off" placeholder="Ask SvaklaAI...">
+<button type="submit">Send</button>
+</form>
+</main>
+<script>
+const log = document.getElementById('log');
+// The upgrade carries the HttpOnly session cookie set by /auth/session.
+// The conversation is kept as the "panel" chat and replayed on reconnecting.
+const socket = new WebSocket('wss://' + location.hostname + ':776/?chat=panel');
+socket.onclose = () => {
+  log.textContent += '[Connection closed]\n';
+};
+socket.onmessage = (event) => {
+  const frame = JSON.parse(event.data);
+  if (frame.type === 'history') log.textContent += frame.data;
+  if (frame.type === 'token') log.textContent += frame.data;
+  if (frame.type === 'done') log.textContent += '\n';
+  if (frame.type === 'error') log.textContent += '[' + frame.message + ']\n';
+};
+document.getElementById('prompt').onsubmit = (event) => {
+  event.preventDefault();
+  const text = document.getElementById('text');
+  log.textContent += '> ' + text.value + '\n';
+  socket.send(text.value);
+  text.value = '';
+};
+</script>
+</body>
+</html>
+)HTML";
+}